@@ -160,9 +160,9 @@ static apr_status_t cmd_reg_update(md_cmd_ctx *ctx, const md_cmd_t *cmd)
         const char *aspect = ctx->argv[1];
         
         if (!strcmp("domains", aspect)) {
-            nmd->domains = md_cmd_gather_args(ctx, 2);
+            nmd->domains = md_domain_set_from_array(ctx->p, md_cmd_gather_args(ctx, 2));
             
-            if (apr_is_empty_array(nmd->domains)) {
+            if (md_domain_set_count(nmd->domains) == 0) {
                 fprintf(stderr, "update domains needs at least 1 domain name as parameter\n");
                 return APR_EGENERAL;
             }
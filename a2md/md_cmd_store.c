@@ -21,6 +21,7 @@
 #include <apr_getopt.h>
 #include <apr_hash.h>
 #include <apr_strings.h>
+#include <apr_time.h>
 
 #include "md.h"
 #include "md_json.h"
@@ -28,6 +29,7 @@
 #include "md_log.h"
 #include "md_reg.h"
 #include "md_store.h"
+#include "md_store_fs.h"
 #include "md_util.h"
 #include "md_version.h"
 #include "md_cmd.h"
@@ -169,9 +171,9 @@ static apr_status_t cmd_update(md_cmd_ctx *ctx, const md_cmd_t *cmd)
         const char *aspect = ctx->argv[1];
         
         if (!strcmp("domains", aspect)) {
-            md->domains = md_cmd_gather_args(ctx, 2);
+            md->domains = md_domain_set_from_array(ctx->p, md_cmd_gather_args(ctx, 2));
             
-            if (apr_is_empty_array(md->domains)) {
+            if (md_domain_set_count(md->domains) == 0) {
                 fprintf(stderr, "update domains needs at least 1 domain name as parameter\n");
                 return APR_EGENERAL;
             }
@@ -209,6 +211,96 @@ static md_cmd_t UpdateCmd = {
     "update the managed domain <name> in the store"
 };
 
+/**************************************************************************************************/
+/* command: store archive */
+
+static apr_status_t cmd_archive_list(md_cmd_ctx *ctx, const md_cmd_t *cmd)
+{
+    apr_array_header_t *gens;
+    const md_store_fs_gen_t *gen;
+    const char *name;
+    char ts[APR_RFC822_DATE_LEN];
+    apr_status_t rv;
+    int i;
+    
+    if (ctx->argc <= 0) {
+        return usage(cmd, "needs md name");
+    }
+    name = ctx->argv[0];
+    
+    if (APR_SUCCESS != (rv = md_store_fs_archive_list(&gens, ctx->store, name, ctx->p))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ctx->p, "%s: listing archive", name);
+        return rv;
+    }
+    for (i = 0; i < gens->nelts; ++i) {
+        gen = APR_ARRAY_IDX(gens, i, const md_store_fs_gen_t *);
+        apr_rfc822_date(ts, gen->archived);
+        if (ctx->json_out) {
+            md_json_t *json = md_json_create(ctx->p);
+            md_json_sets(name, json, "name", NULL);
+            md_json_setl(gen->n, json, "generation", NULL);
+            md_json_sets(ts, json, "archived", NULL);
+            md_json_setb(gen->packed, json, "packed", NULL);
+            md_json_addj(json, ctx->json_out, "output", NULL);
+        }
+        else {
+            fprintf(stdout, "%s: generation %ld, archived %s%s\n", name, gen->n, ts, 
+                    gen->packed? " (packed)" : "");
+        }
+    }
+    return rv;
+}
+
+static md_cmd_t ArchiveListCmd = {
+    "list", MD_CTX_STORE, 
+    NULL, cmd_archive_list, MD_NoOptions, NULL,
+    "list name",
+    "list the archived generations of the managed domain <name>"
+};
+
+static apr_status_t cmd_archive_restore(md_cmd_ctx *ctx, const md_cmd_t *cmd)
+{
+    const char *name;
+    md_t *md;
+    apr_status_t rv;
+    long n;
+    
+    if (ctx->argc <= 1) {
+        return usage(cmd, "needs md name and generation");
+    }
+    name = ctx->argv[0];
+    n = (long)apr_atoi64(ctx->argv[1]);
+    if (n <= 0) {
+        return usage(cmd, "generation must be a positive number");
+    }
+    
+    rv = md_store_fs_archive_restore(ctx->store, ctx->p, name, n);
+    if (APR_SUCCESS == rv && APR_SUCCESS == md_load(ctx->store, MD_SG_DOMAINS, name, &md, ctx->p)) {
+        md_cmd_print_md(ctx, md);
+    }
+    return rv;
+}
+
+static md_cmd_t ArchiveRestoreCmd = {
+    "restore", MD_CTX_STORE, 
+    NULL, cmd_archive_restore, MD_NoOptions, NULL,
+    "restore name generation",
+    "make an archived generation of <name> the current one, archiving the current one"
+};
+
+static const md_cmd_t *ArchiveSubCmds[] = {
+    &ArchiveListCmd,
+    &ArchiveRestoreCmd,
+    NULL
+};
+
+static md_cmd_t ArchiveCmd = {
+    "archive", MD_CTX_STORE,  
+    NULL, NULL, MD_NoOptions, ArchiveSubCmds,
+    "archive cmd [opts] [args]", 
+    "inspect and restore archived generations of managed domains", 
+};
+
 /**************************************************************************************************/
 /* command: store */
 
@@ -217,6 +309,7 @@ static const md_cmd_t *StoreSubCmds[] = {
     &RemoveCmd,
     &ListCmd,
     &UpdateCmd,
+    &ArchiveCmd,
     NULL
 };
 
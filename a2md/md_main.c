@@ -274,8 +274,8 @@ void md_cmd_print_md(md_cmd_ctx *ctx, const md_t *md)
     else {
         int i;
         fprintf(stdout, "md: %s [", md->name);
-        for (i = 0; i < md->domains->nelts; ++i) {
-            const char *domain = APR_ARRAY_IDX(md->domains, i, const char*);
+        for (i = 0; i < md_domain_set_count(md->domains); ++i) {
+            const char *domain = md_domain_set_get(md->domains, i);
             fprintf(stdout, "%s%s", (i? ", " : ""), domain);
         }
         fprintf(stdout, "]\n");
@@ -400,6 +400,7 @@ int main(int argc, const char *const *argv)
     
     memset(&ctx, 0, sizeof(ctx));
     md_log_set(log_is_level, log_print, NULL);
+    md_json_arena_setup();
     
     apr_allocator_create(&allocator);
     rv = apr_pool_create_ex(&p, NULL, pool_abort, allocator);
@@ -410,6 +411,7 @@ int main(int argc, const char *const *argv)
     
     md_http_use_implementation(md_curl_get_impl(p));
     md_acme_init(p, BASE_VERSION);
+    md_domain_intern_init(p);
     md_cmd_ctx_init(&ctx, p, argc, argv);
     
     rv = cmd_process(&ctx, &MainCmd);
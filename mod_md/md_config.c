@@ -26,6 +26,8 @@
 
 #include "md.h"
 #include "md_config.h"
+#include "md_store.h"
+#include "md_store_fs.h"
 #include "md_util.h"
 #include "md_private.h"
 
@@ -46,6 +48,9 @@ static md_config_t defconf = {
     apr_time_from_sec(14 * MD_SECS_PER_DAY), 
     NULL, 
     "md",
+    MD_S_FS_SYNC_BATCHED,
+    0,
+    4,
     NULL
 };
 
@@ -62,6 +67,9 @@ void *md_config_create_svr(apr_pool_t *pool, server_rec *s)
     conf->drive_mode = DEF_VAL;
     conf->mds = apr_array_make(pool, 5, sizeof(const md_t *));
     conf->renew_window = DEF_VAL;
+    conf->store_durability = DEF_VAL;
+    conf->store_watch = DEF_VAL;
+    conf->startup_threads = DEF_VAL;
     
     return conf;
 }
@@ -92,6 +100,11 @@ static void *md_config_merge(apr_pool_t *pool, void *basev, void *addv)
     n->drive_mode = (add->drive_mode != DEF_VAL)? add->drive_mode : base->drive_mode;
     n->md = NULL;
     n->base_dir = add->base_dir? add->base_dir : base->base_dir;
+    n->store_durability = ((add->store_durability != DEF_VAL)? 
+                           add->store_durability : base->store_durability);
+    n->store_watch = (add->store_watch != DEF_VAL)? add->store_watch : base->store_watch;
+    n->startup_threads = ((add->startup_threads != DEF_VAL)? 
+                          add->startup_threads : base->startup_threads);
     n->renew_window = (add->renew_window != DEF_VAL)? add->renew_window : base->renew_window;
     n->ca_challenges = (add->ca_challenges? apr_array_copy(pool, add->ca_challenges) 
                     : (base->ca_challenges? apr_array_copy(pool, base->ca_challenges) : NULL));
@@ -133,13 +146,6 @@ static const char *md_section_check(cmd_parms *cmd) {
     return NULL;
 }
 
-static void add_domain_name(apr_array_header_t *domains, const char *name, apr_pool_t *p)
-{
-    if (md_array_str_index(domains, name, 0, 0) < 0) {
-        APR_ARRAY_PUSH(domains, char *) = md_util_str_tolower(apr_pstrdup(p, name));
-    }
-}
-
 static const char *md_config_sec_start(cmd_parms *cmd, void *mconfig, const char *arg)
 {
     md_config_t *sconf = ap_get_module_config(cmd->server->module_config, &md_module);
@@ -169,12 +175,12 @@ static const char *md_config_sec_start(cmd_parms *cmd, void *mconfig, const char
     
     md = md_create_empty(cmd->pool);
     md->name = name;
-    APR_ARRAY_PUSH(md->domains, const char*) = name;
+    md_domain_set_add(md->domains, name);
     md->drive_mode = DEF_VAL;
     
     while (*arg != '\0') {
         name = ap_getword_white(cmd->pool, &arg);
-        APR_ARRAY_PUSH(md->domains, const char*) = name;
+        md_domain_set_add(md->domains, name);
     }
 
     dconf = ap_set_config_vectors(cmd->server, new_dir_conf, cmd->path, &md_module, cmd->pool);
@@ -194,7 +200,7 @@ static const char *md_config_sec_add_members(cmd_parms *cmd, void *dc,
                                              int argc, char *const argv[])
 {
     md_config_dir_t *dconfig = dc;
-    apr_array_header_t *domains;
+    md_domain_set_t *domains;
     const char *err;
     int i;
     
@@ -204,7 +210,7 @@ static const char *md_config_sec_add_members(cmd_parms *cmd, void *dc,
     
     domains = dconfig->md->domains;
     for (i = 0; i < argc; ++i) {
-        add_domain_name(domains, argv[i], cmd->pool);
+        md_domain_set_add(domains, argv[i]);
     }
     return NULL;
 }
@@ -213,7 +219,7 @@ static const char *md_config_set_names(cmd_parms *cmd, void *arg,
                                        int argc, char *const argv[])
 {
     md_config_t *config = (md_config_t *)md_config_get(cmd->server);
-    apr_array_header_t *domains = apr_array_make(cmd->pool, 5, sizeof(const char *));
+    md_domain_set_t *domains = md_domain_set_make(cmd->pool, argc);
     const char *err;
     md_t *md;
     int i;
@@ -224,9 +230,9 @@ static const char *md_config_set_names(cmd_parms *cmd, void *arg,
     }
 
     for (i = 0; i < argc; ++i) {
-        add_domain_name(domains, argv[i], cmd->pool);
+        md_domain_set_add(domains, argv[i]);
     }
-    err = md_create(&md, cmd->pool, domains);
+    err = md_create(&md, cmd->pool, md_domain_set_names(domains));
     if (err) {
         return err;
     }
@@ -396,6 +402,63 @@ static const char *md_config_set_store_dir(cmd_parms *cmd, void *arg, const char
     return NULL;
 }
 
+static const char *md_config_set_store_durability(cmd_parms *cmd, void *arg, 
+                                                  const char *value)
+{
+    md_config_t *config = (md_config_t *)md_config_get(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    (void)arg;
+    if (err) {
+        return err;
+    }
+    if (!apr_strnatcasecmp("none", value)) {
+        config->store_durability = MD_S_FS_SYNC_NONE;
+    }
+    else if (!apr_strnatcasecmp("batched", value)) {
+        config->store_durability = MD_S_FS_SYNC_BATCHED;
+    }
+    else if (!apr_strnatcasecmp("strict", value)) {
+        config->store_durability = MD_S_FS_SYNC_STRICT;
+    }
+    else {
+        return apr_pstrcat(cmd->pool, "unknown MDStoreDurability ", value, NULL);
+    }
+    return NULL;
+}
+
+static const char *md_config_set_store_watch(cmd_parms *cmd, void *arg, int flag)
+{
+    md_config_t *config = (md_config_t *)md_config_get(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    (void)arg;
+    if (err) {
+        return err;
+    }
+    config->store_watch = flag;
+    return NULL;
+}
+
+static const char *md_config_set_startup_threads(cmd_parms *cmd, void *arg, 
+                                                 const char *value)
+{
+    md_config_t *config = (md_config_t *)md_config_get(cmd->server);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+    int n;
+
+    (void)arg;
+    if (err) {
+        return err;
+    }
+    n = (int)apr_atoi64(value);
+    if (n < 1 || n > 64) {
+        return "MDStartupThreads must be a number from 1 to 64";
+    }
+    config->startup_threads = n;
+    return NULL;
+}
+
 static const char *set_port_map(md_config_t *config, const char *value)
 {
     int net_port, local_port;
@@ -494,6 +557,14 @@ const command_rec md_cmds[] = {
                   "URL of CA issueing the certificates"),
     AP_INIT_TAKE1("MDStoreDir", md_config_set_store_dir, NULL, RSRC_CONF, 
                   "the directory for file system storage of managed domain data."),
+    AP_INIT_TAKE1("MDStoreDurability", md_config_set_store_durability, NULL, RSRC_CONF, 
+                  "how changes to the store are synced to disk: none, batched or strict."),
+    AP_INIT_FLAG("MDStoreWatch", md_config_set_store_watch, NULL, RSRC_CONF, 
+                 "look at managed domains as soon as they are changed in the store, "
+                 "e.g. by a2md, instead of on the next regular run."),
+    AP_INIT_TAKE1("MDStartupThreads", md_config_set_startup_threads, NULL, RSRC_CONF, 
+                  "number of threads checking the certificates of managed domains "
+                  "at server start."),
     AP_INIT_TAKE1("MDCertificateProtocol", md_config_set_ca_proto, NULL, RSRC_CONF, 
                   "Protocol used to obtain/renew certificates"),
     AP_INIT_TAKE1("MDCertificateAgreement", md_config_set_agreement, NULL, RSRC_CONF, 
@@ -566,6 +637,14 @@ int md_config_geti(const md_config_t *config, md_config_var_t var)
             return (config->local_80 != DEF_VAL)? config->local_80 : 80;
         case MD_CONFIG_LOCAL_443:
             return (config->local_443 != DEF_VAL)? config->local_443 : 443;
+        case MD_CONFIG_STORE_DURABILITY:
+            return ((config->store_durability != DEF_VAL)? 
+                    config->store_durability : defconf.store_durability);
+        case MD_CONFIG_STORE_WATCH:
+            return (config->store_watch != DEF_VAL)? config->store_watch : defconf.store_watch;
+        case MD_CONFIG_STARTUP_THREADS:
+            return ((config->startup_threads != DEF_VAL)? 
+                    config->startup_threads : defconf.startup_threads);
         default:
             return 0;
     }
@@ -27,6 +27,9 @@ typedef enum {
     MD_CONFIG_LOCAL_80,
     MD_CONFIG_LOCAL_443,
     MD_CONFIG_RENEW_WINDOW,
+    MD_CONFIG_STORE_DURABILITY,
+    MD_CONFIG_STORE_WATCH,
+    MD_CONFIG_STARTUP_THREADS,
 } md_config_var_t;
 
 typedef struct {
@@ -47,6 +50,9 @@ typedef struct {
     
     const md_t *md;
     const char *base_dir;
+    int store_durability;              /* md_store_fs_sync_t for the store */
+    int store_watch;                   /* react to changes of the store right away */
+    int startup_threads;               /* threads assessing the mds at startup */
     struct md_store_t *store;
 
 } md_config_t;
@@ -24,6 +24,9 @@
 #if APR_HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifndef WIN32
+#include <sys/resource.h>
+#endif
 #ifdef WIN32
 #include "mpm_winnt.h"
 #endif
@@ -67,8 +70,31 @@ apr_status_t md_server_graceful(apr_pool_t *p, server_rec *s)
     return APR_ENOTIMPL;
 }
  
+apr_status_t md_os_peak_rss_get(apr_size_t *pbytes)
+{
+    *pbytes = 0;
+    return APR_ENOTIMPL;
+}
+
 #else
 
+apr_status_t md_os_peak_rss_get(apr_size_t *pbytes)
+{
+    struct rusage usage;
+    
+    *pbytes = 0;
+    if (getrusage(RUSAGE_SELF, &usage) < 0) {
+        return APR_FROM_OS_ERROR(errno);
+    }
+#ifdef __APPLE__
+    *pbytes = (apr_size_t)usage.ru_maxrss;
+#else
+    /* kilobytes */
+    *pbytes = (apr_size_t)usage.ru_maxrss * 1024;
+#endif
+    return APR_SUCCESS;
+}
+
 apr_status_t md_server_graceful(apr_pool_t *p, server_rec *s)
 { 
     apr_status_t rv;
@@ -33,4 +33,10 @@ apr_status_t md_make_worker_accessible(const char *fname, apr_pool_t *p);
  */
 apr_status_t md_server_graceful(apr_pool_t *p, server_rec *s);
 
+/**
+ * Get the most memory this process had resident at any time so far, in bytes. 
+ * May return APR_ENOTIMPL, depending on the platform.
+ */
+apr_status_t md_os_peak_rss_get(apr_size_t *pbytes);
+
 #endif /* mod_md_md_os_h */
@@ -14,6 +14,8 @@
  */
 
 #include <assert.h>
+#include <apr_file_info.h>
+#include <apr_hash.h>
 #include <apr_strings.h>
 
 #include <ap_release.h>
@@ -31,6 +33,7 @@
 #include "md_curl.h"
 #include "md_crypt.h"
 #include "md_http.h"
+#include "md_json.h"
 #include "md_store.h"
 #include "md_store_fs.h"
 #include "md_log.h"
@@ -60,16 +63,23 @@ typedef struct {
     apr_array_header_t *unused_names;
     int can_http;
     int can_https;
+    int vhost_checks;           /* pairs of MD and server looked at in the mapping */
 } md_ctx;
  
+static const char *domain_key(const char *domain, apr_pool_t *p)
+{
+    return md_util_str_tolower(apr_pstrdup(p, domain));
+}
+
 static apr_status_t md_calc_md_list(md_ctx *ctx, apr_pool_t *p, apr_pool_t *plog,
                                     apr_pool_t *ptemp, server_rec *base_server)
 {
     server_rec *s;
     apr_array_header_t *mds;
+    apr_hash_t *by_domain;
     int i, j;
     md_t *md, *nmd;
-    const char *domain;
+    const char *domain, *key;
     apr_status_t rv = APR_SUCCESS;
     md_config_t *config;
     apr_port_t effective_80, effective_443;
@@ -79,6 +89,8 @@ static apr_status_t md_calc_md_list(md_ctx *ctx, apr_pool_t *p, apr_pool_t *plog
     ctx->can_http = 0;
     ctx->can_https = 0;
     mds = apr_array_make(p, 5, sizeof(const md_t*));
+    /* all domain names of the MDs seen so far, lowercase, to the MD they are in */
+    by_domain = apr_hash_make(ptemp);
 
     config = (md_config_t *)md_config_get(base_server);
     effective_80 = md_config_geti(config, MD_CONFIG_LOCAL_80);
@@ -109,15 +121,18 @@ static apr_status_t md_calc_md_list(md_ctx *ctx, apr_pool_t *p, apr_pool_t *plog
         for (i = 0; i < config->mds->nelts; ++i) {
             nmd = APR_ARRAY_IDX(config->mds, i, md_t*);
 
-            for (j = 0; j < mds->nelts; ++j) {
-                md = APR_ARRAY_IDX(mds, j, md_t*);
-
-                if (nmd == md) {
-                    nmd = NULL;
-                    break; /* merged between different configs */
-                }
+            for (j = 0; j < md_domain_set_count(nmd->domains); ++j) {
+                domain = md_domain_set_get(nmd->domains, j);
+                key = domain_key(domain, ptemp);
+                md = apr_hash_get(by_domain, key, APR_HASH_KEY_STRING);
                 
-                if ((domain = md_common_name(nmd, md)) != NULL) {
+                if (md == nmd) {
+                    if (j == 0) {
+                        nmd = NULL;
+                        break; /* merged between different configs */
+                    }
+                }
+                else if (md) {
                     ap_log_error(APLOG_MARK, APLOG_ERR, 0, base_server, APLOGNO()
                                  "two Managed Domains have an overlap in domain '%s'"
                                  ", first definition in %s(line %d), second in %s(line %d)",
@@ -125,6 +140,9 @@ static apr_status_t md_calc_md_list(md_ctx *ctx, apr_pool_t *p, apr_pool_t *plog
                                  nmd->defn_name, nmd->defn_line_number);
                     return APR_EINVAL;
                 }
+                else {
+                    apr_hash_set(by_domain, key, APR_HASH_KEY_STRING, nmd);
+                }
             }
             
             if (nmd) {
@@ -165,100 +183,181 @@ static apr_status_t md_calc_md_list(md_ctx *ctx, apr_pool_t *p, apr_pool_t *plog
     return rv;
 }
 
+/* The servers a domain name may select, as ap_matches_request_vhost() would find
+ * them, by lowercase name. Servers with wildcard aliases are also kept aside, those
+ * are matched against every name. */
+typedef struct {
+    apr_hash_t *by_name;            /* name -> apr_array_header_t of server_rec* */
+    apr_array_header_t *wild;       /* server_rec* with ServerAlias patterns */
+} vhost_index;
+
+static void vhost_index_add(vhost_index *idx, const char *name, server_rec *s, 
+                            apr_pool_t *ptemp)
+{
+    apr_array_header_t *servers;
+    const char *key;
+    
+    if (!name) {
+        return;
+    }
+    key = domain_key(name, ptemp);
+    if (!(servers = apr_hash_get(idx->by_name, key, APR_HASH_KEY_STRING))) {
+        servers = apr_array_make(ptemp, 1, sizeof(server_rec *));
+        apr_hash_set(idx->by_name, key, APR_HASH_KEY_STRING, servers);
+    }
+    /* a server's names are added one after the other */
+    if (servers->nelts == 0 || APR_ARRAY_IDX(servers, servers->nelts-1, server_rec *) != s) {
+        APR_ARRAY_PUSH(servers, server_rec *) = s;
+    }
+}
+
+static void vhost_index_make(vhost_index *idx, server_rec *base_server, apr_pool_t *ptemp)
+{
+    server_rec *s;
+    server_addr_rec *sar;
+    int i;
+    
+    idx->by_name = apr_hash_make(ptemp);
+    idx->wild = apr_array_make(ptemp, 5, sizeof(server_rec *));
+    for (s = base_server; s; s = s->next) {
+        for (sar = s->addrs; sar; sar = sar->next) {
+            if (sar->host_port == 0 || sar->host_port == s->port) {
+                vhost_index_add(idx, sar->virthost, s, ptemp);
+            }
+        }
+        vhost_index_add(idx, s->server_hostname, s, ptemp);
+        if (s->names) {
+            for (i = 0; i < s->names->nelts; ++i) {
+                vhost_index_add(idx, APR_ARRAY_IDX(s->names, i, const char*), s, ptemp);
+            }
+        }
+        if (s->wild_names && s->wild_names->nelts > 0) {
+            APR_ARRAY_PUSH(idx->wild, server_rec *) = s;
+        }
+    }
+}
+
+static apr_status_t md_apply_to_vhost(md_t *md, server_rec *s, apr_pool_t *p, 
+                                      server_rec *base_server)
+{
+    md_config_t *config;
+    const char *name;
+    int k;
+    
+    /* Create a unique md_config_t record for this server. 
+     * We keep local information here. */
+    config = (md_config_t *)md_config_get_unique(s, p);
+
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, base_server, APLOGNO()
+                 "Server %s:%d matches md %s (config %s)", 
+                 s->server_hostname, s->port, md->name, config->name);
+    
+    if (config->md == md) {
+        /* already matched via another domain name */
+    }
+    else if (config->md) {
+         
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, base_server, APLOGNO()
+                     "conflict: MD %s matches server %s, but MD %s also matches.",
+                     md->name, s->server_hostname, config->md->name);
+        return APR_EINVAL;
+    }
+    
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, base_server, APLOGNO()
+                 "Managed Domain %s applies to vhost %s:%d", md->name,
+                 s->server_hostname, s->port);
+    if (s->server_admin && strcmp(DEFAULT_ADMIN, s->server_admin)) {
+        apr_array_clear(md->contacts);
+        APR_ARRAY_PUSH(md->contacts, const char *) = 
+            md_util_schemify(p, s->server_admin, "mailto");
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, base_server, APLOGNO()
+                     "Managed Domain %s assigned server admin %s", md->name,
+                     s->server_admin);
+    }
+    config->md = md;
+
+    /* This server matches a managed domain. If it contains names or
+     * alias that are not in this md, a generated certificate will not match. */
+    if (!md_contains(md, s->server_hostname)) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, base_server, APLOGNO()
+                     "Virtual Host %s:%d matches Managed Domain '%s', but the name"
+                     " itself is not managed. A requested MD certificate will "
+                     "not match ServerName.",
+                     s->server_hostname, s->port, md->name);
+        return APR_EINVAL;
+    }
+    for (k = 0; k < s->names->nelts; ++k) {
+        name = APR_ARRAY_IDX(s->names, k, const char*);
+        if (!md_contains(md, name)) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, 0, base_server, APLOGNO()
+                         "Virtual Host %s:%d matches Managed Domain '%s', but "
+                         "the ServerAlias %s is not covered by the MD. "
+                         "A requested MD certificate will not match this " 
+                         "alias.", s->server_hostname, s->port, md->name,
+                         name);
+            return APR_EINVAL;
+        }
+    }
+    return APR_SUCCESS;
+}
+
 static apr_status_t md_check_vhost_mapping(md_ctx *ctx, apr_pool_t *p, apr_pool_t *plog,
                                            apr_pool_t *ptemp, server_rec *base_server)
 {
     server_rec *s;
     request_rec r;
-    md_config_t *config;
+    vhost_index idx;
+    apr_array_header_t *servers;
+    apr_hash_t *matched;
     apr_status_t rv = APR_SUCCESS;
     md_t *md;
     int i, j, k;
-    const char *domain, *name;
+    const char *domain;
     
     /* Find the (at most one) managed domain for each vhost/base server and
      * remember it at our config for it. 
      * The config is not accepted, if a vhost matches 2 or more managed domains.
+     * Servers are looked up by the domain names of an MD, instead of asking
+     * every server about every name.
      */
     ctx->unused_names = apr_array_make(p, 5, sizeof(const char*));
+    vhost_index_make(&idx, base_server, ptemp);
+    matched = apr_hash_make(ptemp);
     memset(&r, 0, sizeof(r));
     for (i = 0; i < ctx->mds->nelts; ++i) {
         md = APR_ARRAY_IDX(ctx->mds, i, md_t*);
-        config = NULL;
-        /* This MD may apply to 0, 1 or more sever_recs */
-        for (s = base_server; s; s = s->next) {
-            r.server = s;
-            for (j = 0; j < md->domains->nelts; ++j) {
-                domain = APR_ARRAY_IDX(md->domains, j, const char*);
-                
-                if (ap_matches_request_vhost(&r, domain, s->port)) {
-                    /* Create a unique md_config_t record for this server. 
-                     * We keep local information here. */
-                    config = (md_config_t *)md_config_get_unique(s, p);
-                
-                    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, base_server, APLOGNO()
-                                 "Server %s:%d matches md %s (config %s)", 
-                                 s->server_hostname, s->port, md->name, config->name);
-                    
-                    if (config->md == md) {
-                        /* already matched via another domain name */
-                    }
-                    else if (config->md) {
-                         
-                        ap_log_error(APLOG_MARK, APLOG_ERR, 0, base_server, APLOGNO()
-                                     "conflict: MD %s matches server %s, but MD %s also matches.",
-                                     md->name, s->server_hostname, config->md->name);
+        /* This MD may apply to 0, 1 or more sever_recs, each is looked at once */
+        apr_hash_clear(matched);
+        for (j = 0; j < md_domain_set_count(md->domains); ++j) {
+            domain = md_domain_set_get(md->domains, j);
+            
+            servers = apr_hash_get(idx.by_name, domain_key(domain, ptemp), 
+                                   APR_HASH_KEY_STRING);
+            for (k = 0; servers && k < servers->nelts; ++k) {
+                s = APR_ARRAY_IDX(servers, k, server_rec *);
+                ++ctx->vhost_checks;
+                if (!apr_hash_get(matched, &s, sizeof(s))) {
+                    apr_hash_set(matched, apr_pmemdup(ptemp, &s, sizeof(s)), sizeof(s), s);
+                    if (APR_SUCCESS != md_apply_to_vhost(md, s, p, base_server)) {
                         rv = APR_EINVAL;
-                        goto next_server;
                     }
-                    
-                    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, base_server, APLOGNO()
-                                 "Managed Domain %s applies to vhost %s:%d", md->name,
-                                 s->server_hostname, s->port);
-                    if (s->server_admin && strcmp(DEFAULT_ADMIN, s->server_admin)) {
-                        apr_array_clear(md->contacts);
-                        APR_ARRAY_PUSH(md->contacts, const char *) = 
-                            md_util_schemify(p, s->server_admin, "mailto");
-                        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, base_server, APLOGNO()
-                                     "Managed Domain %s assigned server admin %s", md->name,
-                                     s->server_admin);
-                    }
-                    config->md = md;
-
-                    /* This server matches a managed domain. If it contains names or
-                     * alias that are not in this md, a generated certificate will not match. */
-                    if (!md_contains(md, s->server_hostname)) {
-                        ap_log_error(APLOG_MARK, APLOG_ERR, 0, base_server, APLOGNO()
-                                     "Virtual Host %s:%d matches Managed Domain '%s', but the name"
-                                     " itself is not managed. A requested MD certificate will "
-                                     "not match ServerName.",
-                                     s->server_hostname, s->port, md->name);
+                }
+            }
+            for (k = 0; k < idx.wild->nelts; ++k) {
+                s = APR_ARRAY_IDX(idx.wild, k, server_rec *);
+                r.server = s;
+                ++ctx->vhost_checks;
+                if (!apr_hash_get(matched, &s, sizeof(s))
+                    && ap_matches_request_vhost(&r, domain, s->port)) {
+                    apr_hash_set(matched, apr_pmemdup(ptemp, &s, sizeof(s)), sizeof(s), s);
+                    if (APR_SUCCESS != md_apply_to_vhost(md, s, p, base_server)) {
                         rv = APR_EINVAL;
-                        goto next_server;
-                    }
-                    else {
-                        for (k = 0; k < s->names->nelts; ++k) {
-                            name = APR_ARRAY_IDX(s->names, k, const char*);
-                            if (!md_contains(md, name)) {
-                                ap_log_error(APLOG_MARK, APLOG_ERR, 0, base_server, APLOGNO()
-                                             "Virtual Host %s:%d matches Managed Domain '%s', but "
-                                             "the ServerAlias %s is not covered by the MD. "
-                                             "A requested MD certificate will not match this " 
-                                             "alias.", s->server_hostname, s->port, md->name,
-                                             name);
-                                rv = APR_EINVAL;
-                                goto next_server;
-                            }
-                        }
                     }
-                    goto next_server;
                 }
             }
-next_server:
-            continue;
         }
         
-        if (config == NULL && md->drive_mode != MD_DRIVE_ALWAYS) {
+        if (apr_hash_count(matched) == 0 && md->drive_mode != MD_DRIVE_ALWAYS) {
             /* Not an error, but looks suspicious */
             ap_log_error(APLOG_MARK, APLOG_WARNING, 0, base_server, APLOGNO()
                          "No VirtualHost matches Managed Domain %s", md->name);
@@ -284,17 +383,30 @@ static apr_status_t store_file_ev(void *baton, struct md_store_t *store,
                  
     /* Directories in group CHALLENGES and STAGING are written to by our watchdog,
      * running on certain mpms in a child process under a different user. Give them
-     * ownership. 
+     * ownership. The same for the lock files of those groups, which the watchdog 
+     * opens for writing. Other files stay with whoever wrote them.
      */
-    if (ftype == APR_DIR) {
+    if (ftype == APR_DIR || ftype == APR_REG) {
         switch (group) {
             case MD_SG_CHALLENGES:
             case MD_SG_STAGING:
+                if (ftype == APR_REG && ev != MD_S_FS_EV_LOCK_CREATED) {
+                    break;
+                }
                 rv = md_make_worker_accessible(fname, p);
                 if (APR_ENOTIMPL != rv) {
                     return rv;
                 }
                 break;
+            case MD_SG_NONE:
+                /* the store journal and its lock, the watchdog appends its changes */
+                if (strcmp(MD_FN_HTTPD_JSON, apr_filepath_name_get(fname))) {
+                    rv = md_make_worker_accessible(fname, p);
+                    if (APR_ENOTIMPL != rv) {
+                        return rv;
+                    }
+                }
+                break;
             default: 
                 break;
         }
@@ -315,6 +427,16 @@ static apr_status_t check_group_dir(md_store_t *store, md_store_group_t group,
     return rv;
 }
 
+/* Archived generations are kept when among the last MD_ARCHIVE_KEEP ones of their MD
+ * or younger than MD_ARCHIVE_MAX_AGE. Those older than MD_ARCHIVE_PACK_AGE, except
+ * the newest, are packed into one tarball per MD. */
+#define MD_ARCHIVE_KEEP         5
+#define MD_ARCHIVE_MAX_AGE      apr_time_from_sec(365 * MD_SECS_PER_DAY)
+#define MD_ARCHIVE_PACK_AGE     apr_time_from_sec(30 * MD_SECS_PER_DAY)
+
+/* With MDStoreDurability batched, changes are synced at the latest after this */
+#define MD_STORE_SYNC_WINDOW    apr_time_from_sec(5)
+
 static apr_status_t setup_store(md_store_t **pstore, apr_pool_t *p, server_rec *s,
                                 int post_config)
 {
@@ -332,8 +454,19 @@ static apr_status_t setup_store(md_store_t **pstore, apr_pool_t *p, server_rec *
         goto out;
     }
 
+    /* saved certificates and chains get DER copies, loading them skips the PEM parsing */
+    md_store_fs_der_cache_set(store, 1);
+    md_store_fs_archive_retention_set(store, MD_ARCHIVE_KEEP, MD_ARCHIVE_MAX_AGE);
+    md_store_fs_durability_set(store, md_config_geti(config, MD_CONFIG_STORE_DURABILITY), 
+                               MD_STORE_SYNC_WINDOW);
+    
     if (post_config) {
         md_store_fs_set_event_cb(store, store_file_ev, s);
+        /* let readers of the store, e.g. the watchdog, catch up on changes */
+        if (APR_SUCCESS != (rv = md_store_fs_journal_set(store, 1, 0))) {
+            ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO() "setup store journal");
+            goto out;
+        }
         if (APR_SUCCESS != (rv = check_group_dir(store, MD_SG_CHALLENGES, p, s))) {
             ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO() 
                          "setup challenges directory");
@@ -370,7 +503,9 @@ static apr_status_t setup_reg(md_reg_t **preg, apr_pool_t *p, server_rec *s, int
     config = (md_config_t *)md_config_get(s);
     if (config->store 
         || APR_SUCCESS == (rv = setup_store(&config->store, p, s, post_config))) {
-        return md_reg_init(preg, p, config->store);
+        if (APR_SUCCESS == (rv = md_reg_init(preg, p, config->store))) {
+            md_reg_load_threads_set(*preg, md_config_geti(config, MD_CONFIG_STARTUP_THREADS));
+        }
     }
     return rv;
 }
@@ -430,10 +565,26 @@ static void init_setups(apr_pool_t *p, server_rec *base_server)
 
 #define MD_WATCHDOG_NAME   "_md_"
 
+/* With MDStoreWatch, how often the watchdog looks for changes and how long they need
+ * to have settled before it reacts */
+#define MD_STORE_WATCH_POLL         apr_time_from_msec(500)
+#define MD_STORE_WATCH_DEBOUNCE     apr_time_from_sec(2)
+
 static APR_OPTIONAL_FN_TYPE(ap_watchdog_get_instance) *wd_get_instance;
 static APR_OPTIONAL_FN_TYPE(ap_watchdog_register_callback) *wd_register_callback;
 static APR_OPTIONAL_FN_TYPE(ap_watchdog_set_callback_interval) *wd_set_interval;
 
+/* What the watchdog keeps of a managed domain from one run to the next. Everything
+ * else, the md itself included, is loaded into the pool of a run when needed and 
+ * is gone when the run is over. */
+typedef struct {
+    const char *name;
+    md_state_t state;
+    apr_time_t expires;
+    apr_interval_time_t renew_window;
+    int renewed;                    /* staged, waits on the next restart to activate */
+} md_wd_entry;
+
 typedef struct {
     apr_pool_t *p;
     server_rec *s;
@@ -445,28 +596,93 @@ typedef struct {
     int error_runs;
     apr_time_t next_change;
     
-    apr_array_header_t *mds;
+    apr_array_header_t *entries;    /* of md_wd_entry */
+    apr_size_t entries_size;
+    apr_uint32_t runs;
     md_reg_t *reg;
+    md_store_fs_watch_t *watch;
 } md_watchdog;
 
-static apr_status_t drive_md(md_watchdog *wd, md_t *md, apr_pool_t *ptemp)
+static void entry_set(md_wd_entry *entry, const md_t *md)
+{
+    entry->state = md->state;
+    entry->expires = md->expires;
+    entry->renew_window = md->renew_window;
+}
+
+/* Each run of the watchdog gets a fresh pool for all it does. It comes from the 
+ * watchdog's own allocator, which keeps no more than MaxMemFree of what was freed. */
+static apr_pool_t *run_pool_create(md_watchdog *wd)
+{
+    apr_pool_t *p;
+    
+    if (APR_SUCCESS != apr_pool_create(&p, wd->p)) {
+        return NULL;
+    }
+    apr_pool_tag(p, "md_watchdog_run");
+    return p;
+}
+
+/* Report the memory a run needed and give it back. Only pool debug builds of APR count 
+ * the bytes of a pool, otherwise the peak of the process shows if memory stays flat. */
+static void run_pool_destroy(md_watchdog *wd, apr_pool_t *p, int loaded)
+{
+    apr_size_t peak_rss, run_bytes = 0;
+    
+    ++wd->runs;
+    if (APLOGdebug(wd->s)) {
+#if APR_POOL_DEBUG
+        run_bytes = apr_pool_num_bytes(p, 1);
+#endif
+        md_os_peak_rss_get(&peak_rss);
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO()
+                     "md watchdog run %u: %d mds kept in %lu bytes, %d loaded, "
+                     "run pool %lu bytes, process peak rss %lu kb", wd->runs, 
+                     wd->entries->nelts, (unsigned long)wd->entries_size, loaded, 
+                     (unsigned long)run_bytes, (unsigned long)(peak_rss / 1024));
+    }
+    apr_pool_destroy(p);
+}
+
+static apr_status_t drive_md(md_watchdog *wd, md_wd_entry *entry, int *ploaded, 
+                             apr_pool_t *ptemp)
 {
     apr_status_t rv = APR_SUCCESS;
     apr_time_t renew_time;
     int errored, renew;
     char ts[APR_RFC822_DATE_LEN];
+    md_t probe, *md = &probe;
+    
+    if (entry->renewed) {
+        ap_log_error( APLOG_MARK, APLOG_INFO, 0, wd->s, APLOGNO() 
+                     "md(%s): has been renewed, will activate on next restart", entry->name);
+        return APR_SUCCESS;
+    }
+    
+    /* The kept state is all it takes to see if something needs to be done */
+    memset(&probe, 0, sizeof(probe));
+    probe.name = entry->name;
+    probe.state = entry->state;
+    probe.expires = entry->expires;
+    probe.renew_window = entry->renew_window;
     
-    if (APR_SUCCESS == (rv = md_reg_assess(wd->reg, md, &errored, &renew, wd->p))) {
+    rv = md_reg_assess(wd->reg, md, &errored, &renew, ptemp);
+    if (APR_SUCCESS == rv && !errored && renew) {
+        /* it does, work on the md as it is in the store now */
+        if (NULL == (md = md_reg_get(wd->reg, entry->name, ptemp))) {
+            ap_log_error( APLOG_MARK, APLOG_ERR, 0, wd->s, APLOGNO() 
+                         "md(%s): not found in store", entry->name);
+            return APR_ENOENT;
+        }
+        ++(*ploaded);
+        entry_set(entry, md);
+        rv = md_reg_assess(wd->reg, md, &errored, &renew, ptemp);
+    }
+    if (APR_SUCCESS == rv) {
         if (errored) {
             ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO() 
                          "md(%s): in error state", md->name);
         }
-        else if (md->state == MD_S_COMPLETE && !md->expires) {
-            /* This is our indicator that we did already renew this managed domain
-             * successfully and only wait on the next restart for it to activate */
-            ap_log_error( APLOG_MARK, APLOG_INFO, 0, wd->s, APLOGNO() 
-                         "md(%s): has been renewed, will activate on next restart", md->name);
-        }
         else if (renew) {
             ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO() 
                          "md(%s): state=%d, driving", md->name, md->state);
@@ -474,8 +690,21 @@ static apr_status_t drive_md(md_watchdog *wd, md_t *md, apr_pool_t *ptemp)
             if (APR_SUCCESS == rv) {
                 md->state = MD_S_COMPLETE;
                 md->expires = 0;
+                entry_set(entry, md);
+                entry->renewed = 1;
                 ++wd->processed_count;
             }
+            else if (APR_STATUS_IS_EBUSY(rv)) {
+                /* Another server on the same store is renewing it. Look again once
+                 * its lease would have run out, we may then just find it staged. */
+                ap_log_error( APLOG_MARK, APLOG_INFO, 0, wd->s, APLOGNO() 
+                             "md(%s): is being renewed by another server", md->name);
+                renew_time = apr_time_now() + MD_REG_LEASE_DURATION;
+                if (!wd->next_change || renew_time < wd->next_change) {
+                    wd->next_change = renew_time;
+                }
+                rv = APR_SUCCESS;
+            }
         }
         else {
             apr_rfc822_date(ts, md->expires);
@@ -490,18 +719,21 @@ static apr_status_t drive_md(md_watchdog *wd, md_t *md, apr_pool_t *ptemp)
     return rv;
 }
 
+static void activate_processed(md_watchdog *wd, apr_pool_t *ptemp);
+
 static apr_status_t run_watchdog(int state, void *baton, apr_pool_t *ptemp)
 {
     md_watchdog *wd = baton;
     apr_status_t rv = APR_SUCCESS;
-    md_t *md;
+    md_wd_entry *entry;
     apr_interval_time_t interval;
-    int i;
+    apr_pool_t *prun;
+    int i, loaded;
     
     switch (state) {
         case AP_WATCHDOG_STATE_STARTING:
             ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO()
-                         "md watchdog start, auto drive %d mds", wd->mds->nelts);
+                         "md watchdog start, auto drive %d mds", wd->entries->nelts);
             break;
         case AP_WATCHDOG_STATE_RUNNING:
             assert(wd->reg);
@@ -514,20 +746,44 @@ static apr_status_t run_watchdog(int state, void *baton, apr_pool_t *ptemp)
             wd->error_count = 0;
             wd->next_change = 0;
             
+            if (NULL == (prun = run_pool_create(wd))) {
+                ap_log_error(APLOG_MARK, APLOG_ERR, APR_ENOMEM, wd->s, APLOGNO()
+                             "md watchdog: create run pool");
+                break;
+            }
+            loaded = 0;
+            
             ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO()
-                         "md watchdog run, auto drive %d mds", wd->mds->nelts);
+                         "md watchdog run, auto drive %d mds", wd->entries->nelts);
                          
             /* Check if all Managed Domains are ok or if we have to do something */
-            for (i = 0; i < wd->mds->nelts; ++i) {
-                md = APR_ARRAY_IDX(wd->mds, i, md_t *);
-                if (APR_SUCCESS != (rv = drive_md(wd, md, ptemp))) {
+            for (i = 0; i < wd->entries->nelts; ++i) {
+                entry = &APR_ARRAY_IDX(wd->entries, i, md_wd_entry);
+                if (APR_SUCCESS != (rv = drive_md(wd, entry, &loaded, prun))) {
                     wd->all_valid = 0;
                     ++wd->error_count;
                     ap_log_error( APLOG_MARK, APLOG_ERR, rv, wd->s, APLOGNO() 
-                                 "processing %s", md->name);
+                                 "processing %s", entry->name);
                 }
             }
 
+            /* Whatever got staged must be on disk before a restart activates it */
+            if (APR_SUCCESS != (rv = md_store_sync(md_reg_store_get(wd->reg), prun))) {
+                ap_log_error( APLOG_MARK, APLOG_WARNING, rv, wd->s, APLOGNO() 
+                             "syncing md store");
+            }
+            if (APLOGdebug(wd->s)) {
+                md_store_fs_lock_stats_t stats;
+                
+                md_store_fs_lock_stats_get(&stats, md_reg_store_get(wd->reg));
+                ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO() 
+                             "store locks: %u granted, %u after waiting, %u timed out, "
+                             "waited %" APR_TIME_T_FMT "ms in total, %" APR_TIME_T_FMT 
+                             "ms at most", stats.acquired, stats.contended, stats.timeouts,
+                             apr_time_as_msec(stats.wait_total), 
+                             apr_time_as_msec(stats.wait_max));
+            }
+
             /* Determine when we want to run next */
             wd->error_runs = wd->error_count? (wd->error_runs + 1) : 0;
             if (wd->all_valid) {
@@ -564,6 +820,7 @@ static apr_status_t run_watchdog(int state, void *baton, apr_pool_t *ptemp)
                              (int)(secs%60));
             }
             wd_set_interval(wd->watchdog, interval, wd, run_watchdog);
+            run_pool_destroy(wd, prun, loaded);
             break;
         case AP_WATCHDOG_STATE_STOPPING:
             ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO()
@@ -571,6 +828,14 @@ static apr_status_t run_watchdog(int state, void *baton, apr_pool_t *ptemp)
             break;
     }
 
+    activate_processed(wd, ptemp);
+    return APR_SUCCESS;
+}
+
+static void activate_processed(md_watchdog *wd, apr_pool_t *ptemp)
+{
+    apr_status_t rv;
+    
     if (wd->processed_count) {
         if (wd->all_valid) {
             rv = md_server_graceful(ptemp, wd->s);
@@ -591,7 +856,110 @@ static apr_status_t run_watchdog(int state, void *baton, apr_pool_t *ptemp)
                          wd->error_count, (wd->error_count > 1)? " are" : " is");
         }
     }
+}
+
+/* Take over the state the md has in the store now, unless this process renewed it
+ * already and it waits for a restart to become active. */
+static void refresh_entry(md_watchdog *wd, md_wd_entry *entry, int *ploaded, 
+                          apr_pool_t *ptemp)
+{
+    md_t *md;
     
+    if (!entry->renewed && (md = md_reg_get(wd->reg, entry->name, ptemp))) {
+        ++(*ploaded);
+        entry_set(entry, md);
+    }
+}
+
+static int names_contain(apr_array_header_t *names, const char *name)
+{
+    int i;
+    
+    for (i = 0; i < names->nelts; ++i) {
+        if (!strcmp(name, APR_ARRAY_IDX(names, i, const char *))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static apr_status_t run_store_watch(int state, void *baton, apr_pool_t *ptemp)
+{
+    md_watchdog *wd = baton;
+    apr_array_header_t *names;
+    apr_status_t rv;
+    apr_time_t next_change;
+    md_wd_entry *entry;
+    apr_pool_t *prun;
+    int i, all, loaded;
+    
+    switch (state) {
+        case AP_WATCHDOG_STATE_STARTING:
+            /* here, in the process the watchdog runs in */
+            rv = md_store_fs_watch(&wd->watch, md_reg_store_get(wd->reg), wd->p, 
+                                   MD_STORE_WATCH_DEBOUNCE);
+            if (APR_SUCCESS != rv) {
+                ap_log_error(APLOG_MARK, APLOG_WARNING, rv, wd->s, APLOGNO()
+                             "not watching the md store, changes will be seen on the "
+                             "next regular run");
+            }
+            break;
+        case AP_WATCHDOG_STATE_RUNNING:
+            if (!wd->watch) {
+                break;
+            }
+            if (APR_SUCCESS != (rv = md_store_fs_watch_poll(&names, &all, wd->watch, ptemp))) {
+                ap_log_error(APLOG_MARK, APLOG_WARNING, rv, wd->s, APLOGNO()
+                             "watching the md store");
+                break;
+            }
+            if (!names->nelts && !all) {
+                break;
+            }
+            
+            wd->all_valid = 1;
+            wd->processed_count = 0;
+            wd->error_count = 0;
+            next_change = wd->next_change;
+            
+            if (NULL == (prun = run_pool_create(wd))) {
+                ap_log_error(APLOG_MARK, APLOG_ERR, APR_ENOMEM, wd->s, APLOGNO()
+                             "md watchdog: create run pool");
+                break;
+            }
+            loaded = 0;
+            
+            /* Re-assess only the mds that changed, as they are now in the store */
+            for (i = 0; i < wd->entries->nelts; ++i) {
+                entry = &APR_ARRAY_IDX(wd->entries, i, md_wd_entry);
+                if (!all && !names_contain(names, entry->name)) {
+                    continue;
+                }
+                ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO() 
+                             "md(%s): changed in store, assessing", entry->name);
+                refresh_entry(wd, entry, &loaded, prun);
+                if (APR_SUCCESS != (rv = drive_md(wd, entry, &loaded, prun))) {
+                    wd->all_valid = 0;
+                    ++wd->error_count;
+                    ap_log_error( APLOG_MARK, APLOG_ERR, rv, wd->s, APLOGNO() 
+                                 "processing %s", entry->name);
+                }
+            }
+            if (APR_SUCCESS != (rv = md_store_sync(md_reg_store_get(wd->reg), prun))) {
+                ap_log_error( APLOG_MARK, APLOG_WARNING, rv, wd->s, APLOGNO() 
+                             "syncing md store");
+            }
+            
+            if (wd->next_change && (!next_change || wd->next_change < next_change)) {
+                wd_set_interval(wd->watchdog, wd->next_change - apr_time_now(), 
+                                wd, run_watchdog);
+            }
+            activate_processed(wd, prun);
+            run_pool_destroy(wd, prun, loaded);
+            break;
+        default:
+            break;
+    }
     return APR_SUCCESS;
 }
 
@@ -600,11 +968,14 @@ static apr_status_t start_watchdog(apr_array_header_t *names, apr_pool_t *p,
 {
     apr_allocator_t *allocator;
     md_watchdog *wd;
-    apr_pool_t *wdp;
+    apr_pool_t *wdp, *ptemp;
     apr_status_t rv;
+    apr_array_header_t *results;
+    const md_reg_assessment_t *result;
+    md_wd_entry *entry;
     const char *name;
-    md_t *md;
-    int i, errored, renew;
+    apr_time_t start;
+    int i;
     
     wd_get_instance = APR_RETRIEVE_OPTIONAL_FN(ap_watchdog_get_instance);
     wd_register_callback = APR_RETRIEVE_OPTIONAL_FN(ap_watchdog_register_callback);
@@ -631,25 +1002,41 @@ static apr_status_t start_watchdog(apr_array_header_t *names, apr_pool_t *p,
     wd->reg = reg;
     wd->s = s;
     
-    wd->mds = apr_array_make(wd->p, 10, sizeof(md_t *));
-    for (i = 0; i < names->nelts; ++i) {
+    wd->entries = apr_array_make(wd->p, 10, sizeof(md_wd_entry));
+    /* the mds are only needed until their state is copied into the entries */
+    if (APR_SUCCESS != (rv = apr_pool_create(&ptemp, wd->p))) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO() "md_watchdog: create pool");
+        apr_pool_destroy(wd->p);
+        return rv;
+    }
+    start = apr_time_now();
+    md_reg_assess_all(&results, wd->reg, names, 
+                      md_config_geti(md_config_get(s), MD_CONFIG_STARTUP_THREADS), ptemp);
+    ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO() 
+                 "assessed %d managed domains in %ld ms", results->nelts, 
+                 (long)apr_time_as_msec(apr_time_now() - start));
+    for (i = 0; i < results->nelts; ++i) {
         name = APR_ARRAY_IDX(names, i, const char *);
-        md = md_reg_get(wd->reg, name, wd->p);
-        if (md) {
-            md_reg_assess(wd->reg, md, &errored, &renew, wd->p);
-            if (errored) {
+        result = &APR_ARRAY_IDX(results, i, md_reg_assessment_t);
+        if (result->md) {
+            if (result->errored) {
                 ap_log_error( APLOG_MARK, APLOG_WARNING, 0, wd->s, APLOGNO() 
                              "md(%s): seems errored. Will not process this any further.", name);
             }
             else {
                 ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, wd->s, APLOGNO() 
-                             "md(%s): state=%d, driving", name, md->state);
-                APR_ARRAY_PUSH(wd->mds, md_t*) = md;
+                             "md(%s): state=%d, driving", name, result->md->state);
+                entry = &APR_ARRAY_PUSH(wd->entries, md_wd_entry);
+                memset(entry, 0, sizeof(*entry));
+                entry->name = apr_pstrdup(wd->p, name);
+                entry_set(entry, result->md);
+                wd->entries_size += sizeof(*entry) + strlen(name) + 1;
             }
         }
     }
+    apr_pool_destroy(ptemp);
 
-    if (!wd->mds->nelts) {
+    if (!wd->entries->nelts) {
         ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO()
                      "no managed domain in state to drive, no watchdog needed, "
                      "will check again on next server restart");
@@ -665,28 +1052,268 @@ static apr_status_t start_watchdog(apr_array_header_t *names, apr_pool_t *p,
     rv = wd_register_callback(wd->watchdog, 0, wd, run_watchdog);
     ap_log_error(APLOG_MARK, rv? APLOG_CRIT : APLOG_DEBUG, rv, s, APLOGNO() 
                  "register md watchdog(%s)", MD_WATCHDOG_NAME);
+    if (APR_SUCCESS == rv && md_config_geti(md_config_get(s), MD_CONFIG_STORE_WATCH)) {
+        rv = wd_register_callback(wd->watchdog, MD_STORE_WATCH_POLL, wd, run_store_watch);
+        ap_log_error(APLOG_MARK, rv? APLOG_CRIT : APLOG_DEBUG, rv, s, APLOGNO() 
+                     "register md store watch(%s)", MD_WATCHDOG_NAME);
+    }
     return rv;
 }
  
-static void load_stage_sets(apr_array_header_t *names, apr_pool_t *p, 
-                            md_reg_t *reg, server_rec *s)
+/* Activate the staged sets of the mds named, return how many there were */
+static int load_stage_sets(apr_array_header_t *names, apr_pool_t *p, 
+                           md_reg_t *reg, server_rec *s)
 {
     const char *name; 
     apr_status_t rv;
-    int i;
+    int i, loaded = 0;
     
     for (i = 0; i < names->nelts; ++i) {
         name = APR_ARRAY_IDX(names, i, const char*);
         if (APR_SUCCESS == (rv = md_reg_load(reg, name, p))) {
             ap_log_error( APLOG_MARK, APLOG_INFO, rv, s, APLOGNO() 
                          "%s: staged set activated", name);
+            ++loaded;
         }
         else if (!APR_STATUS_IS_ENOENT(rv)) {
             ap_log_error( APLOG_MARK, APLOG_ERR, rv, s, APLOGNO()
                          "%s: error loading staged set", name);
         }
     }
-    return;
+    return loaded;
+}
+
+/**************************************************************************************************/
+/* credentials table */
+
+/* mod_ssl asks for the credentials of every managed server_rec, many of which may share
+ * the same MD. post_config looks up each MD once, after any staged sets were activated,
+ * and the answers stay the same for the lifetime of the configuration.
+ */
+typedef struct {
+    md_state_t state;
+    apr_time_t expires;
+    apr_status_t rv;
+    const char *keyfile;
+    const char *certfile;
+    const char *chainfile;
+    const char *stamp;              /* mtimes and sizes of the files, when looked up */
+} cred_entry_t;
+
+static apr_hash_t *cred_table;
+
+static apr_status_t cred_table_cleanup(void *data)
+{
+    if (cred_table == data) {
+        cred_table = NULL;
+    }
+    return APR_SUCCESS;
+}
+
+static cred_entry_t *cred_entry_copy(const cred_entry_t *entry, apr_pool_t *p)
+{
+    cred_entry_t *copy;
+    
+    copy = apr_pmemdup(p, entry, sizeof(*entry));
+    copy->keyfile = entry->keyfile? apr_pstrdup(p, entry->keyfile) : NULL;
+    copy->certfile = entry->certfile? apr_pstrdup(p, entry->certfile) : NULL;
+    copy->chainfile = entry->chainfile? apr_pstrdup(p, entry->chainfile) : NULL;
+    copy->stamp = entry->stamp? apr_pstrdup(p, entry->stamp) : NULL;
+    return copy;
+}
+
+/* The mtimes and sizes of the files of an entry, NULL if one cannot be read */
+static const char *cred_files_stamp(const cred_entry_t *entry, apr_pool_t *p)
+{
+    const char *files[3], *stamp = "";
+    apr_finfo_t finfo;
+    int i;
+    
+    files[0] = entry->keyfile;
+    files[1] = entry->certfile;
+    files[2] = entry->chainfile;
+    for (i = 0; i < 3; ++i) {
+        if (!files[i]) {
+            continue;
+        }
+        if (APR_SUCCESS != apr_stat(&finfo, files[i], APR_FINFO_MTIME|APR_FINFO_SIZE, p)) {
+            return NULL;
+        }
+        stamp = apr_psprintf(p, "%s%" APR_TIME_T_FMT ":%" APR_OFF_T_FMT " ", stamp, 
+                             finfo.mtime, finfo.size);
+    }
+    return stamp;
+}
+
+/* Determine if a credentials entry of a previous run still holds. Only complete ones
+ * are kept, as long as the certificate is valid and its files were not touched. */
+static int cred_entry_current(const cred_entry_t *entry, apr_time_t now, apr_pool_t *ptemp)
+{
+    const char *stamp;
+    
+    if (!entry || entry->state != MD_S_COMPLETE || APR_SUCCESS != entry->rv || !entry->stamp
+        || (entry->expires > 0 && entry->expires <= now)) {
+        return 0;
+    }
+    stamp = cred_files_stamp(entry, ptemp);
+    return stamp && !strcmp(stamp, entry->stamp);
+}
+
+/* Make the table for 'mds'. Entries in 'prev', made when the store was the same as now,
+ * are taken over, unless their certificate has expired or their files changed since. */
+static apr_hash_t *cred_table_make(apr_array_header_t *mds, md_reg_t *reg, apr_hash_t *prev,
+                                   apr_pool_t *p, apr_pool_t *ptemp, server_rec *s)
+{
+    apr_hash_t *table;
+    apr_array_header_t *names, *results;
+    const md_reg_assessment_t *result;
+    cred_entry_t *entry;
+    const md_t *md, *smd;
+    apr_time_t start;
+    int i, reused = 0;
+    
+    start = apr_time_now();
+    table = apr_hash_make(p);
+    names = apr_array_make(ptemp, mds->nelts + 1, sizeof(const char *));
+    for (i = 0; i < mds->nelts; ++i) {
+        md = APR_ARRAY_IDX(mds, i, const md_t *);
+        entry = prev? apr_hash_get(prev, md->name, APR_HASH_KEY_STRING) : NULL;
+        if (cred_entry_current(entry, start, ptemp)) {
+            apr_hash_set(table, md->name, APR_HASH_KEY_STRING, cred_entry_copy(entry, p));
+            ++reused;
+        }
+        else {
+            APR_ARRAY_PUSH(names, const char *) = md->name;
+        }
+    }
+    
+    /* the others have their certificates checked, on several threads */
+    md_reg_assess_all(&results, reg, names, 
+                      md_config_geti(md_config_get(s), MD_CONFIG_STARTUP_THREADS), ptemp);
+    for (i = 0; i < results->nelts; ++i) {
+        result = &APR_ARRAY_IDX(results, i, md_reg_assessment_t);
+        entry = apr_pcalloc(p, sizeof(*entry));
+        if (NULL == (smd = result->md)) {
+            entry->state = MD_S_UNKNOWN;
+        }
+        else if (MD_S_COMPLETE == (entry->state = smd->state)) {
+            entry->expires = smd->expires;
+            entry->rv = md_reg_get_cred_files(reg, smd, p, &entry->keyfile, 
+                                              &entry->certfile, &entry->chainfile);
+            if (APR_SUCCESS == entry->rv) {
+                entry->stamp = cred_files_stamp(entry, p);
+            }
+        }
+        apr_hash_set(table, APR_ARRAY_IDX(names, i, const char *), APR_HASH_KEY_STRING, entry);
+    }
+    apr_pool_cleanup_register(p, table, cred_table_cleanup, apr_pool_cleanup_null);
+    cred_table = table;
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO()
+                 "credentials of %d managed domains looked up in %ld ms, %d reused",
+                 mds->nelts, (long)apr_time_as_msec(apr_time_now() - start), reused);
+    return table;
+}
+
+/**************************************************************************************************/
+/* post_config cache */
+
+/* post_config runs twice on startup, the first time as a dry run, and again on every
+ * restart. When the configured MDs and the store are the same as in the previous run,
+ * the store does not need to be synched again and the credentials stay as they were,
+ * as long as their files were not touched. What the previous run found is kept in the 
+ * process pool. Its store is identified by the last sequence number in the store's 
+ * journal, which changes that bypass the store, e.g. copying in a certificate, do
+ * not move.
+ */
+#define MD_PCONF_CACHE_KEY      "mod_md_post_config_cache"
+
+typedef struct {
+    apr_pool_t *pool;
+    const char *digest;             /* of the configured mds and sync parameters */
+    apr_int64_t store_seq;          /* last change in the store journal afterwards */
+    apr_hash_t *creds;              /* md name -> cred_entry_t */
+} pconf_cache_t;
+
+static pconf_cache_t *pconf_cache_get(server_rec *s)
+{
+    void *data = NULL;
+    
+    apr_pool_userdata_get(&data, MD_PCONF_CACHE_KEY, s->process->pool);
+    return data;
+}
+
+static int pconf_cache_matches(pconf_cache_t *cache, const char *digest, apr_int64_t store_seq)
+{
+    return (cache && digest && store_seq >= 0 
+            && store_seq == cache->store_seq && !strcmp(digest, cache->digest));
+}
+
+static void pconf_cache_save(server_rec *s, const char *digest, apr_int64_t store_seq,
+                             apr_hash_t *creds)
+{
+    pconf_cache_t *cache, *old;
+    apr_hash_index_t *hi;
+    const void *key;
+    void *val;
+    apr_pool_t *pool;
+    
+    old = pconf_cache_get(s);
+    if (APR_SUCCESS != apr_pool_create(&pool, s->process->pool)) {
+        return;
+    }
+    apr_pool_tag(pool, "md_pconf_cache");
+    cache = apr_pcalloc(pool, sizeof(*cache));
+    cache->pool = pool;
+    cache->digest = apr_pstrdup(pool, digest);
+    cache->store_seq = store_seq;
+    cache->creds = apr_hash_make(pool);
+    for (hi = apr_hash_first(pool, creds); hi; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, &key, NULL, &val);
+        apr_hash_set(cache->creds, apr_pstrdup(pool, key), APR_HASH_KEY_STRING, 
+                     cred_entry_copy(val, pool));
+    }
+    apr_pool_userdata_setn(cache, MD_PCONF_CACHE_KEY, apr_pool_cleanup_null, s->process->pool);
+    if (old) {
+        apr_pool_destroy(old->pool);
+    }
+}
+
+/* The digest of everything md_reg_sync() gets from the config, NULL on failure */
+static const char *mds_digest(md_ctx *ctx, server_rec *s, apr_pool_t *p)
+{
+    apr_array_header_t *parts;
+    const char *text, *digest;
+    const md_t *md;
+    int i;
+    
+    parts = apr_array_make(p, ctx->mds->nelts + 1, sizeof(const char *));
+    APR_ARRAY_PUSH(parts, const char *) = apr_psprintf(p, "%d %d %s", 
+        ctx->can_http, ctx->can_https, md_config_gets(md_config_get(s), MD_CONFIG_BASE_DIR));
+    for (i = 0; i < ctx->mds->nelts; ++i) {
+        md = APR_ARRAY_IDX(ctx->mds, i, const md_t *);
+        if (!(digest = md_digest(md, p))) {
+            return NULL;
+        }
+        APR_ARRAY_PUSH(parts, const char *) = digest;
+    }
+    text = apr_array_pstrcat(p, parts, '\n');
+    if (APR_SUCCESS != md_crypt_sha256_digest_hex(&digest, p, text, strlen(text))) {
+        return NULL;
+    }
+    return digest;
+}
+
+/* The last sequence number in the store journal, -1 if there is none */
+static apr_int64_t store_seq_get(md_reg_t *reg, apr_pool_t *p)
+{
+    apr_array_header_t *changes;
+    apr_int64_t last;
+    
+    if (APR_SUCCESS != md_store_fs_changes(&changes, &last, md_reg_store_get(reg), 
+                                           APR_INT64_MAX, p)) {
+        return -1;
+    }
+    return last;
 }
 
 static apr_status_t md_post_config(apr_pool_t *p, apr_pool_t *plog,
@@ -699,7 +1326,13 @@ static apr_status_t md_post_config(apr_pool_t *p, apr_pool_t *plog,
     md_reg_t *reg;
     apr_status_t rv = APR_SUCCESS;
     const md_t *md;
-    int i;
+    apr_time_t start;
+    apr_size_t ibytes, isaved;
+    pconf_cache_t *cache;
+    const char *digest;
+    apr_hash_t *creds;
+    apr_int64_t store_seq;
+    int i, icount, reuse, loaded = 0;
     
     apr_pool_userdata_get(&data, mod_md_init_key, s->process->pool);
     if (data == NULL) {
@@ -721,6 +1354,7 @@ static apr_status_t md_post_config(apr_pool_t *p, apr_pool_t *plog,
     /* 1. Check uniqueness of MDs, calculate global, configured MD list.
      * If successful, we have a list of MD definitions that do not overlap. */
     /* We also need to find out if we can be reached on 80/443 from the outside (e.g. the CA) */
+    start = apr_time_now();
     if (APR_SUCCESS != (rv = md_calc_md_list(&ctx, p, plog, ptemp, s))) {
         goto out;
     }
@@ -731,15 +1365,32 @@ static apr_status_t md_post_config(apr_pool_t *p, apr_pool_t *plog,
     if (APR_SUCCESS != (rv = md_check_vhost_mapping(&ctx, p, plog, ptemp, s))) {
         goto out;
     }    
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO()
+                 "%d managed domains checked and mapped to virtual hosts in %ld ms, "
+                 "%d server checks", ctx.mds->nelts, 
+                 (long)apr_time_as_msec(apr_time_now() - start), ctx.vhost_checks);
+    md_domain_intern_stats(&icount, &ibytes, &isaved);
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO()
+                 "%d domain names interned in %lu bytes, %lu bytes of copies saved",
+                 icount, (unsigned long)ibytes, (unsigned long)isaved);
     
-    /* 3. Synchronize the defintions we now have with the store via a registry (reg). */
+    /* 3. Synchronize the defintions we now have with the store via a registry (reg). 
+     * Not needed when the previous run synched the same mds and the store is unchanged. */
     if (APR_SUCCESS != (rv = setup_reg(&reg, p, s, 1))) {
         ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO()
                      "setup md registry");
         goto out;
     }
-    if (APR_SUCCESS != (rv = md_reg_sync(reg, p, ptemp, ctx.mds, 
-                                         ctx.can_http, ctx.can_https))) {
+    cache = pconf_cache_get(s);
+    digest = mds_digest(&ctx, s, ptemp);
+    store_seq = store_seq_get(reg, ptemp);
+    if ((reuse = pconf_cache_matches(cache, digest, store_seq))) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO()
+                     "%d mds and the store unchanged since the last run, sync skipped", 
+                     ctx.mds->nelts);
+    }
+    else if (APR_SUCCESS != (rv = md_reg_sync(reg, p, ptemp, ctx.mds, 
+                                              ctx.can_http, ctx.can_https))) {
         ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, APLOGNO()
                      "synching %d mds to registry", ctx.mds->nelts);
         goto out;
@@ -777,7 +1428,13 @@ static apr_status_t md_post_config(apr_pool_t *p, apr_pool_t *plog,
                      "%d out of %d mds are configured for auto-drive", 
                      drive_names->nelts, ctx.mds->nelts);
     
-        load_stage_sets(drive_names, p, reg, s);
+        loaded = load_stage_sets(drive_names, p, reg, s);
+        if (data) {
+            /* Loading the staged sets just archived the previous ones. This is not
+             * left to the watchdog, its child process has no write access there. */
+            md_store_fs_archive_compact(md_reg_store_get(reg), ptemp, MD_ARCHIVE_PACK_AGE);
+            md_store_sync(md_reg_store_get(reg), ptemp);
+        }
         md_http_use_implementation(md_curl_get_impl(p));
         rv = start_watchdog(drive_names, p, reg, s);
     }
@@ -785,6 +1442,17 @@ static apr_status_t md_post_config(apr_pool_t *p, apr_pool_t *plog,
         ap_log_error( APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO()
                      "no mds to auto drive, no watchdog needed");
     }
+    
+    /* 4. What mod_ssl will ask for each managed server, now that staged sets are active */
+    creds = cred_table_make(ctx.mds, reg, (reuse && !loaded)? cache->creds : NULL, 
+                            p, ptemp, s);
+    if (digest) {
+        if (!reuse || loaded) {
+            /* this run changed the store, the next one needs to compare with that */
+            store_seq = store_seq_get(reg, ptemp);
+        }
+        pconf_cache_save(s, digest, store_seq, creds);
+    }
 out:     
     return rv;
 }
@@ -814,13 +1482,26 @@ static apr_status_t md_get_credentials(server_rec *s, apr_pool_t *p,
     md_config_t *conf;
     md_reg_t *reg;
     const md_t *md;
+    const cred_entry_t *entry;
     
     *pkeyfile = NULL;
     *pcertfile = NULL;
     *pchainfile = NULL;
     conf = (md_config_t *)md_config_get(s);
     
-    if (conf && conf->md && conf->store) {
+    if (conf && conf->md && cred_table
+        && (entry = apr_hash_get(cred_table, conf->md->name, APR_HASH_KEY_STRING))) {
+        if (entry->state != MD_S_COMPLETE) {
+            return APR_EAGAIN;
+        }
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, s, APLOGNO() 
+                     "%s: credentials for server %s", conf->md->name, s->server_hostname);
+        *pkeyfile = entry->keyfile;
+        *pcertfile = entry->certfile;
+        *pchainfile = entry->chainfile;
+        return entry->rv;
+    }
+    else if (conf && conf->md && conf->store) {
         if (APR_SUCCESS == (rv = md_reg_init(&reg, p, conf->store))) {
             md = md_reg_get(reg, conf->md->name, p);
             if (md->state != MD_S_COMPLETE) {
@@ -936,6 +1617,16 @@ static int md_http_challenge_pr(request_rec *r)
     return DECLINED;
 }
 
+/* Runs before each configuration is read, the first and on every restart.
+ */
+static int md_pre_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp)
+{
+    /* domain names are interned for one configuration. The table goes with pconf on a
+     * restart, also when the module is built in and md_hooks() does not run again. */
+    md_domain_intern_init(pconf);
+    return OK;
+}
+
 /* Runs once per created child process. Perform any process 
  * related initionalization here.
  */
@@ -948,11 +1639,20 @@ static void md_child_init(apr_pool_t *pool, server_rec *s)
 static void md_hooks(apr_pool_t *pool)
 {
     static const char *const mod_ssl[] = { "mod_ssl.c", NULL};
+    apr_status_t rv;
 
     md_acme_init(pool, AP_SERVER_BASEVERSION);
+    /* parse md.json files into pools, where the platform allows */
+    if (APR_SUCCESS != (rv = md_json_arena_setup())) {
+        ap_log_perror(APLOG_MARK, APLOG_DEBUG, rv, pool, "json pool arenas not available");
+    }
         
     ap_log_perror(APLOG_MARK, APLOG_TRACE1, 0, pool, "installing hooks");
     
+    /* Run before each configuration is read.
+     */
+    ap_hook_pre_config(md_pre_config, NULL, NULL, APR_HOOK_MIDDLE);
+    
     /* Run once after configuration is set, before mod_ssl.
      */
     ap_hook_post_config(md_post_config, NULL, mod_ssl, APR_HOOK_MIDDLE);
@@ -15,6 +15,7 @@
 
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <apr_lib.h>
 #include <apr_strings.h>
@@ -159,12 +160,26 @@ apr_status_t md_acme_setup(md_acme_t *acme)
 /**************************************************************************************************/
 /* acme requests */
 
+/* Every response brings a new nonce. It is copied into a buffer that the next one
+ * reuses, so that the many requests of a long staging do not pile up in acme->p. */
+static void set_nonce(md_acme_t *acme, const char *nonce)
+{
+    apr_size_t len = strlen(nonce) + 1;
+    
+    if (len > acme->nonce_size) {
+        acme->nonce_size = (len < 128)? 128 : len;
+        acme->nonce_buf = apr_palloc(acme->p, acme->nonce_size);
+    }
+    memcpy(acme->nonce_buf, nonce, len);
+    acme->nonce = acme->nonce_buf;
+}
+
 static void req_update_nonce(md_acme_t *acme, apr_table_t *hdrs)
 {
     if (hdrs) {
         const char *nonce = apr_table_get(hdrs, "Replay-Nonce");
         if (nonce) {
-            acme->nonce = apr_pstrdup(acme->p, nonce);
+            set_nonce(acme, nonce);
         }
     }
 }
@@ -174,8 +189,7 @@ static apr_status_t http_update_nonce(const md_http_response_t *res)
     if (res->headers) {
         const char *nonce = apr_table_get(res->headers, "Replay-Nonce");
         if (nonce) {
-            md_acme_t *acme = res->req->baton;
-            acme->nonce = apr_pstrdup(acme->p, nonce);
+            set_nonce(res->req->baton, nonce);
         }
     }
     return res->rv;
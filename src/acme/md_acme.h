@@ -61,6 +61,8 @@ struct md_acme_t {
     struct md_http_t *http;
     
     const char *nonce;
+    char *nonce_buf;                /* reused for each new nonce */
+    apr_size_t nonce_size;
     int max_retries;
     unsigned int pkey_bits;
 };
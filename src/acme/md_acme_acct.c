@@ -93,6 +93,13 @@ static md_json_t *acct_to_json(md_acme_acct_t *acct, apr_pool_t *p)
     return jacct;
 }
 
+static const md_json_path_t PATH_ID = MD_JSON_PATH1(MD_KEY_ID);
+static const md_json_path_t PATH_DISABLED = MD_JSON_PATH1(MD_KEY_DISABLED);
+static const md_json_path_t PATH_CA_URL = MD_JSON_PATH1(MD_KEY_CA_URL);
+static const md_json_path_t PATH_URL = MD_JSON_PATH1(MD_KEY_URL);
+static const md_json_path_t PATH_REG_CONTACT = MD_JSON_PATH2(MD_KEY_REGISTRATION, MD_KEY_CONTACT);
+static const md_json_path_t PATH_TOS = MD_JSON_PATH1("terms-of-service");
+
 static apr_status_t acct_from_json(md_acme_acct_t **pacct, md_json_t *json, apr_pool_t *p)
 {
     apr_status_t rv = APR_EINVAL;
@@ -101,27 +108,27 @@ static apr_status_t acct_from_json(md_acme_acct_t **pacct, md_json_t *json, apr_
     const char *ca_url, *url, *id;
     apr_array_header_t *contacts;
     
-    id = md_json_gets(json, MD_KEY_ID, NULL);
-    disabled = md_json_getb(json, MD_KEY_DISABLED, NULL);
-    ca_url = md_json_gets(json, MD_KEY_CA_URL, NULL);
+    id = md_json_path_gets(json, &PATH_ID);
+    disabled = md_json_path_getb(json, &PATH_DISABLED);
+    ca_url = md_json_path_gets(json, &PATH_CA_URL);
     if (!ca_url) {
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "account has no CA url: %s", id);
         goto out;
     }
     
-    url = md_json_gets(json, MD_KEY_URL, NULL);
+    url = md_json_path_gets(json, &PATH_URL);
     if (!url) {
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "account has no url: %s", id);
         goto out;
     }
 
     contacts = apr_array_make(p, 5, sizeof(const char *));
-    md_json_getsa(contacts, json, MD_KEY_REGISTRATION, MD_KEY_CONTACT, NULL);
+    md_json_path_getsa(contacts, json, &PATH_REG_CONTACT);
     rv = acct_make(&acct, p, ca_url, id, contacts);
     if (APR_SUCCESS == rv) {
         acct->disabled = disabled;
         acct->url = url;
-        acct->agreement = md_json_gets(json, "terms-of-service", NULL);
+        acct->agreement = md_json_path_gets(json, &PATH_TOS);
     }
 
 out:
@@ -63,7 +63,7 @@ md_acme_authz_t *md_acme_authz_set_get(md_acme_authz_set_t *set, const char *dom
     assert(domain);
     for (i = 0; i < set->authzs->nelts; ++i) {
         authz = APR_ARRAY_IDX(set->authzs, i, md_acme_authz_t *);
-        if (!apr_strnatcasecmp(domain, authz->domain)) {
+        if (domain == authz->domain || !apr_strnatcasecmp(domain, authz->domain)) {
             return authz;
         }
     }
@@ -90,7 +90,7 @@ apr_status_t md_acme_authz_set_remove(md_acme_authz_set_t *set, const char *doma
     assert(domain);
     for (i = 0; i < set->authzs->nelts; ++i) {
         authz = APR_ARRAY_IDX(set->authzs, i, md_acme_authz_t *);
-        if (!apr_strnatcasecmp(domain, authz->domain)) {
+        if (domain == authz->domain || !apr_strnatcasecmp(domain, authz->domain)) {
             int n = i +1;
             if (n < set->authzs->nelts) {
                 void **elems = (void **)set->authzs->elts;
@@ -154,7 +154,7 @@ static apr_status_t authz_created(md_acme_t *acme, apr_pool_t *p, const apr_tabl
     
     if (location) {
         ctx->authz = md_acme_authz_create(ctx->p);
-        ctx->authz->domain = apr_pstrdup(ctx->p, ctx->domain);
+        ctx->authz->domain = md_domain_intern(ctx->p, ctx->domain);
         ctx->authz->location = apr_pstrdup(ctx->p, location);
         ctx->authz->resource = md_json_clone(ctx->p, body);
         md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, rv, ctx->p, "authz_new at %s", location);
@@ -540,14 +540,19 @@ apr_status_t md_acme_authz_del(md_acme_authz_t *authz, md_acme_t *acme,
 /**************************************************************************************************/
 /* authz conversion */
 
+static const md_json_field_t AUTHZ_FIELDS[] = {
+    MD_JSON_FIELD(MD_KEY_DOMAIN, MD_JSON_FIELD_STR, md_acme_authz_t, domain),
+    MD_JSON_FIELD(MD_KEY_LOCATION, MD_JSON_FIELD_STR, md_acme_authz_t, location),
+    MD_JSON_FIELD(MD_KEY_DIR, MD_JSON_FIELD_STR, md_acme_authz_t, dir),
+    MD_JSON_FIELD(MD_KEY_STATE, MD_JSON_FIELD_ENUM, md_acme_authz_t, state),
+    MD_JSON_FIELD_END
+};
+
 md_json_t *md_acme_authz_to_json(md_acme_authz_t *a, apr_pool_t *p)
 {
     md_json_t *json = md_json_create(p);
     if (json) {
-        md_json_sets(a->domain, json, MD_KEY_DOMAIN, NULL);
-        md_json_sets(a->location, json, MD_KEY_LOCATION, NULL);
-        md_json_sets(a->dir, json, MD_KEY_DIR, NULL);
-        md_json_setl(a->state, json, MD_KEY_STATE, NULL);
+        md_json_encode(AUTHZ_FIELDS, a, json, p);
         return json;
     }
     return NULL;
@@ -557,10 +562,10 @@ md_acme_authz_t *md_acme_authz_from_json(struct md_json_t *json, apr_pool_t *p)
 {
     md_acme_authz_t *authz = md_acme_authz_create(p);
     if (authz) {
-        authz->domain = md_json_dups(p, json, MD_KEY_DOMAIN, NULL);            
-        authz->location = md_json_dups(p, json, MD_KEY_LOCATION, NULL);            
-        authz->dir = md_json_dups(p, json, MD_KEY_DIR, NULL);            
-        authz->state = (int)md_json_getl(json, MD_KEY_STATE, NULL);            
+        md_json_decode(AUTHZ_FIELDS, authz, json, p);
+        if (authz->domain) {
+            authz->domain = md_domain_intern(p, authz->domain);
+        }
         return authz;
     }
     return NULL;
@@ -193,8 +193,8 @@ static apr_status_t ad_setup_authz(md_proto_driver_t *d)
     }
     
     /* Add anything we do not already have */
-    for (i = 0; i < md->domains->nelts && APR_SUCCESS == rv; ++i) {
-        const char *domain = APR_ARRAY_IDX(md->domains, i, const char *);
+    for (i = 0; i < md_domain_set_count(md->domains) && APR_SUCCESS == rv; ++i) {
+        const char *domain = md_domain_set_get(md->domains, i);
         changed = 0;
         authz = md_acme_authz_set_get(ad->authz_set, domain);
         if (authz) {
@@ -817,6 +817,7 @@ static apr_status_t acme_preload(md_store_t *store, md_store_group_t load_group,
     md_cert_t *cert;
     apr_array_header_t *chain;
     struct md_acme_acct_t *acct;
+    md_store_txn_t *txn;
 
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "%s: preload start", name);
     /* Load all data which will be taken into the DOMAIN storage group.
@@ -859,14 +860,6 @@ static apr_status_t acme_preload(md_store_t *store, md_store_group_t load_group,
     /* Remove any authz information we have here or in MD_SG_CHALLENGES */
     md_acme_authz_set_purge(store, MD_SG_STAGING, p, name);
 
-    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, 
-                  "%s: staged data load, purging tmp space", name);
-    rv = md_store_purge(store, p, load_group, name);
-    if (APR_SUCCESS != rv) {
-        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "%s: error purging preload storage", name);
-        return rv;
-    }
-    
     if (acct) {
         md_acme_t *acme;
         
@@ -880,23 +873,36 @@ static apr_status_t acme_preload(md_store_t *store, md_store_group_t load_group,
                       name, acct->id);
     }
     
-    if (APR_SUCCESS != (rv = md_save(store, p, load_group, md, 1))) {
-        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "%s: saving md json", name);
+    /* Everything for the MD goes into the preload storage in one transaction, 
+     * replacing whatever is there. Should anything fail, nothing changes. */
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, 
+                  "%s: staged data load, writing tmp space", name);
+    if (APR_SUCCESS != (rv = md_store_txn_begin(&txn, store, p, load_group, name))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "%s: error starting preload", name);
         return rv;
     }
-    if (APR_SUCCESS != (rv = md_cert_save(store, p, load_group, name, cert, 1))) {
+    if (APR_SUCCESS != (rv = md_store_txn_put_md(txn, md))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "%s: saving md json", name);
+        goto out;
+    }
+    if (APR_SUCCESS != (rv = md_store_txn_put(txn, MD_FN_CERT, MD_SV_CERT, cert))) {
         md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "%s: saving certificate", name);
-        return rv;
+        goto out;
     }
-    if (APR_SUCCESS != (rv = md_chain_save(store, p, load_group, name, chain, 1))) {
+    if (APR_SUCCESS != (rv = md_store_txn_put(txn, MD_FN_CHAIN, MD_SV_CHAIN, chain))) {
         md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "%s: saving cert chain", name);
-        return rv;
+        goto out;
     }
-    if (APR_SUCCESS != (rv = md_pkey_save(store, p, load_group, name, pkey, 1))) {
+    if (APR_SUCCESS != (rv = md_store_txn_put(txn, MD_FN_PKEY, MD_SV_PKEY, pkey))) {
         md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "%s: saving domain private key", name);
-        return rv;
+        goto out;
+    }
+    if (APR_SUCCESS != (rv = md_store_txn_commit(txn))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "%s: committing preload storage", name);
     }
     
+out:
+    md_store_txn_abort(txn);
     return rv;
 }
 
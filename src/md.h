@@ -17,6 +17,7 @@
 #define mod_md_md_h
 
 #include "md_version.h"
+#include "md_domain_set.h"
 
 struct apr_array_header_t;
 struct apr_hash_t;
@@ -68,7 +69,7 @@ struct md_t {
     apr_time_t expires;             /* When the credentials for this domain expire. 0 if unknown */
     apr_interval_time_t renew_window;/* time before expiration that starts renewal */
     
-    struct apr_array_header_t *domains; /* all DNS names this MD includes */
+    struct md_domain_set_t *domains; /* all DNS names this MD includes */
     md_drive_mode_t drive_mode;     /* mode of obtaining credentials */
     int must_staple;                /* certificates should set the OCSP Must Staple extension */
     
@@ -196,7 +197,7 @@ md_t *md_create_empty(apr_pool_t *p);
 /**
  * Create a managed domain, given a list of domain names.
  */
-const char *md_create(md_t **pmd, apr_pool_t *p, struct apr_array_header_t *domains);
+const char *md_create(md_t **pmd, apr_pool_t *p, const struct apr_array_header_t *domains);
 
 /**
  * Deep copy an md record into another pool.
@@ -216,6 +217,12 @@ md_t *md_copy(apr_pool_t *p, const md_t *src);
 struct md_json_t *md_to_json (const md_t *md, apr_pool_t *p);
 md_t *md_from_json(struct md_json_t *json, apr_pool_t *p);
 
+/**
+ * The sha256 of the JSON representation, as hex string. Two mds have the same digest
+ * when md_to_json() gives the same for both. NULL on failure.
+ */
+const char *md_digest(const md_t *md, apr_pool_t *p);
+
 /**************************************************************************************************/
 /* domain credentials */
 
@@ -24,6 +24,7 @@
 
 #include "md_json.h"
 #include "md.h"
+#include "md_crypt.h"
 #include "md_log.h"
 #include "md_store.h"
 #include "md_util.h"
@@ -31,25 +32,15 @@
 
 int md_contains(const md_t *md, const char *domain)
 {
-   return md_array_str_index(md->domains, domain, 0, 0) >= 0;
+   return md_domain_set_contains(md->domains, domain);
 }
 
 const char *md_common_name(const md_t *md1, const md_t *md2)
 {
-    int i;
-    
-    if (md1 == NULL || md1->domains == NULL
-        || md2 == NULL || md2->domains == NULL) {
+    if (md1 == NULL || md2 == NULL) {
         return NULL;
     }
-    
-    for (i = 0; i < md1->domains->nelts; ++i) {
-        const char *name1 = APR_ARRAY_IDX(md1->domains, i, const char*);
-        if (md_contains(md2, name1)) {
-            return name1;
-        }
-    }
-    return NULL;
+    return md_domain_set_common(md1->domains, md2->domains);
 }
 
 int md_domains_overlap(const md_t *md1, const md_t *md2)
@@ -59,29 +50,17 @@ int md_domains_overlap(const md_t *md1, const md_t *md2)
 
 apr_size_t md_common_name_count(const md_t *md1, const md_t *md2)
 {
-    int i;
-    apr_size_t hits;
-    
-    if (md1 == NULL || md1->domains == NULL
-        || md2 == NULL || md2->domains == NULL) {
+    if (md1 == NULL || md2 == NULL) {
         return 0;
     }
-    
-    hits = 0;
-    for (i = 0; i < md1->domains->nelts; ++i) {
-        const char *name1 = APR_ARRAY_IDX(md1->domains, i, const char*);
-        if (md_contains(md2, name1)) {
-            ++hits;
-        }
-    }
-    return hits;
+    return (apr_size_t)md_domain_set_intersect_count(md1->domains, md2->domains);
 }
 
 md_t *md_create_empty(apr_pool_t *p)
 {
     md_t *md = apr_pcalloc(p, sizeof(*md));
     if (md) {
-        md->domains = apr_array_make(p, 5, sizeof(const char *));
+        md->domains = md_domain_set_make(p, 5);
         md->contacts = apr_array_make(p, 5, sizeof(const char *));
         md->drive_mode = MD_DRIVE_DEFAULT;
         md->defn_name = "unknown";
@@ -92,32 +71,12 @@ md_t *md_create_empty(apr_pool_t *p)
 
 int md_equal_domains(const md_t *md1, const md_t *md2)
 {
-    int i;
-    if (md1->domains->nelts == md2->domains->nelts) {
-        for (i = 0; i < md1->domains->nelts; ++i) {
-            const char *name1 = APR_ARRAY_IDX(md1->domains, i, const char*);
-            if (!md_contains(md2, name1)) {
-                return 0;
-            }
-        }
-        return 1;
-    }
-    return 0;
+    return md_domain_set_equal(md1->domains, md2->domains);
 }
 
 int md_contains_domains(const md_t *md1, const md_t *md2)
 {
-    int i;
-    if (md1->domains->nelts >= md2->domains->nelts) {
-        for (i = 0; i < md2->domains->nelts; ++i) {
-            const char *name2 = APR_ARRAY_IDX(md2->domains, i, const char*);
-            if (!md_contains(md1, name2)) {
-                return 0;
-            }
-        }
-        return 1;
-    }
-    return 0;
+    return md_domain_set_contains_all(md1->domains, md2->domains);
 }
 
 md_t *md_find_closest_match(apr_array_header_t *mds, const md_t *md)
@@ -188,7 +147,7 @@ md_t *md_get_by_dns_overlap(struct apr_array_header_t *mds, const md_t *md)
     return NULL;
 }
 
-const char *md_create(md_t **pmd, apr_pool_t *p, apr_array_header_t *domains)
+const char *md_create(md_t **pmd, apr_pool_t *p, const apr_array_header_t *domains)
 {
     md_t *md;
     
@@ -201,8 +160,8 @@ const char *md_create(md_t **pmd, apr_pool_t *p, apr_array_header_t *domains)
         return "not enough memory";
     }
 
-    md->domains = md_array_str_compact(p, domains, 0);
-    md->name = APR_ARRAY_IDX(md->domains, 0, const char *);
+    md->domains = md_domain_set_from_array(p, domains);
+    md->name = md_domain_set_get(md->domains, 0);
     
     *pmd = md;
     return NULL;   
@@ -218,7 +177,7 @@ md_t *md_copy(apr_pool_t *p, const md_t *src)
     md = apr_pcalloc(p, sizeof(*md));
     if (md) {
         memcpy(md, src, sizeof(*md));
-        md->domains = apr_array_copy(p, src->domains);
+        md->domains = md_domain_set_copy(p, src->domains);
         md->contacts = apr_array_copy(p, src->contacts);
         if (src->ca_challenges) {
             md->ca_challenges = apr_array_copy(p, src->ca_challenges);
@@ -236,7 +195,7 @@ md_t *md_clone(apr_pool_t *p, const md_t *src)
         md->state = src->state;
         md->name = apr_pstrdup(p, src->name);
         md->drive_mode = src->drive_mode;
-        md->domains = md_array_str_compact(p, src->domains, 0);
+        md->domains = md_domain_set_clone(p, src->domains);
         md->renew_window = src->renew_window;
         md->contacts = md_array_str_clone(p, src->contacts);
         if (src->ca_url) md->ca_url = apr_pstrdup(p, src->ca_url);
@@ -256,34 +215,49 @@ md_t *md_clone(apr_pool_t *p, const md_t *src)
 /**************************************************************************************************/
 /* format conversion */
 
+static const md_json_field_t MD_CA_FIELDS[] = {
+    MD_JSON_FIELD(MD_KEY_ACCOUNT, MD_JSON_FIELD_STR, md_t, ca_account),
+    MD_JSON_FIELD(MD_KEY_PROTO, MD_JSON_FIELD_STR, md_t, ca_proto),
+    MD_JSON_FIELD(MD_KEY_URL, MD_JSON_FIELD_STR, md_t, ca_url),
+    MD_JSON_FIELD(MD_KEY_AGREEMENT, MD_JSON_FIELD_STR, md_t, ca_agreement),
+    MD_JSON_FIELD_OPT(MD_KEY_CHALLENGES, MD_JSON_FIELD_STRA, md_t, ca_challenges),
+    MD_JSON_FIELD_END
+};
+
+static const md_json_field_t MD_CERT_FIELDS[] = {
+    MD_JSON_FIELD(MD_KEY_URL, MD_JSON_FIELD_STR, md_t, cert_url),
+    MD_JSON_FIELD(MD_KEY_EXPIRES, MD_JSON_FIELD_DATE, md_t, expires),
+    MD_JSON_FIELD_END
+};
+
+/* The domains are written between MD_NAME_FIELDS and MD_FIELDS, where they always were */
+static const md_json_field_t MD_NAME_FIELDS[] = {
+    MD_JSON_FIELD(MD_KEY_NAME, MD_JSON_FIELD_STR, md_t, name),
+    MD_JSON_FIELD_END
+};
+
+static const md_json_field_t MD_FIELDS[] = {
+    MD_JSON_FIELD(MD_KEY_CONTACTS, MD_JSON_FIELD_STRA, md_t, contacts),
+    MD_JSON_FIELD_SUB(MD_KEY_CA, MD_CA_FIELDS),
+    MD_JSON_FIELD_SUB(MD_KEY_CERT, MD_CERT_FIELDS),
+    MD_JSON_FIELD(MD_KEY_STATE, MD_JSON_FIELD_ENUM, md_t, state),
+    MD_JSON_FIELD(MD_KEY_DRIVE_MODE, MD_JSON_FIELD_ENUM, md_t, drive_mode),
+    MD_JSON_FIELD(MD_KEY_RENEW_WINDOW, MD_JSON_FIELD_SECS, md_t, renew_window),
+    MD_JSON_FIELD_END
+};
+
 md_json_t *md_to_json(const md_t *md, apr_pool_t *p)
 {
     md_json_t *json = md_json_create(p);
     if (json) {
-        apr_array_header_t *domains = md_array_str_compact(p, md->domains, 0);
-        md_json_sets(md->name, json, MD_KEY_NAME, NULL);
-        md_json_setsa(domains, json, MD_KEY_DOMAINS, NULL);
-        md_json_setsa(md->contacts, json, MD_KEY_CONTACTS, NULL);
-        md_json_sets(md->ca_account, json, MD_KEY_CA, MD_KEY_ACCOUNT, NULL);
-        md_json_sets(md->ca_proto, json, MD_KEY_CA, MD_KEY_PROTO, NULL);
-        md_json_sets(md->ca_url, json, MD_KEY_CA, MD_KEY_URL, NULL);
-        md_json_sets(md->ca_agreement, json, MD_KEY_CA, MD_KEY_AGREEMENT, NULL);
-        if (md->cert_url) {
-            md_json_sets(md->cert_url, json, MD_KEY_CERT, MD_KEY_URL, NULL);
-        }
-        md_json_setl(md->state, json, MD_KEY_STATE, NULL);
-        md_json_setl(md->drive_mode, json, MD_KEY_DRIVE_MODE, NULL);
-        if (md->expires > 0) {
-            char *ts = apr_pcalloc(p, APR_RFC822_DATE_LEN);
-            apr_rfc822_date(ts, md->expires);
-            md_json_sets(ts, json, MD_KEY_CERT, MD_KEY_EXPIRES, NULL);
-        }
-        md_json_setl(apr_time_sec(md->renew_window), json, MD_KEY_RENEW_WINDOW, NULL);
-        if (md->ca_challenges && md->ca_challenges->nelts > 0) {
-            apr_array_header_t *na;
-            na = md_array_str_compact(p, md->ca_challenges, 0);
-            md_json_setsa(na, json, MD_KEY_CA, MD_KEY_CHALLENGES, NULL);
+        md_t cmd = *md;
+        
+        if (md->ca_challenges) {
+            cmd.ca_challenges = md_array_str_compact(p, md->ca_challenges, 0);
         }
+        md_json_encode(MD_NAME_FIELDS, &cmd, json, p);
+        md_json_setsa(md_domain_set_names(md->domains), json, MD_KEY_DOMAINS, NULL);
+        md_json_encode(MD_FIELDS, &cmd, json, p);
         return json;
     }
     return NULL;
@@ -291,31 +265,30 @@ md_json_t *md_to_json(const md_t *md, apr_pool_t *p)
 
 md_t *md_from_json(md_json_t *json, apr_pool_t *p)
 {
-    const char *s;
+    apr_array_header_t *domains;
     md_t *md = md_create_empty(p);
     if (md) {
-        md->name = md_json_dups(p, json, MD_KEY_NAME, NULL);            
-        md_json_dupsa(md->domains, p, json, MD_KEY_DOMAINS, NULL);
-        md_json_dupsa(md->contacts, p, json, MD_KEY_CONTACTS, NULL);
-        md->ca_account = md_json_dups(p, json, MD_KEY_CA, MD_KEY_ACCOUNT, NULL);
-        md->ca_proto = md_json_dups(p, json, MD_KEY_CA, MD_KEY_PROTO, NULL);
-        md->ca_url = md_json_dups(p, json, MD_KEY_CA, MD_KEY_URL, NULL);
-        md->ca_agreement = md_json_dups(p, json, MD_KEY_CA, MD_KEY_AGREEMENT, NULL);
-        md->cert_url = md_json_dups(p, json, MD_KEY_CERT, MD_KEY_URL, NULL);
-        md->state = (int)md_json_getl(json, MD_KEY_STATE, NULL);
-        md->drive_mode = (int)md_json_getl(json, MD_KEY_DRIVE_MODE, NULL);
-        md->domains = md_array_str_compact(p, md->domains, 0);
-        s = md_json_dups(p, json, MD_KEY_CERT, MD_KEY_EXPIRES, NULL);
-        if (s && *s) {
-            md->expires = apr_date_parse_rfc(s);
-        }
-        md->renew_window = apr_time_from_sec(md_json_getl(json, MD_KEY_RENEW_WINDOW, NULL));
-        if (md_json_has_key(json, MD_KEY_CA, MD_KEY_CHALLENGES, NULL)) {
-            md->ca_challenges = apr_array_make(p, 5, sizeof(const char*));
-            md_json_dupsa(md->ca_challenges, p, json, MD_KEY_CA, MD_KEY_CHALLENGES, NULL);
-        }
+        /* an absent drive-mode has always been read as 0 */
+        md->drive_mode = MD_DRIVE_MANUAL;
+        md_json_decode(MD_NAME_FIELDS, md, json, p);
+        md_json_decode(MD_FIELDS, md, json, p);
+        /* the set interns or copies the names, they need not be duplicated first */
+        domains = apr_array_make(p, 5, sizeof(const char *));
+        md_json_getsa(domains, json, MD_KEY_DOMAINS, NULL);
+        md->domains = md_domain_set_from_array(p, domains);
         return md;
     }
     return NULL;
 }
 
+const char *md_digest(const md_t *md, apr_pool_t *p)
+{
+    const char *s, *digest;
+    
+    s = md_json_writep(md_to_json(md, p), p, MD_JSON_FMT_COMPACT);
+    if (!s || APR_SUCCESS != md_crypt_sha256_digest_hex(&digest, p, s, strlen(s))) {
+        return NULL;
+    }
+    return digest;
+}
+
@@ -14,13 +14,17 @@
  */
 
 #include <assert.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <apr_lib.h>
 #include <apr_buckets.h>
 #include <apr_file_io.h>
+#include <apr_hash.h>
 #include <apr_strings.h>
+#include <apr_thread_mutex.h>
 
 #include <openssl/err.h>
 #include <openssl/evp.h>
@@ -50,6 +54,8 @@
 
 static int initialized;
 
+static apr_status_t intern_init(void);
+
 struct md_pkey_t {
     apr_pool_t *pool;
     EVP_PKEY   *pkey;
@@ -132,11 +138,24 @@ apr_status_t md_crypt_init(apr_pool_t *pool)
             seed_RAND(pid);
 	}
 
+        if (APR_SUCCESS != intern_init()) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, 0, pool, 
+                          "unable to setup shared certificates, chains are loaded per domain"); 
+        }
         initialized = 1;
     }
     return APR_SUCCESS;
 }
 
+int md_crypt_is_thread_safe(void)
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    return CRYPTO_get_locking_callback() != NULL;
+#else
+    return 1;
+#endif
+}
+
 typedef struct {
     char *data;
     apr_size_t len;
@@ -303,6 +322,56 @@ apr_status_t md_pkey_fsave(md_pkey_t *pkey, apr_pool_t *p,
     return rv;
 }
 
+apr_status_t md_pkey_to_pem(const char **ppem, apr_size_t *plen, md_pkey_t *pkey, 
+                            apr_pool_t *p, const char *pass_phrase, apr_size_t pass_len)
+{
+    buffer buffer;
+    apr_status_t rv;
+    
+    memset(&buffer, 0, sizeof(buffer));
+    rv = pkey_to_buffer(&buffer, pkey, p, pass_phrase, pass_len);
+    *ppem = (APR_SUCCESS == rv)? buffer.data : NULL;
+    *plen = (APR_SUCCESS == rv)? buffer.len : 0;
+    return rv;
+}
+
+apr_status_t md_pkey_from_pem(md_pkey_t **ppkey, apr_pool_t *p, 
+                              const char *pass_phrase, apr_size_t pass_len,
+                              const char *pem, apr_size_t pem_len)
+{
+    apr_status_t rv = APR_EINVAL;
+    md_pkey_t *pkey;
+    BIO *bio;
+    passwd_ctx ctx;
+    
+    if (pem_len > INT_MAX) {
+        *ppkey = NULL;
+        return APR_EINVAL;
+    }
+    pkey = make_pkey(p);
+    if (NULL != (bio = BIO_new_mem_buf((void *)pem, (int)pem_len))) {
+        ctx.pass_phrase = pass_phrase;
+        ctx.pass_len = (int)pass_len;
+        
+        ERR_clear_error();
+        pkey->pkey = PEM_read_bio_PrivateKey(bio, NULL, pem_passwd, &ctx);
+        BIO_free(bio);
+        
+        if (pkey->pkey != NULL) {
+            rv = APR_SUCCESS;
+            apr_pool_cleanup_register(p, pkey, pkey_cleanup, apr_pool_cleanup_null);
+        }
+        else {
+            long err = ERR_get_error();
+            md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, "error reading pkey: %s "
+                          "(pass phrase was %snull)", ERR_error_string(err, NULL), 
+                          pass_phrase? "not " : ""); 
+        }
+    }
+    *ppkey = (APR_SUCCESS == rv)? pkey : NULL;
+    return rv;
+}
+
 apr_status_t md_pkey_gen_rsa(md_pkey_t **ppkey, apr_pool_t *p, int bits)
 {
     EVP_PKEY_CTX *ctx = NULL;
@@ -532,6 +601,8 @@ struct md_cert_t {
     apr_pool_t *pool;
     X509 *x509;
     apr_array_header_t *alt_names;
+    const unsigned char *digest;    /* set for interned certificates only */
+    apr_uint32_t refs;
 };
 
 static apr_status_t cert_cleanup(void *data)
@@ -556,7 +627,10 @@ static md_cert_t *make_cert(apr_pool_t *p, X509 *x509)
 
 void md_cert_free(md_cert_t *cert)
 {
-    cert_cleanup(cert);
+    if (!cert->digest) {
+        /* interned ones go away with their last pool */
+        cert_cleanup(cert);
+    }
 }
 
 void *md_cert_get_X509(struct md_cert_t *cert)
@@ -609,8 +683,8 @@ int md_cert_covers_md(md_cert_t *cert, const md_t *md)
     if (cert->alt_names) {
         md_log_perror(MD_LOG_MARK, MD_LOG_TRACE4, 0, cert->pool, "cert has %d alt names",
                       cert->alt_names->nelts); 
-        for (i = 0; i < md->domains->nelts; ++i) {
-            name = APR_ARRAY_IDX(md->domains, i, const char *);
+        for (i = 0; i < md_domain_set_count(md->domains); ++i) {
+            name = md_domain_set_get(md->domains, i);
             if (md_array_str_index(cert->alt_names, name, 0, 0) < 0) {
                 md_log_perror(MD_LOG_MARK, MD_LOG_TRACE1, 0, cert->pool, 
                               "md domain %s not covered by cert", name);
@@ -763,6 +837,178 @@ apr_status_t md_cert_to_base64url(const char **ps64, md_cert_t *cert, apr_pool_t
     return rv;
 }
 
+apr_status_t md_cert_to_der(const char **pder, apr_size_t *pder_len, 
+                            const md_cert_t *cert, apr_pool_t *p)
+{
+    unsigned char *der, *bf;
+    int len;
+    
+    *pder = NULL;
+    *pder_len = 0;
+    if (0 >= (len = i2d_X509(cert->x509, NULL))) {
+        return APR_EINVAL;
+    }
+    bf = der = apr_palloc(p, (apr_size_t)len);
+    if (len != i2d_X509(cert->x509, &bf)) {
+        return APR_EINVAL;
+    }
+    *pder = (const char*)der;
+    *pder_len = (apr_size_t)len;
+    return APR_SUCCESS;
+}
+
+apr_status_t md_cert_from_der(md_cert_t **pcert, apr_pool_t *p, 
+                              const char *der, apr_size_t der_len)
+{
+    const unsigned char *bf = (const unsigned char*)der;
+    X509 *x509;
+    
+    *pcert = NULL;
+    if (der_len > LONG_MAX || NULL == (x509 = d2i_X509(NULL, &bf, (long)der_len))) {
+        return APR_EINVAL;
+    }
+    *pcert = make_cert(p, x509);
+    return APR_SUCCESS;
+}
+
+/**************************************************************************************************/
+/* interned certificates */
+
+/* The chains of most managed domains share the same few intermediate and root
+ * certificates. Instead of a X509 per domain, chains are loaded from a process
+ * wide table keyed by the SHA-256 of the DER encoding. Each interned certificate
+ * lives in its own sub pool and counts the pools it was handed out to. */
+
+#define INTERN_KEY_LEN      32
+
+static apr_pool_t *intern_pool;
+static apr_hash_t *interned;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *intern_mutex;
+#endif
+
+static apr_status_t intern_init(void)
+{
+    apr_status_t rv;
+    
+    if (intern_pool) {
+        return APR_SUCCESS;
+    }
+    /* Not a child of the global pool: the table must outlive all pools 
+     * that still hold references when APR terminates. */
+    if (APR_SUCCESS != (rv = apr_pool_create_unmanaged_ex(&intern_pool, NULL, NULL))) {
+        return rv;
+    }
+    apr_pool_tag(intern_pool, "md_cert_intern");
+#if APR_HAS_THREADS
+    if (APR_SUCCESS != (rv = apr_thread_mutex_create(&intern_mutex, 
+                                                     APR_THREAD_MUTEX_DEFAULT, intern_pool))) {
+        apr_pool_destroy(intern_pool);
+        intern_pool = NULL;
+        return rv;
+    }
+#endif
+    interned = apr_hash_make(intern_pool);
+    return APR_SUCCESS;
+}
+
+static void intern_lock(void)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(intern_mutex);
+#endif
+}
+
+static void intern_unlock(void)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(intern_mutex);
+#endif
+}
+
+static apr_status_t cert_release(void *data)
+{
+    md_cert_t *cert = data;
+    
+    intern_lock();
+    if (--cert->refs == 0) {
+        apr_hash_set(interned, cert->digest, INTERN_KEY_LEN, NULL);
+        apr_pool_destroy(cert->pool);
+    }
+    intern_unlock();
+    return APR_SUCCESS;
+}
+
+static apr_status_t cert_intern(md_cert_t **pcert, apr_pool_t *p, 
+                                const char *der, apr_size_t der_len)
+{
+    unsigned char key[EVP_MAX_MD_SIZE], *digest;
+    unsigned int klen;
+    const unsigned char *bf;
+    md_cert_t *cert;
+    apr_pool_t *cp;
+    X509 *x509;
+    apr_status_t rv = APR_SUCCESS;
+    
+    *pcert = NULL;
+    if (der_len > LONG_MAX 
+        || !EVP_Digest(der, der_len, key, &klen, EVP_sha256(), NULL)
+        || klen != INTERN_KEY_LEN) {
+        return APR_EINVAL;
+    }
+    
+    intern_lock();
+    if (NULL == (cert = apr_hash_get(interned, key, INTERN_KEY_LEN))) {
+        bf = (const unsigned char*)der;
+        if (NULL == (x509 = d2i_X509(NULL, &bf, (long)der_len))) {
+            rv = APR_EINVAL;
+            goto leave;
+        }
+        if (APR_SUCCESS != (rv = apr_pool_create(&cp, intern_pool))) {
+            X509_free(x509);
+            goto leave;
+        }
+        cert = make_cert(cp, x509);
+        digest = apr_pmemdup(cp, key, INTERN_KEY_LEN);
+        cert->digest = digest;
+        /* Shared between threads from now on, nothing may be added lazily. */
+        if (APR_SUCCESS != md_cert_get_alt_names(&cert->alt_names, cert, cp)) {
+            cert->alt_names = apr_array_make(cp, 0, sizeof(const char *));
+        }
+        apr_hash_set(interned, cert->digest, INTERN_KEY_LEN, cert);
+    }
+    ++cert->refs;
+leave:
+    intern_unlock();
+    
+    if (APR_SUCCESS == rv) {
+        apr_pool_cleanup_register(p, cert, cert_release, apr_pool_cleanup_null);
+        *pcert = cert;
+    }
+    return rv;
+}
+
+apr_status_t md_cert_intern_der(md_cert_t **pcert, apr_pool_t *p, 
+                                const char *der, apr_size_t der_len)
+{
+    if (!intern_pool) {
+        return md_cert_from_der(pcert, p, der, der_len);
+    }
+    return cert_intern(pcert, p, der, der_len);
+}
+
+unsigned int md_cert_interned_count(void)
+{
+    unsigned int count = 0;
+    
+    if (intern_pool) {
+        intern_lock();
+        count = apr_hash_count(interned);
+        intern_unlock();
+    }
+    return count;
+}
+
 apr_status_t md_cert_read_http(md_cert_t **pcert, apr_pool_t *p, 
                                const md_http_response_t *res)
 {
@@ -782,16 +1028,7 @@ apr_status_t md_cert_read_http(md_cert_t **pcert, apr_pool_t *p,
             return APR_EINVAL;
         }
         if (APR_SUCCESS == (rv = apr_brigade_pflatten(res->body, &der, &der_len, p))) {
-            const unsigned char *bf = (const unsigned char*)der;
-            X509 *x509;
-            
-            if (NULL == (x509 = d2i_X509(NULL, &bf, der_len))) {
-                rv = APR_EINVAL;
-            }
-            else {
-                *pcert = make_cert(p, x509);
-                rv = APR_SUCCESS;
-            }
+            rv = md_cert_from_der(pcert, p, der, der_len);
         }
         md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, rv, p, "cert parsed");
     }
@@ -811,20 +1048,38 @@ apr_status_t md_chain_fload(apr_array_header_t **pcerts, apr_pool_t *p, const ch
     FILE *f;
     apr_status_t rv;
     apr_array_header_t *certs = NULL;
-    X509 *x509;
     md_cert_t *cert;
+    char *name, *header;
+    unsigned char *der;
+    long der_len;
     unsigned long err;
     
     rv = md_util_fopen(&f, fname, "r");
     if (rv == APR_SUCCESS) {
         certs = apr_array_make(p, 5, sizeof(md_cert_t *));
         
+        /* Only base64 decode the PEM here, the certificates themselves are
+         * most likely already known to the intern table. */
         ERR_clear_error();
-        while (NULL != (x509 = PEM_read_X509(f, NULL, NULL, NULL))) {
-            cert = make_cert(p, x509);
-            APR_ARRAY_PUSH(certs, md_cert_t *) = cert;
+        while (PEM_read(f, &name, &header, &der, &der_len)) {
+            cert = NULL;
+            if (!strcmp(PEM_STRING_X509, name) || !strcmp(PEM_STRING_X509_OLD, name)) {
+                rv = md_cert_intern_der(&cert, p, (const char*)der, (apr_size_t)der_len);
+            }
+            OPENSSL_free(name);
+            OPENSSL_free(header);
+            OPENSSL_free(der);
+            if (APR_SUCCESS != rv) {
+                break;
+            }
+            if (cert) {
+                APR_ARRAY_PUSH(certs, md_cert_t *) = cert;
+            }
         }
         fclose(f);
+        if (APR_SUCCESS != rv) {
+            goto out;
+        }
         
         if (0 < (err =  ERR_get_error())
             && !(ERR_GET_LIB(err) == ERR_LIB_PEM && ERR_GET_REASON(err) == PEM_R_NO_START_LINE)) {
@@ -854,6 +1109,40 @@ out:
     return rv;
 }
 
+apr_status_t md_chain_to_pem(const char **ppem, apr_size_t *plen, 
+                             apr_array_header_t *certs, apr_pool_t *p)
+{
+    BIO *bio;
+    const md_cert_t *cert;
+    char *pem;
+    int i, len;
+    
+    *ppem = NULL;
+    *plen = 0;
+    if (!(bio = BIO_new(BIO_s_mem()))) {
+        return APR_ENOMEM;
+    }
+    ERR_clear_error();
+    for (i = 0; i < certs->nelts; ++i) {
+        cert = APR_ARRAY_IDX(certs, i, const md_cert_t *);
+        assert(cert->x509);
+        PEM_write_bio_X509(bio, cert->x509);
+        if (ERR_get_error() > 0) {
+            BIO_free(bio);
+            return APR_EINVAL;
+        }
+    }
+    len = BIO_pending(bio);
+    pem = apr_palloc(p, (apr_size_t)len + 1);
+    len = (len > 0)? BIO_read(bio, pem, len) : 0;
+    pem[len > 0? len : 0] = '\0';
+    BIO_free(bio);
+    
+    *ppem = pem;
+    *plen = (len > 0)? (apr_size_t)len : 0;
+    return APR_SUCCESS;
+}
+
 apr_status_t md_chain_fsave(apr_array_header_t *certs, apr_pool_t *p, 
                             const char *fname, apr_fileperms_t perms)
 {
@@ -894,7 +1183,7 @@ static const char *alt_name(const char *domain, apr_pool_t *p)
     return apr_psprintf(p, "DNS:%s", domain);
 }
 
-static const char *alt_names(apr_array_header_t *domains, apr_pool_t *p)
+static const char *alt_names(const apr_array_header_t *domains, apr_pool_t *p)
 {
     const char *alts = "", *sep = "", *domain;
     int i;
@@ -931,7 +1220,7 @@ static apr_status_t add_ext(X509 *x, int nid, const char *value, apr_pool_t *p)
 }
 
 static apr_status_t sk_add_alt_names(STACK_OF(X509_EXTENSION) *exts,
-                                     apr_array_header_t *domains, apr_pool_t *p)
+                                     const apr_array_header_t *domains, apr_pool_t *p)
 {
     if (domains->nelts > 0) {
         X509_EXTENSION *x;
@@ -970,7 +1259,7 @@ apr_status_t md_cert_req_create(const char **pcsr_der_64, const md_t *md,
     apr_status_t rv;
     int csr_der_len;
     
-    assert(md->domains->nelts > 0);
+    assert(md_domain_set_count(md->domains) > 0);
     
     if (NULL == (csr = X509_REQ_new()) 
         || NULL == (exts = sk_X509_EXTENSION_new_null())
@@ -981,14 +1270,14 @@ apr_status_t md_cert_req_create(const char **pcsr_der_64, const md_t *md,
     }
 
     /* subject name == first domain */
-    domain = APR_ARRAY_IDX(md->domains, 0, const unsigned char *);
+    domain = (const unsigned char *)md_domain_set_get(md->domains, 0);
     if (!X509_NAME_add_entry_by_txt(n, "CN", MBSTRING_ASC, domain, -1, -1, 0)
         || !X509_REQ_set_subject_name(csr, n)) {
         md_log_perror(MD_LOG_MARK, MD_LOG_ERR, 0, p, "%s: REQ name add entry", md->name);
         rv = APR_EGENERAL; goto out;
     }
     /* collect extensions, such as alt names and must staple */
-    if (APR_SUCCESS != (rv = sk_add_alt_names(exts, md->domains, p))) {
+    if (APR_SUCCESS != (rv = sk_add_alt_names(exts, md_domain_set_names(md->domains), p))) {
         md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "%s: collecting alt names", md->name);
         rv = APR_EGENERAL; goto out;
     }
@@ -43,6 +43,12 @@ typedef struct md_pkey_t md_pkey_t;
 
 apr_status_t md_crypt_init(apr_pool_t *pool);
 
+/**
+ * Determine if keys and certificates may be loaded and checked on several threads at
+ * once. OpenSSL before 1.1.0 only is when the application installed its locking callbacks.
+ */
+int md_crypt_is_thread_safe(void);
+
 apr_status_t md_pkey_gen_rsa(md_pkey_t **ppkey, apr_pool_t *p, int bits);
 void md_pkey_free(md_pkey_t *pkey);
 
@@ -56,6 +62,12 @@ apr_status_t md_pkey_fsave(md_pkey_t *pkey, apr_pool_t *p,
                            const char *pass_phrase, apr_size_t pass_len, 
                            const char *fname, apr_fileperms_t perms);
 
+apr_status_t md_pkey_to_pem(const char **ppem, apr_size_t *plen, md_pkey_t *pkey, 
+                            apr_pool_t *p, const char *pass_phrase, apr_size_t pass_len);
+apr_status_t md_pkey_from_pem(md_pkey_t **ppkey, apr_pool_t *p, 
+                              const char *pass_phrase, apr_size_t pass_len,
+                              const char *pem, apr_size_t pem_len);
+
 apr_status_t md_crypt_sign64(const char **psign64, md_pkey_t *pkey, apr_pool_t *p, 
                              const char *d, size_t dlen);
 
@@ -95,8 +107,29 @@ apr_status_t md_cert_get_alt_names(apr_array_header_t **pnames, md_cert_t *cert,
 apr_status_t md_cert_to_base64url(const char **ps64, md_cert_t *cert, apr_pool_t *p);
 apr_status_t md_cert_from_base64url(md_cert_t **pcert, const char *s64, apr_pool_t *p);
 
+apr_status_t md_cert_to_der(const char **pder, apr_size_t *pder_len, 
+                            const md_cert_t *cert, apr_pool_t *p);
+apr_status_t md_cert_from_der(md_cert_t **pcert, apr_pool_t *p, 
+                              const char *der, apr_size_t der_len);
+
+/**
+ * Get the certificate for the DER encoding from the process wide table of shared
+ * certificates, parsing and adding it when not known yet. The certificate must not
+ * be modified and stays valid as long as pool p. Without md_crypt_init(), this is
+ * the same as md_cert_from_der().
+ */
+apr_status_t md_cert_intern_der(md_cert_t **pcert, apr_pool_t *p, 
+                                const char *der, apr_size_t der_len);
+unsigned int md_cert_interned_count(void);
+
+/**
+ * Load all certificates in a PEM file. The certificates are shared with all other
+ * chains loaded in this process, see md_cert_intern_der().
+ */
 apr_status_t md_chain_fload(struct apr_array_header_t **pcerts, 
                             apr_pool_t *p, const char *fname);
+apr_status_t md_chain_to_pem(const char **ppem, apr_size_t *plen, 
+                             struct apr_array_header_t *certs, apr_pool_t *p);
 apr_status_t md_chain_fsave(struct apr_array_header_t *certs, 
                             apr_pool_t *p, const char *fname, apr_fileperms_t perms);
 
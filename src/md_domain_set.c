@@ -0,0 +1,455 @@
+/* Copyright 2017 greenbytes GmbH (https://www.greenbytes.de)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#include <apr_lib.h>
+#include <apr_atomic.h>
+#include <apr_hash.h>
+#include <apr_strings.h>
+#include <apr_tables.h>
+#include <apr_thread_rwlock.h>
+
+#include "md_domain_set.h"
+#include "md_util.h"
+
+/**************************************************************************************************/
+/* interned names */
+
+/* Longer names are lowercased in the caller's pool before the lookup. A DNS name has at
+ * most 253 characters, so this is only for garbage.
+ */
+#define INTERN_KEY_MAX      256
+
+/* Names are added while configs and MDs are loaded, later nearly all are found. Lookups
+ * share the lock, only adding a new name takes it alone. */
+typedef struct {
+    apr_pool_t *pool;
+    apr_hash_t *names;          /* lowercase name -> itself */
+#if APR_HAS_THREADS
+    apr_thread_rwlock_t *lock;
+#endif
+    apr_size_t bytes;
+    apr_uint32_t saved;         /* counted by readers, atomic */
+} intern_table_t;
+
+static intern_table_t *intern;
+
+static apr_status_t intern_cleanup(void *data)
+{
+    if (intern == data) {
+        intern = NULL;
+    }
+    return APR_SUCCESS;
+}
+
+apr_status_t md_domain_intern_init(apr_pool_t *pool)
+{
+    intern_table_t *table;
+    apr_status_t rv = APR_SUCCESS;
+
+    if (intern) {
+        return APR_SUCCESS;
+    }
+    table = apr_pcalloc(pool, sizeof(*table));
+    table->pool = pool;
+    table->names = apr_hash_make(pool);
+#if APR_HAS_THREADS
+    rv = apr_thread_rwlock_create(&table->lock, pool);
+#endif
+    if (APR_SUCCESS == rv) {
+        apr_pool_cleanup_register(pool, table, intern_cleanup, apr_pool_cleanup_null);
+        intern = table;
+    }
+    return rv;
+}
+
+const char *md_domain_intern(apr_pool_t *p, const char *name)
+{
+    char buffer[INTERN_KEY_MAX], *lkey;
+    const char *s, *key, *interned;
+    apr_size_t len;
+    int lower = 1;
+
+    for (s = name; *s; ++s) {
+        if (apr_tolower(*s) != *s) {
+            lower = 0;
+        }
+    }
+    len = (apr_size_t)(s - name);
+    if (!intern) {
+        return md_util_str_tolower(apr_pstrmemdup(p, name, len));
+    }
+    key = name;
+    if (!lower) {
+        if (len < sizeof(buffer)) {
+            lkey = buffer;
+            memcpy(lkey, name, len + 1);
+        }
+        else {
+            lkey = apr_pstrmemdup(p, name, len);
+        }
+        key = md_util_str_tolower(lkey);
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_rwlock_rdlock(intern->lock);
+#endif
+    interned = apr_hash_get(intern->names, key, (apr_ssize_t)len);
+#if APR_HAS_THREADS
+    apr_thread_rwlock_unlock(intern->lock);
+#endif
+    if (interned) {
+        apr_atomic_add32(&intern->saved, (apr_uint32_t)(len + 1));
+        return interned;
+    }
+    
+#if APR_HAS_THREADS
+    apr_thread_rwlock_wrlock(intern->lock);
+#endif
+    /* another thread may have added it in the meantime */
+    interned = apr_hash_get(intern->names, key, (apr_ssize_t)len);
+    if (interned) {
+        apr_atomic_add32(&intern->saved, (apr_uint32_t)(len + 1));
+    }
+    else {
+        interned = apr_pstrmemdup(intern->pool, key, len);
+        apr_hash_set(intern->names, interned, (apr_ssize_t)len, interned);
+        intern->bytes += len + 1;
+    }
+#if APR_HAS_THREADS
+    apr_thread_rwlock_unlock(intern->lock);
+#endif
+    return interned;
+}
+
+void md_domain_intern_stats(int *pcount, apr_size_t *pbytes, apr_size_t *psaved)
+{
+    *pcount = 0;
+    *pbytes = *psaved = 0;
+    if (intern) {
+#if APR_HAS_THREADS
+        apr_thread_rwlock_rdlock(intern->lock);
+#endif
+        *pcount = (int)apr_hash_count(intern->names);
+        *pbytes = intern->bytes;
+        *psaved = apr_atomic_read32(&intern->saved);
+#if APR_HAS_THREADS
+        apr_thread_rwlock_unlock(intern->lock);
+#endif
+    }
+}
+
+/**************************************************************************************************/
+/* domain sets */
+
+/* The names are held in an array, in the order they were added. An open addressing
+ * table with linear probing maps them to their position. Each slot keeps the hash
+ * of its name, so probing compares strings only when the hashes are equal. The table
+ * has at least twice as many slots as there are names.
+ */
+#define DSET_MIN_SLOTS      8
+
+typedef struct {
+    apr_uint32_t hash;
+    int index;                  /* into names, -1 for an empty slot */
+} dset_slot_t;
+
+struct md_domain_set_t {
+    apr_pool_t *p;
+    apr_array_header_t *names;  /* const char*, lowercase */
+    dset_slot_t *slots;
+    unsigned int mask;          /* number of slots - 1, a power of 2 */
+};
+
+/* FNV-1a of the lowercased name */
+static apr_uint32_t name_hash(const char *name)
+{
+    apr_uint32_t hash = 2166136261U;
+    const char *s;
+    int c;
+
+    for (s = name; *s; ++s) {
+        c = apr_tolower(*s);
+        hash ^= (apr_uint32_t)(unsigned char)c;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/* compare 'key', lowercase, to 'name' in any case */
+static int key_eq(const char *key, const char *name)
+{
+    while (*key && *key == apr_tolower(*name)) {
+        ++key;
+        ++name;
+    }
+    return *key == *name;
+}
+
+/* Get the slot of 'name' or of the empty slot where it belongs */
+static unsigned int slot_find(const md_domain_set_t *set, const char *name, apr_uint32_t hash)
+{
+    const dset_slot_t *slot;
+    const char *key;
+    unsigned int i;
+
+    for (i = hash & set->mask; ; i = (i + 1) & set->mask) {
+        slot = &set->slots[i];
+        if (slot->index < 0) {
+            return i;
+        }
+        if (slot->hash == hash) {
+            key = APR_ARRAY_IDX(set->names, slot->index, const char*);
+            /* interned names are the same pointer */
+            if (key == name || key_eq(key, name)) {
+                return i;
+            }
+        }
+    }
+}
+
+static void slots_make(md_domain_set_t *set, unsigned int nslots)
+{
+    const char *name;
+    apr_uint32_t hash;
+    unsigned int i;
+    int n;
+
+    set->slots = apr_palloc(set->p, nslots * sizeof(dset_slot_t));
+    set->mask = nslots - 1;
+    for (i = 0; i < nslots; ++i) {
+        set->slots[i].index = -1;
+    }
+    for (n = 0; n < set->names->nelts; ++n) {
+        name = APR_ARRAY_IDX(set->names, n, const char*);
+        hash = name_hash(name);
+        i = slot_find(set, name, hash);
+        set->slots[i].hash = hash;
+        set->slots[i].index = n;
+    }
+}
+
+static unsigned int slots_for(int count)
+{
+    unsigned int nslots = DSET_MIN_SLOTS;
+
+    while (nslots < 2 * (unsigned int)count) {
+        nslots *= 2;
+    }
+    return nslots;
+}
+
+md_domain_set_t *md_domain_set_make(apr_pool_t *p, int nalloc)
+{
+    md_domain_set_t *set;
+
+    set = apr_pcalloc(p, sizeof(*set));
+    set->p = p;
+    set->names = apr_array_make(p, (nalloc > 0)? nalloc : 1, sizeof(const char*));
+    slots_make(set, slots_for(nalloc));
+    return set;
+}
+
+md_domain_set_t *md_domain_set_from_array(apr_pool_t *p, const apr_array_header_t *names)
+{
+    md_domain_set_t *set;
+    int i;
+
+    set = md_domain_set_make(p, names->nelts);
+    for (i = 0; i < names->nelts; ++i) {
+        md_domain_set_add(set, APR_ARRAY_IDX(names, i, const char*));
+    }
+    return set;
+}
+
+md_domain_set_t *md_domain_set_copy(apr_pool_t *p, const md_domain_set_t *src)
+{
+    md_domain_set_t *set;
+
+    set = apr_pcalloc(p, sizeof(*set));
+    set->p = p;
+    set->names = apr_array_copy(p, src->names);
+    set->mask = src->mask;
+    set->slots = apr_pmemdup(p, src->slots, (src->mask + 1) * sizeof(dset_slot_t));
+    return set;
+}
+
+md_domain_set_t *md_domain_set_clone(apr_pool_t *p, const md_domain_set_t *src)
+{
+    md_domain_set_t *set;
+    int i;
+
+    set = md_domain_set_copy(p, src);
+    for (i = 0; i < set->names->nelts; ++i) {
+        APR_ARRAY_IDX(set->names, i, const char*) =
+            md_domain_intern(p, APR_ARRAY_IDX(set->names, i, const char*));
+    }
+    return set;
+}
+
+int md_domain_set_count(const md_domain_set_t *set)
+{
+    return set? set->names->nelts : 0;
+}
+
+const char *md_domain_set_get(const md_domain_set_t *set, int i)
+{
+    assert(i >= 0 && i < set->names->nelts);
+    return APR_ARRAY_IDX(set->names, i, const char*);
+}
+
+const apr_array_header_t *md_domain_set_names(const md_domain_set_t *set)
+{
+    return set->names;
+}
+
+int md_domain_set_index(const md_domain_set_t *set, const char *name)
+{
+    if (!set || !name) {
+        return -1;
+    }
+    return set->slots[slot_find(set, name, name_hash(name))].index;
+}
+
+int md_domain_set_contains(const md_domain_set_t *set, const char *name)
+{
+    return md_domain_set_index(set, name) >= 0;
+}
+
+int md_domain_set_add(md_domain_set_t *set, const char *name)
+{
+    apr_uint32_t hash;
+    unsigned int i;
+
+    hash = name_hash(name);
+    i = slot_find(set, name, hash);
+    if (set->slots[i].index >= 0) {
+        return 0;
+    }
+    APR_ARRAY_PUSH(set->names, const char*) = md_domain_intern(set->p, name);
+    if (2 * (unsigned int)set->names->nelts > set->mask + 1) {
+        slots_make(set, 2 * (set->mask + 1));
+    }
+    else {
+        set->slots[i].hash = hash;
+        set->slots[i].index = set->names->nelts - 1;
+    }
+    return 1;
+}
+
+int md_domain_set_remove(md_domain_set_t *set, const char *name)
+{
+    int n;
+
+    if ((n = md_domain_set_index(set, name)) < 0) {
+        return 0;
+    }
+    /* positions after the name change, the table is made anew */
+    memmove(set->names->elts + n * sizeof(const char*),
+            set->names->elts + (n + 1) * sizeof(const char*),
+            (size_t)(set->names->nelts - n - 1) * sizeof(const char*));
+    --set->names->nelts;
+    slots_make(set, set->mask + 1);
+    return 1;
+}
+
+int md_domain_set_add_all(md_domain_set_t *dest, const md_domain_set_t *src)
+{
+    int i, added = 0;
+
+    for (i = 0; i < src->names->nelts; ++i) {
+        added += md_domain_set_add(dest, APR_ARRAY_IDX(src->names, i, const char*));
+    }
+    return added;
+}
+
+md_domain_set_t *md_domain_set_diff(apr_pool_t *p, const md_domain_set_t *set,
+                                    const md_domain_set_t *other)
+{
+    md_domain_set_t *diff;
+    const char *name;
+    int i;
+
+    diff = md_domain_set_make(p, set->names->nelts);
+    for (i = 0; i < set->names->nelts; ++i) {
+        name = APR_ARRAY_IDX(set->names, i, const char*);
+        if (!md_domain_set_contains(other, name)) {
+            md_domain_set_add(diff, name);
+        }
+    }
+    return diff;
+}
+
+int md_domain_set_intersect_count(const md_domain_set_t *set1, const md_domain_set_t *set2)
+{
+    const md_domain_set_t *tmp;
+    int i, count = 0;
+
+    if (!set1 || !set2) {
+        return 0;
+    }
+    if (set1->names->nelts > set2->names->nelts) {
+        /* look up the names of the smaller set */
+        tmp = set1;
+        set1 = set2;
+        set2 = tmp;
+    }
+    for (i = 0; i < set1->names->nelts; ++i) {
+        if (md_domain_set_contains(set2, APR_ARRAY_IDX(set1->names, i, const char*))) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+const char *md_domain_set_common(const md_domain_set_t *set1, const md_domain_set_t *set2)
+{
+    const char *name;
+    int i;
+
+    if (!set1 || !set2) {
+        return NULL;
+    }
+    for (i = 0; i < set1->names->nelts; ++i) {
+        name = APR_ARRAY_IDX(set1->names, i, const char*);
+        if (md_domain_set_contains(set2, name)) {
+            return name;
+        }
+    }
+    return NULL;
+}
+
+int md_domain_set_contains_all(const md_domain_set_t *set1, const md_domain_set_t *set2)
+{
+    int i;
+
+    if (md_domain_set_count(set1) < md_domain_set_count(set2)) {
+        return 0;
+    }
+    for (i = 0; i < md_domain_set_count(set2); ++i) {
+        if (!md_domain_set_contains(set1, APR_ARRAY_IDX(set2->names, i, const char*))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int md_domain_set_equal(const md_domain_set_t *set1, const md_domain_set_t *set2)
+{
+    return (md_domain_set_count(set1) == md_domain_set_count(set2)
+            && md_domain_set_contains_all(set1, set2));
+}
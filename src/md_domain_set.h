@@ -0,0 +1,146 @@
+/* Copyright 2017 greenbytes GmbH (https://www.greenbytes.de)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef mod_md_md_domain_set_h
+#define mod_md_md_domain_set_h
+
+#include <apr_pools.h>
+
+struct apr_array_header_t;
+
+/**************************************************************************************************/
+/* interned names */
+
+/**
+ * Install the process wide table of interned domain names, allocated from 'pool'. Until
+ * 'pool' is cleared, md_domain_intern() gives the same string for names that only differ
+ * in case, so names can be compared by pointer first. Calling this again while a table
+ * is installed does nothing. Once 'pool' is cleared, names are copied again until the
+ * next call installs a new table; mod_md does that on pconf in every pre_config, so
+ * a restart drops the names of the old configuration whether the module is built in
+ * or loaded.
+ */
+apr_status_t md_domain_intern_init(apr_pool_t *pool);
+
+/**
+ * Get the canonical, lowercase form of 'name'. With a table installed, this is the
+ * interned string that lives as long as the table, otherwise a copy in 'p'.
+ * Safe to call from several threads. Names already in the table are found under a
+ * shared lock, only new names take it exclusively.
+ */
+const char *md_domain_intern(apr_pool_t *p, const char *name);
+
+/**
+ * Get the number of names and the bytes held in the intern table, and the bytes that
+ * interning saved by handing out an existing name instead of making a copy.
+ */
+void md_domain_intern_stats(int *pcount, apr_size_t *pbytes, apr_size_t *psaved);
+
+/**************************************************************************************************/
+/* domain sets */
+
+/**
+ * A set of DNS names, e.g. the domains of a managed domain. Names are kept in
+ * lowercase, in the order they were first added, and compared case-insensitively.
+ * Lookups go through a hash of the names, so adding and finding a name does not
+ * depend on the size of the set.
+ */
+typedef struct md_domain_set_t md_domain_set_t;
+
+md_domain_set_t *md_domain_set_make(apr_pool_t *p, int nalloc);
+
+/**
+ * Make a set of the names in array 'names' of const char*. Names that appear more
+ * than once are added at the position of their first appearance.
+ */
+md_domain_set_t *md_domain_set_from_array(apr_pool_t *p,
+                                          const struct apr_array_header_t *names);
+
+/**
+ * Copy a set, the copy shares the names with 'src'.
+ */
+md_domain_set_t *md_domain_set_copy(apr_pool_t *p, const md_domain_set_t *src);
+
+/**
+ * Copy a set into pool 'p', including names that are not interned.
+ */
+md_domain_set_t *md_domain_set_clone(apr_pool_t *p, const md_domain_set_t *src);
+
+/**
+ * Get the number of names in the set, 0 for a NULL set.
+ */
+int md_domain_set_count(const md_domain_set_t *set);
+
+/**
+ * Get the name at position 'i' in the order they were added.
+ */
+const char *md_domain_set_get(const md_domain_set_t *set, int i);
+
+/**
+ * Get the names of the set as array of const char*, in the order they were added.
+ * The array belongs to the set and changes with it.
+ */
+const struct apr_array_header_t *md_domain_set_names(const md_domain_set_t *set);
+
+/**
+ * Get the position of 'name' in the set or -1 when it is not in there.
+ */
+int md_domain_set_index(const md_domain_set_t *set, const char *name);
+
+int md_domain_set_contains(const md_domain_set_t *set, const char *name);
+
+/**
+ * Add 'name' to the end of the set, unless it is already in there. The set keeps the
+ * interned name, see md_domain_intern(). Returns 1 when the name was added, 0 otherwise.
+ */
+int md_domain_set_add(md_domain_set_t *set, const char *name);
+
+/**
+ * Remove 'name' from the set. Returns 1 when it was in there, 0 otherwise.
+ */
+int md_domain_set_remove(md_domain_set_t *set, const char *name);
+
+/**
+ * Add all names of 'src' to 'dest', the union of both. Returns the number of names added.
+ */
+int md_domain_set_add_all(md_domain_set_t *dest, const md_domain_set_t *src);
+
+/**
+ * Get a new set with the names of 'set' that are not in 'other', in their order in 'set'.
+ */
+md_domain_set_t *md_domain_set_diff(apr_pool_t *p, const md_domain_set_t *set,
+                                    const md_domain_set_t *other);
+
+/**
+ * Get the number of names in both sets.
+ */
+int md_domain_set_intersect_count(const md_domain_set_t *set1, const md_domain_set_t *set2);
+
+/**
+ * Get the first name of 'set1' that is also in 'set2', or NULL.
+ */
+const char *md_domain_set_common(const md_domain_set_t *set1, const md_domain_set_t *set2);
+
+/**
+ * Determine if 'set1' contains all names of 'set2'.
+ */
+int md_domain_set_contains_all(const md_domain_set_t *set1, const md_domain_set_t *set2);
+
+/**
+ * Determine if both sets have the same names, in whatever order.
+ */
+int md_domain_set_equal(const md_domain_set_t *set1, const md_domain_set_t *set2);
+
+#endif /* mod_md_md_domain_set_h */
@@ -13,7 +13,10 @@
  */
 
 #include <assert.h>
+#include <stdlib.h>
 #include <apr_lib.h>
+#include <apr_atomic.h>
+#include <apr_date.h>
 #include <apr_strings.h>
 #include <apr_buckets.h>
 
@@ -44,6 +47,176 @@ struct md_json_t {
     json_t *j;
 };
 
+/**************************************************************************************************/
+/* pool arenas */
+
+/* Once installed, all jansson memory goes through arena_malloc/arena_free. Only while a parse
+ * into an arena enabled pool is running on a thread, new nodes are allocated from that pool
+ * and freeing them is a no-op. Everything else, including other jansson users in the process,
+ * is passed on to the allocator jansson had before. 
+ * A parsed arena document is sealed: all its nodes get the refcount jansson uses for its 
+ * constants, so it never frees them. md_json deep copies a sealed document before it
+ * modifies it and before it puts a part of it into another document. Freeing the pool thus 
+ * leaves no references to its memory behind.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#define MD_JSON_THREAD_LOCAL    __thread
+#endif
+
+#define ARENA_KEY           "md-json-arena"
+#define ARENA_SEAL          ((size_t)-1)
+
+static int arena_installed;
+static volatile apr_uint32_t arena_heap_allocs;
+static volatile apr_uint32_t arena_pool_allocs;
+
+static int arena_sealed(const json_t *j)
+{
+    return (j && j->refcount == ARENA_SEAL 
+            && !json_is_true(j) && !json_is_false(j) && !json_is_null(j));
+}
+
+#ifdef MD_JSON_THREAD_LOCAL
+
+static MD_JSON_THREAD_LOCAL apr_pool_t *arena_pool;
+static json_malloc_t arena_next_malloc = malloc;
+static json_free_t arena_next_free = free;
+
+static void *arena_malloc(size_t len)
+{
+    void *mem;
+    
+    if (arena_pool) {
+        mem = apr_palloc(arena_pool, len);
+        apr_atomic_inc32(&arena_pool_allocs);
+    }
+    else if ((mem = arena_next_malloc(len))) {
+        apr_atomic_inc32(&arena_heap_allocs);
+    }
+    return mem;
+}
+
+static void arena_free(void *mem)
+{
+    if (mem && !arena_pool) {
+        arena_next_free(mem);
+    }
+    /* else: freed while parsing into the arena, only ever blocks of that parse */
+}
+
+static int arena_enter(apr_pool_t *pool, apr_pool_t **pprev)
+{
+    apr_pool_t *ap;
+    void *data;
+    
+    *pprev = arena_pool;
+    if (arena_installed) {
+        for (ap = pool; ap; ap = apr_pool_parent_get(ap)) {
+            apr_pool_userdata_get(&data, ARENA_KEY, ap);
+            if (data) {
+                arena_pool = pool;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void arena_leave(apr_pool_t *prev)
+{
+    arena_pool = prev;
+}
+
+static void arena_seal(json_t *j)
+{
+    const char *key;
+    json_t *val;
+    size_t index;
+    
+    if (json_is_object(j)) {
+        json_object_foreach(j, key, val) {
+            arena_seal(val);
+        }
+    }
+    else if (json_is_array(j)) {
+        json_array_foreach(j, index, val) {
+            arena_seal(val);
+        }
+    }
+    j->refcount = ARENA_SEAL;
+}
+
+apr_status_t md_json_arena_setup(void)
+{
+    if (!arena_installed) {
+#if JANSSON_VERSION_HEX >= 0x020800
+        json_get_alloc_funcs(&arena_next_malloc, &arena_next_free);
+#endif
+        json_set_alloc_funcs(arena_malloc, arena_free);
+        arena_installed = 1;
+    }
+    return APR_SUCCESS;
+}
+
+#else /* MD_JSON_THREAD_LOCAL */
+
+static int arena_enter(apr_pool_t *pool, apr_pool_t **pprev)
+{
+    *pprev = NULL;
+    return 0;
+}
+
+static void arena_leave(apr_pool_t *prev)
+{
+}
+
+static void arena_seal(json_t *j)
+{
+}
+
+apr_status_t md_json_arena_setup(void)
+{
+    return APR_ENOTIMPL;
+}
+
+#endif /* MD_JSON_THREAD_LOCAL */
+
+apr_status_t md_json_arena_enable(apr_pool_t *pool)
+{
+    if (!arena_installed) {
+        return APR_ENOTIMPL;
+    }
+    return apr_pool_userdata_setn(pool, ARENA_KEY, NULL, pool);
+}
+
+void md_json_arena_counts(apr_uint32_t *pheap_allocs, apr_uint32_t *ppool_allocs)
+{
+    if (pheap_allocs) {
+        *pheap_allocs = apr_atomic_read32(&arena_heap_allocs);
+    }
+    if (ppool_allocs) {
+        *ppool_allocs = apr_atomic_read32(&arena_pool_allocs);
+    }
+}
+
+/* A sealed json, or a part of it, in a new reference that can be modified and shared */
+static json_t *arena_unsealed(json_t *j)
+{
+    if (arena_sealed(j)) {
+        return json_deep_copy(j);
+    }
+    json_incref(j);
+    return j;
+}
+
+/* Make 'json' modifiable, replacing a sealed document with a copy of its own */
+static void json_own(md_json_t *json)
+{
+    if (arena_sealed(json->j)) {
+        json->j = json_deep_copy(json->j);
+    }
+}
+
 /**************************************************************************************************/
 /* lifecylce */
 
@@ -56,7 +229,7 @@ static apr_status_t json_pool_cleanup(void *data)
     return APR_SUCCESS;
 }
 
-static md_json_t *json_create(apr_pool_t *pool, json_t *j)
+static md_json_t *json_wrap(apr_pool_t *pool, json_t *j, int pooled)
 {
     md_json_t *json;
     
@@ -67,14 +240,21 @@ static md_json_t *json_create(apr_pool_t *pool, json_t *j)
         }
         assert(j != NULL); /* failsafe in case abort is unset */
     }
+    if (pooled) {
+        arena_seal(j);
+    }
     json = apr_pcalloc(pool, sizeof(*json));
     json->p = pool;
     json->j = j;
     apr_pool_cleanup_register(pool, json, json_pool_cleanup, apr_pool_cleanup_null);
-        
     return json;
 }
 
+static md_json_t *json_create(apr_pool_t *pool, json_t *j)
+{
+    return json_wrap(pool, j, 0);
+}
+
 md_json_t *md_json_create(apr_pool_t *pool)
 {
     return json_create(pool, json_object());
@@ -95,6 +275,9 @@ void md_json_destroy(md_json_t *json)
 
 md_json_t *md_json_copy(apr_pool_t *pool, md_json_t *json)
 {
+    if (arena_sealed(json->j)) {
+        return json_create(pool, json_deep_copy(json->j));
+    }
     return json_create(pool, json_copy(json->j));
 }
 
@@ -127,6 +310,9 @@ static json_t *jselect_parent(const char **child_key, int create, md_json_t *jso
     json_t *j, *jn;
     
     *child_key = NULL;
+    if (create) {
+        json_own(json);
+    }
     j = json->j;
     key = va_arg(ap, char *);
     while (key && j) {
@@ -389,9 +575,13 @@ apr_status_t md_json_setj(md_json_t *value, md_json_t *json, ...)
     json_t *j;
     
     if (value) {
+        j = arena_unsealed(value->j);
         va_start(ap, json);
-        rv = jselect_set(value->j, json, ap);
+        rv = jselect_set(j, json, ap);
         va_end(ap);
+        if (APR_SUCCESS == rv) {
+            json_decref(j);
+        }
     }
     else {
         va_start(ap, json);
@@ -413,10 +603,15 @@ apr_status_t md_json_addj(md_json_t *value, md_json_t *json, ...)
 {
     va_list ap;
     apr_status_t rv;
+    json_t *j;
     
+    j = arena_unsealed(value->j);
     va_start(ap, json);
-    rv = jselect_add(value->j, json, ap);
+    rv = jselect_add(j, json, ap);
     va_end(ap);
+    if (APR_SUCCESS == rv) {
+        json_decref(j);
+    }
     return rv;
 }
 
@@ -429,6 +624,7 @@ apr_status_t md_json_clr(md_json_t *json, ...)
     json_t *j;
     va_list ap;
     
+    json_own(json);
     va_start(ap, json);
     j = jselect(json, ap);
     va_end(ap);
@@ -448,6 +644,7 @@ apr_status_t md_json_del(md_json_t *json, ...)
     json_t *j;
     va_list ap;
     
+    json_own(json);
     va_start(ap, json);
     j = jselect_parent(&key, 0, json, ap);
     va_end(ap);
@@ -497,6 +694,7 @@ apr_status_t md_json_sets_dict(apr_table_t *dict, md_json_t *json, ...)
     json_t *nj, *j;
     va_list ap;
     
+    json_own(json);
     va_start(ap, json);
     j = jselect(json, ap);
     va_end(ap);
@@ -600,6 +798,7 @@ apr_status_t md_json_seta(apr_array_header_t *a, md_json_to_cb *cb, void *baton,
     va_list ap;
     int i;
     
+    json_own(json);
     va_start(ap, json);
     j = jselect(json, ap);
     va_end(ap);
@@ -708,12 +907,13 @@ apr_status_t md_json_dupsa(apr_array_header_t *a, apr_pool_t *p, md_json_t *json
     return APR_ENOENT;
 }
 
-apr_status_t md_json_setsa(apr_array_header_t *a, md_json_t *json, ...)
+apr_status_t md_json_setsa(const apr_array_header_t *a, md_json_t *json, ...)
 {
     json_t *nj, *j;
     va_list ap;
     int i;
     
+    json_own(json);
     va_start(ap, json);
     j = jselect(json, ap);
     va_end(ap);
@@ -740,6 +940,303 @@ apr_status_t md_json_setsa(apr_array_header_t *a, md_json_t *json, ...)
     return APR_SUCCESS;
 }
 
+/**************************************************************************************************/
+/* compiled paths */
+
+md_json_path_t *md_json_path_make(apr_pool_t *p, ...)
+{
+    md_json_path_t *path;
+    const char *key;
+    va_list ap;
+    int i = 0;
+    
+    path = apr_pcalloc(p, sizeof(*path));
+    va_start(ap, p);
+    while ((key = va_arg(ap, char *))) {
+        if (i >= MD_JSON_PATH_MAX) {
+            path = NULL;
+            break;
+        }
+        path->keys[i++] = key;
+    }
+    va_end(ap);
+    return path;
+}
+
+static json_t *pselect(md_json_t *json, const md_json_path_t *path)
+{
+    const char *const *key;
+    json_t *j;
+    
+    j = json->j;
+    for (key = path->keys; *key && j; ++key) {
+        j = json_object_get(j, *key);
+    }
+    return j;
+}
+
+static json_t *pselect_parent(const char **child_key, md_json_t *json, const md_json_path_t *path)
+{
+    const char *const *key;
+    json_t *j, *jn;
+    
+    *child_key = NULL;
+    json_own(json);
+    j = json->j;
+    for (key = path->keys; *key && j; ++key) {
+        if (key[1]) {
+            jn = json_object_get(j, *key);
+            if (!jn) {
+                jn = json_object();
+                json_object_set_new(j, *key, jn);
+            }
+            j = jn;
+        }
+        else {
+            *child_key = *key;
+        }
+    }
+    return j;
+}
+
+static apr_status_t pselect_set_new(json_t *val, md_json_t *json, const md_json_path_t *path)
+{
+    const char *key;
+    json_t *j;
+    
+    j = pselect_parent(&key, json, path);
+    if (!j || !key || !json_is_object(j)) {
+        json_decref(val);
+        return APR_EINVAL;
+    }
+    json_object_set_new(j, key, val);
+    return APR_SUCCESS;
+}
+
+int md_json_path_has_key(md_json_t *json, const md_json_path_t *path)
+{
+    return pselect(json, path) != NULL;
+}
+
+int md_json_path_getb(md_json_t *json, const md_json_path_t *path)
+{
+    json_t *j = pselect(json, path);
+    return j? json_is_true(j) : 0;
+}
+
+apr_status_t md_json_path_setb(int value, md_json_t *json, const md_json_path_t *path)
+{
+    return pselect_set_new(json_boolean(value), json, path);
+}
+
+long md_json_path_getl(md_json_t *json, const md_json_path_t *path)
+{
+    json_t *j = pselect(json, path);
+    return (long)((j && json_is_number(j))? json_integer_value(j) : 0L);
+}
+
+apr_status_t md_json_path_setl(long value, md_json_t *json, const md_json_path_t *path)
+{
+    return pselect_set_new(json_integer(value), json, path);
+}
+
+const char *md_json_path_gets(md_json_t *json, const md_json_path_t *path)
+{
+    json_t *j = pselect(json, path);
+    return (j && json_is_string(j))? json_string_value(j) : NULL;
+}
+
+const char *md_json_path_dups(apr_pool_t *p, md_json_t *json, const md_json_path_t *path)
+{
+    json_t *j = pselect(json, path);
+    return (j && json_is_string(j))? apr_pstrdup(p, json_string_value(j)) : NULL;
+}
+
+apr_status_t md_json_path_sets(const char *value, md_json_t *json, const md_json_path_t *path)
+{
+    return pselect_set_new(json_string(value), json, path);
+}
+
+apr_status_t md_json_path_getsa(apr_array_header_t *a, md_json_t *json, 
+                                const md_json_path_t *path)
+{
+    json_t *j, *val;
+    size_t index;
+    
+    j = pselect(json, path);
+    if (j && json_is_array(j)) {
+        json_array_foreach(j, index, val) {
+            if (json_is_string(val)) {
+                APR_ARRAY_PUSH(a, const char *) = json_string_value(val);
+            }
+        }
+        return APR_SUCCESS;
+    }
+    return APR_ENOENT;
+}
+
+apr_status_t md_json_path_setsa(apr_array_header_t *a, md_json_t *json, 
+                                const md_json_path_t *path)
+{
+    json_t *j;
+    int i;
+    
+    j = json_array();
+    for (i = 0; i < a->nelts; ++i) {
+        json_array_append_new(j, json_string(APR_ARRAY_IDX(a, i, const char*)));
+    }
+    return pselect_set_new(j, json, path);
+}
+
+/**************************************************************************************************/
+/* struct codec */
+
+static json_t *field_to_json(const md_json_field_t *field, const void *obj, apr_pool_t *p)
+{
+    const char *base = obj;
+    const char *s;
+    apr_array_header_t *a;
+    apr_time_t t;
+    md_json_t sub;
+    json_t *j;
+    int i;
+    
+    switch (field->type) {
+        case MD_JSON_FIELD_STR:
+            s = *(const char *const *)(base + field->offset);
+            return s? json_string(s) : NULL;
+        case MD_JSON_FIELD_STRA:
+            a = *(apr_array_header_t *const *)(base + field->offset);
+            if (!a || (a->nelts == 0 && (field->flags & MD_JSON_FIELD_OPTIONAL))) {
+                return NULL;
+            }
+            j = json_array();
+            for (i = 0; i < a->nelts; ++i) {
+                json_array_append_new(j, json_string(APR_ARRAY_IDX(a, i, const char*)));
+            }
+            return j;
+        case MD_JSON_FIELD_ENUM:
+            return json_integer(*(const int *)(base + field->offset));
+        case MD_JSON_FIELD_LONG:
+            return json_integer(*(const long *)(base + field->offset));
+        case MD_JSON_FIELD_SECS:
+            return json_integer(apr_time_sec(*(const apr_interval_time_t *)(base + field->offset)));
+        case MD_JSON_FIELD_DATE:
+            t = *(const apr_time_t *)(base + field->offset);
+            if (t > 0) {
+                char ts[APR_RFC822_DATE_LEN];
+                apr_rfc822_date(ts, t);
+                return json_string(ts);
+            }
+            return NULL;
+        case MD_JSON_FIELD_OBJ:
+            sub.p = p;
+            sub.j = j = json_object();
+            md_json_encode(field->sub, obj, &sub, p);
+            if (json_object_size(j) == 0) {
+                json_decref(j);
+                return NULL;
+            }
+            return j;
+    }
+    return NULL;
+}
+
+apr_status_t md_json_encode(const md_json_field_t *fields, const void *obj, 
+                            md_json_t *json, apr_pool_t *p)
+{
+    const md_json_field_t *field;
+    json_t *val;
+    
+    json_own(json);
+    if (!json_is_object(json->j)) {
+        return APR_EINVAL;
+    }
+    for (field = fields; field->key; ++field) {
+        if ((val = field_to_json(field, obj, p))) {
+            json_object_set_new(json->j, field->key, val);
+        }
+    }
+    return APR_SUCCESS;
+}
+
+static void field_from_json(const md_json_field_t *field, json_t *j, void *obj, apr_pool_t *p)
+{
+    char *base = obj;
+    apr_array_header_t **pa;
+    md_json_t sub;
+    json_t *val;
+    size_t index;
+    const char *s;
+    
+    switch (field->type) {
+        case MD_JSON_FIELD_STR:
+            *(const char **)(base + field->offset) = 
+                json_is_string(j)? apr_pstrdup(p, json_string_value(j)) : NULL;
+            break;
+        case MD_JSON_FIELD_STRA:
+            pa = (apr_array_header_t **)(base + field->offset);
+            if (!*pa) {
+                *pa = apr_array_make(p, 5, sizeof(const char*));
+            }
+            if (json_is_array(j)) {
+                json_array_foreach(j, index, val) {
+                    if (json_is_string(val)) {
+                        APR_ARRAY_PUSH(*pa, const char *) = apr_pstrdup(p, json_string_value(val));
+                    }
+                }
+            }
+            break;
+        case MD_JSON_FIELD_ENUM:
+            *(int *)(base + field->offset) = 
+                (int)(json_is_number(j)? json_integer_value(j) : 0);
+            break;
+        case MD_JSON_FIELD_LONG:
+            *(long *)(base + field->offset) = 
+                (long)(json_is_number(j)? json_integer_value(j) : 0);
+            break;
+        case MD_JSON_FIELD_SECS:
+            *(apr_interval_time_t *)(base + field->offset) = 
+                apr_time_from_sec(json_is_number(j)? json_integer_value(j) : 0);
+            break;
+        case MD_JSON_FIELD_DATE:
+            s = json_is_string(j)? json_string_value(j) : NULL;
+            if (s && *s) {
+                *(apr_time_t *)(base + field->offset) = apr_date_parse_rfc(s);
+            }
+            break;
+        case MD_JSON_FIELD_OBJ:
+            if (json_is_object(j)) {
+                sub.p = p;
+                sub.j = j;
+                md_json_decode(field->sub, obj, &sub, p);
+            }
+            break;
+    }
+}
+
+apr_status_t md_json_decode(const md_json_field_t *fields, void *obj, 
+                            md_json_t *json, apr_pool_t *p)
+{
+    const md_json_field_t *field;
+    const char *key;
+    json_t *val;
+    
+    if (!json_is_object(json->j)) {
+        return APR_EINVAL;
+    }
+    /* one pass over the members present, fields not in the json are left untouched */
+    json_object_foreach(json->j, key, val) {
+        for (field = fields; field->key; ++field) {
+            if (!strcmp(field->key, key)) {
+                field_from_json(field, val, obj, p);
+                break;
+            }
+        }
+    }
+    return APR_SUCCESS;
+}
+
 /**************************************************************************************************/
 /* formatting, parsing */
 
@@ -860,11 +1357,16 @@ apr_status_t md_json_readd(md_json_t **pjson, apr_pool_t *pool, const char *data
     json_error_t error;
     json_t *j;
     
+    apr_pool_t *prev;
+    int pooled;
+    
+    pooled = arena_enter(pool, &prev);
     j = json_loadb(data, data_len, 0, &error);
+    arena_leave(prev);
     if (!j) {
         return APR_EINVAL;
     }
-    *pjson = json_create(pool, j);
+    *pjson = json_wrap(pool, j, pooled);
     return APR_SUCCESS;
 }
 
@@ -916,11 +1418,16 @@ apr_status_t md_json_readb(md_json_t **pjson, apr_pool_t *pool, apr_bucket_briga
     json_error_t error;
     json_t *j;
     
+    apr_pool_t *prev;
+    int pooled;
+    
+    pooled = arena_enter(pool, &prev);
     j = json_load_callback(load_cb, bb, 0, &error);
+    arena_leave(prev);
     if (!j) {
         return APR_EINVAL;
     }
-    *pjson = json_create(pool, j);
+    *pjson = json_wrap(pool, j, pooled);
     return APR_SUCCESS;
 }
 
@@ -946,15 +1453,19 @@ apr_status_t md_json_readf(md_json_t **pjson, apr_pool_t *p, const char *fpath)
     json_t *j;
     apr_status_t rv;
     json_error_t error;
+    apr_pool_t *prev;
+    int pooled;
     
     rv = apr_file_open(&f, fpath, APR_FOPEN_READ, 0, p);
     if (rv != APR_SUCCESS) {
         return rv;
     }
 
+    pooled = arena_enter(p, &prev);
     j = json_load_callback(load_file_cb, f, 0, &error);
+    arena_leave(prev);
     if (j) {
-        *pjson = json_create(p, j);
+        *pjson = json_wrap(p, j, pooled);
     }
     else {
         md_log_perror(MD_LOG_MARK, MD_LOG_ERR, 0, p,
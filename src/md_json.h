@@ -32,6 +32,18 @@ typedef enum {
     MD_JSON_FMT_INDENT,
 } md_json_fmt_t;
 
+/* Pool arenas: md_json_arena_setup() installs an allocator for jansson that hands all memory
+ * not parsed into an arena to the allocator jansson used before, so it may be called at any
+ * time. Afterwards, documents parsed into a pool on which md_json_arena_enable() was called 
+ * (or into one of its sub pools) take all their memory from that pool and are freed when the 
+ * pool is cleared. Modifying such a document or a part got from it, or setting it into
+ * another one, works on a copy on the heap. Parts of it passed to md_json_itera() callbacks
+ * must not be modified.
+ * Returns APR_ENOTIMPL where the platform lacks thread local storage. */
+apr_status_t md_json_arena_setup(void);
+apr_status_t md_json_arena_enable(apr_pool_t *pool);
+void md_json_arena_counts(apr_uint32_t *pheap_allocs, apr_uint32_t *ppool_allocs);
+
 md_json_t *md_json_create(apr_pool_t *pool);
 void md_json_destroy(md_json_t *json);
 
@@ -95,7 +107,74 @@ apr_status_t md_json_sets_dict(apr_table_t *dict, md_json_t *json, ...);
 /* Manipulating String Arrays */
 apr_status_t md_json_getsa(apr_array_header_t *a, md_json_t *json, ...);
 apr_status_t md_json_dupsa(apr_array_header_t *a, apr_pool_t *p, md_json_t *json, ...);
-apr_status_t md_json_setsa(apr_array_header_t *a, md_json_t *json, ...);
+apr_status_t md_json_setsa(const apr_array_header_t *a, md_json_t *json, ...);
+
+/* Compiled key paths: the NULL terminated keys are laid out once, e.g. as
+ *   static const md_json_path_t CA_URL = MD_JSON_PATH2(MD_KEY_CA, MD_KEY_URL);
+ * and the accessors below walk them without going through a va_list. Longer paths
+ * are made with md_json_path_make(). */
+#define MD_JSON_PATH_MAX        7
+
+typedef struct md_json_path_t {
+    const char *keys[MD_JSON_PATH_MAX + 1];
+} md_json_path_t;
+
+#define MD_JSON_PATH1(k1)           { { k1, NULL } }
+#define MD_JSON_PATH2(k1, k2)       { { k1, k2, NULL } }
+#define MD_JSON_PATH3(k1, k2, k3)   { { k1, k2, k3, NULL } }
+
+md_json_path_t *md_json_path_make(apr_pool_t *p, ...);
+
+int md_json_path_has_key(md_json_t *json, const md_json_path_t *path);
+int md_json_path_getb(md_json_t *json, const md_json_path_t *path);
+apr_status_t md_json_path_setb(int value, md_json_t *json, const md_json_path_t *path);
+long md_json_path_getl(md_json_t *json, const md_json_path_t *path);
+apr_status_t md_json_path_setl(long value, md_json_t *json, const md_json_path_t *path);
+const char *md_json_path_gets(md_json_t *json, const md_json_path_t *path);
+const char *md_json_path_dups(apr_pool_t *p, md_json_t *json, const md_json_path_t *path);
+apr_status_t md_json_path_sets(const char *value, md_json_t *json, const md_json_path_t *path);
+apr_status_t md_json_path_getsa(apr_array_header_t *a, md_json_t *json, 
+                                const md_json_path_t *path);
+apr_status_t md_json_path_setsa(apr_array_header_t *a, md_json_t *json, 
+                                const md_json_path_t *path);
+
+/* Table driven conversion between a struct and a json object. Decoding makes a single
+ * pass over the members of the object, encoding builds each nested object once.
+ * A table is terminated by an entry with a NULL key. */
+typedef enum {
+    MD_JSON_FIELD_STR,          /* const char *, copied into the pool */
+    MD_JSON_FIELD_STRA,         /* apr_array_header_t * of const char * */
+    MD_JSON_FIELD_ENUM,         /* enum (int sized) */
+    MD_JSON_FIELD_LONG,         /* long */
+    MD_JSON_FIELD_SECS,         /* apr_interval_time_t as seconds */
+    MD_JSON_FIELD_DATE,         /* apr_time_t as RFC 822 date, omitted when 0 */
+    MD_JSON_FIELD_OBJ           /* nested object with fields from 'sub' of the same struct */
+} md_json_field_type_t;
+
+#define MD_JSON_FIELD_OPTIONAL  0x01    /* omit empty arrays */
+
+typedef struct md_json_field_t md_json_field_t;
+struct md_json_field_t {
+    const char *key;
+    md_json_field_type_t type;
+    apr_size_t offset;
+    int flags;
+    const md_json_field_t *sub;
+};
+
+#define MD_JSON_FIELD(key, type, stype, member) \
+    { key, type, APR_OFFSETOF(stype, member), 0, NULL }
+#define MD_JSON_FIELD_OPT(key, type, stype, member) \
+    { key, type, APR_OFFSETOF(stype, member), MD_JSON_FIELD_OPTIONAL, NULL }
+#define MD_JSON_FIELD_SUB(key, fields) \
+    { key, MD_JSON_FIELD_OBJ, 0, 0, fields }
+#define MD_JSON_FIELD_END \
+    { NULL, MD_JSON_FIELD_STR, 0, 0, NULL }
+
+apr_status_t md_json_encode(const md_json_field_t *fields, const void *obj, 
+                            md_json_t *json, apr_pool_t *p);
+apr_status_t md_json_decode(const md_json_field_t *fields, void *obj, 
+                            md_json_t *json, apr_pool_t *p);
 
 /* serialization & parsing */
 apr_status_t md_json_writeb(md_json_t *json, md_json_fmt_t fmt, struct apr_bucket_brigade *bb);
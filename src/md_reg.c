@@ -18,9 +18,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <apr_allocator.h>
 #include <apr_lib.h>
 #include <apr_hash.h>
+#include <apr_network_io.h>
 #include <apr_strings.h>
+#include <apr_thread_cond.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_proc.h>
 #include <apr_uri.h>
 
 #include "md.h"
@@ -34,12 +39,26 @@
 #include "acme/md_acme.h"
 #include "acme/md_acme_acct.h"
 
+/* getpid for *NIX */
+#if APR_HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#if APR_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+/* getpid for Windows */
+#if APR_HAVE_PROCESS_H
+#include <process.h>
+#endif
+
 struct md_reg_t {
     struct md_store_t *store;
     struct apr_hash_t *protos;
     int was_synched;
     int can_http;
     int can_https;
+    int load_threads;                   /* threads loading mds in full iterations */
 };
 
 /**************************************************************************************************/
@@ -55,6 +74,7 @@ apr_status_t md_reg_init(md_reg_t **preg, apr_pool_t *p, struct md_store_t *stor
     reg->protos = apr_hash_make(p);
     reg->can_http = 1;
     reg->can_https = 1;
+    reg->load_threads = 1;
     
     rv = md_acme_protos_add(reg->protos, p);
     
@@ -67,6 +87,11 @@ struct md_store_t *md_reg_store_get(md_reg_t *reg)
     return reg->store;
 }
 
+void md_reg_load_threads_set(md_reg_t *reg, int nthreads)
+{
+    reg->load_threads = (nthreads > 1)? nthreads : 1;
+}
+
 /**************************************************************************************************/
 /* checks */
 
@@ -80,14 +105,14 @@ static apr_status_t check_values(md_reg_t *reg, apr_pool_t *p, const md_t *md, i
         const char *domain;
         int i;
         
-        if (!md->domains || md->domains->nelts <= 0) {
+        if (md_domain_set_count(md->domains) <= 0) {
             md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, APR_EINVAL, p, 
                           "empty domain list: %s", md->name);
             return APR_EINVAL;
         }
         
-        for (i = 0; i < md->domains->nelts; ++i) {
-            domain = APR_ARRAY_IDX(md->domains, i, const char *);
+        for (i = 0; i < md_domain_set_count(md->domains); ++i) {
+            domain = md_domain_set_get(md->domains, i);
             if (!md_util_is_dns_name(p, domain, 1)) {
                 md_log_perror(MD_LOG_MARK, MD_LOG_ERR, APR_EINVAL, p, 
                               "md %s with invalid domain name: %s", md->name, domain);
@@ -296,6 +321,192 @@ apr_status_t md_reg_assess(md_reg_t *reg, md_t *md, int *perrored, int *prenew,
     return APR_SUCCESS;
 }
 
+/**************************************************************************************************/
+/* parallel assessment */
+
+typedef struct {
+    md_reg_t *reg;
+    apr_pool_t *p;
+    const apr_array_header_t *names;
+    md_reg_assessment_t *results;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;      /* guards next, 'p' and saving to the store */
+#endif
+    int next;
+} assess_ctx;
+
+typedef struct {
+    assess_ctx *ctx;
+    apr_pool_t *pool;               /* used by this worker only */
+} assess_worker_t;
+
+static void assess_lock(assess_ctx *ctx)
+{
+#if APR_HAS_THREADS
+    if (ctx->mutex) {
+        apr_thread_mutex_lock(ctx->mutex);
+    }
+#endif
+}
+
+static void assess_unlock(assess_ctx *ctx)
+{
+#if APR_HAS_THREADS
+    if (ctx->mutex) {
+        apr_thread_mutex_unlock(ctx->mutex);
+    }
+#endif
+}
+
+static void assess_one(assess_ctx *ctx, int i, apr_pool_t *ptemp)
+{
+    md_reg_assessment_t *result = &ctx->results[i];
+    const char *name = APR_ARRAY_IDX(ctx->names, i, const char *);
+    md_t *md;
+    int ostate;
+    
+    md_json_arena_enable(ptemp);
+    if (APR_SUCCESS != (result->rv = md_load(ctx->reg->store, MD_SG_DOMAINS, name, &md, ptemp))) {
+        return;
+    }
+    /* as state_check() */
+    ostate = md->state;
+    result->rv = state_init(ctx->reg, ptemp, md);
+    if (APR_SUCCESS == result->rv && md->state != ostate) {
+        assess_lock(ctx);
+        md_save(ctx->reg->store, ptemp, MD_SG_DOMAINS, md, 0);
+        assess_unlock(ctx);
+    }
+    md_reg_assess(ctx->reg, md, &result->errored, &result->renew, ptemp);
+    
+    assess_lock(ctx);
+    result->md = md_clone(ctx->p, md);
+    result->md->expires = md->expires;
+    assess_unlock(ctx);
+}
+
+#if APR_HAS_THREADS
+
+static void * APR_THREAD_FUNC assess_worker(apr_thread_t *thread, void *data)
+{
+    assess_worker_t *worker = data;
+    assess_ctx *ctx = worker->ctx;
+    apr_pool_t *ptemp;
+    int i;
+    
+    for (;;) {
+        apr_thread_mutex_lock(ctx->mutex);
+        i = ctx->next++;
+        apr_thread_mutex_unlock(ctx->mutex);
+        if (i >= ctx->names->nelts) {
+            break;
+        }
+        if (APR_SUCCESS != (ctx->results[i].rv = apr_pool_create(&ptemp, worker->pool))) {
+            continue;
+        }
+        assess_one(ctx, i, ptemp);
+        apr_pool_destroy(ptemp);
+    }
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+static apr_status_t assess_worker_pool_create(apr_pool_t **ppool, apr_pool_t *parent)
+{
+    apr_allocator_t *allocator;
+    apr_status_t rv;
+    
+    /* an allocator of its own, so that workers do not contend for memory */
+    if (APR_SUCCESS != (rv = apr_allocator_create(&allocator))) {
+        return rv;
+    }
+    if (APR_SUCCESS != (rv = apr_pool_create_ex(ppool, parent, NULL, allocator))) {
+        apr_allocator_destroy(allocator);
+        return rv;
+    }
+    apr_allocator_owner_set(allocator, *ppool);
+    return APR_SUCCESS;
+}
+
+static apr_status_t assess_parallel(assess_ctx *ctx, int nthreads, apr_pool_t *ptemp)
+{
+    assess_worker_t *workers;
+    apr_thread_t **threads;
+    apr_status_t rv, trv;
+    int i, started = 0;
+    
+    workers = apr_pcalloc(ptemp, (apr_size_t)nthreads * sizeof(*workers));
+    threads = apr_pcalloc(ptemp, (apr_size_t)nthreads * sizeof(apr_thread_t *));
+    if (APR_SUCCESS != (rv = apr_thread_mutex_create(&ctx->mutex, 
+                                                     APR_THREAD_MUTEX_DEFAULT, ptemp))) {
+        return rv;
+    }
+    for (i = 0; i < nthreads; ++i) {
+        workers[i].ctx = ctx;
+        if (APR_SUCCESS != (rv = assess_worker_pool_create(&workers[i].pool, ptemp))
+            || APR_SUCCESS != (rv = apr_thread_create(&threads[i], NULL, assess_worker, 
+                                                      &workers[i], ptemp))) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, ptemp, 
+                          "md assessment: creating worker %d", i);
+            break;
+        }
+        ++started;
+    }
+    for (i = 0; i < started; ++i) {
+        apr_thread_join(&trv, threads[i]);
+    }
+    /* without any worker, or when all failed to start, the caller does it */
+    return started? APR_SUCCESS : rv;
+}
+
+#endif /* APR_HAS_THREADS */
+
+static apr_status_t p_assess_all(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    assess_ctx *ctx = baton;
+    apr_pool_t *ip;
+    int i, nthreads;
+    
+    nthreads = va_arg(ap, int);
+    if (nthreads > ctx->names->nelts) {
+        nthreads = ctx->names->nelts;
+    }
+#if APR_HAS_THREADS
+    if (nthreads > 1 && md_crypt_is_thread_safe()
+        && APR_SUCCESS == assess_parallel(ctx, nthreads, ptemp)) {
+        return APR_SUCCESS;
+    }
+    ctx->mutex = NULL;
+#endif
+    for (i = ctx->next; i < ctx->names->nelts; ++i) {
+        if (APR_SUCCESS != (ctx->results[i].rv = apr_pool_create(&ip, ptemp))) {
+            continue;
+        }
+        assess_one(ctx, i, ip);
+        apr_pool_destroy(ip);
+    }
+    return APR_SUCCESS;
+}
+
+apr_status_t md_reg_assess_all(apr_array_header_t **presults, md_reg_t *reg, 
+                               const apr_array_header_t *names, int nthreads, apr_pool_t *p)
+{
+    apr_array_header_t *results;
+    assess_ctx ctx;
+    
+    results = apr_array_make(p, names->nelts? names->nelts : 1, sizeof(md_reg_assessment_t));
+    results->nelts = names->nelts;
+    memset(results->elts, 0, (apr_size_t)results->nalloc * sizeof(md_reg_assessment_t));
+    *presults = results;
+    
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.reg = reg;
+    ctx.p = p;
+    ctx.names = names;
+    ctx.results = (md_reg_assessment_t *)results->elts;
+    return md_util_pool_vdo(p_assess_all, &ctx, p, nthreads, NULL);
+}
+
 /**************************************************************************************************/
 /* iteration */
 
@@ -326,7 +537,8 @@ static int reg_do(md_reg_do_cb *cb, void *baton, md_reg_t *reg, apr_pool_t *p, c
     ctx.cb = cb;
     ctx.baton = baton;
     ctx.exclude = exclude;
-    return md_store_md_iter(reg_md_iter, &ctx, reg->store, p, MD_SG_DOMAINS, "*");
+    return md_store_md_iter_parallel(reg_md_iter, &ctx, reg->store, p, MD_SG_DOMAINS, "*",
+                                     reg->load_threads, 1);
 }
 
 
@@ -599,10 +811,32 @@ apr_status_t md_reg_creds_get(const md_creds_t **pcreds, md_reg_t *reg,
 /**************************************************************************************************/
 /* synching */
 
+/* The sync fingerprint, kept in httpd.json next to the protocol properties, remembers
+ * the last sync: the hash of each configured md, the domains of each md in the store
+ * and the position in the store's record of changes afterwards. The next sync only
+ * needs to look at configured mds whose hash is different, and at the store mds that
+ * changed since or share domains with them.
+ */
+#define MD_KEY_SYNC             "sync"
+#define MD_KEY_JOURNAL          "journal"
+#define MD_KEY_CONFIG           "config"
+#define MD_KEY_STORE            "store"
+#define MD_KEY_HASH             "hash"
+
 typedef struct {
     apr_pool_t *p;
     apr_array_header_t *conf_mds;
     apr_array_header_t *store_mds;
+    
+    apr_array_header_t *todo;       /* the conf_mds to reconcile with the store */
+    apr_hash_t *hashes;             /* conf md name -> sync hash */
+    int incremental;                /* only mds in todo, store_mds are the candidates */
+    apr_hash_t *prev_hashes;        /* conf md name -> sync hash, from the last sync */
+    apr_hash_t *prev_store;         /* store md name -> array of domains, from the last sync */
+    apr_hash_t *prev_by_domain;     /* domain -> store md name, from the last sync */
+    apr_array_header_t *dirty;      /* store md names changed since the last sync */
+    apr_hash_t *dirty_names;        /* the same as a set */
+    apr_hash_t *touched;            /* store md names changed by this sync */
 } sync_ctx;
 
 static int find_changes(void *baton, md_store_t *store, md_t *md, apr_pool_t *ptemp)
@@ -634,15 +868,231 @@ static apr_status_t load_props(md_reg_t *reg, apr_pool_t *p)
     return rv;
 }
 
-static apr_status_t sync_props(md_reg_t *reg, apr_pool_t *p, int can_http, int can_https)
+static apr_status_t sync_props(md_reg_t *reg, apr_pool_t *p, int can_http, int can_https,
+                               md_json_t *fingerprint)
 {
     md_json_t *json = md_json_create(p);
     md_json_setb(can_http, json, MD_KEY_PROTO, MD_KEY_HTTP, NULL);
     md_json_setb(can_https, json, MD_KEY_PROTO, MD_KEY_HTTPS, NULL);
+    if (fingerprint) {
+        md_json_setj(fingerprint, json, MD_KEY_SYNC, NULL);
+    }
     
     return md_store_save(reg->store, p, MD_SG_NONE, NULL, MD_FN_HTTPD_JSON, MD_SV_JSON, json, 0);
 }
- 
+
+static int prev_hash_add(void *baton, size_t index, md_json_t *json)
+{
+    sync_ctx *ctx = baton;
+    const char *name, *hash;
+    
+    name = md_json_gets(json, MD_KEY_NAME, NULL);
+    hash = md_json_gets(json, MD_KEY_HASH, NULL);
+    if (name && hash) {
+        apr_hash_set(ctx->prev_hashes, apr_pstrdup(ctx->p, name), APR_HASH_KEY_STRING, 
+                     apr_pstrdup(ctx->p, hash));
+    }
+    return 1;
+}
+
+static int prev_store_add(void *baton, size_t index, md_json_t *json)
+{
+    sync_ctx *ctx = baton;
+    apr_array_header_t *domains;
+    const char *name;
+    
+    if ((name = md_json_gets(json, MD_KEY_NAME, NULL))) {
+        domains = apr_array_make(ctx->p, 5, sizeof(const char *));
+        md_json_dupsa(domains, ctx->p, json, MD_KEY_DOMAINS, NULL);
+        apr_hash_set(ctx->prev_store, apr_pstrdup(ctx->p, name), APR_HASH_KEY_STRING, domains);
+    }
+    return 1;
+}
+
+/* Read the fingerprint of the last sync and what changed in the store since. Without
+ * either, the sync is done in full. */
+static void sync_prev_load(sync_ctx *ctx, md_reg_t *reg, apr_pool_t *p)
+{
+    md_json_t *json;
+    apr_hash_index_t *hi;
+    apr_array_header_t *domains;
+    const void *key;
+    const char *name;
+    void *val;
+    apr_int64_t last;
+    int i;
+    
+    ctx->incremental = 0;
+    if (APR_SUCCESS != md_store_load(reg->store, MD_SG_NONE, NULL, MD_FN_HTTPD_JSON, 
+                                     MD_SV_JSON, (void**)&json, p)
+        || !md_json_has_key(json, MD_KEY_SYNC, MD_KEY_JOURNAL, NULL)) {
+        return;
+    }
+    if (APR_SUCCESS != md_store_changed_names(&ctx->dirty, &last, reg->store, MD_SG_DOMAINS, 
+                                              md_json_getl(json, MD_KEY_SYNC, 
+                                                           MD_KEY_JOURNAL, NULL), p)) {
+        return;
+    }
+    md_json_itera(prev_hash_add, ctx, json, MD_KEY_SYNC, MD_KEY_CONFIG, NULL);
+    md_json_itera(prev_store_add, ctx, json, MD_KEY_SYNC, MD_KEY_STORE, NULL);
+    
+    for (hi = apr_hash_first(p, ctx->prev_store); hi; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, &key, NULL, &val);
+        domains = val;
+        for (i = 0; i < domains->nelts; ++i) {
+            apr_hash_set(ctx->prev_by_domain, APR_ARRAY_IDX(domains, i, const char *), 
+                         APR_HASH_KEY_STRING, key);
+        }
+    }
+    for (i = 0; i < ctx->dirty->nelts; ++i) {
+        name = APR_ARRAY_IDX(ctx->dirty, i, const char *);
+        apr_hash_set(ctx->dirty_names, name, APR_HASH_KEY_STRING, name);
+    }
+    ctx->incremental = 1;
+}
+
+/* Determine if the store mds 'md' matched in the last sync have changed since */
+static int sync_is_dirty(sync_ctx *ctx, const md_t *md)
+{
+    const char *name;
+    int i;
+    
+    if (apr_hash_get(ctx->dirty_names, md->name, APR_HASH_KEY_STRING)) {
+        return 1;
+    }
+    for (i = 0; i < md_domain_set_count(md->domains); ++i) {
+        name = apr_hash_get(ctx->prev_by_domain, md_domain_set_get(md->domains, i), 
+                            APR_HASH_KEY_STRING);
+        if (name && apr_hash_get(ctx->dirty_names, name, APR_HASH_KEY_STRING)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Load the store mds the mds in todo may match or overlap with, according to the last
+ * sync, and those changed since. */
+static apr_status_t sync_load_candidates(sync_ctx *ctx, md_store_t *store, apr_pool_t *p)
+{
+    apr_hash_t *names;
+    apr_hash_index_t *hi;
+    const char *name;
+    void *val;
+    md_t *md;
+    apr_status_t rv;
+    int i, j;
+    
+    names = apr_hash_copy(p, ctx->dirty_names);
+    for (i = 0; i < ctx->todo->nelts; ++i) {
+        md = APR_ARRAY_IDX(ctx->todo, i, md_t *);
+        apr_hash_set(names, md->name, APR_HASH_KEY_STRING, md->name);
+        for (j = 0; j < md_domain_set_count(md->domains); ++j) {
+            name = apr_hash_get(ctx->prev_by_domain, md_domain_set_get(md->domains, j), 
+                                APR_HASH_KEY_STRING);
+            if (name) {
+                apr_hash_set(names, name, APR_HASH_KEY_STRING, name);
+            }
+        }
+    }
+    
+    for (hi = apr_hash_first(p, names); hi; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, NULL, NULL, &val);
+        name = val;
+        rv = md_load(store, MD_SG_DOMAINS, name, &md, ctx->p);
+        if (APR_SUCCESS == rv) {
+            APR_ARRAY_PUSH(ctx->store_mds, const md_t*) = md;
+        }
+        else if (APR_STATUS_IS_ENOENT(rv)) {
+            /* gone from the store, the fingerprint needs to forget it */
+            apr_hash_set(ctx->touched, name, APR_HASH_KEY_STRING, name);
+        }
+        else {
+            return rv;
+        }
+    }
+    return APR_SUCCESS;
+}
+
+static void sync_touched(sync_ctx *ctx, const char *name)
+{
+    apr_hash_set(ctx->touched, name, APR_HASH_KEY_STRING, name);
+}
+
+static apr_status_t store_entry_add(md_json_t *fingerprint, const char *name,
+                                    const apr_array_header_t *domains, apr_pool_t *p)
+{
+    md_json_t *entry = md_json_create(p);
+    
+    md_json_sets(name, entry, MD_KEY_NAME, NULL);
+    md_json_setsa(domains, entry, MD_KEY_DOMAINS, NULL);
+    return md_json_addj(entry, fingerprint, MD_KEY_STORE, NULL);
+}
+
+/* Save the protocol properties and the fingerprint of this sync. */
+static apr_status_t sync_fingerprint_save(sync_ctx *ctx, md_reg_t *reg, apr_pool_t *p,
+                                          int can_http, int can_https)
+{
+    md_json_t *fingerprint, *entry;
+    apr_hash_t *store;
+    apr_hash_index_t *hi;
+    apr_array_header_t *names;
+    const void *key;
+    const char *name, *hash;
+    void *val;
+    md_t *md;
+    apr_int64_t last;
+    apr_status_t rv;
+    int i;
+    
+    rv = md_store_changed_names(&names, &last, reg->store, MD_SG_DOMAINS, APR_INT64_MAX, p);
+    if (APR_SUCCESS != rv) {
+        /* without a position in the store's changes, next time is a full sync again */
+        return APR_ENOTIMPL == rv? APR_SUCCESS : rv;
+    }
+    
+    /* the store mds as they are now */
+    store = ctx->incremental? apr_hash_copy(p, ctx->prev_store) : apr_hash_make(p);
+    for (i = 0; i < ctx->store_mds->nelts; ++i) {
+        md = APR_ARRAY_IDX(ctx->store_mds, i, md_t *);
+        if (!apr_hash_get(ctx->touched, md->name, APR_HASH_KEY_STRING)) {
+            apr_hash_set(store, md->name, APR_HASH_KEY_STRING, md_domain_set_names(md->domains));
+        }
+    }
+    for (hi = apr_hash_first(p, ctx->touched); hi; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, &key, NULL, NULL);
+        rv = md_load(reg->store, MD_SG_DOMAINS, key, &md, p);
+        if (APR_SUCCESS == rv) {
+            apr_hash_set(store, key, APR_HASH_KEY_STRING, md_domain_set_names(md->domains));
+        }
+        else if (APR_STATUS_IS_ENOENT(rv)) {
+            apr_hash_set(store, key, APR_HASH_KEY_STRING, NULL);
+        }
+        else {
+            return rv;
+        }
+    }
+    
+    fingerprint = md_json_create(p);
+    md_json_setl((long)last, fingerprint, MD_KEY_JOURNAL, NULL);
+    for (i = 0; i < ctx->conf_mds->nelts; ++i) {
+        md = APR_ARRAY_IDX(ctx->conf_mds, i, md_t *);
+        if ((hash = apr_hash_get(ctx->hashes, md->name, APR_HASH_KEY_STRING))) {
+            entry = md_json_create(p);
+            md_json_sets(md->name, entry, MD_KEY_NAME, NULL);
+            md_json_sets(hash, entry, MD_KEY_HASH, NULL);
+            md_json_addj(entry, fingerprint, MD_KEY_CONFIG, NULL);
+        }
+    }
+    for (hi = apr_hash_first(p, store); hi; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, &key, NULL, &val);
+        name = key;
+        if (APR_SUCCESS != (rv = store_entry_add(fingerprint, name, val, p))) {
+            return rv;
+        }
+    }
+    return sync_props(reg, p, can_http, can_https, fingerprint);
+}
+
 /**
  * Procedure:
  * 1. Collect all defined "managed domains" (MD). It does not matter where a MD is defined. 
@@ -658,49 +1108,89 @@ static apr_status_t sync_props(md_reg_t *reg, apr_pool_t *p, int can_http, int c
  *        issue WARNING.
  *      - store misses dns name from config, add dns name and update store
  *   c. compare MD acme url/protocol, update if changed
+ *   With the fingerprint of the last sync, only the MDs changed in the config since, 
+ *   or whose store MDs changed since, are looked at.
  */
 apr_status_t md_reg_sync(md_reg_t *reg, apr_pool_t *p, apr_pool_t *ptemp, 
                          apr_array_header_t *master_mds, int can_http, int can_https) 
 {
     sync_ctx ctx;
     md_store_t *store = reg->store;
+    const char *hash, *prev;
+    md_t *md;
     apr_status_t rv;
+    int i;
 
-    if (APR_SUCCESS != (rv = sync_props(reg, ptemp, can_http, can_https))) {
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.p = ptemp;
+    ctx.conf_mds = master_mds;
+    ctx.store_mds = apr_array_make(ptemp, 100, sizeof(md_t *));
+    ctx.todo = apr_array_make(ptemp, 100, sizeof(md_t *));
+    ctx.hashes = apr_hash_make(ptemp);
+    ctx.prev_hashes = apr_hash_make(ptemp);
+    ctx.prev_store = apr_hash_make(ptemp);
+    ctx.prev_by_domain = apr_hash_make(ptemp);
+    ctx.dirty_names = apr_hash_make(ptemp);
+    ctx.touched = apr_hash_make(ptemp);
+    sync_prev_load(&ctx, reg, ptemp);
+
+    if (APR_SUCCESS != (rv = sync_props(reg, ptemp, can_http, can_https, NULL))) {
         reg->was_synched = 0;
         return rv;
     }
     
     reg->was_synched = 1;
     
-    ctx.p = ptemp;
-    ctx.conf_mds = master_mds;
-    ctx.store_mds = apr_array_make(ptemp, 100, sizeof(md_t *));
+    for (i = 0; i < ctx.conf_mds->nelts; ++i) {
+        md = APR_ARRAY_IDX(ctx.conf_mds, i, md_t *);
+        hash = md_digest(md, ptemp);
+        if (hash) {
+            apr_hash_set(ctx.hashes, md->name, APR_HASH_KEY_STRING, hash);
+        }
+        prev = apr_hash_get(ctx.prev_hashes, md->name, APR_HASH_KEY_STRING);
+        if (!ctx.incremental || !hash || !prev || strcmp(hash, prev) 
+            || sync_is_dirty(&ctx, md)) {
+            APR_ARRAY_PUSH(ctx.todo, md_t *) = md;
+        }
+    }
     
-    rv = md_store_md_iter(find_changes, &ctx, store, ptemp, MD_SG_DOMAINS, "*");
-    if (APR_STATUS_IS_ENOENT(rv)) {
-        rv = APR_SUCCESS;
+    if (ctx.incremental) {
+        rv = sync_load_candidates(&ctx, store, ptemp);
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, 
+                      "sync: %d of %d mds changed in config, %d in store, %d mds loaded", 
+                      ctx.todo->nelts, ctx.conf_mds->nelts, ctx.dirty->nelts, 
+                      ctx.store_mds->nelts);
+    }
+    else {
+        rv = md_store_md_iter_parallel(find_changes, &ctx, store, ptemp, MD_SG_DOMAINS, "*",
+                                       reg->load_threads, 1);
+        if (APR_STATUS_IS_ENOENT(rv)) {
+            rv = APR_SUCCESS;
+        }
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, 
+                      "sync: found %d mds in store", ctx.store_mds->nelts);
     }
     
-    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, 
-                  "sync: found %d mds in store", ctx.store_mds->nelts);
     if (APR_SUCCESS == rv) {
-        int i, added, fields;
-        md_t *md, *config_md, *smd, *omd;
+        int fields;
+        md_domain_set_t *added;
+        md_t *config_md, *smd, *omd;
         const char *common;
         
-        for (i = 0; i < ctx.conf_mds->nelts; ++i) {
-            md = APR_ARRAY_IDX(ctx.conf_mds, i, md_t *);
+        for (i = 0; i < ctx.todo->nelts; ++i) {
+            md = APR_ARRAY_IDX(ctx.todo, i, md_t *);
             
             /* find the store md that is closest match for the configured md */
             smd = md_find_closest_match(ctx.store_mds, md);
             if (smd) {
                 fields = 0;
                 /* add any newly configured domains to the store md */
-                added = md_array_str_add_missing(smd->domains, md->domains, 0);
-                if (added) {
-                    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, 
-                                 "%s: %d domains added", smd->name, added);
+                added = md_domain_set_diff(ptemp, md->domains, smd->domains);
+                if (md_domain_set_count(added) > 0) {
+                    md_domain_set_add_all(smd->domains, added);
+                    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "%s: %d domains added: %s", 
+                                  smd->name, md_domain_set_count(added), 
+                                  apr_array_pstrcat(ptemp, md_domain_set_names(added), ' '));
                     fields |= MD_UPD_DOMAINS;
                 }
                 
@@ -722,13 +1212,15 @@ apr_status_t md_reg_sync(md_reg_t *reg, apr_pool_t *p, apr_pool_t *ptemp,
                     else if (config_md) {
                         /* domain stored in omd, but no longer has the offending domain,
                            remove it from the store md. */
-                        omd->domains = md_array_str_remove(ptemp, omd->domains, common, 0);
+                        md_domain_set_remove(omd->domains, common);
                         rv = md_reg_update(reg, ptemp, omd->name, omd, MD_UPD_DOMAINS);
+                        sync_touched(&ctx, omd->name);
                     }
                     else {
                         /* domain in a store md that is no longer configured, warn about it.
                          * Remove the domain here, so we can progress, but never save it. */
-                        omd->domains = md_array_str_remove(ptemp, omd->domains, common, 0);
+                        md_domain_set_remove(omd->domains, common);
+                        sync_touched(&ctx, omd->name);
                         md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, 
                                       "domain %s, configured in md %s, is part of the stored md %s."
                                       " That md however is no longer mentioned in the config. "
@@ -777,12 +1269,14 @@ apr_status_t md_reg_sync(md_reg_t *reg, apr_pool_t *p, apr_pool_t *ptemp,
                 
                 if (fields) {
                     rv = md_reg_update(reg, ptemp, smd->name, smd, fields);
+                    sync_touched(&ctx, smd->name);
                     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "md %s updated", smd->name);
                 }
             }
             else {
                 /* new managed domain */
                 rv = md_reg_add(reg, md, ptemp);
+                sync_touched(&ctx, md->name);
                 md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "new md %s added", md->name);
             }
         }
@@ -791,10 +1285,16 @@ apr_status_t md_reg_sync(md_reg_t *reg, apr_pool_t *p, apr_pool_t *ptemp,
         md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "loading mds");
     }
     
+    if (APR_SUCCESS == rv) {
+        /* one sync for all the updates above */
+        rv = md_store_sync(reg->store, ptemp);
+    }
+    if (APR_SUCCESS == rv) {
+        rv = sync_fingerprint_save(&ctx, reg, ptemp, can_http, can_https);
+    }
     return rv;
 }
 
-
 /**************************************************************************************************/
 /* driving */
 
@@ -824,6 +1324,93 @@ static apr_status_t init_proto_driver(md_proto_driver_t *driver, const md_proto_
     return rv;
 }
 
+/* Servers sharing a store take turns in staging: it is done while holding a lease on
+ * the MD in MD_SG_STAGING, kept alive by a heartbeat. Whoever does not get the lease
+ * leaves the MD alone and loads what the holder staged on its next restart. */
+
+typedef struct {
+    md_store_lease_t *lease;
+    apr_status_t rv;
+    int done;
+#if APR_HAS_THREADS
+    apr_thread_t *thread;
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+#endif
+} lease_beat_t;
+
+static const char *lease_owner(apr_pool_t *p)
+{
+    char host[APRMAXHOSTLEN+1];
+    
+    if (APR_SUCCESS != apr_gethostname(host, sizeof(host), p)) {
+        apr_cpystrn(host, "localhost", sizeof(host));
+    }
+    return apr_psprintf(p, "%s:%d", host, (int)getpid());
+}
+
+#if APR_HAS_THREADS
+static void * APR_THREAD_FUNC lease_beat_run(apr_thread_t *thread, void *data)
+{
+    lease_beat_t *beat = data;
+    apr_pool_t *p = apr_thread_pool_get(thread);
+    
+    apr_thread_mutex_lock(beat->mutex);
+    while (!beat->done && APR_SUCCESS == beat->rv) {
+        apr_thread_cond_timedwait(beat->cond, beat->mutex, beat->lease->duration / 3);
+        if (!beat->done) {
+            beat->rv = md_store_lease_renew(beat->lease, p);
+        }
+    }
+    apr_thread_mutex_unlock(beat->mutex);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+#endif
+
+static void lease_beat_start(lease_beat_t *beat, md_store_lease_t *lease, apr_pool_t *p)
+{
+    memset(beat, 0, sizeof(*beat));
+    beat->lease = lease;
+#if APR_HAS_THREADS
+    {
+        apr_pool_t *bp;
+        apr_status_t rv;
+        
+        /* the heartbeat gets a pool of its own, 'p' stays with the staging thread */
+        if (APR_SUCCESS != (rv = apr_pool_create(&bp, p))
+            || APR_SUCCESS != (rv = apr_thread_mutex_create(&beat->mutex, 
+                                                            APR_THREAD_MUTEX_DEFAULT, bp))
+            || APR_SUCCESS != (rv = apr_thread_cond_create(&beat->cond, bp))
+            || APR_SUCCESS != (rv = apr_thread_create(&beat->thread, NULL, lease_beat_run, 
+                                                      beat, bp))) {
+            /* staging then needs to finish within the lease duration */
+            md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, 
+                          "%s: starting lease heartbeat", lease->name);
+            beat->thread = NULL;
+        }
+    }
+#endif
+}
+
+static apr_status_t lease_beat_stop(lease_beat_t *beat)
+{
+#if APR_HAS_THREADS
+    apr_status_t rv;
+    
+    if (beat->thread) {
+        apr_thread_mutex_lock(beat->mutex);
+        beat->done = 1;
+        apr_thread_cond_signal(beat->cond);
+        apr_thread_mutex_unlock(beat->mutex);
+        apr_thread_join(&rv, beat->thread);
+        beat->thread = NULL;
+    }
+#endif
+    beat->done = 1;
+    return beat->rv;
+}
+
 static apr_status_t run_stage(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
 {
     md_reg_t *reg = baton;
@@ -831,14 +1418,29 @@ static apr_status_t run_stage(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_
     const md_t *md;
     int reset;
     md_proto_driver_t *driver;
+    md_store_lease_t *lease;
+    lease_beat_t beat;
     const char *challenge;
-    apr_status_t rv;
+    apr_status_t rv, rv2;
     
     proto = va_arg(ap, const md_proto_t *);
     md = va_arg(ap, const md_t *);
     challenge = va_arg(ap, const char *);
     reset = va_arg(ap, int); 
     
+    rv = md_store_lease_acquire(&lease, reg->store, ptemp, MD_SG_STAGING, md->name, 
+                                lease_owner(ptemp), MD_REG_LEASE_DURATION);
+    if (APR_STATUS_IS_EBUSY(rv)) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_INFO, 0, ptemp, 
+                      "%s: staging is done by another server", md->name);
+        return rv;
+    }
+    else if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ptemp, "%s: acquire staging lease", md->name);
+        return rv;
+    }
+    lease_beat_start(&beat, lease, ptemp);
+    
     driver = apr_pcalloc(ptemp, sizeof(*driver));
     rv = init_proto_driver(driver, proto, reg, md, challenge, reset, ptemp);
     if (APR_SUCCESS == rv && 
@@ -847,6 +1449,21 @@ static apr_status_t run_stage(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_
         md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, ptemp, "%s: run staging", md->name);
         rv = proto->stage(driver);
     }
+    
+    /* Only a lease that is still ours, with the same token, makes the result ours */
+    rv2 = lease_beat_stop(&beat);
+    if (APR_SUCCESS == rv2) {
+        rv2 = md_store_lease_renew(lease, ptemp);
+    }
+    if (APR_SUCCESS != rv2) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv2, ptemp, 
+                      "%s: lost the staging lease (token %ld)", md->name, lease->token);
+        if (APR_SUCCESS == rv) {
+            rv = APR_EBUSY;
+        }
+    }
+    md_store_lease_release(lease);
+    
     md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ptemp, "%s: staging done", md->name);
     return rv;
 }
@@ -36,6 +36,13 @@ apr_status_t md_reg_init(md_reg_t **preg, apr_pool_t *pm, struct md_store_t *sto
 
 struct md_store_t *md_reg_store_get(md_reg_t *reg);
 
+/**
+ * Load the mds on up to 'nthreads' threads when iterating over all of them, as in
+ * md_reg_do() and a full md_reg_sync(). The callbacks still run on the calling thread,
+ * in the order of the store. Default is 1, loading on the calling thread.
+ */
+void md_reg_load_threads_set(md_reg_t *reg, int nthreads);
+
 /**
  * Add a new md to the registry. This will check the name for uniqueness and
  * that domain names do not overlap with already existing mds.
@@ -66,6 +73,28 @@ md_t *md_reg_get(md_reg_t *reg, const char *name, apr_pool_t *p);
  */
 apr_status_t md_reg_assess(md_reg_t *reg, md_t *md, int *perrored, int *prenew, apr_pool_t *p);
 
+/**
+ * The outcome of assessing one managed domain in md_reg_assess_all().
+ */
+typedef struct md_reg_assessment_t {
+    md_t *md;               /* the managed domain, NULL if it could not be loaded */
+    apr_status_t rv;        /* of loading the md and checking its credentials */
+    int errored;            /* as from md_reg_assess() */
+    int renew;              /* as from md_reg_assess() */
+} md_reg_assessment_t;
+
+/**
+ * Get and assess the managed domains with the given names, as md_reg_get() and
+ * md_reg_assess() would one after the other, on up to 'nthreads' threads. Each thread 
+ * loads credentials into a pool of its own, only the mds are copied to 'p'. 
+ * Returns an array of md_reg_assessment_t in the order of 'names'.
+ * With less than 2 threads, no thread support or an OpenSSL that may not be used
+ * from several threads, all is done on the calling thread.
+ */
+apr_status_t md_reg_assess_all(struct apr_array_header_t **presults, md_reg_t *reg, 
+                               const struct apr_array_header_t *names, int nthreads, 
+                               apr_pool_t *p);
+
 /**
  * Callback invoked for every md in the registry. If 0 is returned, iteration stops.
  */
@@ -149,9 +178,13 @@ struct md_proto_t {
 };
 
 
+/* How long a server may stage a managed domain without renewing its lease */
+#define MD_REG_LEASE_DURATION       apr_time_from_sec(5 * 60)
+
 /**
  * Stage a new credentials set for the given managed domain in a separate location
  * without interfering with any existing credentials.
+ * Fails with APR_EBUSY when another server sharing the store is staging the domain.
  */
 apr_status_t md_reg_stage(md_reg_t *reg, const md_t *md, 
                           const char *challenge, int reset, apr_pool_t *p);
@@ -17,13 +17,18 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include <apr_allocator.h>
 #include <apr_lib.h>
 #include <apr_file_info.h>
 #include <apr_file_io.h>
 #include <apr_fnmatch.h>
 #include <apr_hash.h>
 #include <apr_strings.h>
+#include <apr_thread_cond.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_proc.h>
 
 #include "md.h"
 #include "md_crypt.h"
@@ -120,6 +125,32 @@ apr_status_t md_store_save_json(md_store_t *store, apr_pool_t *p, md_store_group
     return md_store_save(store, p, group, name, aspect, MD_SV_JSON, (void*)data, create);
 }
 
+static int names_insp(void *baton, const char *name, const char *aspect, 
+                      md_store_vtype_t vtype, void *value, apr_pool_t *ptemp)
+{
+    apr_array_header_t *names = baton;
+
+    if (!names->nelts || strcmp(name, APR_ARRAY_IDX(names, names->nelts-1, const char *))) {
+        APR_ARRAY_PUSH(names, const char *) = apr_pstrdup(names->pool, name);
+    }
+    return 1;
+}
+
+apr_status_t md_store_names(apr_array_header_t **pnames, md_store_t *store, apr_pool_t *p, 
+                            md_store_group_t group, const char *pattern, const char *aspect)
+{
+    apr_array_header_t *names;
+    apr_status_t rv;
+
+    if (store->names) {
+        return store->names(pnames, store, p, group, pattern, aspect);
+    }
+    names = apr_array_make(p, 100, sizeof(const char *));
+    rv = md_store_iter(names_insp, names, store, p, group, pattern, aspect, MD_SV_TEXT);
+    *pnames = (APR_SUCCESS == rv)? names : NULL;
+    return rv;
+}
+
 apr_status_t md_store_move(md_store_t *store, apr_pool_t *p, 
                            md_store_group_t from, md_store_group_t to,
                            const char *name, int archive)
@@ -138,6 +169,229 @@ apr_status_t md_store_get_fname(const char **pfname,
     return APR_ENOTIMPL;
 }
 
+apr_status_t md_store_sync(md_store_t *store, apr_pool_t *p)
+{
+    return store->sync? store->sync(store, p) : APR_SUCCESS;
+}
+
+apr_status_t md_store_changed_names(apr_array_header_t **pnames, apr_int64_t *plast,
+                                    md_store_t *store, md_store_group_t group, 
+                                    apr_int64_t since, apr_pool_t *p)
+{
+    *pnames = NULL;
+    *plast = since;
+    if (!store->changed_names) {
+        return APR_ENOTIMPL;
+    }
+    return store->changed_names(pnames, plast, store, group, since, p);
+}
+
+/**************************************************************************************************/
+/* transactions */
+
+/* Stores without transaction support get one that holds the puts back until commit,
+ * then purges and saves them one by one. Readers may see a partial state during the
+ * commit, but an abort leaves everything as it was. */
+typedef struct {
+    const char *aspect;
+    md_store_vtype_t vtype;
+    void *value;
+} gen_txn_put_t;
+
+static apr_status_t gen_txn_put(md_store_txn_t *txn, const char *aspect, 
+                                md_store_vtype_t vtype, void *value)
+{
+    apr_array_header_t *puts = txn->baton;
+    gen_txn_put_t *put;
+    
+    put = &APR_ARRAY_PUSH(puts, gen_txn_put_t);
+    put->aspect = apr_pstrdup(txn->p, aspect);
+    put->vtype = vtype;
+    put->value = value;
+    return APR_SUCCESS;
+}
+
+static apr_status_t gen_txn_end(md_store_txn_t *txn, int commit)
+{
+    apr_array_header_t *puts = txn->baton;
+    gen_txn_put_t *put;
+    apr_status_t rv;
+    int i;
+    
+    if (!commit) {
+        return APR_SUCCESS;
+    }
+    if (APR_SUCCESS != (rv = md_store_purge(txn->store, txn->p, txn->group, txn->name))) {
+        return rv;
+    }
+    for (i = 0; i < puts->nelts; ++i) {
+        put = &APR_ARRAY_IDX(puts, i, gen_txn_put_t);
+        rv = md_store_save(txn->store, txn->p, txn->group, txn->name, 
+                           put->aspect, put->vtype, put->value, 0);
+        if (APR_SUCCESS != rv) {
+            return rv;
+        }
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t gen_txn_begin(md_store_txn_t **ptxn, md_store_t *store, apr_pool_t *p, 
+                                  md_store_group_t group, const char *name)
+{
+    md_store_txn_t *txn;
+    
+    txn = apr_pcalloc(p, sizeof(*txn));
+    txn->put = gen_txn_put;
+    txn->end = gen_txn_end;
+    txn->baton = apr_array_make(p, 5, sizeof(gen_txn_put_t));
+    *ptxn = txn;
+    return APR_SUCCESS;
+}
+
+static apr_status_t txn_cleanup(void *data)
+{
+    md_store_txn_t *txn = data;
+    
+    if (txn->end) {
+        md_store_txn_end_cb *end = txn->end;
+        txn->end = NULL;
+        end(txn, 0);
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t txn_end(md_store_txn_t *txn, int commit)
+{
+    md_store_txn_end_cb *end = txn->end;
+    
+    if (!end) {
+        return commit? APR_EINVAL : APR_SUCCESS;
+    }
+    txn->end = NULL;
+    apr_pool_cleanup_kill(txn->p, txn, txn_cleanup);
+    return end(txn, commit);
+}
+
+apr_status_t md_store_txn_begin(md_store_txn_t **ptxn, md_store_t *store, apr_pool_t *p, 
+                                md_store_group_t group, const char *name)
+{
+    md_store_txn_t *txn;
+    apr_status_t rv;
+    
+    rv = (store->txn_begin? store->txn_begin : gen_txn_begin)(&txn, store, p, group, name);
+    if (APR_SUCCESS == rv) {
+        txn->store = store;
+        txn->p = p;
+        txn->group = group;
+        txn->name = apr_pstrdup(p, name);
+        apr_pool_cleanup_register(p, txn, txn_cleanup, apr_pool_cleanup_null);
+    }
+    *ptxn = (APR_SUCCESS == rv)? txn : NULL;
+    return rv;
+}
+
+apr_status_t md_store_txn_put(md_store_txn_t *txn, const char *aspect, 
+                              md_store_vtype_t vtype, void *value)
+{
+    if (!txn->end) {
+        return APR_EINVAL;
+    }
+    return txn->put(txn, aspect, vtype, value);
+}
+
+apr_status_t md_store_txn_commit(md_store_txn_t *txn)
+{
+    return txn_end(txn, 1);
+}
+
+void md_store_txn_abort(md_store_txn_t *txn)
+{
+    if (txn) {
+        txn_end(txn, 0);
+    }
+}
+
+apr_status_t md_store_txn_put_md(md_store_txn_t *txn, md_t *md)
+{
+    md_json_t *json = md_to_json(md, txn->p);
+    
+    assert(json);
+    return md_store_txn_put(txn, MD_FN_MD, MD_SV_JSON, json);
+}
+
+/**************************************************************************************************/
+/* leases */
+
+/* Stores without lease support are not shared, whoever asks gets the lease. */
+static apr_status_t gen_lease_renew(md_store_lease_t *lease, apr_pool_t *p)
+{
+    lease->expires = apr_time_now() + lease->duration;
+    return APR_SUCCESS;
+}
+
+static apr_status_t gen_lease_release(md_store_lease_t *lease, apr_pool_t *p)
+{
+    return APR_SUCCESS;
+}
+
+static apr_status_t gen_lease_acquire(md_store_lease_t *lease, apr_pool_t *p)
+{
+    lease->token = 1;
+    lease->renew = gen_lease_renew;
+    lease->release = gen_lease_release;
+    return gen_lease_renew(lease, p);
+}
+
+static apr_status_t lease_cleanup(void *data)
+{
+    md_store_lease_t *lease = data;
+    
+    if (lease->release) {
+        md_store_lease_release_cb *release = lease->release;
+        lease->release = NULL;
+        release(lease, lease->p);
+    }
+    return APR_SUCCESS;
+}
+
+apr_status_t md_store_lease_acquire(md_store_lease_t **please, md_store_t *store, 
+                                    apr_pool_t *p, md_store_group_t group, const char *name,
+                                    const char *owner, apr_interval_time_t duration)
+{
+    md_store_lease_t *lease;
+    apr_status_t rv;
+    
+    lease = apr_pcalloc(p, sizeof(*lease));
+    lease->store = store;
+    lease->p = p;
+    lease->group = group;
+    lease->name = apr_pstrdup(p, name);
+    lease->owner = apr_pstrdup(p, owner);
+    lease->duration = duration;
+    
+    rv = (store->lease_acquire? store->lease_acquire : gen_lease_acquire)(lease, p);
+    if (APR_SUCCESS == rv) {
+        apr_pool_cleanup_register(p, lease, lease_cleanup, apr_pool_cleanup_null);
+    }
+    *please = (APR_SUCCESS == rv)? lease : NULL;
+    return rv;
+}
+
+apr_status_t md_store_lease_renew(md_store_lease_t *lease, apr_pool_t *p)
+{
+    if (!lease->release) {
+        return APR_EINVAL;
+    }
+    return lease->renew(lease, p);
+}
+
+void md_store_lease_release(md_store_lease_t *lease)
+{
+    if (lease) {
+        apr_pool_cleanup_run(lease->p, lease, lease_cleanup);
+    }
+}
+
 /**************************************************************************************************/
 /* convenience */
 
@@ -276,6 +530,17 @@ static int insp_md(void *baton, const char *name, const char *aspect,
     return 1;
 }
 
+static apr_status_t p_md_iter(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    inspect_md_ctx *ctx = baton;
+    
+    /* the md.json documents are only needed until md_from_json() has copied them,
+     * parse them into the arena of ptemp when the process has one set up. */
+    md_json_arena_enable(ptemp);
+    return md_store_iter(insp_md, ctx, ctx->store, ptemp, ctx->group, ctx->pattern, 
+                         MD_FN_MD, MD_SV_JSON);
+}
+
 apr_status_t md_store_md_iter(md_store_md_inspect *inspect, void *baton, md_store_t *store, 
                               apr_pool_t *p, md_store_group_t group, const char *pattern)
 {
@@ -283,9 +548,245 @@ apr_status_t md_store_md_iter(md_store_md_inspect *inspect, void *baton, md_stor
     
     ctx.store = store;
     ctx.group = group;
+    ctx.pattern = pattern;
     ctx.inspect = inspect;
     ctx.baton = baton;
     
-    return md_store_iter(insp_md, &ctx, store, p, group, pattern, MD_FN_MD, MD_SV_JSON);
+    return md_util_pool_vdo(p_md_iter, &ctx, p, NULL);
+}
+
+#if APR_HAS_THREADS
+
+/* Workers take the next name, load its md into a pool of its own and queue it as
+ * ready. The calling thread hands the ready ones to the inspector. Workers stay
+ * at most a window of mds ahead of the inspector, so memory does not grow with the
+ * number of mds. */
+
+typedef struct {
+    apr_pool_t *p;
+    md_t *md;
+    apr_status_t rv;
+    int ready;
+} md_par_item_t;
+
+typedef struct {
+    md_store_t *store;
+    md_store_group_t group;
+    apr_array_header_t *names;
+    apr_pool_t *ipool;          /* parent of item pools, its allocator is locked */
+    md_par_item_t *items;       /* one for each name */
+    int *ready;                 /* item indices in the order they became ready */
+    int ready_head, ready_tail;
+    int next;                   /* the next name to load */
+    int delivered;              /* items done with by the inspector */
+    int window;
+    int stop;
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *loaded;
+    apr_thread_cond_t *consumed;
+} md_par_iter_t;
+
+static void * APR_THREAD_FUNC par_iter_worker(apr_thread_t *thread, void *data)
+{
+    md_par_iter_t *ctx = data;
+    md_par_item_t *item;
+    apr_pool_t *p;
+    apr_status_t rv;
+    int i;
+
+    apr_thread_mutex_lock(ctx->mutex);
+    while (!ctx->stop && ctx->next < ctx->names->nelts) {
+        if (ctx->next - ctx->delivered >= ctx->window) {
+            apr_thread_cond_wait(ctx->consumed, ctx->mutex);
+            continue;
+        }
+        i = ctx->next++;
+        apr_thread_mutex_unlock(ctx->mutex);
+
+        item = &ctx->items[i];
+        p = NULL;
+        if (APR_SUCCESS == (rv = apr_pool_create(&p, ctx->ipool))) {
+            md_json_arena_enable(p);
+            rv = md_load(ctx->store, ctx->group, APR_ARRAY_IDX(ctx->names, i, const char *), 
+                         &item->md, p);
+        }
+
+        apr_thread_mutex_lock(ctx->mutex);
+        item->p = p;
+        item->rv = rv;
+        item->ready = 1;
+        ctx->ready[ctx->ready_tail++] = i;
+        apr_thread_cond_signal(ctx->loaded);
+    }
+    apr_thread_mutex_unlock(ctx->mutex);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+static apr_status_t par_iter_deliver(md_par_iter_t *ctx, md_store_md_inspect *inspect, 
+                                     void *baton, int ordered)
+{
+    md_par_item_t *item;
+    apr_status_t rv = APR_SUCCESS;
+    int i, done = 0;
+
+    apr_thread_mutex_lock(ctx->mutex);
+    while (!done && ctx->delivered < ctx->names->nelts) {
+        if (ordered) {
+            i = ctx->delivered;
+            if (!ctx->items[i].ready) {
+                apr_thread_cond_wait(ctx->loaded, ctx->mutex);
+                continue;
+            }
+        }
+        else if (ctx->ready_head < ctx->ready_tail) {
+            i = ctx->ready[ctx->ready_head++];
+        }
+        else {
+            apr_thread_cond_wait(ctx->loaded, ctx->mutex);
+            continue;
+        }
+        apr_thread_mutex_unlock(ctx->mutex);
+
+        item = &ctx->items[i];
+        if (APR_SUCCESS == item->rv) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, item->p, "inspecting md at: %s", 
+                          item->md->name);
+            done = !inspect(baton, ctx->store, item->md, item->p);
+        }
+        else if (!APR_STATUS_IS_ENOENT(item->rv)) {
+            /* gone in the meantime is fine, anything else ends the iteration */
+            rv = item->rv;
+            done = 1;
+        }
+        if (item->p) {
+            apr_pool_destroy(item->p);
+            item->p = NULL;
+        }
+
+        apr_thread_mutex_lock(ctx->mutex);
+        ++ctx->delivered;
+        ctx->stop = done;
+        apr_thread_cond_broadcast(ctx->consumed);
+    }
+    apr_thread_mutex_unlock(ctx->mutex);
+    return rv;
+}
+
+static apr_status_t par_iter_pool_create(apr_pool_t **ppool, apr_pool_t *parent)
+{
+    apr_allocator_t *allocator;
+    apr_thread_mutex_t *mutex;
+    apr_pool_t *pool;
+    apr_status_t rv;
+
+    if (APR_SUCCESS != (rv = apr_allocator_create(&allocator))) {
+        return rv;
+    }
+    if (APR_SUCCESS != (rv = apr_pool_create_ex(&pool, parent, NULL, allocator))) {
+        apr_allocator_destroy(allocator);
+        return rv;
+    }
+    apr_allocator_owner_set(allocator, pool);
+    if (APR_SUCCESS != (rv = apr_thread_mutex_create(&mutex, APR_THREAD_MUTEX_DEFAULT, pool))) {
+        apr_pool_destroy(pool);
+        return rv;
+    }
+    apr_allocator_mutex_set(allocator, mutex);
+    *ppool = pool;
+    return APR_SUCCESS;
+}
+
+static apr_status_t p_md_iter_parallel(void *baton, apr_pool_t *p, apr_pool_t *ptemp, 
+                                       va_list ap)
+{
+    md_par_iter_t *ctx = baton;
+    md_store_md_inspect *inspect;
+    apr_thread_t **threads;
+    apr_status_t rv, trv;
+    const char *pattern;
+    void *inspect_baton;
+    int i, nthreads, ordered, started = 0;
+
+    inspect = va_arg(ap, md_store_md_inspect *);
+    inspect_baton = va_arg(ap, void *);
+    pattern = va_arg(ap, const char *);
+    nthreads = va_arg(ap, int);
+    ordered = va_arg(ap, int);
+
+    if (APR_SUCCESS != (rv = md_store_names(&ctx->names, ctx->store, ptemp, ctx->group,
+                                            pattern, MD_FN_MD))) {
+        return rv;
+    }
+    if (ctx->names->nelts < nthreads) {
+        nthreads = ctx->names->nelts;
+    }
+    if (!nthreads) {
+        return APR_SUCCESS;
+    }
+    ctx->items = apr_pcalloc(ptemp, (apr_size_t)ctx->names->nelts * sizeof(md_par_item_t));
+    ctx->ready = apr_pcalloc(ptemp, (apr_size_t)ctx->names->nelts * sizeof(int));
+    ctx->window = 4 * nthreads;
+    threads = apr_pcalloc(ptemp, (apr_size_t)nthreads * sizeof(apr_thread_t *));
+
+    if (APR_SUCCESS != (rv = par_iter_pool_create(&ctx->ipool, ptemp))
+        || APR_SUCCESS != (rv = apr_thread_mutex_create(&ctx->mutex, 
+                                                        APR_THREAD_MUTEX_DEFAULT, ptemp))
+        || APR_SUCCESS != (rv = apr_thread_cond_create(&ctx->loaded, ptemp))
+        || APR_SUCCESS != (rv = apr_thread_cond_create(&ctx->consumed, ptemp))) {
+        goto serial;
+    }
+
+    for (i = 0; i < nthreads; ++i) {
+        if (APR_SUCCESS != (rv = apr_thread_create(&threads[i], NULL, par_iter_worker, 
+                                                   ctx, ptemp))) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, ptemp, 
+                          "md iteration: creating worker %d", i);
+            break;
+        }
+        ++started;
+    }
+    if (started) {
+        rv = par_iter_deliver(ctx, inspect, inspect_baton, ordered);
+    }
+
+    /* workers may be waiting for room or still loading */
+    apr_thread_mutex_lock(ctx->mutex);
+    ctx->stop = 1;
+    apr_thread_cond_broadcast(ctx->consumed);
+    apr_thread_mutex_unlock(ctx->mutex);
+    for (i = 0; i < started; ++i) {
+        apr_thread_join(&trv, threads[i]);
+    }
+    /* with the items not delivered */
+    apr_pool_destroy(ctx->ipool);
+    if (started) {
+        return rv;
+    }
+serial:
+    md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, ptemp, 
+                  "md iteration: no worker threads, loading mds one by one");
+    return md_store_md_iter(inspect, inspect_baton, ctx->store, p, ctx->group, pattern);
+}
+
+#endif /* APR_HAS_THREADS */
+
+apr_status_t md_store_md_iter_parallel(md_store_md_inspect *inspect, void *baton, 
+                                       md_store_t *store, apr_pool_t *p, 
+                                       md_store_group_t group, const char *pattern, 
+                                       int nthreads, int ordered)
+{
+#if APR_HAS_THREADS
+    md_par_iter_t ctx;
+
+    if (nthreads > 1) {
+        memset(&ctx, 0, sizeof(ctx));
+        ctx.store = store;
+        ctx.group = group;
+        return md_util_pool_vdo(p_md_iter_parallel, &ctx, p, inspect, baton, pattern, 
+                                nthreads, ordered, NULL);
+    }
+#endif
+    return md_store_md_iter(inspect, baton, store, p, group, pattern);
 }
 
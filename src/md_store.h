@@ -56,6 +56,27 @@ typedef apr_status_t md_store_get_fname_cb(const char **pfname,
                                            const char *name, const char *aspect, 
                                            apr_pool_t *p);
 
+typedef apr_status_t md_store_sync_cb(md_store_t *store, apr_pool_t *p);
+
+typedef apr_status_t md_store_names_cb(struct apr_array_header_t **pnames, md_store_t *store, 
+                                       apr_pool_t *p, md_store_group_t group, 
+                                       const char *pattern, const char *aspect);
+
+typedef apr_status_t md_store_changed_names_cb(struct apr_array_header_t **pnames, 
+                                               apr_int64_t *plast, md_store_t *store, 
+                                               md_store_group_t group, apr_int64_t since, 
+                                               apr_pool_t *p);
+
+typedef struct md_store_txn_t md_store_txn_t;
+
+typedef apr_status_t md_store_txn_begin_cb(md_store_txn_t **ptxn, md_store_t *store, 
+                                           apr_pool_t *p, md_store_group_t group, 
+                                           const char *name);
+
+typedef struct md_store_lease_t md_store_lease_t;
+
+typedef apr_status_t md_store_lease_acquire_cb(md_store_lease_t *lease, apr_pool_t *p);
+
 struct md_store_t {
     md_store_destroy_cb *destroy;
 
@@ -66,6 +87,11 @@ struct md_store_t {
     md_store_iter_cb *iterate;
     md_store_purge_cb *purge;
     md_store_get_fname_cb *get_fname;
+    md_store_txn_begin_cb *txn_begin;   /* NULL: generic, applied on commit */
+    md_store_sync_cb *sync;             /* NULL: nothing is held back */
+    md_store_lease_acquire_cb *lease_acquire; /* NULL: leases are always granted */
+    md_store_names_cb *names;           /* NULL: found by iterating */
+    md_store_changed_names_cb *changed_names; /* NULL: changes are not tracked */
 };
 
 void md_store_destroy(md_store_t *store);
@@ -97,6 +123,15 @@ apr_status_t md_store_iter(md_store_inspect *inspect, void *baton, md_store_t *s
                            apr_pool_t *p, md_store_group_t group, const char *pattern, 
                            const char *aspect, md_store_vtype_t vtype);
 
+/**
+ * Get the names in 'group' matching 'pattern' that have a value for 'aspect',
+ * without loading any values. Each name is listed once, in the order the store
+ * iterates them.
+ */
+apr_status_t md_store_names(struct apr_array_header_t **pnames, md_store_t *store, 
+                            apr_pool_t *p, md_store_group_t group, 
+                            const char *pattern, const char *aspect);
+
 apr_status_t md_store_move(md_store_t *store, apr_pool_t *p,
                            md_store_group_t from, md_store_group_t to,
                            const char *name, int archive);
@@ -106,6 +141,113 @@ apr_status_t md_store_get_fname(const char **pfname,
                                 const char *name, const char *aspect, 
                                 apr_pool_t *p);
 
+/**
+ * Get the names in 'group' that changed after position 'since' in the store's record of
+ * changes, each listed once, and the position of the last change in *plast. A 'since'
+ * beyond the last change only gets the position. Returns APR_INCOMPLETE when the store
+ * cannot tell which names changed, APR_ENOTIMPL when it does not record changes.
+ */
+apr_status_t md_store_changed_names(struct apr_array_header_t **pnames, apr_int64_t *plast,
+                                    md_store_t *store, md_store_group_t group, 
+                                    apr_int64_t since, apr_pool_t *p);
+
+/**
+ * Make all changes to the store so far durable, as far as the store's
+ * configuration asks for it. Call after a series of modifications.
+ */
+apr_status_t md_store_sync(md_store_t *store, apr_pool_t *p);
+
+/**************************************************************************************************/
+/* transactions */
+
+typedef apr_status_t md_store_txn_put_cb(md_store_txn_t *txn, const char *aspect, 
+                                         md_store_vtype_t vtype, void *value);
+typedef apr_status_t md_store_txn_end_cb(md_store_txn_t *txn, int commit);
+
+/**
+ * A transaction replaces everything stored for 'name' in 'group' by the aspects
+ * put into it. Stores that support it make the new set visible at once on commit,
+ * so that readers see either all of the old or all of the new aspects. Without
+ * commit, nothing changes. 
+ */
+struct md_store_txn_t {
+    md_store_t *store;
+    apr_pool_t *p;
+    md_store_group_t group;
+    const char *name;
+    
+    md_store_txn_put_cb *put;
+    md_store_txn_end_cb *end;   /* NULL once committed or aborted */
+    void *baton;                /* for use by the store implementation */
+};
+
+/**
+ * Start a transaction on 'name' in 'group'. The transaction lives in pool 'p'
+ * and is aborted when the pool is destroyed before commit.
+ */
+apr_status_t md_store_txn_begin(md_store_txn_t **ptxn, md_store_t *store, apr_pool_t *p, 
+                                md_store_group_t group, const char *name);
+apr_status_t md_store_txn_put(md_store_txn_t *txn, const char *aspect, 
+                              md_store_vtype_t vtype, void *value);
+/**
+ * Commit the transaction. The transaction is ended after this, whether it
+ * succeeded or not.
+ */
+apr_status_t md_store_txn_commit(md_store_txn_t *txn);
+/**
+ * Abort the transaction, discarding everything put into it. Does nothing
+ * when the transaction has already ended.
+ */
+void md_store_txn_abort(md_store_txn_t *txn);
+
+apr_status_t md_store_txn_put_md(md_store_txn_t *txn, md_t *md);
+
+/**************************************************************************************************/
+/* leases */
+
+typedef apr_status_t md_store_lease_renew_cb(md_store_lease_t *lease, apr_pool_t *p);
+typedef apr_status_t md_store_lease_release_cb(md_store_lease_t *lease, apr_pool_t *p);
+
+/**
+ * A lease gives its owner the sole right to work on 'name' in 'group' until it
+ * expires, also among several servers sharing one store. Owners renew it while
+ * they are busy. Whenever a lease is granted anew, its token is incremented, which
+ * lets an owner detect that it lost the lease in between.
+ */
+struct md_store_lease_t {
+    md_store_t *store;
+    apr_pool_t *p;
+    md_store_group_t group;
+    const char *name;
+    const char *owner;
+    apr_interval_time_t duration;
+    long token;
+    apr_time_t expires;
+    
+    md_store_lease_renew_cb *renew;
+    md_store_lease_release_cb *release; /* NULL once released */
+    void *baton;                        /* for use by the store implementation */
+};
+
+/**
+ * Acquire the lease on 'name' in 'group' for 'owner', valid for 'duration'. Fails
+ * with APR_EBUSY while another owner holds an unexpired lease. The lease lives in
+ * pool 'p' and is released when the pool is destroyed.
+ */
+apr_status_t md_store_lease_acquire(md_store_lease_t **please, md_store_t *store, 
+                                    apr_pool_t *p, md_store_group_t group, const char *name,
+                                    const char *owner, apr_interval_time_t duration);
+/**
+ * Extend the lease by its duration from now on. Fails with APR_EBUSY when the lease
+ * has been taken over by another owner. Pool 'p' is used for temporary allocations,
+ * so renewals may be done from another thread than the one owning the lease pool.
+ */
+apr_status_t md_store_lease_renew(md_store_lease_t *lease, apr_pool_t *p);
+/**
+ * Give up the lease. Does nothing when it has already been released.
+ */
+void md_store_lease_release(md_store_lease_t *lease);
+
 /**************************************************************************************************/
 /* Storage handling utils */
 
@@ -121,6 +263,20 @@ typedef int md_store_md_inspect(void *baton, md_store_t *store, md_t *md, apr_po
 apr_status_t md_store_md_iter(md_store_md_inspect *inspect, void *baton, md_store_t *store, 
                               apr_pool_t *p, md_store_group_t group, const char *pattern);
 
+/**
+ * As md_store_md_iter(), but load and parse the managed domains on 'nthreads' threads.
+ * The inspector is still called on the calling thread only, one md at a time. With
+ * 'ordered' set, it sees them in the order of md_store_names(), otherwise in the
+ * order they become ready. Each md is in a pool of its own, handed to the inspector
+ * as ptemp and destroyed when it returns.
+ * With less than 2 threads, no thread support or when no thread can be started, this
+ * is md_store_md_iter().
+ */
+apr_status_t md_store_md_iter_parallel(md_store_md_inspect *inspect, void *baton, 
+                                       md_store_t *store, apr_pool_t *p, 
+                                       md_store_group_t group, const char *pattern, 
+                                       int nthreads, int ordered);
+
 
 apr_status_t md_pkey_load(md_store_t *store, md_store_group_t group, 
                           const char *name, struct md_pkey_t **ppkey, apr_pool_t *p);
@@ -13,17 +13,24 @@
  * limitations under the License.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE         /* for F_OFD_SETLK */
+#endif
+
 #include <assert.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <apr_lib.h>
+#include <apr_atomic.h>
 #include <apr_file_info.h>
 #include <apr_file_io.h>
 #include <apr_fnmatch.h>
 #include <apr_hash.h>
+#include <apr_portable.h>
 #include <apr_strings.h>
+#include <apr_thread_mutex.h>
 
 #include "md.h"
 #include "md_crypt.h"
@@ -34,6 +41,33 @@
 #include "md_util.h"
 #include "md_version.h"
 
+/* getpid for *NIX */
+#if APR_HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+#if APR_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+/* getpid for Windows */
+#if APR_HAVE_PROCESS_H
+#include <process.h>
+#endif
+
+#ifndef WIN32
+#include <fcntl.h>
+#endif
+
+#ifdef MD_HAVE_INOTIFY
+#include <errno.h>
+#include <sys/inotify.h>
+#endif
+
+#if !defined(WIN32) && !defined(F_OFD_SETLK) && APR_HAS_THREADS
+/* plain fcntl() locks belong to the process, its threads need a mutex on top */
+#define FS_LOCK_PROC_MUTEX
+#endif
+
 /**************************************************************************************************/
 /* file system based implementation of md_store_t */
 
@@ -60,10 +94,46 @@ struct md_store_fs_t {
     int port_443;
 
     const unsigned char *dupkey;
+    
+    apr_pool_t *p;
+    int der_cache;              /* keep DER copies of certs and chains */
+    apr_pool_t *der_pool;       /* of der_blobs, cleared when others change the store */
+    apr_hash_t *der_blobs;      /* shared chain certs by sha256 hex */
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *der_mutex;
+#endif
+    
+    int arch_keep;              /* archived generations kept per MD, <= 0 for all */
+    apr_interval_time_t arch_max_age; /* keep generations younger than this */
+    
+    md_store_fs_sync_t sync_mode;
+    apr_interval_time_t sync_window;
+    apr_time_t sync_start;      /* of the current commit window, 0 when nothing is pending */
+    apr_pool_t *sync_pool;
+    apr_hash_t *sync_dirs;      /* directories changed in the current commit window */
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *sync_mutex;
+#endif
+    
+    int journal;                /* record all changes in the journal */
+    apr_off_t journal_max;      /* size beyond which the journal is rotated */
+    
+    apr_hash_t *locks;          /* outermost lock of a thread, by lock file */
+    md_store_fs_lock_stats_t lock_stats;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *lock_mutex;
+#endif
+#ifdef FS_LOCK_PROC_MUTEX
+    apr_thread_mutex_t *lock_proc_mutex; /* held by the thread holding store locks */
+#endif
+    
+    struct md_store_fs_watch_t *watch;  /* of this process, told about its own writes */
 };
 
 #define FS_STORE(store)     (md_store_fs_t*)(((char*)store)-offsetof(md_store_fs_t, s))
 #define FS_STORE_JSON       "md_store.json"
+#define FS_JOURNAL          "md_store.journal"
+#define FS_JOURNAL_MAX      (1024 * 1024)
 #define FS_STORE_KLEN       48
 
 static apr_status_t fs_load(md_store_t *store, md_store_group_t group, 
@@ -84,10 +154,20 @@ static apr_status_t fs_iterate(md_store_inspect *inspect, void *baton, md_store_
                                apr_pool_t *p, md_store_group_t group,  const char *pattern,
                                const char *aspect, md_store_vtype_t vtype);
 
+static apr_status_t fs_names(apr_array_header_t **pnames, md_store_t *store, apr_pool_t *p, 
+                             md_store_group_t group, const char *pattern, const char *aspect);
 static apr_status_t fs_get_fname(const char **pfname, 
                                  md_store_t *store, md_store_group_t group, 
                                  const char *name, const char *aspect, 
                                  apr_pool_t *p);
+static apr_status_t fs_txn_begin(md_store_txn_t **ptxn, md_store_t *store, apr_pool_t *p, 
+                                 md_store_group_t group, const char *name);
+static apr_status_t fs_sync(md_store_t *store, apr_pool_t *p);
+static apr_status_t fs_changed_names(apr_array_header_t **pnames, apr_int64_t *plast, 
+                                     md_store_t *store, md_store_group_t group, 
+                                     apr_int64_t since, apr_pool_t *p);
+static apr_status_t fs_lease_acquire(md_store_lease_t *lease, apr_pool_t *p);
+static apr_status_t txn_sweep_all(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap);
 
 static apr_status_t init_store_file(md_store_fs_t *s_fs, const char *fname, 
                                     apr_pool_t *p, apr_pool_t *ptemp)
@@ -184,12 +264,38 @@ read:
     return rv;
 }
 
+/* md_util_freplace() writes to "<file>.<pid>.<seq>.tmp" before the rename. Those of 
+ * a process that died while writing are removed at init, once they are too old to 
+ * belong to a writer still at work. */
+#define FS_TMP_PATTERN      "*.[0-9]*.[0-9]*.tmp"
+#define FS_TMP_STALE        apr_time_from_sec(10 * 60)
+
+static apr_status_t tmp_sweep(void *baton, apr_pool_t *p, apr_pool_t *ptemp, 
+                              const char *dir, const char *name, apr_filetype_e ftype)
+{
+    const char *fpath;
+    apr_finfo_t info;
+    
+    (void)baton;
+    (void)p;
+    if (APR_REG == ftype && APR_SUCCESS == apr_fnmatch(FS_TMP_PATTERN, name, 0)
+        && APR_SUCCESS == md_util_path_merge(&fpath, ptemp, dir, name, NULL)
+        && APR_SUCCESS == apr_stat(&info, fpath, APR_FINFO_MTIME, ptemp)
+        && apr_time_now() - info.mtime >= FS_TMP_STALE) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, ptemp, "removing stale %s", fpath);
+        apr_file_remove(fpath, ptemp);
+    }
+    return APR_SUCCESS;
+}
+
 apr_status_t md_store_fs_init(md_store_t **pstore, apr_pool_t *p, const char *path)
 {
     md_store_fs_t *s_fs;
+    const char *fpath;
     apr_status_t rv = APR_SUCCESS;
     
     s_fs = apr_pcalloc(p, sizeof(*s_fs));
+    s_fs->p = p;
 
     s_fs->s.load = fs_load;
     s_fs->s.save = fs_save;
@@ -197,7 +303,12 @@ apr_status_t md_store_fs_init(md_store_t **pstore, apr_pool_t *p, const char *pa
     s_fs->s.move = fs_move;
     s_fs->s.purge = fs_purge;
     s_fs->s.iterate = fs_iterate;
+    s_fs->s.names = fs_names;
     s_fs->s.get_fname = fs_get_fname;
+    s_fs->s.txn_begin = fs_txn_begin;
+    s_fs->s.sync = fs_sync;
+    s_fs->s.changed_names = fs_changed_names;
+    s_fs->s.lease_acquire = fs_lease_acquire;
     
     /* by default, everything is only readable by the current user */ 
     s_fs->def_perms.dir = MD_FPROT_D_UONLY;
@@ -214,6 +325,21 @@ apr_status_t md_store_fs_init(md_store_t **pstore, apr_pool_t *p, const char *pa
     s_fs->group_perms[MD_SG_CHALLENGES].file = MD_FPROT_F_UALL_WREAD;
 
     s_fs->base = apr_pstrdup(p, path);
+    s_fs->locks = apr_hash_make(p);
+#if APR_HAS_THREADS
+    if (APR_SUCCESS != (rv = apr_thread_mutex_create(&s_fs->lock_mutex, 
+                                                     APR_THREAD_MUTEX_DEFAULT, p))) {
+        *pstore = NULL;
+        return rv;
+    }
+#endif
+#ifdef FS_LOCK_PROC_MUTEX
+    if (APR_SUCCESS != (rv = apr_thread_mutex_create(&s_fs->lock_proc_mutex, 
+                                                     APR_THREAD_MUTEX_NESTED, p))) {
+        *pstore = NULL;
+        return rv;
+    }
+#endif
     
     if (APR_SUCCESS != (rv = md_util_is_dir(s_fs->base, p))) {
         if (APR_STATUS_IS_ENOENT(rv)) {
@@ -228,6 +354,18 @@ apr_status_t md_store_fs_init(md_store_t **pstore, apr_pool_t *p, const char *pa
     }
     rv = md_util_pool_vdo(setup_store_file, s_fs, p, NULL);
     
+    /* once someone journals the store, all writers need to */
+    s_fs->journal_max = FS_JOURNAL_MAX;
+    if (APR_SUCCESS == rv 
+        && APR_SUCCESS == md_util_path_merge(&fpath, p, s_fs->base, FS_JOURNAL, NULL)) {
+        s_fs->journal = (APR_SUCCESS == md_util_is_file(fpath, p));
+    }
+    if (APR_SUCCESS == rv) {
+        /* put back what a commit interrupted by a crash had moved away */
+        md_util_pool_vdo(txn_sweep_all, s_fs, p, NULL);
+        md_util_tree_do(tmp_sweep, NULL, p, s_fs->base, 0);
+    }
+    
     if (APR_SUCCESS != rv) {
         md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "init fs store at %s", path);
     }
@@ -317,6 +455,425 @@ static void get_pass(const char **ppass, apr_size_t *plen,
     }
 }
  
+/**************************************************************************************************/
+/* binary cache for certificates and chains */
+
+/* Next to a cert/chain PEM file, the store may keep "<file>.der" with the DER encodings
+ * of the certificates. It is written when the PEM is saved, under the MD's write lock, and
+ * starts with a line recording the size, modification time and inode of the PEM file it
+ * was made from. Loading only stats the PEM and ignores the DER file when that no longer
+ * matches. As PEM files are always replaced by a rename, any change gives a new inode.
+ * Each certificate then follows either inline ("i <len>\n<der>") or, for chain members,
+ * as a reference to a blob shared by all MDs ("r <sha256 hex>\n" in FS_DER_DIR). A blob
+ * is checked against its name when read.
+ */
+#define FS_DER_DIR          "der"
+#define FS_DER_EXT          ".der"
+#define FS_DER_MAGIC        "mdder3"
+
+static apr_status_t fs_fread_all(const char **pdata, apr_size_t *plen, 
+                                 const char *fpath, apr_pool_t *p)
+{
+    apr_file_t *f;
+    apr_finfo_t info;
+    apr_status_t rv;
+    char *data;
+    
+    if (APR_SUCCESS == (rv = apr_file_open(&f, fpath, APR_FOPEN_READ|APR_FOPEN_BINARY, 0, p))) {
+        if (APR_SUCCESS == (rv = apr_file_info_get(&info, APR_FINFO_SIZE, f))) {
+            data = apr_palloc(p, (apr_size_t)info.size + 1);
+            rv = apr_file_read_full(f, data, (apr_size_t)info.size, plen);
+            data[*plen] = '\0';
+            *pdata = data;
+        }
+        apr_file_close(f);
+    }
+    return rv;
+}
+
+/* The stamp of the PEM file a DER file is valid for */
+static apr_status_t der_stamp(const char **pstamp, const char *fpath, apr_pool_t *p)
+{
+    apr_finfo_t info;
+    apr_status_t rv;
+    
+    rv = apr_stat(&info, fpath, APR_FINFO_SIZE|APR_FINFO_MTIME|APR_FINFO_INODE, p);
+    if (APR_SUCCESS == rv) {
+        *pstamp = apr_psprintf(p, "%" APR_OFF_T_FMT " %" APR_TIME_T_FMT " %" APR_UINT64_T_FMT, 
+                               info.size, info.mtime, (apr_uint64_t)info.inode);
+    }
+    /* APR_INCOMPLETE where there are no inodes, no cache then */
+    return rv;
+}
+
+static apr_status_t der_blob_path(const char **ppath, md_store_fs_t *s_fs, 
+                                  const char *hex, apr_pool_t *p)
+{
+    return md_util_path_merge(ppath, p, s_fs->base, FS_DER_DIR, 
+                              apr_pstrcat(p, hex, FS_DER_EXT, NULL), NULL);
+}
+
+static apr_status_t der_blob_get(const char **pder, apr_size_t *pder_len, 
+                                 md_store_fs_t *s_fs, const char *hex, apr_pool_t *ptemp)
+{
+    const char *fpath, *digest, *der = NULL;
+    apr_size_t *plen, der_len = 0;
+    apr_status_t rv = APR_SUCCESS;
+
+    /* intermediates are few and shared by many MDs, keep them in memory once read */
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(s_fs->der_mutex);
+#endif
+    if ((plen = apr_hash_get(s_fs->der_blobs, hex, APR_HASH_KEY_STRING))) {
+        /* copied, the table may be dropped once we let go of the mutex */
+        der_len = *plen;
+        der = apr_pmemdup(ptemp, plen + 1, der_len);
+    }
+    else if (APR_SUCCESS == (rv = der_blob_path(&fpath, s_fs, hex, ptemp))
+             && APR_SUCCESS == (rv = fs_fread_all(&der, &der_len, fpath, ptemp))
+             && APR_SUCCESS == (rv = md_crypt_sha256_digest_hex(&digest, ptemp, der, der_len))) {
+        if (strcmp(hex, digest)) {
+            /* damaged, remove it so that the next DER write makes it anew */
+            md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, 0, ptemp, 
+                          "DER blob %s does not match its digest, removing", fpath);
+            apr_file_remove(fpath, ptemp);
+            der = NULL;
+            der_len = 0;
+            rv = APR_EINVAL;
+            goto leave;
+        }
+        plen = apr_palloc(s_fs->der_pool, sizeof(*plen) + der_len);
+        *plen = der_len;
+        memcpy(plen + 1, der, der_len);
+        apr_hash_set(s_fs->der_blobs, apr_pstrdup(s_fs->der_pool, hex), 
+                     APR_HASH_KEY_STRING, plen);
+    }
+leave:
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(s_fs->der_mutex);
+#endif
+    *pder = der;
+    *pder_len = der_len;
+    return rv;
+}
+
+static apr_status_t der_read(apr_array_header_t **pcerts, md_store_fs_t *s_fs, 
+                             const char *dpath, const char *stamp, 
+                             apr_pool_t *p, apr_pool_t *ptemp)
+{
+    apr_array_header_t *certs;
+    const char *data, *end, *der;
+    char *line, *last, *kind, *arg;
+    apr_size_t len, der_len;
+    apr_status_t rv;
+    md_cert_t *cert;
+    
+    if (APR_SUCCESS != (rv = fs_fread_all(&data, &len, dpath, ptemp))) {
+        return rv;
+    }
+    end = data + len;
+    if (!(last = memchr(data, '\n', len))) {
+        return APR_EINVAL;
+    }
+    line = apr_pstrmemdup(ptemp, data, (apr_size_t)(last - data));
+    if (strcmp(line, apr_pstrcat(ptemp, FS_DER_MAGIC " ", stamp, NULL))) {
+        /* made from another PEM version */
+        return APR_ENOENT;
+    }
+    data = last + 1;
+    
+    certs = apr_array_make(p, 5, sizeof(md_cert_t *));
+    while (data < end) {
+        if (!(last = memchr(data, '\n', (apr_size_t)(end - data)))) {
+            return APR_EINVAL;
+        }
+        line = apr_pstrmemdup(ptemp, data, (apr_size_t)(last - data));
+        data = last + 1;
+        kind = apr_strtok(line, " ", &last);
+        arg = apr_strtok(NULL, " ", &last);
+        if (!kind || !arg) {
+            return APR_EINVAL;
+        }
+        if (!strcmp("i", kind)) {
+            der_len = (apr_size_t)apr_atoi64(arg);
+            if (der_len > (apr_size_t)(end - data)) {
+                return APR_EINVAL;
+            }
+            der = data;
+            data += der_len;
+            rv = md_cert_from_der(&cert, p, der, der_len);
+        }
+        else if (!strcmp("r", kind)) {
+            if (APR_SUCCESS != (rv = der_blob_get(&der, &der_len, s_fs, arg, ptemp))) {
+                return rv;
+            }
+            rv = md_cert_intern_der(&cert, p, der, der_len);
+        }
+        else {
+            return APR_EINVAL;
+        }
+        if (APR_SUCCESS != rv) {
+            return rv;
+        }
+        APR_ARRAY_PUSH(certs, md_cert_t *) = cert;
+    }
+    *pcerts = certs;
+    return APR_SUCCESS;
+}
+
+typedef struct {
+    const char *data;
+    apr_size_t len;
+} der_buffer;
+
+static apr_status_t der_fwrite(void *baton, apr_file_t *f, apr_pool_t *p)
+{
+    der_buffer *buf = baton;
+    apr_size_t written;
+    return apr_file_write_full(f, buf->data, buf->len, &written);
+}
+
+static void der_add(apr_array_header_t *parts, const char *data, apr_size_t len)
+{
+    der_buffer *part = apr_array_push(parts);
+    part->data = data;
+    part->len = len;
+}
+
+static apr_status_t der_write(md_store_fs_t *s_fs, md_store_group_t group, const char *dpath, 
+                              const char *stamp, apr_array_header_t *certs, 
+                              int shared, apr_pool_t *ptemp)
+{
+    apr_array_header_t *parts;
+    const char *der, *hex, *bdir, *bpath, *s;
+    der_buffer buf, *part;
+    apr_size_t der_len;
+    apr_status_t rv;
+    char *cp;
+    int i;
+    
+    parts = apr_array_make(ptemp, 5, sizeof(der_buffer));
+    s = apr_pstrcat(ptemp, FS_DER_MAGIC " ", stamp, "\n", NULL);
+    der_add(parts, s, strlen(s));
+        
+    for (i = 0; i < certs->nelts; ++i) {
+        rv = md_cert_to_der(&der, &der_len, APR_ARRAY_IDX(certs, i, const md_cert_t *), ptemp);
+        if (APR_SUCCESS != rv) {
+            return rv;
+        }
+        if (shared) {
+            if (APR_SUCCESS != (rv = md_crypt_sha256_digest_hex(&hex, ptemp, der, der_len))
+                || APR_SUCCESS != (rv = der_blob_path(&bpath, s_fs, hex, ptemp))) {
+                return rv;
+            }
+            if (APR_SUCCESS != md_util_is_file(bpath, ptemp)) {
+                buf.data = der;
+                buf.len = der_len;
+                if (APR_SUCCESS != (rv = md_util_path_merge(&bdir, ptemp, s_fs->base, 
+                                                            FS_DER_DIR, NULL))
+                    || APR_SUCCESS != (rv = apr_dir_make_recursive(bdir, s_fs->def_perms.dir, 
+                                                                   ptemp))
+                    || APR_SUCCESS != (rv = md_util_freplace(bpath, s_fs->def_perms.file, 
+                                                             ptemp, der_fwrite, &buf))) {
+                    return rv;
+                }
+            }
+            s = apr_psprintf(ptemp, "r %s\n", hex);
+            der_add(parts, s, strlen(s));
+        }
+        else {
+            s = apr_psprintf(ptemp, "i %" APR_SIZE_T_FMT "\n", der_len);
+            der_add(parts, s, strlen(s));
+            der_add(parts, der, der_len);
+        }
+    }
+    
+    buf.len = 0;
+    for (i = 0; i < parts->nelts; ++i) {
+        buf.len += APR_ARRAY_IDX(parts, i, der_buffer).len;
+    }
+    buf.data = cp = apr_palloc(ptemp, buf.len);
+    for (i = 0; i < parts->nelts; ++i) {
+        part = &APR_ARRAY_IDX(parts, i, der_buffer);
+        memcpy(cp, part->data, part->len);
+        cp += part->len;
+    }
+    return md_util_freplace(dpath, gperms(s_fs, group)->file, ptemp, der_fwrite, &buf);
+}
+
+static apr_status_t fs_fload_der(apr_array_header_t **pcerts, md_store_fs_t *s_fs, 
+                                 const char *fpath, md_store_vtype_t vtype, 
+                                 apr_pool_t *p, apr_pool_t *ptemp)
+{
+    apr_array_header_t *certs;
+    const char *stamp;
+    md_cert_t *cert;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS == der_stamp(&stamp, fpath, ptemp)
+        && APR_SUCCESS == der_read(pcerts, s_fs, apr_pstrcat(ptemp, fpath, FS_DER_EXT, NULL), 
+                                   stamp, p, ptemp)) {
+        return APR_SUCCESS;
+    }
+    
+    /* no usable cache, go for the PEM. The next save of it makes the cache anew. */
+    if (MD_SV_CERT == vtype) {
+        if (APR_SUCCESS == (rv = md_cert_fload(&cert, p, fpath))) {
+            certs = apr_array_make(p, 1, sizeof(md_cert_t *));
+            APR_ARRAY_PUSH(certs, md_cert_t *) = cert;
+            *pcerts = certs;
+        }
+        return rv;
+    }
+    return md_chain_fload(pcerts, p, fpath);
+}
+
+/* Write the DER file for the PEM just saved at 'fpath'. The cache is an optimization,
+ * failing to write it leaves the PEM to be loaded. */
+static void der_save(md_store_fs_t *s_fs, md_store_group_t group, const char *fpath, 
+                     md_store_vtype_t vtype, void *value, apr_pool_t *ptemp)
+{
+    apr_array_header_t *certs;
+    const char *stamp, *dpath;
+    apr_status_t rv;
+    
+    if (MD_SV_CERT == vtype) {
+        certs = apr_array_make(ptemp, 1, sizeof(md_cert_t *));
+        APR_ARRAY_PUSH(certs, md_cert_t *) = value;
+    }
+    else {
+        certs = value;
+    }
+    dpath = apr_pstrcat(ptemp, fpath, FS_DER_EXT, NULL);
+    if (APR_SUCCESS == (rv = der_stamp(&stamp, fpath, ptemp))) {
+        rv = der_write(s_fs, group, dpath, stamp, certs, (MD_SV_CHAIN == vtype), ptemp);
+    }
+    if (APR_SUCCESS != rv && !APR_STATUS_IS_INCOMPLETE(rv)) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, ptemp, "writing DER cache %s", dpath);
+    }
+}
+
+static apr_status_t der_remove(const char *fpath, apr_pool_t *ptemp)
+{
+    apr_status_t rv;
+    
+    rv = apr_file_remove(apr_pstrcat(ptemp, fpath, FS_DER_EXT, NULL), ptemp);
+    return APR_STATUS_IS_ENOENT(rv)? APR_SUCCESS : rv;
+}
+
+/* Shared blobs stay when the last DER file referring to them is gone. Collecting them
+ * looks at the DER files of all MD directories. A DER file that was packed into an 
+ * archive tarball and lost its blob just makes a load fall back to the PEM. */
+static apr_status_t der_refs_add(void *baton, apr_pool_t *p, apr_pool_t *ptemp, 
+                                 const char *dir, const char *name, apr_filetype_e ftype)
+{
+    apr_hash_t *refs = baton;
+    const char *fpath, *data, *end, *hex;
+    char *nl;
+    apr_size_t len, der_len;
+    apr_status_t rv;
+    
+    if (APR_REG != ftype) {
+        return APR_SUCCESS;
+    }
+    if (APR_SUCCESS != (rv = md_util_path_merge(&fpath, ptemp, dir, name, NULL))
+        || APR_SUCCESS != (rv = fs_fread_all(&data, &len, fpath, ptemp))) {
+        /* a reference we cannot see must not make us remove its blob */
+        return APR_STATUS_IS_ENOENT(rv)? APR_SUCCESS : rv;
+    }
+    end = data + len;
+    if (!(nl = memchr(data, '\n', len))) {
+        return APR_SUCCESS;
+    }
+    data = nl + 1;
+    while (data + 2 < end && (nl = memchr(data, '\n', (apr_size_t)(end - data)))) {
+        if (!strncmp("r ", data, 2)) {
+            hex = apr_pstrmemdup(p, data + 2, (apr_size_t)(nl - data - 2));
+            apr_hash_set(refs, hex, APR_HASH_KEY_STRING, hex);
+            data = nl + 1;
+        }
+        else if (!strncmp("i ", data, 2)) {
+            der_len = (apr_size_t)apr_atoi64(apr_pstrmemdup(ptemp, data + 2, 
+                                                           (apr_size_t)(nl - data - 2)));
+            data = nl + 1;
+            if (der_len > (apr_size_t)(end - data)) {
+                break;
+            }
+            data += der_len;
+        }
+        else {
+            break;
+        }
+    }
+    return APR_SUCCESS;
+}
+
+/* Remove the blobs no DER file refers to that are older than 'min_age'. A younger one
+ * may just have been written by someone about to refer to it. */
+static apr_status_t der_gc(md_store_fs_t *s_fs, apr_interval_time_t min_age, 
+                           int *premoved, apr_pool_t *ptemp)
+{
+    apr_hash_t *refs;
+    apr_dir_t *d;
+    apr_finfo_t entry;
+    const char *dir, *fpath, *hex;
+    apr_size_t len, elen = sizeof(FS_DER_EXT) - 1;
+    apr_time_t now = apr_time_now();
+    apr_status_t rv;
+    
+    *premoved = 0;
+    if (APR_SUCCESS != (rv = md_util_path_merge(&dir, ptemp, s_fs->base, FS_DER_DIR, NULL))) {
+        return rv;
+    }
+    if (APR_SUCCESS != (rv = apr_dir_open(&d, dir, ptemp))) {
+        return APR_STATUS_IS_ENOENT(rv)? APR_SUCCESS : rv;
+    }
+    refs = apr_hash_make(ptemp);
+    rv = md_util_files_do(der_refs_add, refs, ptemp, s_fs->base, "*", "*", "*" FS_DER_EXT, NULL);
+    if (APR_SUCCESS != rv) {
+        apr_dir_close(d);
+        return rv;
+    }
+    while (APR_SUCCESS == apr_dir_read(&entry, APR_FINFO_NAME|APR_FINFO_TYPE|APR_FINFO_MTIME, d)) {
+        len = strlen(entry.name);
+        if (APR_REG != entry.filetype || len <= elen 
+            || strcmp(FS_DER_EXT, entry.name + len - elen)) {
+            continue;
+        }
+        hex = apr_pstrmemdup(ptemp, entry.name, len - elen);
+        if (apr_hash_get(refs, hex, APR_HASH_KEY_STRING) || now - entry.mtime < min_age) {
+            continue;
+        }
+        if (APR_SUCCESS == md_util_path_merge(&fpath, ptemp, dir, entry.name, NULL)
+            && APR_SUCCESS == apr_file_remove(fpath, ptemp)) {
+            ++(*premoved);
+        }
+    }
+    apr_dir_close(d);
+    return APR_SUCCESS;
+}
+
+apr_status_t md_store_fs_der_cache_set(md_store_t *store, int enabled)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    apr_status_t rv = APR_SUCCESS;
+    
+    if (enabled && !s_fs->der_blobs) {
+        if (APR_SUCCESS != (rv = apr_pool_create(&s_fs->der_pool, s_fs->p))) {
+            return rv;
+        }
+#if APR_HAS_THREADS
+        rv = apr_thread_mutex_create(&s_fs->der_mutex, APR_THREAD_MUTEX_DEFAULT, s_fs->p);
+        if (APR_SUCCESS != rv) {
+            return rv;
+        }
+#endif
+        s_fs->der_blobs = apr_hash_make(s_fs->der_pool);
+    }
+    s_fs->der_cache = enabled;
+    return rv;
+}
+
 static apr_status_t fs_fload(void **pvalue, md_store_fs_t *s_fs, const char *fpath, 
                              md_store_group_t group, md_store_vtype_t vtype, 
                              apr_pool_t *p, apr_pool_t *ptemp)
@@ -334,6 +891,14 @@ static apr_status_t fs_fload(void **pvalue, md_store_fs_t *s_fs, const char *fpa
                 rv = md_json_readf((md_json_t **)pvalue, p, fpath);
                 break;
             case MD_SV_CERT:
+                if (s_fs->der_cache) {
+                    apr_array_header_t *certs;
+                    if (APR_SUCCESS == (rv = fs_fload_der(&certs, s_fs, fpath, vtype, 
+                                                          p, ptemp))) {
+                        *pvalue = APR_ARRAY_IDX(certs, 0, md_cert_t *);
+                    }
+                    break;
+                }
                 rv = md_cert_fload((md_cert_t **)pvalue, p, fpath);
                 break;
             case MD_SV_PKEY:
@@ -341,7 +906,10 @@ static apr_status_t fs_fload(void **pvalue, md_store_fs_t *s_fs, const char *fpa
                 rv = md_pkey_fload((md_pkey_t **)pvalue, p, pass, pass_len, fpath);
                 break;
             case MD_SV_CHAIN:
-                rv = md_chain_fload((apr_array_header_t **)pvalue, p, fpath);
+                rv = (s_fs->der_cache? 
+                      fs_fload_der((apr_array_header_t **)pvalue, s_fs, fpath, vtype, 
+                                   p, ptemp)
+                      : md_chain_fload((apr_array_header_t **)pvalue, p, fpath));
                 break;
             default:
                 rv = APR_ENOTIMPL;
@@ -378,12 +946,173 @@ static apr_status_t pfs_load(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_l
     return rv;
 }
 
+/**************************************************************************************************/
+/* durability */
+
+/* Strict mode syncs every file before it is renamed into place and every changed 
+ * directory right away. Batched mode collects the changed directories and syncs them 
+ * at the end of a commit window: with one syncfs() of the store where available, 
+ * otherwise with an fsync() of each directory and the files in it. Transactions 
+ * are synced on commit in both modes.
+ */
+
+static apr_status_t sync_dir(const char *dir, apr_pool_t *ptemp)
+{
+    apr_dir_t *d;
+    apr_finfo_t entry;
+    const char *fpath;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS != (rv = apr_dir_open(&d, dir, ptemp))) {
+        return APR_STATUS_IS_ENOENT(rv)? APR_SUCCESS : rv;
+    }
+    while (APR_SUCCESS == apr_dir_read(&entry, APR_FINFO_NAME|APR_FINFO_TYPE, d)) {
+        if (APR_REG == entry.filetype
+            && APR_SUCCESS == md_util_path_merge(&fpath, ptemp, dir, entry.name, NULL)
+            && APR_SUCCESS != (rv = md_util_fsync_path(fpath, ptemp))) {
+            break;
+        }
+        rv = APR_SUCCESS;
+    }
+    apr_dir_close(d);
+    if (APR_SUCCESS == rv) {
+        rv = md_util_fsync_path(dir, ptemp);
+    }
+    return APR_STATUS_IS_ENOENT(rv)? APR_SUCCESS : rv;
+}
+
+/* Needs to be called with sync_mutex held. */
+static apr_status_t sync_flush(md_store_fs_t *s_fs, apr_pool_t *ptemp)
+{
+    apr_hash_index_t *hi;
+    const void *dir;
+    apr_status_t rv, rv2;
+    
+    if (!s_fs->sync_start) {
+        return APR_SUCCESS;
+    }
+    rv = md_util_syncfs(s_fs->base, ptemp);
+    if (APR_STATUS_IS_ENOTIMPL(rv)) {
+        rv = APR_SUCCESS;
+        for (hi = apr_hash_first(ptemp, s_fs->sync_dirs); hi; hi = apr_hash_next(hi)) {
+            apr_hash_this(hi, &dir, NULL, NULL);
+            if (APR_SUCCESS != (rv2 = sync_dir(dir, ptemp))) {
+                md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv2, ptemp, "syncing %s", 
+                              (const char *)dir);
+                rv = rv2;
+            }
+        }
+    }
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ptemp, "synced %d directories, window of %"
+                  APR_TIME_T_FMT "ms", (int)apr_hash_count(s_fs->sync_dirs), 
+                  apr_time_as_msec(apr_time_now() - s_fs->sync_start));
+    apr_hash_clear(s_fs->sync_dirs);
+    apr_pool_clear(s_fs->sync_pool);
+    s_fs->sync_start = 0;
+    return rv;
+}
+
+/* Record that entries of 'dir', or the content of files in it, have changed. */
+static apr_status_t sync_mark(md_store_fs_t *s_fs, const char *dir, apr_pool_t *ptemp)
+{
+    apr_status_t rv = APR_SUCCESS;
+    apr_time_t now;
+    
+    switch (s_fs->sync_mode) {
+        case MD_S_FS_SYNC_STRICT:
+            rv = md_util_fsync_path(dir, ptemp);
+            break;
+        case MD_S_FS_SYNC_BATCHED:
+#if APR_HAS_THREADS
+            apr_thread_mutex_lock(s_fs->sync_mutex);
+#endif
+            if (!apr_hash_get(s_fs->sync_dirs, dir, APR_HASH_KEY_STRING)) {
+                dir = apr_pstrdup(s_fs->sync_pool, dir);
+                apr_hash_set(s_fs->sync_dirs, dir, APR_HASH_KEY_STRING, dir);
+            }
+            now = apr_time_now();
+            if (!s_fs->sync_start) {
+                s_fs->sync_start = now;
+            }
+            else if (now - s_fs->sync_start >= s_fs->sync_window) {
+                rv = sync_flush(s_fs, ptemp);
+            }
+#if APR_HAS_THREADS
+            apr_thread_mutex_unlock(s_fs->sync_mutex);
+#endif
+            break;
+        default:
+            break;
+    }
+    return rv;
+}
+
+static apr_status_t fs_sync(md_store_t *store, apr_pool_t *p)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    apr_pool_t *ptemp;
+    apr_status_t rv;
+    
+    if (MD_S_FS_SYNC_BATCHED != s_fs->sync_mode) {
+        return APR_SUCCESS;
+    }
+    if (APR_SUCCESS != (rv = apr_pool_create(&ptemp, p))) {
+        return rv;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(s_fs->sync_mutex);
+#endif
+    rv = sync_flush(s_fs, ptemp);
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(s_fs->sync_mutex);
+#endif
+    apr_pool_destroy(ptemp);
+    return rv;
+}
+
+static apr_status_t sync_cleanup(void *data)
+{
+    md_store_fs_t *s_fs = data;
+    
+    /* do not lose the last commit window when the store goes away */
+    fs_sync(&s_fs->s, s_fs->p);
+    return APR_SUCCESS;
+}
+
+apr_status_t md_store_fs_durability_set(md_store_t *store, md_store_fs_sync_t mode,
+                                        apr_interval_time_t window)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    apr_status_t rv = APR_SUCCESS;
+    
+    if (MD_S_FS_SYNC_BATCHED == mode && !s_fs->sync_pool) {
+        if (APR_SUCCESS != (rv = apr_pool_create(&s_fs->sync_pool, s_fs->p))) {
+            return rv;
+        }
+        apr_pool_tag(s_fs->sync_pool, "md_store_fs_sync");
+#if APR_HAS_THREADS
+        rv = apr_thread_mutex_create(&s_fs->sync_mutex, APR_THREAD_MUTEX_DEFAULT, s_fs->p);
+        if (APR_SUCCESS != rv) {
+            return rv;
+        }
+#endif
+        s_fs->sync_dirs = apr_hash_make(s_fs->p);
+        apr_pool_cleanup_register(s_fs->p, s_fs, sync_cleanup, apr_pool_cleanup_null);
+    }
+    else if (MD_S_FS_SYNC_BATCHED == s_fs->sync_mode && MD_S_FS_SYNC_BATCHED != mode) {
+        /* nothing may stay pending when leaving batched mode */
+        rv = fs_sync(store, s_fs->p);
+    }
+    s_fs->sync_mode = mode;
+    s_fs->sync_window = window;
+    return rv;
+}
+
 static apr_status_t dispatch(md_store_fs_t *s_fs, md_store_fs_ev_t ev, int group, 
                              const char *fname, apr_filetype_e ftype, apr_pool_t *p)
 {
     if (s_fs->event_cb) {
-        return s_fs->event_cb(s_fs->event_baton, &s_fs->s, MD_S_FS_EV_CREATED, 
-                              group, fname, ftype, p);
+        return s_fs->event_cb(s_fs->event_baton, &s_fs->s, ev, group, fname, ftype, p);
     }
     return APR_SUCCESS;
 }
@@ -393,6 +1122,7 @@ static apr_status_t mk_group_dir(const char **pdir, md_store_fs_t *s_fs,
                                  apr_pool_t *p)
 {
     const perms_t *perms;
+    const char *gdir;
     apr_status_t rv;
     
     perms = gperms(s_fs, group);
@@ -403,6 +1133,10 @@ static apr_status_t mk_group_dir(const char **pdir, md_store_fs_t *s_fs,
             if (APR_SUCCESS == (rv = apr_dir_make_recursive(*pdir, perms->dir, p))) {
                 rv = dispatch(s_fs, MD_S_FS_EV_CREATED, group, *pdir, APR_DIR, p);
             }
+            if (APR_SUCCESS == rv && name
+                && APR_SUCCESS == (rv = fs_get_dname(&gdir, &s_fs->s, group, NULL, p))) {
+                rv = sync_mark(s_fs, gdir, p);
+            }
         }
         else {
             /* already exists */
@@ -421,307 +1155,2964 @@ static apr_status_t mk_group_dir(const char **pdir, md_store_fs_t *s_fs,
 }
  
  
+/**************************************************************************************************/
+/* locking */
+
+/* Writers of an MD hold an exclusive lock on "locks/<group>/<name>.lock". The lock files
+ * are kept apart from the MD directories, as those get replaced by renames. Open file
+ * description locks are used where available, they also keep threads of the same 
+ * process apart. Plain fcntl() locks do not, and closing any descriptor of a lock file
+ * drops them for the whole process. There, a nested mutex lets only one thread at a
+ * time hold store locks. A thread's nested locks on an MD are granted by its 
+ * outermost one.
+ */
+#define FS_LOCK_DIR         "locks"
+#define FS_LOCK_EXT         ".lock"
+#define FS_LOCK_TIMEOUT     apr_time_from_sec(60)
+#define FS_LOCK_POLL_MAX    apr_time_from_msec(50)
+
+static void watch_own_begin(md_store_fs_t *s_fs, md_store_group_t group, const char *name,
+                            apr_pool_t *p);
+static void watch_own_end(md_store_fs_t *s_fs, md_store_group_t group, const char *name);
+
+struct md_store_fs_lock_t {
+    md_store_fs_t *s_fs;
+    apr_pool_t *p;
+    md_store_group_t group;
+    const char *name;
+    const char *fpath;
+    md_store_fs_lock_mode_t mode;
+    apr_file_t *f;              /* NULL when nested in an outer lock of the thread */
+#if APR_HAS_THREADS
+    apr_os_thread_t owner;
+#endif
+};
+
+static apr_status_t lock_try(apr_file_t *f, md_store_fs_lock_mode_t mode, int wait)
+{
+#ifdef WIN32
+    apr_status_t rv;
+    
+    rv = apr_file_lock(f, ((MD_S_FS_LOCK_SHARED == mode)? APR_FLOCK_SHARED : APR_FLOCK_EXCLUSIVE)
+                          | (wait? 0 : APR_FLOCK_NONBLOCK));
+    return APR_STATUS_IS_EAGAIN(rv)? APR_EAGAIN : rv;
+#else
+    struct flock fl;
+    apr_os_file_t fd;
+    apr_status_t rv;
+    int cmd;
+    
+    if (APR_SUCCESS != (rv = apr_os_file_get(&fd, f))) {
+        return rv;
+    }
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = (MD_S_FS_LOCK_SHARED == mode)? F_RDLCK : F_WRLCK;
+    fl.l_whence = SEEK_SET;
+#ifdef F_OFD_SETLK
+    cmd = wait? F_OFD_SETLKW : F_OFD_SETLK;
+#else
+    cmd = wait? F_SETLKW : F_SETLK;
+#endif
+    while (fcntl(fd, cmd, &fl) < 0) {
+        if (EINTR != errno) {
+            return (EAGAIN == errno || EACCES == errno)? APR_EAGAIN : errno;
+        }
+    }
+    return APR_SUCCESS;
+#endif
+}
+
+static apr_status_t lock_open(apr_file_t **pf, md_store_fs_t *s_fs, const char *fpath,
+                              md_store_group_t group, apr_pool_t *p)
+{
+    const char *dir;
+    apr_status_t rv;
+    
+    rv = apr_file_open(pf, fpath, APR_FOPEN_READ|APR_FOPEN_WRITE, 0, p);
+    if (!APR_STATUS_IS_ENOENT(rv)) {
+        return rv;
+    }
+    
+    if (APR_SUCCESS != (rv = md_util_path_merge(&dir, p, s_fs->base, FS_LOCK_DIR, NULL))
+        || APR_SUCCESS != (rv = apr_dir_make_recursive(dir, MD_FPROT_D_UALL_WREAD, p))
+        || APR_SUCCESS != (rv = md_util_path_merge(&dir, p, dir, md_store_group_name(group), 
+                                                   NULL))) {
+        return rv;
+    }
+    if (APR_SUCCESS != md_util_is_dir(dir, p)) {
+        if (APR_SUCCESS != (rv = apr_dir_make_recursive(dir, gperms(s_fs, group)->dir, p))
+            || APR_SUCCESS != (rv = dispatch(s_fs, MD_S_FS_EV_CREATED, group, dir, APR_DIR, p))) {
+            return rv;
+        }
+    }
+    rv = md_util_fcreatex(pf, fpath, gperms(s_fs, group)->file, p);
+    if (APR_SUCCESS == rv) {
+        /* whoever writes the group needs to be able to lock it */
+        return dispatch(s_fs, MD_S_FS_EV_LOCK_CREATED, group, fpath, APR_REG, p);
+    }
+    else if (APR_STATUS_IS_EEXIST(rv)) {
+        return apr_file_open(pf, fpath, APR_FOPEN_READ|APR_FOPEN_WRITE, 0, p);
+    }
+    return rv;
+}
+
+static void lock_stats_add(md_store_fs_t *s_fs, apr_status_t rv, int contended, 
+                           apr_interval_time_t waited)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(s_fs->lock_mutex);
+#endif
+    if (APR_SUCCESS == rv) {
+        ++s_fs->lock_stats.acquired;
+        if (contended) {
+            ++s_fs->lock_stats.contended;
+        }
+    }
+    else if (APR_TIMEUP == rv) {
+        ++s_fs->lock_stats.timeouts;
+    }
+    s_fs->lock_stats.wait_total += waited;
+    if (waited > s_fs->lock_stats.wait_max) {
+        s_fs->lock_stats.wait_max = waited;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(s_fs->lock_mutex);
+#endif
+}
+
+static apr_status_t lock_cleanup(void *data)
+{
+    md_store_fs_lock_t *lock = data;
+    md_store_fs_t *s_fs = lock->s_fs;
+    
+    if (lock->f) {
+#if APR_HAS_THREADS
+        apr_thread_mutex_lock(s_fs->lock_mutex);
+#endif
+        if (apr_hash_get(s_fs->locks, lock->fpath, APR_HASH_KEY_STRING) == lock) {
+            apr_hash_set(s_fs->locks, lock->fpath, APR_HASH_KEY_STRING, NULL);
+        }
+#if APR_HAS_THREADS
+        apr_thread_mutex_unlock(s_fs->lock_mutex);
+#endif
+        if (MD_S_FS_LOCK_EXCLUSIVE == lock->mode) {
+            watch_own_end(s_fs, lock->group, lock->name);
+        }
+        /* closing releases the lock */
+        apr_file_close(lock->f);
+        lock->f = NULL;
+#ifdef FS_LOCK_PROC_MUTEX
+        apr_thread_mutex_unlock(s_fs->lock_proc_mutex);
+#endif
+    }
+    return APR_SUCCESS;
+}
+
+#ifdef FS_LOCK_PROC_MUTEX
+/* Wait for the threads of this process that hold store locks, before a lock file is
+ * even opened. */
+static apr_status_t lock_proc_enter(md_store_fs_t *s_fs, apr_interval_time_t timeout,
+                                    int *pcontended)
+{
+    apr_time_t start = apr_time_now();
+    apr_interval_time_t delay, left;
+    apr_status_t rv;
+    
+    rv = apr_thread_mutex_trylock(s_fs->lock_proc_mutex);
+    if (!APR_STATUS_IS_EBUSY(rv)) {
+        return rv;
+    }
+    *pcontended = 1;
+    if (timeout < 0) {
+        return apr_thread_mutex_lock(s_fs->lock_proc_mutex);
+    }
+    delay = apr_time_from_msec(1);
+    while (APR_STATUS_IS_EBUSY(rv)) {
+        left = timeout - (apr_time_now() - start);
+        if (left <= 0) {
+            return APR_TIMEUP;
+        }
+        apr_sleep((delay < left)? delay : left);
+        delay = (2 * delay < FS_LOCK_POLL_MAX)? 2 * delay : FS_LOCK_POLL_MAX;
+        rv = apr_thread_mutex_trylock(s_fs->lock_proc_mutex);
+    }
+    return rv;
+}
+#endif
+
+/* Find the lock the calling thread already holds on 'fpath', if any. */
+static md_store_fs_lock_t *lock_held(md_store_fs_t *s_fs, const char *fpath)
+{
+    md_store_fs_lock_t *lock;
+    
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(s_fs->lock_mutex);
+#endif
+    lock = apr_hash_get(s_fs->locks, fpath, APR_HASH_KEY_STRING);
+#if APR_HAS_THREADS
+    if (lock && !apr_os_thread_equal(lock->owner, apr_os_thread_current())) {
+        lock = NULL;
+    }
+    apr_thread_mutex_unlock(s_fs->lock_mutex);
+#endif
+    return lock;
+}
+
+static apr_status_t fs_lock(md_store_fs_lock_t **plock, md_store_fs_t *s_fs, apr_pool_t *p, 
+                            md_store_group_t group, const char *name, 
+                            md_store_fs_lock_mode_t mode, apr_interval_time_t timeout)
+{
+    md_store_fs_lock_t *lock, *outer;
+    apr_time_t start;
+    apr_interval_time_t delay, left, waited = 0;
+    apr_status_t rv;
+    int contended = 0;
+    
+    *plock = NULL;
+    lock = apr_pcalloc(p, sizeof(*lock));
+    lock->s_fs = s_fs;
+    lock->p = p;
+    lock->group = group;
+    lock->name = apr_pstrdup(p, name);
+    lock->mode = mode;
+    rv = md_util_path_merge(&lock->fpath, p, s_fs->base, FS_LOCK_DIR, md_store_group_name(group),
+                            apr_pstrcat(p, name, FS_LOCK_EXT, NULL), NULL);
+    if (APR_SUCCESS != rv) {
+        return rv;
+    }
+    
+    if ((outer = lock_held(s_fs, lock->fpath))) {
+        if (MD_S_FS_LOCK_EXCLUSIVE == mode && MD_S_FS_LOCK_SHARED == outer->mode) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_ERR, APR_EINVAL, p, 
+                          "%s: upgrading a shared lock is not supported", lock->fpath);
+            return APR_EINVAL;
+        }
+        *plock = lock;
+        return APR_SUCCESS;
+    }
+    
+    start = apr_time_now();
+#ifdef FS_LOCK_PROC_MUTEX
+    if (APR_SUCCESS != (rv = lock_proc_enter(s_fs, timeout, &contended))) {
+        waited = apr_time_now() - start;
+        lock_stats_add(s_fs, rv, contended, waited);
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "%s: lock not granted after %"
+                      APR_TIME_T_FMT "ms", lock->fpath, apr_time_as_msec(waited));
+        return rv;
+    }
+#endif
+    if (APR_SUCCESS != (rv = lock_open(&lock->f, s_fs, lock->fpath, group, p))) {
+#ifdef FS_LOCK_PROC_MUTEX
+        apr_thread_mutex_unlock(s_fs->lock_proc_mutex);
+#endif
+        return rv;
+    }
+    rv = lock_try(lock->f, mode, 0);
+    if (APR_EAGAIN == rv) {
+        contended = 1;
+        if (timeout < 0) {
+            rv = lock_try(lock->f, mode, 1);
+        }
+        else {
+            /* fcntl() does not time out, poll with increasing delays */
+            delay = apr_time_from_msec(1);
+            while (APR_EAGAIN == rv) {
+                left = timeout - (apr_time_now() - start);
+                if (left <= 0) {
+                    rv = APR_TIMEUP;
+                    break;
+                }
+                apr_sleep((delay < left)? delay : left);
+                delay = (2 * delay < FS_LOCK_POLL_MAX)? 2 * delay : FS_LOCK_POLL_MAX;
+                rv = lock_try(lock->f, mode, 0);
+            }
+        }
+    }
+    if (contended) {
+        waited = apr_time_now() - start;
+    }
+    lock_stats_add(s_fs, rv, contended, waited);
+    
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "%s: lock not granted after %"
+                      APR_TIME_T_FMT "ms", lock->fpath, apr_time_as_msec(waited));
+        apr_file_close(lock->f);
+#ifdef FS_LOCK_PROC_MUTEX
+        apr_thread_mutex_unlock(s_fs->lock_proc_mutex);
+#endif
+        return rv;
+    }
+    if (contended) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, p, "%s: lock granted after %"
+                      APR_TIME_T_FMT "ms", lock->fpath, apr_time_as_msec(waited));
+    }
+    
+#if APR_HAS_THREADS
+    lock->owner = apr_os_thread_current();
+    apr_thread_mutex_lock(s_fs->lock_mutex);
+#endif
+    if (!apr_hash_get(s_fs->locks, lock->fpath, APR_HASH_KEY_STRING)) {
+        apr_hash_set(s_fs->locks, lock->fpath, APR_HASH_KEY_STRING, lock);
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(s_fs->lock_mutex);
+#endif
+    if (MD_S_FS_LOCK_EXCLUSIVE == mode) {
+        watch_own_begin(s_fs, group, lock->name, p);
+    }
+    apr_pool_cleanup_register(p, lock, lock_cleanup, apr_pool_cleanup_null);
+    *plock = lock;
+    return APR_SUCCESS;
+}
+
+/* Lock an MD for writing by the store. Where the lock file is not accessible to
+ * this process, e.g. a2md run by another user, the write goes ahead unlocked. */
+static apr_status_t fs_wlock(md_store_fs_t *s_fs, md_store_group_t group, const char *name,
+                             apr_pool_t *p)
+{
+    md_store_fs_lock_t *lock;
+    apr_status_t rv;
+    
+    rv = fs_lock(&lock, s_fs, p, group, name, MD_S_FS_LOCK_EXCLUSIVE, FS_LOCK_TIMEOUT);
+    if (APR_STATUS_IS_EACCES(rv)) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, p, "%s/%s: writing without lock", 
+                      md_store_group_name(group), name);
+        rv = APR_SUCCESS;
+    }
+    else if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "%s/%s: locking for write", 
+                      md_store_group_name(group), name);
+    }
+    return rv;
+}
+
+apr_status_t md_store_fs_lock(md_store_fs_lock_t **plock, md_store_t *store, 
+                              apr_pool_t *p, md_store_group_t group, const char *name,
+                              md_store_fs_lock_mode_t mode, apr_interval_time_t timeout)
+{
+    return fs_lock(plock, FS_STORE(store), p, group, name, mode, timeout);
+}
+
+void md_store_fs_unlock(md_store_fs_lock_t *lock)
+{
+    if (lock) {
+        apr_pool_cleanup_run(lock->p, lock, lock_cleanup);
+    }
+}
+
+void md_store_fs_lock_stats_get(md_store_fs_lock_stats_t *stats, md_store_t *store)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(s_fs->lock_mutex);
+#endif
+    *stats = s_fs->lock_stats;
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(s_fs->lock_mutex);
+#endif
+}
+
+/**************************************************************************************************/
+/* journal */
+
+/* With the journal on, every change to the store appends a line
+ *   "<seq> <op> <group> <name> <aspect>\n"
+ * to the journal file in the store base, while holding the journal lock. Sequence numbers
+ * count up by one per line, an aspect of "-" stands for all of the MD, a name of "-" for
+ * the group itself. The first line "mdjournal1 <seq>" has the number of the last change
+ * before the first one in the file. Beyond its maximum size, the journal is replaced by
+ * one with the newer half of its changes. A change that could not be appended empties
+ * the journal past all changes so far, or removes it, and readers start over.
+ * Readers take no lock: a line is appended in one write, a partial last line is not
+ * read and the file is only ever replaced by a rename.
+ */
+#define FS_JOURNAL_LOCK     "journal"
+#define FS_JOURNAL_MAGIC    "mdjournal1"
+#define FS_JOURNAL_LINE_MAX 1024
+#define FS_JOURNAL_SCAN     (4 * FS_JOURNAL_LINE_MAX)
+
+static const char FS_JOURNAL_OPS[] = "srpm";
+
+static apr_status_t journal_path(const char **ppath, md_store_fs_t *s_fs, apr_pool_t *p)
+{
+    return md_util_path_merge(ppath, p, s_fs->base, FS_JOURNAL, NULL);
+}
+
+static apr_status_t journal_read_at(const char **pdata, apr_size_t *plen, apr_file_t *f, 
+                                    apr_off_t off, apr_size_t max, apr_pool_t *p)
+{
+    char *buf;
+    apr_status_t rv;
+    
+    buf = apr_palloc(p, max + 1);
+    if (APR_SUCCESS != (rv = apr_file_seek(f, APR_SET, &off))) {
+        return rv;
+    }
+    rv = apr_file_read_full(f, buf, max, plen);
+    if (APR_STATUS_IS_EOF(rv)) {
+        rv = APR_SUCCESS;
+    }
+    buf[*plen] = '\0';
+    *pdata = buf;
+    return rv;
+}
+
+/* Parse the change in line 'line' of length 'len', without its newline. */
+static apr_status_t journal_parse(md_store_fs_change_t *change, const char *line, 
+                                  apr_size_t len, apr_pool_t *p)
+{
+    char *copy, *last, *seq, *op, *group, *name, *aspect;
+    const char *opc;
+    
+    copy = apr_pstrmemdup(p, line, len);
+    if (!(seq = apr_strtok(copy, " ", &last))
+        || !(op = apr_strtok(NULL, " ", &last))
+        || !(group = apr_strtok(NULL, " ", &last))
+        || !(name = apr_strtok(NULL, " ", &last))
+        || !(aspect = apr_strtok(NULL, " ", &last))
+        || !op[0] || !(opc = strchr(FS_JOURNAL_OPS, op[0]))) {
+        return APR_EINVAL;
+    }
+    change->seq = apr_atoi64(seq);
+    change->op = (md_store_fs_change_op_t)(opc - FS_JOURNAL_OPS);
+    change->group = (md_store_group_t)atoi(group);
+    change->name = strcmp("-", name)? name : NULL;
+    change->aspect = strcmp("-", aspect)? aspect : NULL;
+    return APR_SUCCESS;
+}
+
+static apr_status_t journal_header(apr_int64_t *pbase, apr_off_t *pend, apr_file_t *f,
+                                   apr_pool_t *p)
+{
+    const char *data, *nl;
+    apr_size_t len;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS != (rv = journal_read_at(&data, &len, f, 0, FS_JOURNAL_LINE_MAX, p))) {
+        return rv;
+    }
+    if (!(nl = memchr(data, '\n', len)) 
+        || strncmp(data, FS_JOURNAL_MAGIC " ", sizeof(FS_JOURNAL_MAGIC))) {
+        return APR_EINVAL;
+    }
+    *pbase = apr_atoi64(data + sizeof(FS_JOURNAL_MAGIC));
+    *pend = (apr_off_t)(nl - data) + 1;
+    return APR_SUCCESS;
+}
+
+/* Get the start of the first line starting at 'pos' or after it, 'size' if there is none.
+ * 'pos' is after the header. */
+static apr_status_t journal_line_after(apr_off_t *pstart, apr_file_t *f, apr_off_t pos, 
+                                       apr_off_t size, apr_pool_t *p)
+{
+    const char *data, *nl;
+    apr_size_t len;
+    apr_status_t rv;
+    
+    /* a line starts at pos when the one before ends right there */
+    if (APR_SUCCESS != (rv = journal_read_at(&data, &len, f, pos - 1, 
+                                             FS_JOURNAL_LINE_MAX + 1, p))) {
+        return rv;
+    }
+    *pstart = (nl = memchr(data, '\n', len))? pos + (apr_off_t)(nl - data) : size;
+    return APR_SUCCESS;
+}
+
+/* Get the sequence number of the line at 'start' */
+static apr_status_t journal_seq_at(apr_int64_t *pseq, apr_file_t *f, apr_off_t start, 
+                                   apr_pool_t *p)
+{
+    const char *data;
+    apr_size_t len;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS != (rv = journal_read_at(&data, &len, f, start, 32, p))) {
+        return rv;
+    }
+    *pseq = apr_atoi64(data);
+    return APR_SUCCESS;
+}
+
+/* Get the number of the last change in the journal and the size up to the end of its
+ * line. */
+static apr_status_t journal_last(apr_int64_t *pseq, apr_off_t *psize, apr_file_t *f, 
+                                 apr_pool_t *p)
+{
+    apr_finfo_t finfo;
+    apr_off_t hdr_end, off;
+    const char *data, *end, *start;
+    apr_size_t len;
+    apr_int64_t base;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS != (rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, f))
+        || APR_SUCCESS != (rv = journal_header(&base, &hdr_end, f, p))) {
+        return rv;
+    }
+    off = finfo.size - 2 * FS_JOURNAL_LINE_MAX;
+    if (off < hdr_end) {
+        off = hdr_end;
+    }
+    if (APR_SUCCESS != (rv = journal_read_at(&data, &len, f, off, 
+                                             (apr_size_t)(finfo.size - off), p))) {
+        return rv;
+    }
+    /* find the last complete line */
+    for (end = data + len; end > data && end[-1] != '\n'; --end);
+    *psize = off + (apr_off_t)(end - data);
+    if (end == data) {
+        *pseq = base;
+        return APR_SUCCESS;
+    }
+    for (start = end - 1; start > data && start[-1] != '\n'; --start);
+    *pseq = apr_atoi64(start);
+    return APR_SUCCESS;
+}
+
+static apr_status_t journal_create(md_store_fs_t *s_fs, apr_pool_t *p)
+{
+    const char *fpath, *header;
+    apr_file_t *f;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS != (rv = journal_path(&fpath, s_fs, p))) {
+        return rv;
+    }
+    rv = md_util_fcreatex(&f, fpath, s_fs->def_perms.file, p);
+    if (APR_STATUS_IS_EEXIST(rv)) {
+        return APR_SUCCESS;
+    }
+    else if (APR_SUCCESS != rv) {
+        return rv;
+    }
+    header = FS_JOURNAL_MAGIC " 0\n";
+    rv = apr_file_write_full(f, header, strlen(header), NULL);
+    apr_file_close(f);
+    if (APR_SUCCESS == rv) {
+        /* the journal is written by everyone writing the store */
+        rv = dispatch(s_fs, MD_S_FS_EV_CREATED, MD_SG_NONE, fpath, APR_REG, p);
+    }
+    return rv;
+}
+
+/* Replace the journal with one holding the newer half of its changes */
+static apr_status_t journal_rotate(md_store_fs_t *s_fs, const char *fpath, apr_file_t *f, 
+                                   apr_off_t size, apr_pool_t *ptemp)
+{
+    der_buffer buf;
+    const char *data;
+    apr_off_t hdr_end, cut;
+    apr_size_t len;
+    apr_int64_t base, seq;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS != (rv = journal_header(&base, &hdr_end, f, ptemp))
+        || APR_SUCCESS != (rv = journal_line_after(&cut, f, hdr_end + (size - hdr_end) / 2, 
+                                                   size, ptemp))) {
+        return rv;
+    }
+    if (cut >= size) {
+        return APR_SUCCESS;
+    }
+    if (APR_SUCCESS != (rv = journal_seq_at(&seq, f, cut, ptemp))
+        || APR_SUCCESS != (rv = journal_read_at(&data, &len, f, cut, 
+                                                (apr_size_t)(size - cut), ptemp))) {
+        return rv;
+    }
+    buf.data = apr_psprintf(ptemp, FS_JOURNAL_MAGIC " %" APR_INT64_T_FMT "\n%s", seq - 1, data);
+    buf.len = strlen(buf.data);
+    if (APR_SUCCESS == (rv = md_util_freplace(fpath, s_fs->def_perms.file, ptemp, 
+                                              der_fwrite, &buf))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, ptemp, "journal %s now starts after %" 
+                      APR_INT64_T_FMT, fpath, seq - 1);
+        rv = dispatch(s_fs, MD_S_FS_EV_CREATED, MD_SG_NONE, fpath, APR_REG, ptemp);
+    }
+    return rv;
+}
+
+static apr_status_t journal_append(md_store_fs_t *s_fs, md_store_fs_change_op_t op, 
+                                   md_store_group_t group, const char *name, 
+                                   const char *aspect, apr_pool_t *ptemp)
+{
+    md_store_fs_lock_t *lock;
+    const char *fpath, *line;
+    apr_file_t *f;
+    apr_off_t size, pos;
+    apr_int64_t seq;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS != (rv = journal_path(&fpath, s_fs, ptemp))
+        || APR_SUCCESS != (rv = fs_lock(&lock, s_fs, ptemp, MD_SG_NONE, FS_JOURNAL_LOCK, 
+                                        MD_S_FS_LOCK_EXCLUSIVE, FS_LOCK_TIMEOUT))) {
+        return rv;
+    }
+    rv = apr_file_open(&f, fpath, APR_FOPEN_READ|APR_FOPEN_WRITE|APR_FOPEN_BINARY, 0, ptemp);
+    if (APR_STATUS_IS_ENOENT(rv) && APR_SUCCESS == (rv = journal_create(s_fs, ptemp))) {
+        rv = apr_file_open(&f, fpath, APR_FOPEN_READ|APR_FOPEN_WRITE|APR_FOPEN_BINARY, 
+                           0, ptemp);
+    }
+    if (APR_SUCCESS != rv) {
+        goto unlock;
+    }
+    if (APR_SUCCESS != (rv = journal_last(&seq, &size, f, ptemp))) {
+        goto close;
+    }
+    /* drop a partial line left by a writer that failed */
+    pos = size;
+    if (APR_SUCCESS == (rv = apr_file_trunc(f, size))
+        && APR_SUCCESS == (rv = apr_file_seek(f, APR_SET, &pos))) {
+        line = apr_psprintf(ptemp, "%" APR_INT64_T_FMT " %c %d %s %s\n", seq + 1, 
+                            FS_JOURNAL_OPS[op], (int)group, name? name : "-", 
+                            aspect? aspect : "-");
+        rv = apr_file_write_full(f, line, strlen(line), NULL);
+        size += (apr_off_t)strlen(line);
+    }
+    if (APR_SUCCESS == rv && size > s_fs->journal_max) {
+        rv = journal_rotate(s_fs, fpath, f, size, ptemp);
+    }
+close:
+    apr_file_close(f);
+unlock:
+    md_store_fs_unlock(lock);
+    return rv;
+}
+
+/* Make readers of the journal miss no change, when one could not be appended. */
+static apr_status_t journal_invalidate(md_store_fs_t *s_fs, apr_pool_t *ptemp)
+{
+    md_store_fs_lock_t *lock;
+    der_buffer buf;
+    const char *fpath;
+    apr_file_t *f;
+    apr_off_t size;
+    apr_int64_t seq;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS != (rv = journal_path(&fpath, s_fs, ptemp))) {
+        return rv;
+    }
+    if (APR_SUCCESS == (rv = fs_lock(&lock, s_fs, ptemp, MD_SG_NONE, FS_JOURNAL_LOCK, 
+                                     MD_S_FS_LOCK_EXCLUSIVE, FS_LOCK_TIMEOUT))) {
+        if (APR_SUCCESS == (rv = apr_file_open(&f, fpath, APR_FOPEN_READ|APR_FOPEN_BINARY, 
+                                               0, ptemp))) {
+            rv = journal_last(&seq, &size, f, ptemp);
+            apr_file_close(f);
+        }
+        if (APR_SUCCESS == rv) {
+            /* all changes so far are now rotated out */
+            buf.data = apr_psprintf(ptemp, FS_JOURNAL_MAGIC " %" APR_INT64_T_FMT "\n", seq + 1);
+            buf.len = strlen(buf.data);
+            rv = md_util_freplace(fpath, s_fs->def_perms.file, ptemp, der_fwrite, &buf);
+        }
+        if (APR_SUCCESS == rv) {
+            rv = dispatch(s_fs, MD_S_FS_EV_CREATED, MD_SG_NONE, fpath, APR_REG, ptemp);
+        }
+        md_store_fs_unlock(lock);
+    }
+    if (APR_SUCCESS != rv) {
+        /* without a journal, readers do it all */
+        rv = apr_file_remove(fpath, ptemp);
+        if (APR_STATUS_IS_ENOENT(rv)) {
+            rv = APR_SUCCESS;
+        }
+    }
+    return rv;
+}
+
+/* Record a change made to the store. The change has been made, failing to record it
+ * is logged, but not reported to the caller. */
+static void journal_add(md_store_fs_t *s_fs, md_store_fs_change_op_t op, 
+                        md_store_group_t group, const char *name, const char *aspect, 
+                        apr_pool_t *ptemp)
+{
+    apr_status_t rv;
+    
+    if (!s_fs->journal) {
+        return;
+    }
+    if (APR_SUCCESS == (rv = journal_append(s_fs, op, group, name, aspect, ptemp))) {
+        return;
+    }
+    md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, ptemp, "%s/%s: change not journaled, "
+                  "readers of the journal will look at all of the store", 
+                  md_store_group_name(group), name? name : "-");
+    if (APR_SUCCESS != (rv = journal_invalidate(s_fs, ptemp))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ptemp, "%s/%s: invalidating the journal, "
+                      "changes may go unnoticed until a restart", 
+                      md_store_group_name(group), name? name : "-");
+    }
+}
+
+apr_status_t md_store_fs_journal_set(md_store_t *store, int enabled, apr_off_t max_size)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    apr_pool_t *ptemp;
+    apr_status_t rv = APR_SUCCESS;
+    
+    s_fs->journal_max = (max_size > 0)? max_size : FS_JOURNAL_MAX;
+    if (enabled && APR_SUCCESS == (rv = apr_pool_create(&ptemp, s_fs->p))) {
+        rv = journal_create(s_fs, ptemp);
+        apr_pool_destroy(ptemp);
+    }
+    s_fs->journal = (enabled && APR_SUCCESS == rv);
+    return rv;
+}
+
+static apr_status_t pfs_changes(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_fs_t *s_fs = baton;
+    apr_array_header_t **pchanges, *changes;
+    apr_int64_t *plast, since, base, seq;
+    md_store_fs_change_t *change;
+    const char *fpath, *data, *line, *nl;
+    apr_off_t hdr_end, size, lo, hi, mid, start;
+    apr_size_t len;
+    apr_file_t *f;
+    apr_status_t rv;
+    
+    pchanges = va_arg(ap, apr_array_header_t **);
+    plast = va_arg(ap, apr_int64_t *);
+    since = va_arg(ap, apr_int64_t);
+    
+    if (APR_SUCCESS != (rv = journal_path(&fpath, s_fs, ptemp))
+        || APR_SUCCESS != (rv = apr_file_open(&f, fpath, APR_FOPEN_READ|APR_FOPEN_BINARY, 
+                                              0, ptemp))
+        || APR_SUCCESS != (rv = journal_header(&base, &hdr_end, f, ptemp))
+        || APR_SUCCESS != (rv = journal_last(&seq, &size, f, ptemp))) {
+        return rv;
+    }
+    *plast = seq;
+    changes = apr_array_make(p, (seq > since && seq - since < 100)? (int)(seq - since) : 100, 
+                             sizeof(md_store_fs_change_t));
+    *pchanges = changes;
+    if (since < base || (since > seq && since != APR_INT64_MAX)) {
+        /* the changes after 'since' have been rotated out or the journal was removed
+         * and started anew */
+        return APR_INCOMPLETE;
+    }
+    if (since >= seq) {
+        return APR_SUCCESS;
+    }
+    
+    /* find a line start at or before the first change after 'since', close enough 
+     * to scan from there */
+    lo = hdr_end;
+    hi = size;
+    while (hi - lo > FS_JOURNAL_SCAN) {
+        mid = lo + (hi - lo) / 2;
+        if (APR_SUCCESS != (rv = journal_line_after(&start, f, mid, size, ptemp))
+            || APR_SUCCESS != (rv = journal_seq_at(&seq, f, start, ptemp))) {
+            return rv;
+        }
+        if (seq <= since) {
+            lo = start;
+        }
+        else {
+            hi = start;
+        }
+    }
+    
+    if (APR_SUCCESS != (rv = journal_read_at(&data, &len, f, lo, (apr_size_t)(size - lo), 
+                                             ptemp))) {
+        return rv;
+    }
+    for (line = data; line < data + len; line = nl + 1) {
+        if (!(nl = memchr(line, '\n', (apr_size_t)(data + len - line)))) {
+            break;
+        }
+        change = apr_array_push(changes);
+        if (APR_SUCCESS != (rv = journal_parse(change, line, (apr_size_t)(nl - line), p))) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, ptemp, "%s: invalid line at %"
+                          APR_OFF_T_FMT, fpath, lo + (apr_off_t)(line - data));
+            return rv;
+        }
+        if (change->seq <= since) {
+            apr_array_pop(changes);
+        }
+    }
+    return APR_SUCCESS;
+}
+
+apr_status_t md_store_fs_changes(apr_array_header_t **pchanges, apr_int64_t *plast, 
+                                 md_store_t *store, apr_int64_t since, apr_pool_t *p)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    
+    *pchanges = NULL;
+    *plast = since;
+    return md_util_pool_vdo(pfs_changes, s_fs, p, pchanges, plast, since, NULL);
+}
+
+static apr_status_t fs_changed_names(apr_array_header_t **pnames, apr_int64_t *plast, 
+                                     md_store_t *store, md_store_group_t group, 
+                                     apr_int64_t since, apr_pool_t *p)
+{
+    apr_array_header_t *changes, *names;
+    const md_store_fs_change_t *change;
+    apr_hash_t *seen;
+    apr_status_t rv;
+    int i;
+    
+    if (APR_SUCCESS != (rv = md_store_fs_changes(&changes, plast, store, since, p))) {
+        /* a store without journal does not record its changes */
+        return APR_STATUS_IS_ENOENT(rv)? APR_ENOTIMPL : rv;
+    }
+    names = apr_array_make(p, changes->nelts + 1, sizeof(const char *));
+    seen = apr_hash_make(p);
+    for (i = 0; i < changes->nelts; ++i) {
+        change = &APR_ARRAY_IDX(changes, i, md_store_fs_change_t);
+        if (change->group != group) {
+            continue;
+        }
+        if (!change->name) {
+            return APR_INCOMPLETE;
+        }
+        if (!apr_hash_get(seen, change->name, APR_HASH_KEY_STRING)) {
+            apr_hash_set(seen, change->name, APR_HASH_KEY_STRING, change);
+            APR_ARRAY_PUSH(names, const char *) = change->name;
+        }
+    }
+    *pnames = names;
+    return APR_SUCCESS;
+}
+
+/**************************************************************************************************/
+/* leases */
+
+/* A lease is kept in "locks/<group>/<name>.lease" and only read and changed while
+ * holding the exclusive lock on the MD. Released leases are not removed, but marked
+ * expired, so that the token keeps counting up. As expiry is a wall clock time,
+ * servers sharing a store need to have their clocks in sync.
+ */
+#define FS_LEASE_EXT        ".lease"
+#define MD_KEY_OWNER        "owner"
+
+typedef enum {
+    FS_LEASE_ACQUIRE,
+    FS_LEASE_RENEW,
+    FS_LEASE_RELEASE
+} fs_lease_op_t;
+
+static apr_status_t lease_read(const char **powner, long *ptoken, apr_time_t *pexpires,
+                               const char *fpath, apr_pool_t *p)
+{
+    md_json_t *json;
+    const char *s;
+    apr_status_t rv;
+    
+    *powner = NULL;
+    *ptoken = 0;
+    *pexpires = 0;
+    rv = md_json_readf(&json, p, fpath);
+    if (APR_SUCCESS == rv) {
+        *powner = md_json_gets(json, MD_KEY_OWNER, NULL);
+        *ptoken = md_json_getl(json, MD_KEY_TOKEN, NULL);
+        s = md_json_gets(json, MD_KEY_EXPIRES, NULL);
+        *pexpires = s? apr_atoi64(s) : 0;
+    }
+    return APR_STATUS_IS_ENOENT(rv)? APR_SUCCESS : rv;
+}
+
+static apr_status_t lease_write(md_store_fs_t *s_fs, md_store_lease_t *lease, 
+                                const char *dir, const char *fpath, apr_time_t expires, 
+                                apr_pool_t *p)
+{
+    md_json_t *json = md_json_create(p);
+    apr_status_t rv;
+    
+    md_json_sets(lease->owner, json, MD_KEY_OWNER, NULL);
+    md_json_setl(lease->token, json, MD_KEY_TOKEN, NULL);
+    md_json_sets(apr_psprintf(p, "%" APR_TIME_T_FMT, expires), json, MD_KEY_EXPIRES, NULL);
+    rv = md_json_freplace(json, p, MD_JSON_FMT_INDENT, fpath, gperms(s_fs, lease->group)->file);
+    if (APR_SUCCESS == rv) {
+        /* a token lost in a crash might be handed out again */
+        rv = sync_mark(s_fs, dir, p);
+    }
+    return rv;
+}
+
+static apr_status_t pfs_lease(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_fs_t *s_fs = baton;
+    md_store_lease_t *lease;
+    md_store_fs_lock_t *lock;
+    fs_lease_op_t op;
+    const char *dir, *fpath, *owner;
+    long token;
+    apr_time_t expires, now;
+    char ts[APR_RFC822_DATE_LEN];
+    apr_status_t rv;
+    
+    lease = va_arg(ap, md_store_lease_t *);
+    op = (fs_lease_op_t)va_arg(ap, int);
+    
+    rv = md_util_path_merge(&dir, ptemp, s_fs->base, FS_LOCK_DIR, 
+                            md_store_group_name(lease->group), NULL);
+    if (APR_SUCCESS != rv
+        || APR_SUCCESS != (rv = md_util_path_merge(&fpath, ptemp, dir, apr_pstrcat(ptemp, 
+                                                   lease->name, FS_LEASE_EXT, NULL), NULL))
+        || APR_SUCCESS != (rv = fs_lock(&lock, s_fs, ptemp, lease->group, lease->name, 
+                                        MD_S_FS_LOCK_EXCLUSIVE, FS_LOCK_TIMEOUT))
+        || APR_SUCCESS != (rv = lease_read(&owner, &token, &expires, fpath, ptemp))) {
+        return rv;
+    }
+    
+    now = apr_time_now();
+    if (FS_LEASE_ACQUIRE == op) {
+        if (owner && strcmp(owner, lease->owner) && expires > now) {
+            apr_rfc822_date(ts, expires);
+            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, ptemp, "%s: leased to %s until %s", 
+                          fpath, owner, ts);
+            return APR_EBUSY;
+        }
+        lease->token = token + 1;
+    }
+    else if (!owner || strcmp(owner, lease->owner) || token != lease->token) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, 0, ptemp, "%s: lease %ld of %s was "
+                      "taken over by %s (%ld)", fpath, lease->token, lease->owner, 
+                      owner? owner : "nobody", token);
+        return APR_EBUSY;
+    }
+    
+    expires = (FS_LEASE_RELEASE == op)? 0 : now + lease->duration;
+    if (APR_SUCCESS == (rv = lease_write(s_fs, lease, dir, fpath, expires, ptemp))) {
+        lease->expires = expires;
+    }
+    return rv;
+}
+
+static apr_status_t fs_lease_renew(md_store_lease_t *lease, apr_pool_t *p)
+{
+    return md_util_pool_vdo(pfs_lease, lease->baton, p, lease, FS_LEASE_RENEW, NULL);
+}
+
+static apr_status_t fs_lease_release(md_store_lease_t *lease, apr_pool_t *p)
+{
+    return md_util_pool_vdo(pfs_lease, lease->baton, p, lease, FS_LEASE_RELEASE, NULL);
+}
+
+static apr_status_t fs_lease_acquire(md_store_lease_t *lease, apr_pool_t *p)
+{
+    md_store_fs_t *s_fs = FS_STORE(lease->store);
+    apr_status_t rv;
+    
+    lease->baton = s_fs;
+    rv = md_util_pool_vdo(pfs_lease, s_fs, p, lease, FS_LEASE_ACQUIRE, NULL);
+    if (APR_SUCCESS == rv) {
+        lease->renew = fs_lease_renew;
+        lease->release = fs_lease_release;
+    }
+    return rv;
+}
+
+/**************************************************************************************************/
+/* shared chain files */
+
+/* Chains are the same for most MDs. Instead of a copy in every MD directory, the PEM is
+ * written once to FS_CHAIN_DIR, named by the sha256 of its content and the file permissions
+ * of the group saving it, and hard linked to where the MD expects it. Links share the mode
+ * of their file, so groups with different permissions get different files. The link count
+ * is the reference count: files only linked from FS_CHAIN_DIR are removed by chains_gc().
+ * Where hard links are not available, the MD gets its own copy as before.
+ */
+#define FS_CHAIN_DIR        "chains"
+#define FS_CHAIN_EXT        ".pem"
+
+static int is_linked(const char *fpath, apr_pool_t *ptemp)
+{
+    apr_finfo_t info;
+    return (APR_SUCCESS == apr_stat(&info, fpath, APR_FINFO_NLINK, ptemp) && info.nlink > 1);
+}
+
+static apr_status_t chain_link(const char *bpath, const char *fpath, apr_pool_t *ptemp)
+{
+    const char *tmp;
+    apr_status_t rv;
+    
+    tmp = md_util_tmp_path(fpath, ptemp);
+    rv = apr_file_link(bpath, tmp);
+    if (APR_STATUS_IS_EEXIST(rv)) {
+        /* left behind by a process that had our pid before */
+        apr_file_remove(tmp, ptemp);
+        rv = apr_file_link(bpath, tmp);
+    }
+    if (APR_SUCCESS == rv && APR_SUCCESS != (rv = apr_file_rename(tmp, fpath, ptemp))) {
+        apr_file_remove(tmp, ptemp);
+    }
+    return rv;
+}
+
+static apr_status_t chains_gc(md_store_fs_t *s_fs, apr_pool_t *ptemp)
+{
+    apr_dir_t *d;
+    apr_finfo_t entry, info;
+    const char *bdir, *bpath;
+    apr_size_t len, elen = sizeof(FS_CHAIN_EXT) - 1;
+    apr_status_t rv;
+    int removed = 0;
+    
+    if (APR_SUCCESS != (rv = md_util_path_merge(&bdir, ptemp, s_fs->base, FS_CHAIN_DIR, NULL))) {
+        return rv;
+    }
+    if (APR_SUCCESS != (rv = apr_dir_open(&d, bdir, ptemp))) {
+        return APR_STATUS_IS_ENOENT(rv)? APR_SUCCESS : rv;
+    }
+    while (APR_SUCCESS == apr_dir_read(&entry, APR_FINFO_NAME, d)) {
+        len = strlen(entry.name);
+        if (len <= elen || strcmp(FS_CHAIN_EXT, entry.name + len - elen)) {
+            continue;
+        }
+        if (APR_SUCCESS == md_util_path_merge(&bpath, ptemp, bdir, entry.name, NULL)
+            && APR_SUCCESS == apr_stat(&info, bpath, APR_FINFO_TYPE|APR_FINFO_NLINK, ptemp)
+            && APR_REG == info.filetype && info.nlink <= 1
+            && APR_SUCCESS == apr_file_remove(bpath, ptemp)) {
+            ++removed;
+        }
+    }
+    apr_dir_close(d);
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, ptemp, "chains gc: removed %d", removed);
+    return APR_SUCCESS;
+}
+
+static apr_status_t chain_save(md_store_fs_t *s_fs, apr_array_header_t *certs, 
+                               const char *fpath, const perms_t *perms, apr_pool_t *ptemp)
+{
+    der_buffer buf;
+    const char *hex, *bdir, *bpath;
+    apr_status_t rv;
+    int was_linked;
+    
+    if (APR_SUCCESS != (rv = md_chain_to_pem(&buf.data, &buf.len, certs, ptemp))
+        || APR_SUCCESS != (rv = md_crypt_sha256_digest_hex(&hex, ptemp, buf.data, buf.len))
+        || APR_SUCCESS != (rv = md_util_path_merge(&bdir, ptemp, s_fs->base, FS_CHAIN_DIR, NULL))
+        || APR_SUCCESS != (rv = md_util_path_merge(&bpath, ptemp, bdir, 
+                                                   apr_psprintf(ptemp, "%s-%04x" FS_CHAIN_EXT, 
+                                                                hex, (int)perms->file), 
+                                                   NULL))) {
+        return rv;
+    }
+    
+    was_linked = is_linked(fpath, ptemp);
+    if (APR_SUCCESS == md_util_is_file(bpath, ptemp)
+        || (APR_SUCCESS == (rv = apr_dir_make_recursive(bdir, s_fs->def_perms.dir, ptemp))
+            && APR_SUCCESS == (rv = md_util_freplace(bpath, perms->file, ptemp, 
+                                                     der_fwrite, &buf)))) {
+        rv = chain_link(bpath, fpath, ptemp);
+    }
+    if (APR_SUCCESS != rv) {
+        /* no hard links on this file system, or the file was collected meanwhile */
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ptemp, 
+                      "linking %s to %s, writing a copy instead", fpath, bpath);
+        rv = md_util_freplace(fpath, perms->file, ptemp, der_fwrite, &buf);
+    }
+    if (APR_SUCCESS == rv && was_linked) {
+        chains_gc(s_fs, ptemp);
+    }
+    return rv;
+}
+
+static apr_status_t fs_fsave(md_store_fs_t *s_fs, md_store_group_t group, const char *fpath, 
+                             md_store_vtype_t vtype, void *value, int create,
+                             apr_pool_t *p, apr_pool_t *ptemp)
+{
+    const perms_t *perms;
+    const char *pass;
+    apr_size_t pass_len;
+    apr_status_t rv;
+    
+    perms = gperms(s_fs, group);
+    
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, ptemp, "storing in %s", fpath);
+    switch (vtype) {
+        case MD_SV_TEXT:
+            rv = (create? md_text_fcreatex(fpath, perms->file, p, value)
+                  : md_text_freplace(fpath, perms->file, p, value));
+            break;
+        case MD_SV_JSON:
+            rv = (create? md_json_fcreatex((md_json_t *)value, p, MD_JSON_FMT_INDENT, 
+                                           fpath, perms->file)
+                  : md_json_freplace((md_json_t *)value, p, MD_JSON_FMT_INDENT, 
+                                     fpath, perms->file));
+            break;
+        case MD_SV_CERT:
+            if (APR_SUCCESS == (rv = der_remove(fpath, ptemp))
+                && APR_SUCCESS == (rv = md_cert_fsave((md_cert_t *)value, ptemp, fpath, 
+                                                      perms->file))
+                && s_fs->der_cache) {
+                der_save(s_fs, group, fpath, vtype, value, ptemp);
+            }
+            break;
+        case MD_SV_PKEY:
+            /* Take care that we write private key with access only to the user,
+             * unless we write the key encrypted */
+            get_pass(&pass, &pass_len, s_fs, group);
+            rv = md_pkey_fsave((md_pkey_t *)value, ptemp, pass, pass_len, 
+                               fpath, (pass && pass_len)? perms->file : MD_FPROT_F_UONLY);
+            break;
+        case MD_SV_CHAIN:
+            if (APR_SUCCESS == (rv = der_remove(fpath, ptemp))
+                && APR_SUCCESS == (rv = chain_save(s_fs, (apr_array_header_t*)value, fpath, 
+                                                   perms, ptemp))
+                && s_fs->der_cache) {
+                der_save(s_fs, group, fpath, vtype, value, ptemp);
+            }
+            break;
+        default:
+            return APR_ENOTIMPL;
+    }
+    if (APR_SUCCESS == rv && create && MD_S_FS_SYNC_STRICT == s_fs->sync_mode
+        && (MD_SV_TEXT == vtype || MD_SV_JSON == vtype)) {
+        /* the others were replaced, which syncs them */
+        rv = md_util_fsync_path(fpath, ptemp);
+    }
+    return rv;
+}
+
 static apr_status_t pfs_save(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
 {
     md_store_fs_t *s_fs = baton;
-    const char *gdir, *dir, *fpath, *name, *aspect;
-    md_store_vtype_t vtype;
-    md_store_group_t group;
-    void *value;
-    int create;
+    const char *gdir, *dir, *fpath, *name, *aspect;
+    md_store_vtype_t vtype;
+    md_store_group_t group;
+    void *value;
+    int create;
+    apr_status_t rv;
+    
+    group = va_arg(ap, int);
+    name = va_arg(ap, const char*);
+    aspect = va_arg(ap, const char*);
+    vtype = va_arg(ap, int);
+    value = va_arg(ap, void *);
+    create = va_arg(ap, int);
+    
+    if (APR_SUCCESS == (rv = fs_wlock(s_fs, group, name, ptemp))
+        && APR_SUCCESS == (rv = mk_group_dir(&gdir, s_fs, group, NULL, p)) 
+        && APR_SUCCESS == (rv = mk_group_dir(&dir, s_fs, group, name, p))
+        && APR_SUCCESS == (rv = md_util_path_merge(&fpath, ptemp, dir, aspect, NULL))
+        && APR_SUCCESS == (rv = fs_fsave(s_fs, group, fpath, vtype, value, create, p, ptemp))
+        && APR_SUCCESS == (rv = sync_mark(s_fs, dir, ptemp))) {
+        journal_add(s_fs, MD_S_FS_CH_SAVE, group, name, aspect, ptemp);
+        rv = dispatch(s_fs, MD_S_FS_EV_CREATED, group, fpath, APR_REG, p);
+    }
+    return rv;
+}
+
+static apr_status_t pfs_remove(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_fs_t *s_fs = baton;
+    const char *dir, *name, *fpath, *groupname, *aspect;
+    apr_status_t rv;
+    int force, linked;
+    apr_finfo_t info;
+    md_store_group_t group;
+    
+    group = va_arg(ap, int);
+    name = va_arg(ap, const char*);
+    aspect = va_arg(ap, const char *);
+    force = va_arg(ap, int);
+    
+    groupname = md_store_group_name(group);
+    
+    if (APR_SUCCESS == (rv = fs_wlock(s_fs, group, name, ptemp))
+        && APR_SUCCESS == (rv = md_util_path_merge(&dir, ptemp, s_fs->base, groupname, name, NULL))
+        && APR_SUCCESS == (rv = md_util_path_merge(&fpath, ptemp, dir, aspect, NULL))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, ptemp, "start remove of md %s/%s/%s", 
+                      groupname, name, aspect);
+
+        if (APR_SUCCESS != (rv = apr_stat(&info, dir, APR_FINFO_TYPE, ptemp))) {
+            if (APR_ENOENT == rv && force) {
+                return APR_SUCCESS;
+            }
+            return rv;
+        }
+    
+        linked = is_linked(fpath, ptemp);
+        rv = apr_file_remove(fpath, ptemp);
+        if (APR_ENOENT == rv && force) {
+            rv = APR_SUCCESS;
+        }
+        if (APR_SUCCESS == rv) {
+            rv = der_remove(fpath, ptemp);
+        }
+        if (APR_SUCCESS == rv) {
+            rv = sync_mark(s_fs, dir, ptemp);
+        }
+        if (APR_SUCCESS == rv) {
+            journal_add(s_fs, MD_S_FS_CH_REMOVE, group, name, aspect, ptemp);
+        }
+        if (APR_SUCCESS == rv && linked) {
+            chains_gc(s_fs, ptemp);
+        }
+    }
+    return rv;
+}
+
+static apr_status_t fs_load(md_store_t *store, md_store_group_t group, 
+                            const char *name, const char *aspect,  
+                            md_store_vtype_t vtype, void **pvalue, apr_pool_t *p)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    return md_util_pool_vdo(pfs_load, s_fs, p, group, name, aspect, vtype, pvalue, NULL);
+}
+
+static apr_status_t fs_save(md_store_t *store, apr_pool_t *p, md_store_group_t group, 
+                            const char *name, const char *aspect,  
+                            md_store_vtype_t vtype, void *value, int create)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    return md_util_pool_vdo(pfs_save, s_fs, p, group, name, aspect, 
+                            vtype, value, create, NULL);
+}
+
+static apr_status_t fs_remove(md_store_t *store, md_store_group_t group, 
+                              const char *name, const char *aspect, 
+                              apr_pool_t *p, int force)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    return md_util_pool_vdo(pfs_remove, s_fs, p, group, name, aspect, force, NULL);
+}
+
+static apr_status_t pfs_purge(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_fs_t *s_fs = baton;
+    const char *dir, *gdir, *name, *groupname;
+    md_store_group_t group;
+    apr_status_t rv;
+    
+    group = va_arg(ap, int);
+    name = va_arg(ap, const char*);
+    
+    groupname = md_store_group_name(group);
+
+    if (APR_SUCCESS != (rv = fs_wlock(s_fs, group, name, ptemp))) {
+        return rv;
+    }
+    if (APR_SUCCESS == (rv = md_util_path_merge(&dir, ptemp, s_fs->base, groupname, name, NULL))) {
+        /* Remove all files in dir, there should be no sub-dirs */
+        if (APR_SUCCESS == (rv = md_util_rm_recursive(dir, ptemp, 1))
+            && APR_SUCCESS == fs_get_dname(&gdir, &s_fs->s, group, NULL, ptemp)) {
+            sync_mark(s_fs, gdir, ptemp);
+        }
+        journal_add(s_fs, MD_S_FS_CH_PURGE, group, name, NULL, ptemp);
+        /* and any shared chain no longer linked from elsewhere */
+        chains_gc(s_fs, ptemp);
+    }
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ptemp, "purge %s/%s (%s)", groupname, name, dir);
+    return APR_SUCCESS;
+}
+
+static apr_status_t fs_purge(md_store_t *store, apr_pool_t *p, 
+                             md_store_group_t group, const char *name)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    return md_util_pool_vdo(pfs_purge, s_fs, p, group, name, NULL);
+}
+
+/**************************************************************************************************/
+/* iteration */
+
+typedef struct {
+    md_store_fs_t *s_fs;
+    md_store_group_t group;
+    const char *pattern;
+    const char *aspect;
+    md_store_vtype_t vtype;
+    md_store_inspect *inspect;
+    void *baton;
+} inspect_ctx;
+
+static apr_status_t insp(void *baton, apr_pool_t *p, apr_pool_t *ptemp, 
+                         const char *dir, const char *name, apr_filetype_e ftype)
+{
+    inspect_ctx *ctx = baton;
+    apr_status_t rv;
+    void *value;
+    const char *fpath;
+    
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, ptemp, "inspecting value at: %s/%s", dir, name);
+    if (APR_SUCCESS == (rv = md_util_path_merge(&fpath, ptemp, dir, name, NULL))) {
+        rv = fs_fload(&value, ctx->s_fs, fpath, ctx->group, ctx->vtype, p, ptemp);
+        if (APR_SUCCESS == rv 
+            && !ctx->inspect(ctx->baton, name, ctx->aspect, ctx->vtype, value, ptemp)) {
+            return APR_EOF;
+        }
+    }
+    return rv;
+}
+
+static apr_status_t fs_iterate(md_store_inspect *inspect, void *baton, md_store_t *store, 
+                               apr_pool_t *p, md_store_group_t group, const char *pattern, 
+                               const char *aspect, md_store_vtype_t vtype)
+{
+    const char *groupname;
+    apr_status_t rv;
+    inspect_ctx ctx;
+    
+    ctx.s_fs = FS_STORE(store);
+    ctx.group = group;
+    ctx.pattern = pattern;
+    ctx.aspect = aspect;
+    ctx.vtype = vtype;
+    ctx.inspect = inspect;
+    ctx.baton = baton;
+    groupname = md_store_group_name(group);
+
+    rv = md_util_files_do(insp, &ctx, p, ctx.s_fs->base, groupname, ctx.pattern, aspect, NULL);
+    
+    return rv;
+}
+
+static apr_status_t insp_name(void *baton, apr_pool_t *p, apr_pool_t *ptemp, 
+                              const char *dir, const char *name, apr_filetype_e ftype)
+{
+    apr_array_header_t *names = baton;
+    const char *mdname = strrchr(dir, '/');
+    
+    mdname = mdname? mdname+1 : dir;
+    /* all matching aspects of a name come one after the other */
+    if (names->nelts 
+        && !strcmp(mdname, APR_ARRAY_IDX(names, names->nelts-1, const char *))) {
+        return APR_SUCCESS;
+    }
+    APR_ARRAY_PUSH(names, const char *) = apr_pstrdup(names->pool, mdname);
+    return APR_SUCCESS;
+}
+
+static apr_status_t fs_names(apr_array_header_t **pnames, md_store_t *store, apr_pool_t *p, 
+                             md_store_group_t group, const char *pattern, const char *aspect)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    apr_array_header_t *names;
+    apr_status_t rv;
+    
+    /* only looks at directory entries, nothing is read */
+    names = apr_array_make(p, 100, sizeof(const char *));
+    rv = md_util_files_do(insp_name, names, p, s_fs->base, md_store_group_name(group), 
+                          pattern, aspect, NULL);
+    *pnames = (APR_SUCCESS == rv)? names : NULL;
+    return rv;
+}
+
+/**************************************************************************************************/
+/* archive */
+
+/* Each MD with archived generations has an index "archive/<name>.idx" with the next
+ * generation number and the generations kept. A generation is either the directory
+ * "archive/<name>.<n>" or, once compacted, the files below "<n>/" in the MD's tarball
+ * "archive/<name>.tar". Archives without a readable index, e.g. made before there was 
+ * one, are scanned once.
+ */
+#define FS_ARCHIVE_IDX      ".idx"
+#define FS_ARCHIVE_TAR      ".tar"
+#define FS_TAR_BLOCK        512
+#define FS_TAR_PADDED(len)  ((((len) + FS_TAR_BLOCK - 1) / FS_TAR_BLOCK) * FS_TAR_BLOCK)
+
+#define MD_KEY_GENERATIONS  "generations"
+#define MD_KEY_NEXT         "next"
+
+static const md_json_field_t GEN_FIELDS[] = {
+    MD_JSON_FIELD("n", MD_JSON_FIELD_LONG, md_store_fs_gen_t, n),
+    MD_JSON_FIELD("archived", MD_JSON_FIELD_DATE, md_store_fs_gen_t, archived),
+    MD_JSON_FIELD("packed", MD_JSON_FIELD_ENUM, md_store_fs_gen_t, packed),
+    MD_JSON_FIELD_END
+};
+
+typedef struct {
+    const char *name;
+    const char *dir;            /* the archive group directory */
+    long next;
+    apr_array_header_t *gens;   /* md_store_fs_gen_t*, oldest first */
+} arch_index_t;
+
+typedef struct {
+    const char *name;
+    const char *data;
+    apr_size_t len;
+    apr_time_t mtime;
+} tar_entry_t;
+
+static apr_status_t gen_to_json(void *value, md_json_t *json, apr_pool_t *p, void *baton)
+{
+    md_json_t *jgen = md_json_create(p);
+    
+    md_json_encode(GEN_FIELDS, value, jgen, p);
+    return md_json_setj(jgen, json, NULL);
+}
+
+static apr_status_t gen_from_json(void **pvalue, md_json_t *json, apr_pool_t *p, void *baton)
+{
+    md_store_fs_gen_t *gen = apr_pcalloc(p, sizeof(*gen));
+    
+    md_json_decode(GEN_FIELDS, gen, json, p);
+    *pvalue = gen;
+    return (gen->n > 0)? APR_SUCCESS : APR_EINVAL;
+}
+
+static int gen_cmp(const void *a, const void *b)
+{
+    const md_store_fs_gen_t *g1 = *(const md_store_fs_gen_t * const *)a;
+    const md_store_fs_gen_t *g2 = *(const md_store_fs_gen_t * const *)b;
+    return (g1->n < g2->n)? -1 : (g1->n > g2->n);
+}
+
+static const char *arch_path(arch_index_t *idx, const char *suffix, apr_pool_t *p)
+{
+    return apr_pstrcat(p, idx->dir, "/", idx->name, suffix, NULL);
+}
+
+static const char *gen_dir(arch_index_t *idx, long n, apr_pool_t *p)
+{
+    return arch_path(idx, apr_psprintf(p, ".%ld", n), p);
+}
+
+static long gen_number(const char *s)
+{
+    char *end;
+    long n;
+    
+    if (!apr_isdigit(*s)) {
+        return 0;
+    }
+    n = strtol(s, &end, 10);
+    return (*end && *end != '/')? 0 : n;
+}
+
+static apr_status_t tar_read(apr_array_header_t *entries, const char *fpath, apr_pool_t *p);
+
+static apr_status_t arch_scan(arch_index_t *idx, apr_pool_t *p, apr_pool_t *ptemp)
+{
+    apr_array_header_t *entries;
+    apr_hash_t *seen;
+    apr_dir_t *d;
+    apr_finfo_t entry, info;
+    md_store_fs_gen_t *gen;
+    const tar_entry_t *e;
+    const char *path;
+    apr_size_t nlen = strlen(idx->name);
+    apr_status_t rv;
+    long n;
+    int i;
+    
+    /* generations in the tarball, packed before the index got lost */
+    seen = apr_hash_make(ptemp);
+    entries = apr_array_make(ptemp, 10, sizeof(tar_entry_t));
+    if (APR_SUCCESS != (rv = tar_read(entries, arch_path(idx, FS_ARCHIVE_TAR, ptemp), ptemp))) {
+        return rv;
+    }
+    for (i = 0; i < entries->nelts; ++i) {
+        e = &APR_ARRAY_IDX(entries, i, tar_entry_t);
+        if (0 >= (n = gen_number(e->name)) || apr_hash_get(seen, &n, sizeof(n))) {
+            continue;
+        }
+        gen = apr_pcalloc(p, sizeof(*gen));
+        gen->n = n;
+        gen->archived = e->mtime;
+        gen->packed = 1;
+        apr_hash_set(seen, &gen->n, sizeof(gen->n), gen);
+        APR_ARRAY_PUSH(idx->gens, md_store_fs_gen_t *) = gen;
+        if (n >= idx->next) {
+            idx->next = n + 1;
+        }
+    }
+    
+    if (APR_SUCCESS != (rv = apr_dir_open(&d, idx->dir, ptemp))) {
+        return APR_STATUS_IS_ENOENT(rv)? APR_SUCCESS : rv;
+    }
+    while (APR_SUCCESS == apr_dir_read(&entry, APR_FINFO_NAME, d)) {
+        if (strncmp(idx->name, entry.name, nlen) || entry.name[nlen] != '.'
+            || 0 >= (n = gen_number(entry.name + nlen + 1))) {
+            continue;
+        }
+        path = gen_dir(idx, n, ptemp);
+        if (!apr_hash_get(seen, &n, sizeof(n))
+            && APR_SUCCESS == apr_stat(&info, path, APR_FINFO_TYPE|APR_FINFO_MTIME, ptemp)
+            && APR_DIR == info.filetype) {
+            gen = apr_pcalloc(p, sizeof(*gen));
+            gen->n = n;
+            gen->archived = info.mtime;
+            APR_ARRAY_PUSH(idx->gens, md_store_fs_gen_t *) = gen;
+            if (n >= idx->next) {
+                idx->next = n + 1;
+            }
+        }
+    }
+    apr_dir_close(d);
+    qsort(idx->gens->elts, (size_t)idx->gens->nelts, sizeof(md_store_fs_gen_t *), gen_cmp);
+    return APR_SUCCESS;
+}
+
+static apr_status_t arch_load(arch_index_t **pidx, md_store_fs_t *s_fs, const char *name, 
+                              apr_pool_t *p, apr_pool_t *ptemp)
+{
+    arch_index_t *idx;
+    md_json_t *json;
+    apr_status_t rv;
+    
+    idx = apr_pcalloc(p, sizeof(*idx));
+    idx->name = apr_pstrdup(p, name);
+    idx->next = 1;
+    idx->gens = apr_array_make(p, 5, sizeof(md_store_fs_gen_t *));
+    rv = md_util_path_merge(&idx->dir, p, s_fs->base, md_store_group_name(MD_SG_ARCHIVE), NULL);
+    if (APR_SUCCESS != rv) {
+        goto out;
+    }
+    
+    rv = md_json_readf(&json, ptemp, arch_path(idx, FS_ARCHIVE_IDX, ptemp));
+    if (APR_SUCCESS == rv) {
+        idx->next = md_json_getl(json, MD_KEY_NEXT, NULL);
+        rv = md_json_geta(idx->gens, gen_from_json, NULL, json, MD_KEY_GENERATIONS, NULL);
+        if (APR_STATUS_IS_ENOENT(rv)) {
+            rv = APR_SUCCESS;
+        }
+        qsort(idx->gens->elts, (size_t)idx->gens->nelts, sizeof(md_store_fs_gen_t *), gen_cmp);
+        if (idx->next < 1) {
+            idx->next = 1;
+        }
+    }
+    else {
+        if (!APR_STATUS_IS_ENOENT(rv)) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, ptemp, 
+                          "%s: unreadable archive index, rebuilding", name);
+        }
+        rv = arch_scan(idx, p, ptemp);
+    }
+out:
+    *pidx = (APR_SUCCESS == rv)? idx : NULL;
+    return rv;
+}
+
+static apr_status_t arch_save(arch_index_t *idx, apr_pool_t *ptemp)
+{
+    md_json_t *json = md_json_create(ptemp);
+    
+    md_json_setl(idx->next, json, MD_KEY_NEXT, NULL);
+    md_json_seta(idx->gens, gen_to_json, NULL, json, MD_KEY_GENERATIONS, NULL);
+    return md_json_freplace(json, ptemp, MD_JSON_FMT_INDENT, 
+                            arch_path(idx, FS_ARCHIVE_IDX, ptemp), MD_FPROT_F_UONLY);
+}
+
+/* Allocate the directory for the next generation. */
+static apr_status_t arch_slot(const char **pdir, arch_index_t *idx, apr_pool_t *ptemp)
+{
+    md_store_fs_gen_t *gen;
+    const char *dir;
+    apr_status_t rv;
+    long n = idx->next;
+    
+    while (APR_SUCCESS != (rv = apr_dir_make((dir = gen_dir(idx, n, ptemp)), 
+                                             MD_FPROT_D_UONLY, ptemp))) {
+        if (!APR_STATUS_IS_EEXIST(rv)) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ptemp, "creating archive dir: %s", dir);
+            return rv;
+        }
+        /* index is behind, e.g. archived by an older version */
+        ++n;
+    }
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ptemp, "using archive dir: %s", dir);
+    
+    gen = apr_pcalloc(idx->gens->pool, sizeof(*gen));
+    gen->n = n;
+    gen->archived = apr_time_now();
+    APR_ARRAY_PUSH(idx->gens, md_store_fs_gen_t *) = gen;
+    idx->next = n + 1;
+    *pdir = dir;
+    return APR_SUCCESS;
+}
+
+/* tarballs, plain ustar with regular files only */
+
+static apr_status_t tar_read(apr_array_header_t *entries, const char *fpath, apr_pool_t *p)
+{
+    const char *data, *hdr, *nul;
+    apr_size_t len, size, off = 0;
+    tar_entry_t *e;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS != (rv = fs_fread_all(&data, &len, fpath, p))) {
+        return APR_STATUS_IS_ENOENT(rv)? APR_SUCCESS : rv;
+    }
+    while (off + FS_TAR_BLOCK <= len) {
+        hdr = data + off;
+        if (!hdr[0]) {
+            /* end of archive */
+            break;
+        }
+        size = (apr_size_t)apr_strtoi64(apr_pstrmemdup(p, hdr + 124, 12), NULL, 8);
+        off += FS_TAR_BLOCK;
+        if (size > len - off) {
+            return APR_EINVAL;
+        }
+        if ('0' == hdr[156] || '\0' == hdr[156]) {
+            e = apr_array_push(entries);
+            nul = memchr(hdr, '\0', 100);
+            e->name = apr_pstrmemdup(p, hdr, nul? (apr_size_t)(nul - hdr) : 100);
+            e->data = data + off;
+            e->len = size;
+            e->mtime = apr_time_from_sec(apr_strtoi64(apr_pstrmemdup(p, hdr + 136, 12), NULL, 8));
+        }
+        off += FS_TAR_PADDED(size);
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t tar_write(const char *fpath, apr_array_header_t *entries, apr_pool_t *p)
+{
+    der_buffer buf;
+    const tar_entry_t *e;
+    apr_size_t len, nlen;
+    unsigned int sum;
+    char *data, *hdr;
+    apr_status_t rv;
+    int i, j;
+    
+    if (apr_is_empty_array(entries)) {
+        rv = apr_file_remove(fpath, p);
+        return APR_STATUS_IS_ENOENT(rv)? APR_SUCCESS : rv;
+    }
+    
+    len = 2 * FS_TAR_BLOCK;
+    for (i = 0; i < entries->nelts; ++i) {
+        len += FS_TAR_BLOCK + FS_TAR_PADDED(APR_ARRAY_IDX(entries, i, tar_entry_t).len);
+    }
+    hdr = data = apr_pcalloc(p, len);
+    for (i = 0; i < entries->nelts; ++i) {
+        e = &APR_ARRAY_IDX(entries, i, tar_entry_t);
+        if ((nlen = strlen(e->name)) >= 100) {
+            return APR_EINVAL;
+        }
+        memcpy(hdr, e->name, nlen);
+        apr_snprintf(hdr + 100, 8, "%07lo", 0600UL);
+        apr_snprintf(hdr + 108, 8, "%07lo", 0UL);
+        apr_snprintf(hdr + 116, 8, "%07lo", 0UL);
+        apr_snprintf(hdr + 124, 12, "%011lo", (unsigned long)e->len);
+        apr_snprintf(hdr + 136, 12, "%011lo", (unsigned long)apr_time_sec(e->mtime));
+        hdr[156] = '0';
+        memcpy(hdr + 257, "ustar", 6);
+        memcpy(hdr + 263, "00", 2);
+        memset(hdr + 148, ' ', 8);
+        for (sum = 0, j = 0; j < FS_TAR_BLOCK; ++j) {
+            sum += (unsigned char)hdr[j];
+        }
+        apr_snprintf(hdr + 148, 8, "%06o", sum);
+        hdr[155] = ' ';
+        
+        memcpy(hdr + FS_TAR_BLOCK, e->data, e->len);
+        hdr += FS_TAR_BLOCK + FS_TAR_PADDED(e->len);
+    }
+    buf.data = data;
+    buf.len = len;
+    return md_util_freplace(fpath, MD_FPROT_F_UONLY, p, der_fwrite, &buf);
+}
+
+static apr_status_t tar_add_dir(apr_array_header_t *entries, const char *dir, long n, 
+                                apr_pool_t *p)
+{
+    apr_dir_t *d;
+    apr_finfo_t entry, info;
+    const char *fpath;
+    tar_entry_t *e;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS != (rv = apr_dir_open(&d, dir, p))) {
+        return rv;
+    }
+    while (APR_SUCCESS == rv && APR_SUCCESS == apr_dir_read(&entry, APR_FINFO_NAME, d)) {
+        if (APR_SUCCESS != md_util_path_merge(&fpath, p, dir, entry.name, NULL)
+            || APR_SUCCESS != apr_stat(&info, fpath, APR_FINFO_TYPE|APR_FINFO_MTIME, p)
+            || APR_REG != info.filetype) {
+            continue;
+        }
+        e = apr_array_push(entries);
+        e->name = apr_psprintf(p, "%ld/%s", n, entry.name);
+        e->mtime = info.mtime;
+        rv = fs_fread_all(&e->data, &e->len, fpath, p);
+    }
+    apr_dir_close(d);
+    return rv;
+}
+
+static apr_status_t tar_extract(apr_array_header_t *entries, long n, const char *dir, 
+                                apr_fileperms_t perms, apr_pool_t *p)
+{
+    const tar_entry_t *e;
+    const char *prefix, *fpath;
+    der_buffer buf;
+    apr_size_t plen;
+    apr_status_t rv;
+    int i;
+    
+    rv = apr_dir_make(dir, MD_FPROT_D_UONLY, p);
+    if (APR_SUCCESS != rv && !APR_STATUS_IS_EEXIST(rv)) {
+        return rv;
+    }
+    prefix = apr_psprintf(p, "%ld/", n);
+    plen = strlen(prefix);
+    for (rv = APR_SUCCESS, i = 0; APR_SUCCESS == rv && i < entries->nelts; ++i) {
+        e = &APR_ARRAY_IDX(entries, i, tar_entry_t);
+        if (strncmp(prefix, e->name, plen) || !e->name[plen] || strchr(e->name + plen, '/')) {
+            continue;
+        }
+        buf.data = e->data;
+        buf.len = e->len;
+        if (APR_SUCCESS == (rv = md_util_path_merge(&fpath, p, dir, e->name + plen, NULL))) {
+            rv = md_util_freplace(fpath, perms, p, der_fwrite, &buf);
+        }
+    }
+    return rv;
+}
+
+/* Bring tarball and directories in line with the index and save it. Generations
+ * marked packed but still having a directory are added to the tarball, entries of
+ * generations no longer packed are dropped. Directories of the 'removed' generations
+ * and of the ones just packed are deleted afterwards. */
+static apr_status_t arch_sync(md_store_fs_t *s_fs, arch_index_t *idx, 
+                              apr_array_header_t *removed, apr_pool_t *ptemp)
+{
+    apr_array_header_t *entries, *kept, *rmdirs;
+    apr_hash_t *packed, *fresh;
+    md_store_fs_gen_t *gen;
+    tar_entry_t *e;
+    const char *tar, *dir;
+    apr_status_t rv;
+    int i, changed = 0;
+    long n;
+    
+    rmdirs = apr_array_make(ptemp, 5, sizeof(const char *));
+    for (i = 0; removed && i < removed->nelts; ++i) {
+        gen = APR_ARRAY_IDX(removed, i, md_store_fs_gen_t *);
+        if (!gen->packed) {
+            APR_ARRAY_PUSH(rmdirs, const char *) = gen_dir(idx, gen->n, ptemp);
+        }
+    }
+    
+    packed = apr_hash_make(ptemp);
+    fresh = apr_hash_make(ptemp);
+    for (i = 0; i < idx->gens->nelts; ++i) {
+        gen = APR_ARRAY_IDX(idx->gens, i, md_store_fs_gen_t *);
+        if (gen->packed) {
+            apr_hash_set(packed, &gen->n, sizeof(gen->n), gen);
+            dir = gen_dir(idx, gen->n, ptemp);
+            if (APR_SUCCESS == md_util_is_dir(dir, ptemp)) {
+                apr_hash_set(fresh, &gen->n, sizeof(gen->n), dir);
+            }
+        }
+    }
+    
+    tar = arch_path(idx, FS_ARCHIVE_TAR, ptemp);
+    entries = apr_array_make(ptemp, 10, sizeof(tar_entry_t));
+    if (APR_SUCCESS != (rv = tar_read(entries, tar, ptemp))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ptemp, "reading archive %s", tar);
+        return rv;
+    }
+    kept = apr_array_make(ptemp, entries->nelts + 10, sizeof(tar_entry_t));
+    for (i = 0; i < entries->nelts; ++i) {
+        e = &APR_ARRAY_IDX(entries, i, tar_entry_t);
+        n = gen_number(e->name);
+        if (apr_hash_get(packed, &n, sizeof(n)) && !apr_hash_get(fresh, &n, sizeof(n))) {
+            *(tar_entry_t *)apr_array_push(kept) = *e;
+        }
+        else {
+            changed = 1;
+        }
+    }
+    for (i = 0; i < idx->gens->nelts; ++i) {
+        gen = APR_ARRAY_IDX(idx->gens, i, md_store_fs_gen_t *);
+        if ((dir = apr_hash_get(fresh, &gen->n, sizeof(gen->n)))) {
+            if (APR_SUCCESS != (rv = tar_add_dir(kept, dir, gen->n, ptemp))) {
+                return rv;
+            }
+            APR_ARRAY_PUSH(rmdirs, const char *) = dir;
+            changed = 1;
+        }
+    }
+    
+    if (changed && APR_SUCCESS != (rv = tar_write(tar, kept, ptemp))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ptemp, "updating archive of %s", idx->name);
+        return rv;
+    }
+    if (APR_SUCCESS != (rv = arch_save(idx, ptemp))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ptemp, "updating archive of %s", idx->name);
+        /* it no longer matches the tarball, the next load scans instead */
+        apr_file_remove(arch_path(idx, FS_ARCHIVE_IDX, ptemp), ptemp);
+        return rv;
+    }
+    for (i = 0; i < rmdirs->nelts; ++i) {
+        dir = APR_ARRAY_IDX(rmdirs, i, const char *);
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, ptemp, "archive: removing %s", dir);
+        md_util_rm_recursive(dir, ptemp, 1);
+    }
+    if (rmdirs->nelts) {
+        /* archived chains may have been the last links to shared ones */
+        chains_gc(s_fs, ptemp);
+    }
+    return APR_SUCCESS;
+}
+
+/* Save the index after a generation was added, without touching the tarball.
+ * Directories of the 'removed' generations are deleted. Packed ones stay in the tarball 
+ * until the next arch_sync(), which drops the entries the index no longer lists. */
+static apr_status_t arch_update(md_store_fs_t *s_fs, arch_index_t *idx, 
+                                apr_array_header_t *removed, apr_pool_t *ptemp)
+{
+    md_store_fs_gen_t *gen;
+    const char *dir;
+    apr_status_t rv;
+    int i, rmcount = 0;
+    
+    if (APR_SUCCESS != (rv = arch_save(idx, ptemp))) {
+        /* an index that misses the new generation must not stay, without one the next
+         * load scans directories and tarball */
+        apr_file_remove(arch_path(idx, FS_ARCHIVE_IDX, ptemp), ptemp);
+        return rv;
+    }
+    for (i = 0; removed && i < removed->nelts; ++i) {
+        gen = APR_ARRAY_IDX(removed, i, md_store_fs_gen_t *);
+        if (!gen->packed) {
+            dir = gen_dir(idx, gen->n, ptemp);
+            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, ptemp, "archive: removing %s", dir);
+            md_util_rm_recursive(dir, ptemp, 1);
+            ++rmcount;
+        }
+    }
+    if (rmcount) {
+        /* archived chains may have been the last links to shared ones */
+        chains_gc(s_fs, ptemp);
+    }
+    return APR_SUCCESS;
+}
+
+/* Drop the generations the retention policy no longer keeps from the index. */
+static apr_array_header_t *arch_retain(md_store_fs_t *s_fs, arch_index_t *idx, apr_pool_t *p)
+{
+    apr_array_header_t *gens, *removed;
+    md_store_fs_gen_t *gen;
+    apr_time_t now = apr_time_now();
+    int i;
+    
+    removed = apr_array_make(p, 5, sizeof(md_store_fs_gen_t *));
+    if (s_fs->arch_keep <= 0 && s_fs->arch_max_age <= 0) {
+        return removed;
+    }
+    gens = apr_array_make(idx->gens->pool, idx->gens->nelts, sizeof(md_store_fs_gen_t *));
+    for (i = 0; i < idx->gens->nelts; ++i) {
+        gen = APR_ARRAY_IDX(idx->gens, i, md_store_fs_gen_t *);
+        if ((s_fs->arch_keep > 0 && idx->gens->nelts - i <= s_fs->arch_keep)
+            || (s_fs->arch_max_age > 0 && now - gen->archived < s_fs->arch_max_age)) {
+            APR_ARRAY_PUSH(gens, md_store_fs_gen_t *) = gen;
+        }
+        else {
+            APR_ARRAY_PUSH(removed, md_store_fs_gen_t *) = gen;
+        }
+    }
+    idx->gens = gens;
+    return removed;
+}
+
+apr_status_t md_store_fs_archive_retention_set(md_store_t *store, int keep, 
+                                               apr_interval_time_t max_age)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    
+    s_fs->arch_keep = keep;
+    s_fs->arch_max_age = max_age;
+    return APR_SUCCESS;
+}
+
+static apr_status_t pfs_archive_list(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_fs_t *s_fs = baton;
+    apr_array_header_t **pgens;
+    arch_index_t *idx;
+    const char *name;
+    apr_status_t rv;
+    
+    pgens = va_arg(ap, apr_array_header_t **);
+    name = va_arg(ap, const char *);
+    
+    if (APR_SUCCESS == (rv = arch_load(&idx, s_fs, name, p, ptemp))) {
+        *pgens = idx->gens;
+    }
+    return rv;
+}
+
+apr_status_t md_store_fs_archive_list(apr_array_header_t **pgens, md_store_t *store, 
+                                      const char *name, apr_pool_t *p)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    return md_util_pool_vdo(pfs_archive_list, s_fs, p, pgens, name, NULL);
+}
+
+static apr_status_t pfs_archive_restore(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_fs_t *s_fs = baton;
+    apr_array_header_t *gens, *entries;
+    md_store_fs_gen_t *gen = NULL;
+    arch_index_t *idx;
+    const char *name, *dir, *md_dir, *slot_dir = NULL;
+    apr_status_t rv;
+    long n;
+    int i;
+    
+    name = va_arg(ap, const char *);
+    n = va_arg(ap, long);
+    
+    if (APR_SUCCESS != (rv = fs_wlock(s_fs, MD_SG_DOMAINS, name, ptemp))
+        || APR_SUCCESS != (rv = fs_wlock(s_fs, MD_SG_ARCHIVE, name, ptemp))
+        || APR_SUCCESS != (rv = arch_load(&idx, s_fs, name, ptemp, ptemp))) {
+        return rv;
+    }
+    gens = apr_array_make(ptemp, idx->gens->nelts, sizeof(md_store_fs_gen_t *));
+    for (i = 0; i < idx->gens->nelts; ++i) {
+        if (APR_ARRAY_IDX(idx->gens, i, md_store_fs_gen_t *)->n == n) {
+            gen = APR_ARRAY_IDX(idx->gens, i, md_store_fs_gen_t *);
+        }
+        else {
+            APR_ARRAY_PUSH(gens, md_store_fs_gen_t *) = APR_ARRAY_IDX(idx->gens, i, 
+                                                                       md_store_fs_gen_t *);
+        }
+    }
+    if (!gen) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, APR_ENOENT, ptemp, 
+                      "%s: no archived generation %ld", name, n);
+        return APR_ENOENT;
+    }
+    
+    dir = gen_dir(idx, n, ptemp);
+    if (gen->packed) {
+        entries = apr_array_make(ptemp, 10, sizeof(tar_entry_t));
+        if (APR_SUCCESS != (rv = tar_read(entries, arch_path(idx, FS_ARCHIVE_TAR, ptemp), ptemp))
+            || APR_SUCCESS != (rv = tar_extract(entries, n, dir, 
+                                                gperms(s_fs, MD_SG_DOMAINS)->file, ptemp))) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ptemp, "%s: unpacking generation %ld", 
+                          name, n);
+            return rv;
+        }
+    }
+    
+    rv = md_util_path_merge(&md_dir, ptemp, s_fs->base, 
+                            md_store_group_name(MD_SG_DOMAINS), name, NULL);
+    if (APR_SUCCESS != rv) {
+        return rv;
+    }
+    idx->gens = gens;
+    if (APR_SUCCESS == md_util_is_dir(md_dir, ptemp)) {
+        /* the current one becomes the newest generation */
+        if (APR_SUCCESS != (rv = arch_slot(&slot_dir, idx, ptemp))) {
+            return rv;
+        }
+        if (APR_SUCCESS != (rv = apr_file_rename(md_dir, slot_dir, ptemp))) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ptemp, "rename from %s to %s", 
+                          md_dir, slot_dir);
+            return rv;
+        }
+    }
+    if (APR_SUCCESS != (rv = apr_file_rename(dir, md_dir, ptemp))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ptemp, "moving %s to %s", dir, md_dir);
+        if (slot_dir) {
+            apr_file_rename(slot_dir, md_dir, ptemp);
+        }
+        return rv;
+    }
+    md_log_perror(MD_LOG_MARK, MD_LOG_INFO, 0, ptemp, "%s: restored archived generation %ld", 
+                  name, n);
+    
+    journal_add(s_fs, MD_S_FS_CH_MOVE, MD_SG_DOMAINS, name, NULL, ptemp);
+    journal_add(s_fs, MD_S_FS_CH_MOVE, MD_SG_ARCHIVE, name, NULL, ptemp);
+    if (APR_SUCCESS != (rv = arch_sync(s_fs, idx, NULL, ptemp))) {
+        /* the restore is done, what is left over goes with the next compaction */
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, ptemp, 
+                      "%s: updating archive index after restore", name);
+    }
+    return dispatch(s_fs, MD_S_FS_EV_MOVED, MD_SG_DOMAINS, md_dir, APR_DIR, ptemp);
+}
+
+apr_status_t md_store_fs_archive_restore(md_store_t *store, apr_pool_t *p, 
+                                         const char *name, long n)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    return md_util_pool_vdo(pfs_archive_restore, s_fs, p, name, n, NULL);
+}
+
+static apr_status_t arch_compact(md_store_fs_t *s_fs, const char *name, 
+                                 apr_interval_time_t min_age, apr_pool_t *ptemp)
+{
+    apr_array_header_t *removed;
+    md_store_fs_gen_t *gen;
+    arch_index_t *idx;
+    apr_time_t now = apr_time_now();
+    apr_status_t rv;
+    int i;
+    
+    if (APR_SUCCESS != (rv = fs_wlock(s_fs, MD_SG_ARCHIVE, name, ptemp))
+        || APR_SUCCESS != (rv = arch_load(&idx, s_fs, name, ptemp, ptemp))) {
+        return rv;
+    }
+    removed = arch_retain(s_fs, idx, ptemp);
+    /* the newest generation is the one most likely restored, leave it as it is */
+    for (i = 0; i + 1 < idx->gens->nelts; ++i) {
+        gen = APR_ARRAY_IDX(idx->gens, i, md_store_fs_gen_t *);
+        if (!gen->packed && now - gen->archived >= min_age) {
+            gen->packed = 1;
+        }
+    }
+    return arch_sync(s_fs, idx, removed, ptemp);
+}
+
+static apr_status_t pfs_archive_compact(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_fs_t *s_fs = baton;
+    apr_interval_time_t min_age;
+    apr_hash_t *names;
+    apr_hash_index_t *hi;
+    apr_pool_t *pmd;
+    apr_dir_t *d;
+    apr_finfo_t entry;
+    const char *dir, *dot;
+    apr_size_t len, ilen = sizeof(FS_ARCHIVE_IDX) - 1;
     apr_status_t rv;
-    const perms_t *perms;
-    const char *pass;
-    apr_size_t pass_len;
+    int removed;
     
-    group = va_arg(ap, int);
+    min_age = va_arg(ap, apr_interval_time_t);
+    
+    rv = md_util_path_merge(&dir, ptemp, s_fs->base, md_store_group_name(MD_SG_ARCHIVE), NULL);
+    if (APR_SUCCESS != rv) {
+        return rv;
+    }
+    if (APR_SUCCESS != (rv = apr_dir_open(&d, dir, ptemp))) {
+        return APR_STATUS_IS_ENOENT(rv)? APR_SUCCESS : rv;
+    }
+    /* MDs with an index or with generation directories from before there was one */
+    names = apr_hash_make(ptemp);
+    while (APR_SUCCESS == apr_dir_read(&entry, APR_FINFO_NAME, d)) {
+        len = strlen(entry.name);
+        if (len > ilen && !strcmp(FS_ARCHIVE_IDX, entry.name + len - ilen)) {
+            len -= ilen;
+        }
+        else if ((dot = strrchr(entry.name, '.')) && dot != entry.name && gen_number(dot + 1) > 0) {
+            len = (apr_size_t)(dot - entry.name);
+        }
+        else {
+            continue;
+        }
+        apr_hash_set(names, apr_pstrmemdup(ptemp, entry.name, len), (apr_ssize_t)len, "");
+    }
+    apr_dir_close(d);
+    
+    apr_pool_create(&pmd, ptemp);
+    for (hi = apr_hash_first(ptemp, names); hi; hi = apr_hash_next(hi)) {
+        const void *name;
+        apr_hash_this(hi, &name, NULL, NULL);
+        if (APR_SUCCESS != (rv = arch_compact(s_fs, name, min_age, pmd))) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, pmd, "%s: compacting archive", 
+                          (const char *)name);
+        }
+        apr_pool_clear(pmd);
+    }
+    
+    rv = der_gc(s_fs, min_age, &removed, ptemp);
+    md_log_perror(MD_LOG_MARK, rv? MD_LOG_WARNING : MD_LOG_DEBUG, rv, ptemp, 
+                  "DER blobs no longer referenced, removed %d", removed);
+    return APR_SUCCESS;
+}
+
+apr_status_t md_store_fs_archive_compact(md_store_t *store, apr_pool_t *p, 
+                                         apr_interval_time_t min_age)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    return md_util_pool_vdo(pfs_archive_compact, s_fs, p, min_age, NULL);
+}
+
+/**************************************************************************************************/
+/* moving */
+
+static apr_status_t pfs_move(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_fs_t *s_fs = baton;
+    const char *name, *from_group, *to_group, *from_dir, *to_dir, *dir;
+    md_store_group_t from, to;
+    int archive;
+    apr_status_t rv;
+    
+    from = va_arg(ap, int);
+    to = va_arg(ap, int);
     name = va_arg(ap, const char*);
-    aspect = va_arg(ap, const char*);
-    vtype = va_arg(ap, int);
-    value = va_arg(ap, void *);
-    create = va_arg(ap, int);
+    archive = va_arg(ap, int);
     
-    perms = gperms(s_fs, group);
+    from_group = md_store_group_name(from);
+    to_group = md_store_group_name(to);
+    if (!strcmp(from_group, to_group)) {
+        return APR_EINVAL;
+    }
     
-    if (APR_SUCCESS == (rv = mk_group_dir(&gdir, s_fs, group, NULL, p)) 
-        && APR_SUCCESS == (rv = mk_group_dir(&dir, s_fs, group, name, p))
-        && APR_SUCCESS == (rv = md_util_path_merge(&fpath, ptemp, dir, aspect, NULL))) {
+    /* always lock groups in ascending order, as all writers do */
+    if (APR_SUCCESS != (rv = fs_wlock(s_fs, (from < to)? from : to, name, ptemp))
+        || (archive && MD_SG_ARCHIVE < ((from < to)? to : from)
+            && APR_SUCCESS != (rv = fs_wlock(s_fs, MD_SG_ARCHIVE, name, ptemp)))
+        || APR_SUCCESS != (rv = fs_wlock(s_fs, (from < to)? to : from, name, ptemp))
+        || (archive && MD_SG_ARCHIVE > ((from < to)? to : from)
+            && APR_SUCCESS != (rv = fs_wlock(s_fs, MD_SG_ARCHIVE, name, ptemp)))) {
+        return rv;
+    }
+
+    rv = md_util_path_merge(&from_dir, ptemp, s_fs->base, from_group, name, NULL);
+    if (APR_SUCCESS != rv) goto out;
+    rv = md_util_path_merge(&to_dir, ptemp, s_fs->base, to_group, name, NULL);
+    if (APR_SUCCESS != rv) goto out;
+    
+    if (APR_SUCCESS != (rv = md_util_is_dir(from_dir, ptemp))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ptemp, "source is no dir: %s", from_dir);
+        goto out;
+    }
+    
+    rv = archive? md_util_is_dir(to_dir, ptemp) : APR_ENOENT;
+    if (APR_SUCCESS == rv) {
+        arch_index_t *idx;
+        const char *narch_dir;
+
+        rv = md_util_path_merge(&dir, ptemp, s_fs->base, md_store_group_name(MD_SG_ARCHIVE), NULL);
+        if (APR_SUCCESS != rv) goto out;
+        rv = apr_dir_make_recursive(dir, MD_FPROT_D_UONLY, ptemp); 
+        if (APR_SUCCESS != rv) goto out;
+        rv = arch_load(&idx, s_fs, name, ptemp, ptemp);
+        if (APR_SUCCESS != rv) goto out;
+        rv = arch_slot(&narch_dir, idx, ptemp);
+        if (APR_SUCCESS != rv) goto out;
         
-        md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, ptemp, "storing in %s", fpath);
-        switch (vtype) {
-            case MD_SV_TEXT:
-                rv = (create? md_text_fcreatex(fpath, perms->file, p, value)
-                      : md_text_freplace(fpath, perms->file, p, value));
-                break;
-            case MD_SV_JSON:
-                rv = (create? md_json_fcreatex((md_json_t *)value, p, MD_JSON_FMT_INDENT, 
-                                               fpath, perms->file)
-                      : md_json_freplace((md_json_t *)value, p, MD_JSON_FMT_INDENT, 
-                                         fpath, perms->file));
-                break;
-            case MD_SV_CERT:
-                rv = md_cert_fsave((md_cert_t *)value, ptemp, fpath, perms->file);
-                break;
-            case MD_SV_PKEY:
-                /* Take care that we write private key with access only to the user,
-                 * unless we write the key encrypted */
-                get_pass(&pass, &pass_len, s_fs, group);
-                rv = md_pkey_fsave((md_pkey_t *)value, ptemp, pass, pass_len, 
-                                   fpath, (pass && pass_len)? perms->file : MD_FPROT_F_UONLY);
-                break;
-            case MD_SV_CHAIN:
-                rv = md_chain_fsave((apr_array_header_t*)value, ptemp, fpath, perms->file);
-                break;
-            default:
-                return APR_ENOTIMPL;
+        if (APR_SUCCESS != (rv = apr_file_rename(to_dir, narch_dir, ptemp))) {
+                md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ptemp, "rename from %s to %s", 
+                              to_dir, narch_dir);
+                goto out;
+        }
+        if (APR_SUCCESS != (rv = apr_file_rename(from_dir, to_dir, ptemp))) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ptemp, "moving %s to %s: %s", 
+                          from_dir, to_dir);
+            apr_file_rename(narch_dir, to_dir, ptemp);
+            goto out;
+        }
+        rv = dispatch(s_fs, MD_S_FS_EV_MOVED, to, to_dir, APR_DIR, ptemp);
+        if (APR_SUCCESS == rv) {
+            rv = dispatch(s_fs, MD_S_FS_EV_MOVED, MD_SG_ARCHIVE, narch_dir, APR_DIR, ptemp);
         }
         if (APR_SUCCESS == rv) {
-            rv = dispatch(s_fs, MD_S_FS_EV_CREATED, group, fpath, APR_REG, p);
+            apr_status_t rv2 = arch_update(s_fs, idx, arch_retain(s_fs, idx, ptemp), ptemp);
+            if (APR_SUCCESS != rv2) {
+                /* the move is done, the index is rebuilt on next load */
+                md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv2, ptemp, 
+                              "%s: updating archive index", name);
+            }
+        }
+    }
+    else if (APR_STATUS_IS_ENOENT(rv)) {
+        if (APR_SUCCESS != (rv = apr_file_rename(from_dir, to_dir, ptemp))) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ptemp, "rename from %s to %s", 
+                          from_dir, to_dir);
+            goto out;
         }
     }
+    else {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ptemp, "target is no dir: %s", to_dir);
+        goto out;
+    }
+    if (APR_SUCCESS != rv) goto out;
+    
+    journal_add(s_fs, MD_S_FS_CH_MOVE, from, name, NULL, ptemp);
+    journal_add(s_fs, MD_S_FS_CH_MOVE, to, name, NULL, ptemp);
+    if (archive) {
+        journal_add(s_fs, MD_S_FS_CH_MOVE, MD_SG_ARCHIVE, name, NULL, ptemp);
+    }
+    
+    /* both groups changed, and the archive when something went there */
+    if (APR_SUCCESS == (rv = fs_get_dname(&dir, &s_fs->s, from, NULL, ptemp))
+        && APR_SUCCESS == (rv = sync_mark(s_fs, dir, ptemp))
+        && APR_SUCCESS == (rv = fs_get_dname(&dir, &s_fs->s, to, NULL, ptemp))
+        && APR_SUCCESS == (rv = sync_mark(s_fs, dir, ptemp))
+        && archive
+        && APR_SUCCESS == (rv = fs_get_dname(&dir, &s_fs->s, MD_SG_ARCHIVE, NULL, ptemp))) {
+        rv = sync_mark(s_fs, dir, ptemp);
+    }
+    
+out:
     return rv;
 }
 
-static apr_status_t pfs_remove(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+static apr_status_t fs_move(md_store_t *store, apr_pool_t *p, 
+                            md_store_group_t from, md_store_group_t to, 
+                            const char *name, int archive)
 {
-    md_store_fs_t *s_fs = baton;
-    const char *dir, *name, *fpath, *groupname, *aspect;
-    apr_status_t rv;
-    int force;
-    apr_finfo_t info;
-    md_store_group_t group;
+    md_store_fs_t *s_fs = FS_STORE(store);
+    return md_util_pool_vdo(pfs_move, s_fs, p, from, to, name, archive, NULL);
+}
+
+/**************************************************************************************************/
+/* transactions */
+
+/* A transaction writes its aspects into a fresh directory "txn/<group>/<pid>-<seq>-<name>",
+ * on the same file system as the group itself. Commit swaps it with the previous version 
+ * of the MD where the platform can do that in one step. Otherwise, the previous version
+ * is first moved to "<pid>-<seq>+<name>". Should the process die before the new one is 
+ * in place, the next store init or transaction in the group puts it back. Other 
+ * directories left behind by a crashed process are removed once they are older than 
+ * FS_TXN_STALE.
+ */
+#define FS_TXN_DIR          "txn"
+#define FS_TXN_NEW          '-'
+#define FS_TXN_OLD          '+'
+#define FS_TXN_STALE        apr_time_from_sec(60 * 60)
+
+typedef struct {
+    md_store_fs_t *s_fs;
+    const char *tdir;       /* the transaction directory of the group */
+    const char *id;         /* <pid>-<seq> */
+    const char *dir;        /* where the aspects are written to */
+} fs_txn_t;
+
+static apr_uint32_t txn_seq;
+
+/* The MD name of a transaction directory entry and whether it is the new or old version */
+static const char *txn_name_of(const char *entry, char *pkind)
+{
+    const char *s = entry;
     
-    group = va_arg(ap, int);
-    name = va_arg(ap, const char*);
-    aspect = va_arg(ap, const char *);
-    force = va_arg(ap, int);
+    if (!apr_isdigit(*s)) return NULL;
+    while (apr_isdigit(*s)) ++s;
+    if ('-' != *s++ || !apr_isdigit(*s)) return NULL;
+    while (apr_isdigit(*s)) ++s;
+    if ((FS_TXN_NEW != *s && FS_TXN_OLD != *s) || !s[1]) return NULL;
+    *pkind = *s;
+    return s + 1;
+}
+
+/* Put back the previous version of an MD whose commit did not complete. Holding the 
+ * lock on the MD, a committing process has either finished or died. */
+static void txn_recover(md_store_fs_t *s_fs, md_store_group_t group, const char *tdir, 
+                        const char *entry, const char *name, apr_pool_t *p)
+{
+    const char *old, *pending, *gdir, *target;
+    char *s;
+    apr_status_t rv;
     
-    groupname = md_store_group_name(group);
+    s = apr_pstrdup(p, entry);
+    s[name - entry - 1] = FS_TXN_NEW;
+    if (APR_SUCCESS != md_util_path_merge(&old, p, tdir, entry, NULL)
+        || APR_SUCCESS != md_util_path_merge(&pending, p, tdir, s, NULL)
+        || APR_SUCCESS != fs_wlock(s_fs, group, name, p)
+        || APR_SUCCESS != md_util_is_dir(old, p)
+        || APR_SUCCESS != fs_get_dname(&gdir, &s_fs->s, group, NULL, p)
+        || APR_SUCCESS != md_util_path_merge(&target, p, gdir, name, NULL)) {
+        return;
+    }
     
-    if (APR_SUCCESS == (rv = md_util_path_merge(&dir, ptemp, s_fs->base, groupname, name, NULL))
-        && APR_SUCCESS == (rv = md_util_path_merge(&fpath, ptemp, dir, aspect, NULL))) {
-        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, ptemp, "start remove of md %s/%s/%s", 
-                      groupname, name, aspect);
+    if (APR_SUCCESS == md_util_is_dir(target, p)) {
+        /* the commit went through, only the cleanup was missed */
+        md_util_rm_recursive(old, p, 1);
+    }
+    else if (APR_SUCCESS == (rv = apr_file_rename(old, target, p))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, 0, p, 
+                      "%s/%s: restored previous version after interrupted commit", 
+                      md_store_group_name(group), name);
+        if (APR_SUCCESS != (rv = md_util_fsync_path(gdir, p))) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, p, "syncing %s", gdir);
+        }
+        journal_add(s_fs, MD_S_FS_CH_SAVE, group, name, NULL, p);
+    }
+    else {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "rename from %s to %s", old, target);
+        return;
+    }
+    md_util_rm_recursive(pending, p, 1);
+}
 
-        if (APR_SUCCESS != (rv = apr_stat(&info, dir, APR_FINFO_TYPE, ptemp))) {
-            if (APR_ENOENT == rv && force) {
-                return APR_SUCCESS;
+static void txn_sweep(md_store_fs_t *s_fs, md_store_group_t group, const char *tdir, 
+                      apr_pool_t *ptemp)
+{
+    apr_dir_t *d;
+    apr_finfo_t entry;
+    apr_pool_t *p;
+    const char *path, *name;
+    apr_time_t now = apr_time_now();
+    char kind;
+    
+    if (APR_SUCCESS != apr_dir_open(&d, tdir, ptemp)) {
+        return;
+    }
+    while (APR_SUCCESS == apr_dir_read(&entry, APR_FINFO_NAME|APR_FINFO_MTIME, d)) {
+        if (entry.name[0] == '.') {
+            continue;
+        }
+        name = txn_name_of(entry.name, &kind);
+        if (name && FS_TXN_OLD == kind) {
+            /* a moved away version must not wait until it is stale */
+            if (APR_SUCCESS == apr_pool_create(&p, ptemp)) {
+                txn_recover(s_fs, group, tdir, entry.name, name, p);
+                apr_pool_destroy(p);
             }
-            return rv;
+            continue;
+        }
+        if (now - entry.mtime < FS_TXN_STALE) {
+            continue;
         }
+        if (APR_SUCCESS == md_util_path_merge(&path, ptemp, tdir, entry.name, NULL)) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, 0, ptemp, "removing stale %s", path);
+            md_util_rm_recursive(path, ptemp, 1);
+        }
+    }
+    apr_dir_close(d);
+}
+
+static apr_status_t txn_sweep_all(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_fs_t *s_fs = baton;
+    const char *tdir;
+    int group;
     
-        rv = apr_file_remove(fpath, ptemp);
-        if (APR_ENOENT == rv && force) {
-            rv = APR_SUCCESS;
+    (void)p;
+    (void)ap;
+    for (group = MD_SG_NONE + 1; group < MD_SG_COUNT; ++group) {
+        if (APR_SUCCESS == md_util_path_merge(&tdir, ptemp, s_fs->base, FS_TXN_DIR, 
+                                              md_store_group_name(group), NULL)
+            && APR_SUCCESS == md_util_is_dir(tdir, ptemp)) {
+            txn_sweep(s_fs, (md_store_group_t)group, tdir, ptemp);
         }
     }
-    return rv;
+    return APR_SUCCESS;
 }
 
-static apr_status_t fs_load(md_store_t *store, md_store_group_t group, 
-                            const char *name, const char *aspect,  
-                            md_store_vtype_t vtype, void **pvalue, apr_pool_t *p)
+static apr_status_t fs_txn_put(md_store_txn_t *txn, const char *aspect, 
+                               md_store_vtype_t vtype, void *value)
 {
-    md_store_fs_t *s_fs = FS_STORE(store);
-    return md_util_pool_vdo(pfs_load, s_fs, p, group, name, aspect, vtype, pvalue, NULL);
+    fs_txn_t *ftxn = txn->baton;
+    const char *fpath;
+    apr_pool_t *ptemp;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS != (rv = apr_pool_create(&ptemp, txn->p))) {
+        return rv;
+    }
+    if (APR_SUCCESS == (rv = md_util_path_merge(&fpath, ptemp, ftxn->dir, aspect, NULL))) {
+        rv = fs_fsave(ftxn->s_fs, txn->group, fpath, vtype, value, 1, txn->p, ptemp);
+    }
+    apr_pool_destroy(ptemp);
+    return rv;
 }
 
-static apr_status_t fs_save(md_store_t *store, apr_pool_t *p, md_store_group_t group, 
-                            const char *name, const char *aspect,  
-                            md_store_vtype_t vtype, void *value, int create)
+static apr_status_t txn_commit(md_store_txn_t *txn, fs_txn_t *ftxn, const char **pold, 
+                               apr_pool_t *ptemp)
 {
-    md_store_fs_t *s_fs = FS_STORE(store);
-    return md_util_pool_vdo(pfs_save, s_fs, p, group, name, aspect, 
-                            vtype, value, create, NULL);
+    md_store_fs_t *s_fs = ftxn->s_fs;
+    const char *gdir, *target, *old;
+    apr_status_t rv;
+    
+    *pold = NULL;
+    if (APR_SUCCESS != (rv = fs_wlock(s_fs, txn->group, txn->name, ptemp))
+        || APR_SUCCESS != (rv = mk_group_dir(&gdir, s_fs, txn->group, NULL, ptemp))
+        || APR_SUCCESS != (rv = md_util_path_merge(&target, ptemp, gdir, txn->name, NULL))) {
+        return rv;
+    }
+    
+    /* unless durability is left to the OS, the content must be on disk before
+     * the directory becomes visible */
+    switch (s_fs->sync_mode) {
+        case MD_S_FS_SYNC_BATCHED:
+            rv = sync_dir(ftxn->dir, ptemp);
+            break;
+        case MD_S_FS_SYNC_STRICT:
+            /* the files were synced when written */
+            rv = md_util_fsync_path(ftxn->dir, ptemp);
+            break;
+        default:
+            break;
+    }
+    if (APR_SUCCESS != rv) {
+        return rv;
+    }
+    
+    rv = APR_ENOTIMPL;
+    if (APR_SUCCESS == md_util_is_dir(target, ptemp)) {
+        if (APR_SUCCESS == (rv = md_util_rename_exchange(ftxn->dir, target, ptemp))) {
+            /* the transaction directory now holds the previous version */
+            *pold = ftxn->dir;
+        }
+        else if (!APR_STATUS_IS_ENOTIMPL(rv)) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ptemp, "exchange %s with %s", 
+                          ftxn->dir, target);
+            return rv;
+        }
+        else {
+            rv = md_util_path_merge(&old, ptemp, ftxn->tdir, apr_psprintf(ptemp, "%s%c%s", 
+                                    ftxn->id, FS_TXN_OLD, txn->name), NULL);
+            if (APR_SUCCESS != rv) {
+                return rv;
+            }
+            if (APR_SUCCESS != (rv = apr_file_rename(target, old, ptemp))) {
+                md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ptemp, "rename from %s to %s", 
+                              target, old);
+                return rv;
+            }
+            *pold = old;
+            rv = APR_ENOTIMPL;
+        }
+    }
+    if (APR_STATUS_IS_ENOTIMPL(rv) 
+        && APR_SUCCESS != (rv = apr_file_rename(ftxn->dir, target, ptemp))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ptemp, "rename from %s to %s", 
+                      ftxn->dir, target);
+        if (*pold && APR_SUCCESS == apr_file_rename(*pold, target, ptemp)) {
+            *pold = NULL;
+        }
+        return rv;
+    }
+    
+    if (APR_SUCCESS != (rv = md_util_fsync_path(gdir, ptemp))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, ptemp, "syncing %s", gdir);
+    }
+    journal_add(s_fs, MD_S_FS_CH_SAVE, txn->group, txn->name, NULL, ptemp);
+    return dispatch(s_fs, MD_S_FS_EV_CREATED, txn->group, target, APR_DIR, ptemp);
 }
 
-static apr_status_t fs_remove(md_store_t *store, md_store_group_t group, 
-                              const char *name, const char *aspect, 
-                              apr_pool_t *p, int force)
+static apr_status_t fs_txn_end(md_store_txn_t *txn, int commit)
 {
-    md_store_fs_t *s_fs = FS_STORE(store);
-    return md_util_pool_vdo(pfs_remove, s_fs, p, group, name, aspect, force, NULL);
+    fs_txn_t *ftxn = txn->baton;
+    const char *old = NULL;
+    apr_pool_t *ptemp;
+    apr_status_t rv = APR_SUCCESS;
+    
+    if (APR_SUCCESS != (rv = apr_pool_create(&ptemp, txn->p))) {
+        return rv;
+    }
+    if (commit) {
+        rv = txn_commit(txn, ftxn, &old, ptemp);
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ptemp, "commit %s/%s", 
+                      md_store_group_name(txn->group), txn->name);
+    }
+    if (old) {
+        md_util_rm_recursive(old, ptemp, 1);
+    }
+    if (!commit || APR_SUCCESS != rv) {
+        md_util_rm_recursive(ftxn->dir, ptemp, 1);
+    }
+    /* the replaced or discarded files may have held the last link to a chain */
+    chains_gc(ftxn->s_fs, ptemp);
+    apr_pool_destroy(ptemp);
+    return rv;
 }
 
-static apr_status_t pfs_purge(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+static apr_status_t pfs_txn_begin(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
 {
     md_store_fs_t *s_fs = baton;
-    const char *dir, *name, *groupname;
+    md_store_txn_t **ptxn, *txn;
     md_store_group_t group;
+    fs_txn_t *ftxn;
+    const char *name, *tdir, *id;
+    const perms_t *perms;
     apr_status_t rv;
     
+    ptxn = va_arg(ap, md_store_txn_t **);
     group = va_arg(ap, int);
-    name = va_arg(ap, const char*);
+    name = va_arg(ap, const char *);
     
-    groupname = md_store_group_name(group);
+    perms = gperms(s_fs, group);
+    rv = md_util_path_merge(&tdir, ptemp, s_fs->base, FS_TXN_DIR, NULL);
+    if (APR_SUCCESS != rv) goto out;
+    /* like the store base, the per group directories below decide access */
+    rv = apr_dir_make_recursive(tdir, MD_FPROT_D_UALL_WREAD, ptemp);
+    if (APR_SUCCESS != rv) goto out;
+    rv = md_util_path_merge(&tdir, ptemp, tdir, md_store_group_name(group), NULL);
+    if (APR_SUCCESS != rv) goto out;
+    
+    if (APR_SUCCESS != md_util_is_dir(tdir, ptemp)) {
+        rv = apr_dir_make_recursive(tdir, perms->dir, ptemp);
+        if (APR_SUCCESS != rv) goto out;
+        rv = dispatch(s_fs, MD_S_FS_EV_CREATED, group, tdir, APR_DIR, ptemp);
+        if (APR_SUCCESS != rv) goto out;
+    }
+    else {
+        txn_sweep(s_fs, group, tdir, ptemp);
+    }
+    
+    ftxn = apr_pcalloc(p, sizeof(*ftxn));
+    ftxn->s_fs = s_fs;
+    ftxn->tdir = apr_pstrdup(p, tdir);
+    ftxn->id = apr_psprintf(p, "%" APR_PID_T_FMT "-%u", (apr_pid_t)getpid(), 
+                            (unsigned int)apr_atomic_inc32(&txn_seq));
+    id = apr_psprintf(ptemp, "%s%c%s", ftxn->id, FS_TXN_NEW, name);
+    rv = md_util_path_merge(&ftxn->dir, p, tdir, id, NULL);
+    if (APR_SUCCESS != rv) goto out;
 
-    if (APR_SUCCESS == (rv = md_util_path_merge(&dir, ptemp, s_fs->base, groupname, name, NULL))) {
-        /* Remove all files in dir, there should be no sub-dirs */
-        rv = md_util_rm_recursive(dir, ptemp, 1);
+    rv = apr_dir_make(ftxn->dir, perms->dir, ptemp);
+    if (APR_STATUS_IS_EEXIST(rv)) {
+        /* left behind by an earlier process with the same pid */
+        md_util_rm_recursive(ftxn->dir, ptemp, 1);
+        rv = apr_dir_make(ftxn->dir, perms->dir, ptemp);
     }
-    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ptemp, "purge %s/%s (%s)", groupname, name, dir);
-    return APR_SUCCESS;
+    if (APR_SUCCESS != rv) goto out;
+    rv = apr_file_perms_set(ftxn->dir, perms->dir);
+    if (APR_STATUS_IS_ENOTIMPL(rv)) {
+        rv = APR_SUCCESS;
+    }
+    if (APR_SUCCESS != rv) {
+        md_util_rm_recursive(ftxn->dir, ptemp, 1);
+        goto out;
+    }
+    
+    txn = apr_pcalloc(p, sizeof(*txn));
+    txn->put = fs_txn_put;
+    txn->end = fs_txn_end;
+    txn->baton = ftxn;
+    *ptxn = txn;
+out:
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, rv, ptemp, "begin txn %s/%s", 
+                  md_store_group_name(group), name);
+    return rv;
 }
 
-static apr_status_t fs_purge(md_store_t *store, apr_pool_t *p, 
-                             md_store_group_t group, const char *name)
+static apr_status_t fs_txn_begin(md_store_txn_t **ptxn, md_store_t *store, apr_pool_t *p, 
+                                 md_store_group_t group, const char *name)
 {
     md_store_fs_t *s_fs = FS_STORE(store);
-    return md_util_pool_vdo(pfs_purge, s_fs, p, group, name, NULL);
+    
+    *ptxn = NULL;
+    return md_util_pool_vdo(pfs_txn_begin, s_fs, p, ptxn, group, name, NULL);
 }
 
 /**************************************************************************************************/
-/* iteration */
+/* watching */
 
-typedef struct {
+/* inotify does not watch subdirectories, so the group directories and each MD directory
+ * in them get a watch of their own. MD directories are replaced by renames, which shows
+ * in the group directory and gives the new directory a new watch. The store base is
+ * watched for the group directories appearing.
+ * inotify does not tell who made a change. Writers hold the exclusive lock of an MD,
+ * so what happens to an MD while this process holds its lock is its own doing. The
+ * events queued up to taking the lock are read before, the ones queued until it is 
+ * released are read and dropped then. */
+
+struct md_store_fs_watch_t {
     md_store_fs_t *s_fs;
+    apr_pool_t *p;
+    apr_interval_time_t debounce;
+    int fd;
+    apr_hash_t *dirs;           /* watched directory by watch descriptor */
+    apr_hash_t *own;            /* "<group>/<name>" of MDs this process holds locked */
+    apr_pool_t *pending_pool;
+    apr_hash_t *pending;        /* "<group>/<name>" of MDs changed since the last report */
+    int pending_all;            /* events were lost */
+    apr_time_t last_event;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;  /* the lock holders may be other threads than the poller */
+#endif
+};
+
+#ifdef MD_HAVE_INOTIFY
+
+#define FS_WATCH_GROUPS     2
+
+static const md_store_group_t watched_groups[FS_WATCH_GROUPS] = {
+    MD_SG_DOMAINS, MD_SG_STAGING
+};
+
+#define FS_WATCH_GROUP_EVENTS   (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_ONLYDIR)
+#define FS_WATCH_MD_EVENTS      (IN_CLOSE_WRITE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_ONLYDIR)
+
+typedef struct {
+    int wd;
+    int level;                  /* 0 store base, 1 group dir, 2 MD dir */
     md_store_group_t group;
-    const char *pattern;
-    const char *aspect;
-    md_store_vtype_t vtype;
-    md_store_inspect *inspect;
-    void *baton;
-} inspect_ctx;
+    const char *name;           /* of the MD */
+} watch_dir_t;
 
-static apr_status_t insp(void *baton, apr_pool_t *p, apr_pool_t *ptemp, 
-                         const char *dir, const char *name, apr_filetype_e ftype)
+static apr_status_t watch_cleanup(void *data)
 {
-    inspect_ctx *ctx = baton;
-    apr_status_t rv;
-    void *value;
-    const char *fpath;
+    md_store_fs_watch_t *watch = data;
     
-    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, ptemp, "inspecting value at: %s/%s", dir, name);
-    if (APR_SUCCESS == (rv = md_util_path_merge(&fpath, ptemp, dir, name, NULL))) {
-        rv = fs_fload(&value, ctx->s_fs, fpath, ctx->group, ctx->vtype, p, ptemp);
-        if (APR_SUCCESS == rv 
-            && !ctx->inspect(ctx->baton, name, ctx->aspect, ctx->vtype, value, ptemp)) {
-            return APR_EOF;
-        }
+    if (watch->s_fs->watch == watch) {
+        watch->s_fs->watch = NULL;
     }
-    return rv;
+    if (watch->fd >= 0) {
+        close(watch->fd);
+        watch->fd = -1;
+    }
+    return APR_SUCCESS;
 }
 
-static apr_status_t fs_iterate(md_store_inspect *inspect, void *baton, md_store_t *store, 
-                               apr_pool_t *p, md_store_group_t group, const char *pattern, 
-                               const char *aspect, md_store_vtype_t vtype)
+static void watch_mark(md_store_fs_watch_t *watch, md_store_group_t group, const char *name)
 {
-    const char *groupname;
+    char own[512];
+    const char *key;
+    
+    apr_snprintf(own, sizeof(own), "%d/%s", group, name);
+    if (apr_hash_get(watch->own, own, APR_HASH_KEY_STRING)) {
+        /* written by this process */
+        return;
+    }
+    key = apr_psprintf(watch->pending_pool, "%d/%s", group, name);
+    apr_hash_set(watch->pending, key, APR_HASH_KEY_STRING, key);
+    watch->last_event = apr_time_now();
+}
+
+static apr_status_t watch_add(md_store_fs_watch_t *watch, int level, md_store_group_t group, 
+                              const char *name, apr_pool_t *ptemp)
+{
+    watch_dir_t *wdir;
+    const char *dir;
     apr_status_t rv;
-    inspect_ctx ctx;
+    int wd;
     
-    ctx.s_fs = FS_STORE(store);
-    ctx.group = group;
-    ctx.pattern = pattern;
-    ctx.aspect = aspect;
-    ctx.vtype = vtype;
-    ctx.inspect = inspect;
-    ctx.baton = baton;
-    groupname = md_store_group_name(group);
+    switch (level) {
+        case 0:
+            dir = watch->s_fs->base;
+            break;
+        case 1:
+            if (APR_SUCCESS != (rv = fs_get_dname(&dir, &watch->s_fs->s, group, NULL, ptemp))) {
+                return rv;
+            }
+            break;
+        default:
+            if (APR_SUCCESS != (rv = fs_get_dname(&dir, &watch->s_fs->s, group, name, ptemp))) {
+                return rv;
+            }
+            break;
+    }
+    wd = inotify_add_watch(watch->fd, dir, (level == 2)? FS_WATCH_MD_EVENTS 
+                                                        : FS_WATCH_GROUP_EVENTS);
+    if (wd < 0) {
+        return APR_FROM_OS_ERROR(errno);
+    }
+    if (!apr_hash_get(watch->dirs, &wd, sizeof(wd))) {
+        wdir = apr_pcalloc(watch->p, sizeof(*wdir));
+        wdir->wd = wd;
+        wdir->level = level;
+        wdir->group = group;
+        wdir->name = name? apr_pstrdup(watch->p, name) : NULL;
+        apr_hash_set(watch->dirs, &wdir->wd, sizeof(wdir->wd), wdir);
+    }
+    md_log_perror(MD_LOG_MARK, MD_LOG_TRACE3, 0, ptemp, "watching %s", dir);
+    return APR_SUCCESS;
+}
 
-    rv = md_util_files_do(insp, &ctx, p, ctx.s_fs->base, groupname, ctx.pattern, aspect, NULL);
+/* Watch a group directory and all MD directories in it. With 'mark', report all of them
+ * as changed, as they may have changed before the watch was in place. */
+static apr_status_t watch_add_group(md_store_fs_watch_t *watch, md_store_group_t group, 
+                                    int mark, apr_pool_t *ptemp)
+{
+    apr_dir_t *d;
+    apr_finfo_t entry;
+    const char *gdir;
+    apr_status_t rv;
     
+    if (APR_SUCCESS != (rv = watch_add(watch, 1, group, NULL, ptemp))
+        || APR_SUCCESS != (rv = fs_get_dname(&gdir, &watch->s_fs->s, group, NULL, ptemp))
+        || APR_SUCCESS != (rv = apr_dir_open(&d, gdir, ptemp))) {
+        return rv;
+    }
+    while (APR_SUCCESS == apr_dir_read(&entry, APR_FINFO_NAME|APR_FINFO_TYPE, d)) {
+        if (APR_DIR != entry.filetype || entry.name[0] == '.') {
+            continue;
+        }
+        rv = watch_add(watch, 2, group, entry.name, ptemp);
+        if (APR_SUCCESS != rv && !APR_STATUS_IS_ENOENT(rv) && !APR_STATUS_IS_EACCES(rv)) {
+            break;
+        }
+        rv = APR_SUCCESS;
+        if (mark) {
+            watch_mark(watch, group, entry.name);
+        }
+    }
+    apr_dir_close(d);
     return rv;
 }
 
-/**************************************************************************************************/
-/* moving */
+/* Files the store writes for itself, their changes change no MD */
+static int watch_ignored(const char *fname)
+{
+    apr_size_t len = strlen(fname), elen = sizeof(FS_DER_EXT) - 1;
+    
+    return (fname[0] == '.' || (len > elen && !strcmp(fname + len - elen, FS_DER_EXT))
+            || (len > 4 && !strcmp(fname + len - 4, ".tmp")));
+}
 
-static apr_status_t pfs_move(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+static void watch_event(md_store_fs_watch_t *watch, const struct inotify_event *ev, 
+                        apr_pool_t *ptemp)
 {
-    md_store_fs_t *s_fs = baton;
-    const char *name, *from_group, *to_group, *from_dir, *to_dir, *arch_dir, *dir;
-    md_store_group_t from, to;
-    int archive;
-    apr_status_t rv;
+    watch_dir_t *wdir;
+    md_store_group_t group;
+    int i;
     
-    from = va_arg(ap, int);
-    to = va_arg(ap, int);
-    name = va_arg(ap, const char*);
-    archive = va_arg(ap, int);
+    if (ev->mask & IN_Q_OVERFLOW) {
+        watch->pending_all = 1;
+        watch->last_event = apr_time_now();
+        return;
+    }
+    if (!(wdir = apr_hash_get(watch->dirs, &ev->wd, sizeof(ev->wd)))) {
+        return;
+    }
+    if (ev->mask & IN_IGNORED) {
+        /* the directory is gone, the descriptor may be given out again */
+        apr_hash_set(watch->dirs, &ev->wd, sizeof(ev->wd), NULL);
+        return;
+    }
+    if (!ev->len || watch_ignored(ev->name)) {
+        return;
+    }
+    switch (wdir->level) {
+        case 0:
+            if ((ev->mask & (IN_CREATE|IN_MOVED_TO)) && (ev->mask & IN_ISDIR)) {
+                for (i = 0; i < FS_WATCH_GROUPS; ++i) {
+                    group = watched_groups[i];
+                    if (!strcmp(ev->name, md_store_group_name(group))) {
+                        watch_add_group(watch, group, 1, ptemp);
+                    }
+                }
+            }
+            break;
+        case 1:
+            if ((ev->mask & (IN_CREATE|IN_MOVED_TO)) && (ev->mask & IN_ISDIR)) {
+                watch_add(watch, 2, wdir->group, ev->name, ptemp);
+            }
+            watch_mark(watch, wdir->group, ev->name);
+            break;
+        default:
+            watch_mark(watch, wdir->group, wdir->name);
+            break;
+    }
+}
+
+static apr_status_t watch_read(md_store_fs_watch_t *watch, apr_pool_t *ptemp)
+{
+    union {
+        struct inotify_event ev;
+        char buf[4096];
+    } u;
+    const struct inotify_event *ev;
+    const char *data;
+    ssize_t len;
     
-    from_group = md_store_group_name(from);
-    to_group = md_store_group_name(to);
-    if (!strcmp(from_group, to_group)) {
-        return APR_EINVAL;
+    while (1) {
+        len = read(watch->fd, u.buf, sizeof(u.buf));
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK)? 
+                APR_SUCCESS : APR_FROM_OS_ERROR(errno);
+        }
+        for (data = u.buf; data < u.buf + len; data += sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event *)data;
+            watch_event(watch, ev, ptemp);
+        }
     }
+}
 
-    rv = md_util_path_merge(&from_dir, ptemp, s_fs->base, from_group, name, NULL);
-    if (APR_SUCCESS != rv) goto out;
-    rv = md_util_path_merge(&to_dir, ptemp, s_fs->base, to_group, name, NULL);
-    if (APR_SUCCESS != rv) goto out;
+apr_status_t md_store_fs_watch(md_store_fs_watch_t **pwatch, md_store_t *store, 
+                               apr_pool_t *p, apr_interval_time_t debounce)
+{
+    md_store_fs_t *s_fs = FS_STORE(store);
+    md_store_fs_watch_t *watch;
+    apr_pool_t *ptemp;
+    apr_status_t rv;
+    int i;
     
-    if (APR_SUCCESS != (rv = md_util_is_dir(from_dir, ptemp))) {
-        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ptemp, "source is no dir: %s", from_dir);
-        goto out;
+    *pwatch = NULL;
+    watch = apr_pcalloc(p, sizeof(*watch));
+    watch->s_fs = s_fs;
+    watch->p = p;
+    watch->debounce = debounce;
+    watch->dirs = apr_hash_make(p);
+    watch->own = apr_hash_make(p);
+    if (APR_SUCCESS != (rv = apr_pool_create(&watch->pending_pool, p))) {
+        return rv;
+    }
+#if APR_HAS_THREADS
+    if (APR_SUCCESS != (rv = apr_thread_mutex_create(&watch->mutex, 
+                                                     APR_THREAD_MUTEX_DEFAULT, p))) {
+        return rv;
     }
+#endif
+    watch->pending = apr_hash_make(watch->pending_pool);
     
-    rv = archive? md_util_is_dir(to_dir, ptemp) : APR_ENOENT;
-    if (APR_SUCCESS == rv) {
-        int n = 1;
-        const char *narch_dir;
-
-        rv = md_util_path_merge(&dir, ptemp, s_fs->base, md_store_group_name(MD_SG_ARCHIVE), NULL);
-        if (APR_SUCCESS != rv) goto out;
-        rv = apr_dir_make_recursive(dir, MD_FPROT_D_UONLY, ptemp); 
-        if (APR_SUCCESS != rv) goto out;
-        rv = md_util_path_merge(&arch_dir, ptemp, dir, name, NULL);
-        if (APR_SUCCESS != rv) goto out;
-        
-        while (1) {
-            narch_dir = apr_psprintf(ptemp, "%s.%d", arch_dir, n);
-            rv = apr_dir_make(narch_dir, MD_FPROT_D_UONLY, ptemp);
-            if (APR_SUCCESS == rv) {
-                md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ptemp, "using archive dir: %s", 
-                              narch_dir);
-                break;
+    if ((watch->fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC)) < 0) {
+        return APR_FROM_OS_ERROR(errno);
+    }
+    apr_pool_cleanup_register(p, watch, watch_cleanup, apr_pool_cleanup_null);
+    
+    if (APR_SUCCESS != (rv = apr_pool_create(&ptemp, p))) {
+        return rv;
+    }
+    if (APR_SUCCESS == (rv = watch_add(watch, 0, MD_SG_NONE, NULL, ptemp))) {
+        for (i = 0; i < FS_WATCH_GROUPS; ++i) {
+            rv = watch_add_group(watch, watched_groups[i], 0, ptemp);
+            if (APR_STATUS_IS_ENOENT(rv)) {
+                /* watched once it is created */
+                rv = APR_SUCCESS;
             }
-            else if (APR_EEXIST == rv) {
-                ++n;
+            else if (APR_STATUS_IS_EACCES(rv)) {
+                /* e.g. a child process running as another user than the store owner */
+                md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, ptemp, "store group %s not "
+                              "readable, its changes are not watched", 
+                              md_store_group_name(watched_groups[i]));
+                rv = APR_SUCCESS;
             }
-            else {
-                md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ptemp, "creating archive dir: %s", 
-                              narch_dir);
-                goto out;
+            else if (APR_SUCCESS != rv) {
+                break;
             }
-        } 
-        
-        if (APR_SUCCESS != (rv = apr_file_rename(to_dir, narch_dir, ptemp))) {
-                md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ptemp, "rename from %s to %s", 
-                              to_dir, narch_dir);
-                goto out;
-        }
-        if (APR_SUCCESS != (rv = apr_file_rename(from_dir, to_dir, ptemp))) {
-            md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ptemp, "moving %s to %s: %s", 
-                          from_dir, to_dir);
-            apr_file_rename(narch_dir, to_dir, ptemp);
-            goto out;
         }
-        rv = dispatch(s_fs, MD_S_FS_EV_MOVED, to, to_dir, APR_DIR, ptemp);
-        if (APR_SUCCESS == rv) {
-            rv = dispatch(s_fs, MD_S_FS_EV_MOVED, MD_SG_ARCHIVE, narch_dir, APR_DIR, ptemp);
+    }
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ptemp, "watching store %s, %d directories", 
+                  s_fs->base, (int)apr_hash_count(watch->dirs));
+    apr_pool_destroy(ptemp);
+    if (APR_SUCCESS == rv) {
+        s_fs->watch = watch;
+        *pwatch = watch;
+    }
+    return rv;
+}
+
+/* Others changed MDs, the shared certs we kept from their chains may be gone or replaced. 
+ * Blobs are shared between MDs, so all are dropped and read again on the next load. */
+static void watch_der_forget(md_store_fs_t *s_fs)
+{
+    if (!s_fs->der_blobs) {
+        return;
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(s_fs->der_mutex);
+#endif
+    apr_pool_clear(s_fs->der_pool);
+    s_fs->der_blobs = apr_hash_make(s_fs->der_pool);
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(s_fs->der_mutex);
+#endif
+}
+
+apr_status_t md_store_fs_watch_poll(apr_array_header_t **pnames, int *pall, 
+                                    md_store_fs_watch_t *watch, apr_pool_t *p)
+{
+    apr_array_header_t *names;
+    apr_hash_index_t *hi;
+    const char *key, *name;
+    const void *vkey;
+    apr_hash_t *seen;
+    apr_status_t rv;
+    
+    names = apr_array_make(p, 5, sizeof(const char *));
+    *pnames = names;
+    *pall = 0;
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(watch->mutex);
+#endif
+    if (APR_SUCCESS != (rv = watch_read(watch, p))
+        || (!watch->pending_all && !apr_hash_count(watch->pending))
+        || apr_time_now() - watch->last_event < watch->debounce) {
+        /* nothing happened or it is still going on */
+        goto leave;
+    }
+    
+    seen = apr_hash_make(p);
+    for (hi = apr_hash_first(p, watch->pending); hi; hi = apr_hash_next(hi)) {
+        apr_hash_this(hi, &vkey, NULL, NULL);
+        key = vkey;
+        name = strchr(key, '/') + 1;
+        if (!apr_hash_get(seen, name, APR_HASH_KEY_STRING)) {
+            name = apr_pstrdup(p, name);
+            apr_hash_set(seen, name, APR_HASH_KEY_STRING, name);
+            APR_ARRAY_PUSH(names, const char *) = name;
         }
     }
-    else if (APR_STATUS_IS_ENOENT(rv)) {
-        if (APR_SUCCESS != (rv = apr_file_rename(from_dir, to_dir, ptemp))) {
-            md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ptemp, "rename from %s to %s", 
-                          from_dir, to_dir);
-            goto out;
+    *pall = watch->pending_all;
+    apr_pool_clear(watch->pending_pool);
+    watch->pending = apr_hash_make(watch->pending_pool);
+    watch->pending_all = 0;
+    watch_der_forget(watch->s_fs);
+leave:
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(watch->mutex);
+#endif
+    return rv;
+}
+
+static int watch_is_watched(md_store_group_t group)
+{
+    int i;
+    
+    for (i = 0; i < FS_WATCH_GROUPS; ++i) {
+        if (watched_groups[i] == group) {
+            return 1;
         }
     }
-    else {
-        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ptemp, "target is no dir: %s", to_dir);
-        goto out;
+    return 0;
+}
+
+/* This process locked an MD for writing. What was queued before is someone else's. */
+static void watch_own_begin(md_store_fs_t *s_fs, md_store_group_t group, const char *name,
+                            apr_pool_t *p)
+{
+    md_store_fs_watch_t *watch = s_fs->watch;
+    const char *key;
+    
+    if (!watch || !watch_is_watched(group)) {
+        return;
     }
+    key = apr_psprintf(p, "%d/%s", group, name);
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(watch->mutex);
+#endif
+    watch_read(watch, p);
+    apr_hash_set(watch->own, key, APR_HASH_KEY_STRING, key);
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(watch->mutex);
+#endif
+}
+
+/* The lock is about to be released. What was queued until now for the MD is its own. */
+static void watch_own_end(md_store_fs_t *s_fs, md_store_group_t group, const char *name)
+{
+    md_store_fs_watch_t *watch = s_fs->watch;
+    apr_pool_t *ptemp;
+    char key[512];
     
-out:
-    return rv;
+    if (!watch || !watch_is_watched(group)) {
+        return;
+    }
+    apr_snprintf(key, sizeof(key), "%d/%s", group, name);
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(watch->mutex);
+#endif
+    if (apr_hash_get(watch->own, key, APR_HASH_KEY_STRING)) {
+        if (APR_SUCCESS == apr_pool_create(&ptemp, watch->p)) {
+            watch_read(watch, ptemp);
+            apr_pool_destroy(ptemp);
+        }
+        apr_hash_set(watch->own, key, APR_HASH_KEY_STRING, NULL);
+    }
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(watch->mutex);
+#endif
 }
 
-static apr_status_t fs_move(md_store_t *store, apr_pool_t *p, 
-                            md_store_group_t from, md_store_group_t to, 
-                            const char *name, int archive)
+#else /* MD_HAVE_INOTIFY */
+
+apr_status_t md_store_fs_watch(md_store_fs_watch_t **pwatch, md_store_t *store, 
+                               apr_pool_t *p, apr_interval_time_t debounce)
+{
+    *pwatch = NULL;
+    return APR_ENOTIMPL;
+}
+
+apr_status_t md_store_fs_watch_poll(apr_array_header_t **pnames, int *pall, 
+                                    md_store_fs_watch_t *watch, apr_pool_t *p)
+{
+    *pnames = apr_array_make(p, 1, sizeof(const char *));
+    *pall = 0;
+    return APR_ENOTIMPL;
+}
+
+static void watch_own_begin(md_store_fs_t *s_fs, md_store_group_t group, const char *name,
+                            apr_pool_t *p)
 {
-    md_store_fs_t *s_fs = FS_STORE(store);
-    return md_util_pool_vdo(pfs_move, s_fs, p, from, to, name, archive, NULL);
 }
+
+static void watch_own_end(md_store_fs_t *s_fs, md_store_group_t group, const char *name)
+{
+}
+
+#endif /* MD_HAVE_INOTIFY */
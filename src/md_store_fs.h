@@ -52,6 +52,7 @@ apr_status_t md_store_fs_group_perms_set(struct md_store_t *store,
 typedef enum {
     MD_S_FS_EV_CREATED,
     MD_S_FS_EV_MOVED,
+    MD_S_FS_EV_LOCK_CREATED     /* a lock file, opened for writing by writers of the group */
 } md_store_fs_ev_t; 
 
 typedef apr_status_t md_store_fs_cb(void *baton, struct md_store_t *store,
@@ -61,4 +62,170 @@ typedef apr_status_t md_store_fs_cb(void *baton, struct md_store_t *store,
                                     
 apr_status_t md_store_fs_set_event_cb(struct md_store_t *store, md_store_fs_cb *cb, void *baton);
 
+/**
+ * Keep DER encoded copies of certificate and chain files, with chain certificates
+ * stored once for all domains, and load from those while their PEM files have the size,
+ * modification time and inode they were saved with. The copies are written when a
+ * certificate or chain is saved, PEM files saved before are loaded as they are.
+ */
+apr_status_t md_store_fs_der_cache_set(struct md_store_t *store, int enabled);
+
+typedef enum {
+    MD_S_FS_SYNC_NONE,          /* leave writing back to the operating system */
+    MD_S_FS_SYNC_BATCHED,       /* sync all changes once per commit window */
+    MD_S_FS_SYNC_STRICT         /* sync every file and directory as it is written */
+} md_store_fs_sync_t;
+
+/**
+ * Set how changes to directories are made durable. MD_S_FS_SYNC_BATCHED syncs on 
+ * md_store_sync() and on the first change after 'window' has passed since the oldest 
+ * unsynced one. MD_S_FS_SYNC_STRICT also syncs newly created files right away. 
+ * Replaced files are synced before their rename in every mode.
+ */
+apr_status_t md_store_fs_durability_set(struct md_store_t *store, md_store_fs_sync_t mode,
+                                        apr_interval_time_t window);
+
+/**************************************************************************************************/
+/* locking */
+
+typedef enum {
+    MD_S_FS_LOCK_SHARED,
+    MD_S_FS_LOCK_EXCLUSIVE
+} md_store_fs_lock_mode_t;
+
+typedef struct md_store_fs_lock_t md_store_fs_lock_t;
+
+/**
+ * Lock MD 'name' in 'group' for other processes and threads. The store takes exclusive
+ * locks itself when it writes an MD. Loading takes no lock and never waits, as files 
+ * are always replaced atomically. A shared lock keeps all writers of the MD out, e.g. 
+ * to read several of its files consistently.
+ *
+ * With 'timeout' < 0 wait until the lock is granted, otherwise give up with APR_TIMEUP 
+ * after 'timeout'. The lock is held until released or pool 'p' is destroyed. A thread 
+ * that holds an exclusive lock may make further changes to the MD via the store.
+ */
+apr_status_t md_store_fs_lock(md_store_fs_lock_t **plock, struct md_store_t *store, 
+                              apr_pool_t *p, md_store_group_t group, const char *name,
+                              md_store_fs_lock_mode_t mode, apr_interval_time_t timeout);
+void md_store_fs_unlock(md_store_fs_lock_t *lock);
+
+typedef struct md_store_fs_lock_stats_t md_store_fs_lock_stats_t;
+struct md_store_fs_lock_stats_t {
+    apr_uint32_t acquired;          /* locks granted */
+    apr_uint32_t contended;         /* of those, granted only after waiting */
+    apr_uint32_t timeouts;          /* locks given up on */
+    apr_interval_time_t wait_total; /* time spent waiting for locks */
+    apr_interval_time_t wait_max;   /* longest single wait */
+};
+
+/**
+ * Get the lock statistics of the store since it was created in this process.
+ */
+void md_store_fs_lock_stats_get(md_store_fs_lock_stats_t *stats, struct md_store_t *store);
+
+/**************************************************************************************************/
+/* archive */
+
+/**
+ * A generation of a managed domain, archived when a new one replaced it in its group.
+ */
+typedef struct md_store_fs_gen_t md_store_fs_gen_t;
+struct md_store_fs_gen_t {
+    long n;                     /* generation number, increasing per MD */
+    apr_time_t archived;        /* when it was archived */
+    int packed;                 /* stored in the MD's tarball, not in its own directory */
+};
+
+/**
+ * Set how many generations are kept per MD: the last 'keep' ones and all that were
+ * archived less than 'max_age' ago. With both <= 0, the archive is never pruned.
+ */
+apr_status_t md_store_fs_archive_retention_set(struct md_store_t *store, int keep, 
+                                               apr_interval_time_t max_age);
+
+/**
+ * Get the archived generations of MD 'name' as md_store_fs_gen_t*, oldest first.
+ */
+apr_status_t md_store_fs_archive_list(apr_array_header_t **pgens, struct md_store_t *store, 
+                                      const char *name, apr_pool_t *p);
+
+/**
+ * Make generation 'n' of MD 'name' the one in MD_SG_DOMAINS again. The current one
+ * is archived as a new generation.
+ */
+apr_status_t md_store_fs_archive_restore(struct md_store_t *store, apr_pool_t *p, 
+                                         const char *name, long n);
+
+/**
+ * Apply the retention policy to all archived MDs and pack every generation but the
+ * newest, when archived at least 'min_age' ago, into one tarball per MD. Shared DER 
+ * blobs that no MD refers to any more and that are at least 'min_age' old are removed.
+ */
+apr_status_t md_store_fs_archive_compact(struct md_store_t *store, apr_pool_t *p, 
+                                         apr_interval_time_t min_age);
+
+/**************************************************************************************************/
+/* journal */
+
+typedef enum {
+    MD_S_FS_CH_SAVE,            /* an aspect or, with a transaction, all of the MD saved */
+    MD_S_FS_CH_REMOVE,          /* an aspect removed */
+    MD_S_FS_CH_PURGE,           /* the MD removed from the group */
+    MD_S_FS_CH_MOVE             /* the MD moved into or out of the group */
+} md_store_fs_change_op_t;
+
+typedef struct md_store_fs_change_t md_store_fs_change_t;
+struct md_store_fs_change_t {
+    apr_int64_t seq;            /* sequence number, one more than the change before */
+    md_store_fs_change_op_t op;
+    md_store_group_t group;
+    const char *name;
+    const char *aspect;         /* NULL when all of the MD changed */
+};
+
+/**
+ * Record every change to the store in a journal file in its base directory, with
+ * a sequence number. Once the journal exceeds 'max_size' (<= 0 for the default),
+ * its older half is dropped. Every process opening the store journals its changes 
+ * once the file exists.
+ */
+apr_status_t md_store_fs_journal_set(struct md_store_t *store, int enabled, 
+                                     apr_off_t max_size);
+
+/**
+ * Get the changes with a sequence number after 'since' as md_store_fs_change_t, in the
+ * order they were made, and the number of the last change in *plast. A reader starting 
+ * from scratch passes 0, one only asking for *plast APR_INT64_MAX. Returns 
+ * APR_INCOMPLETE when changes after 'since' are no longer in the journal and the store 
+ * needs to be read in full, APR_ENOENT when the store has no journal.
+ */
+apr_status_t md_store_fs_changes(apr_array_header_t **pchanges, apr_int64_t *plast, 
+                                 struct md_store_t *store, apr_int64_t since, apr_pool_t *p);
+
+/**************************************************************************************************/
+/* watching */
+
+typedef struct md_store_fs_watch_t md_store_fs_watch_t;
+
+/**
+ * Watch the MD directories in MD_SG_DOMAINS and MD_SG_STAGING for changes made by other
+ * processes, e.g. a2md. Changes this process makes through the store, while holding
+ * the MD's write lock, are not reported. Groups this process may not read are left
+ * out with a warning. The watch ends when pool 'p' is destroyed.
+ * Returns APR_ENOTIMPL where the platform has no inotify.
+ */
+apr_status_t md_store_fs_watch(md_store_fs_watch_t **pwatch, struct md_store_t *store, 
+                               apr_pool_t *p, apr_interval_time_t debounce);
+
+/**
+ * Collect the changes seen so far, without waiting for any. Once no change came in for 
+ * 'debounce', *pnames gets the names of the changed MDs, each once, and the store drops 
+ * the shared chain certificates its DER cache holds in memory, so that the next loads 
+ * read them from disk again. Until then *pnames is empty.
+ * *pall is set when changes were lost and every MD may have changed.
+ */
+apr_status_t md_store_fs_watch_poll(apr_array_header_t **pnames, int *pall, 
+                                    md_store_fs_watch_t *watch, apr_pool_t *p);
+
 #endif /* mod_md_md_store_fs_h */
@@ -0,0 +1,1661 @@
+/* Copyright 2017 greenbytes GmbH (https://www.greenbytes.de)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <apr_lib.h>
+#include <apr_file_info.h>
+#include <apr_file_io.h>
+#include <apr_fnmatch.h>
+#include <apr_hash.h>
+#include <apr_mmap.h>
+#include <apr_strings.h>
+#include <apr_thread_mutex.h>
+
+#include "md.h"
+#include "md_crypt.h"
+#include "md_json.h"
+#include "md_log.h"
+#include "md_store.h"
+#include "md_store_fs.h"
+#include "md_store_log.h"
+#include "md_util.h"
+#include "md_version.h"
+
+/**************************************************************************************************/
+/* log based implementation of md_store_t */
+
+/* All values are kept in the file "md_store.log". After the magic, it is a sequence
+ * of records:
+ *
+ *   crc32 | op | group | vtype | 0 | name len:16 | aspect len:16 | value len:32 |
+ *   name | aspect | value
+ *
+ * with numbers in network byte order and the crc32 covering everything after it.
+ * A change is appended as a batch of records, ended by a LOG_COMMIT, and only takes
+ * effect with it. A torn batch at the end, left by a crash, is ignored by readers and
+ * cut off by the next writer. A damaged record followed by valid ones is no such 
+ * batch: the log is then refused, to be repaired by hand. Writers serialize on an 
+ * exclusive lock of the log file.
+ *
+ * Private keys are encrypted with the store key, kept in "md_store.json" as the file
+ * system store does. So are the key files handed out by md_store_get_fname(), except
+ * in the groups where the file system store keeps them plain for the server to load.
+ *
+ * Each process keeps an index of the current values by group, name and aspect with
+ * their place in the log, which is mapped into memory. Before each operation, the
+ * index is brought up to date with what other processes appended.
+ *
+ * Replaced and removed values stay in the log until compaction writes the current
+ * values into a new log and renames it over the old one. Other processes notice the
+ * new inode and read the new log from its start.
+ */
+#define LOG_FNAME           "md_store.log"
+#define LOG_COMPACT_EXT     ".compact"
+#define LOG_FILES_DIR       "files"
+#define LOG_MAGIC           "mdlog01\n"
+#define LOG_MAGIC_LEN       8
+#define LOG_REC_HLEN        16
+
+#define LOG_KEY_FNAME       "md_store.json"
+#define LOG_KEY_LEN         48
+
+#define LOG_COMPACT_RATIO   50
+#define LOG_COMPACT_MIN     (1024 * 1024)
+
+typedef enum {
+    LOG_PUT = 1,
+    LOG_DEL,
+    LOG_PURGE,
+    LOG_COMMIT
+} log_op_t;
+
+typedef struct {
+    const char *aspect;
+    md_store_vtype_t vtype;
+    apr_off_t rec_off;          /* of the record holding the value */
+    apr_size_t rec_len;
+    apr_off_t val_off;
+    apr_size_t val_len;
+    int materialized;           /* written to its file by get_fname */
+} log_entry_t;
+
+typedef struct {
+    const char *name;
+    apr_hash_t *aspects;        /* log_entry_t by aspect */
+} log_name_t;
+
+typedef struct md_store_log_t md_store_log_t;
+struct md_store_log_t {
+    md_store_t s;
+
+    apr_pool_t *p;
+    const char *base;           /* base directory of store */
+    const char *fpath;          /* of the log */
+    const char *files;          /* where values are materialized */
+    const char *key;            /* the store key, encrypting private keys */
+    apr_size_t key_len;
+
+    apr_pool_t *lpool;          /* the open log, its mapping and index */
+    apr_file_t *f;
+    apr_finfo_t finfo;          /* of the open log */
+    apr_off_t applied;          /* end of the last batch in the index */
+    apr_off_t live;             /* bytes in records of current values */
+    unsigned int names;
+    unsigned int values;
+#if APR_HAS_MMAP
+    apr_mmap_t *mm;             /* the log up to mm->size */
+#endif
+    apr_hash_t *groups[MD_SG_COUNT]; /* log_name_t by name */
+
+    int compact_ratio;
+    apr_off_t compact_min;
+    int sync;                   /* commits are synced before they are applied */
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+};
+
+#define LOG_STORE(store)    (md_store_log_t*)(((char*)store)-offsetof(md_store_log_t, s))
+
+static apr_status_t log_load(md_store_t *store, md_store_group_t group,
+                             const char *name, const char *aspect,
+                             md_store_vtype_t vtype, void **pvalue, apr_pool_t *p);
+static apr_status_t log_save(md_store_t *store, apr_pool_t *p, md_store_group_t group,
+                             const char *name, const char *aspect,
+                             md_store_vtype_t vtype, void *value, int create);
+static apr_status_t log_remove(md_store_t *store, md_store_group_t group,
+                               const char *name, const char *aspect,
+                               apr_pool_t *p, int force);
+static apr_status_t log_purge(md_store_t *store, apr_pool_t *p,
+                              md_store_group_t group, const char *name);
+static apr_status_t log_move(md_store_t *store, apr_pool_t *p,
+                             md_store_group_t from, md_store_group_t to,
+                             const char *name, int archive);
+static apr_status_t log_iterate(md_store_inspect *inspect, void *baton, md_store_t *store,
+                                apr_pool_t *p, md_store_group_t group, const char *pattern,
+                                const char *aspect, md_store_vtype_t vtype);
+static apr_status_t log_names(apr_array_header_t **pnames, md_store_t *store, apr_pool_t *p,
+                              md_store_group_t group, const char *pattern, const char *aspect);
+static apr_status_t log_get_fname(const char **pfname,
+                                  md_store_t *store, md_store_group_t group,
+                                  const char *name, const char *aspect,
+                                  apr_pool_t *p);
+static apr_status_t log_txn_begin(md_store_txn_t **ptxn, md_store_t *store, apr_pool_t *p,
+                                  md_store_group_t group, const char *name);
+
+static void lock_store(md_store_log_t *s_log)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(s_log->mutex);
+#endif
+}
+
+static void unlock_store(md_store_log_t *s_log)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(s_log->mutex);
+#endif
+}
+
+/**************************************************************************************************/
+/* records */
+
+static apr_uint32_t crc_table[256];
+static int crc_table_init;
+
+static void crc_init(void)
+{
+    apr_uint32_t c;
+    int n, k;
+
+    if (!crc_table_init) {
+        for (n = 0; n < 256; ++n) {
+            c = (apr_uint32_t)n;
+            for (k = 0; k < 8; ++k) {
+                c = (c & 1)? (0xedb88320U ^ (c >> 1)) : (c >> 1);
+            }
+            crc_table[n] = c;
+        }
+        crc_table_init = 1;
+    }
+}
+
+static apr_uint32_t log_crc32(const unsigned char *d, apr_size_t len)
+{
+    apr_uint32_t c = 0xffffffffU;
+
+    while (len--) {
+        c = crc_table[(c ^ *d++) & 0xff] ^ (c >> 8);
+    }
+    return c ^ 0xffffffffU;
+}
+
+static void put16(unsigned char *b, apr_uint32_t v)
+{
+    b[0] = (unsigned char)(v >> 8);
+    b[1] = (unsigned char)v;
+}
+
+static void put32(unsigned char *b, apr_uint32_t v)
+{
+    b[0] = (unsigned char)(v >> 24);
+    b[1] = (unsigned char)(v >> 16);
+    b[2] = (unsigned char)(v >> 8);
+    b[3] = (unsigned char)v;
+}
+
+static apr_uint32_t get16(const unsigned char *b)
+{
+    return ((apr_uint32_t)b[0] << 8) | b[1];
+}
+
+static apr_uint32_t get32(const unsigned char *b)
+{
+    return ((apr_uint32_t)b[0] << 24) | ((apr_uint32_t)b[1] << 16)
+           | ((apr_uint32_t)b[2] << 8) | b[3];
+}
+
+typedef struct {
+    log_op_t op;
+    md_store_group_t group;
+    md_store_vtype_t vtype;
+    const char *name;
+    apr_size_t name_len;
+    const char *aspect;
+    apr_size_t aspect_len;
+    const char *value;
+    apr_size_t value_len;
+    apr_size_t len;             /* of the whole record */
+} log_rec_t;
+
+static apr_status_t rec_make(const char **pdata, apr_size_t *plen, log_op_t op,
+                             md_store_group_t group, const char *name, const char *aspect,
+                             md_store_vtype_t vtype, const char *value, apr_size_t value_len,
+                             apr_pool_t *p)
+{
+    apr_size_t name_len = name? strlen(name) : 0;
+    apr_size_t aspect_len = aspect? strlen(aspect) : 0;
+    unsigned char *b;
+
+    if (name_len > 0xffff || aspect_len > 0xffff || value_len > 0xffffffffU) {
+        return APR_EINVAL;
+    }
+    *plen = LOG_REC_HLEN + name_len + aspect_len + value_len;
+    b = apr_palloc(p, *plen);
+    b[4] = (unsigned char)op;
+    b[5] = (unsigned char)group;
+    b[6] = (unsigned char)vtype;
+    b[7] = 0;
+    put16(b + 8, (apr_uint32_t)name_len);
+    put16(b + 10, (apr_uint32_t)aspect_len);
+    put32(b + 12, (apr_uint32_t)value_len);
+    if (name_len) memcpy(b + LOG_REC_HLEN, name, name_len);
+    if (aspect_len) memcpy(b + LOG_REC_HLEN + name_len, aspect, aspect_len);
+    if (value_len) memcpy(b + LOG_REC_HLEN + name_len + aspect_len, value, value_len);
+    put32(b, log_crc32(b + 4, *plen - 4));
+    *pdata = (const char *)b;
+    return APR_SUCCESS;
+}
+
+/* Parse the record at 'data', with 'avail' bytes available. Returns APR_INCOMPLETE
+ * when the record is cut off and APR_EINVAL when it is corrupt. */
+static apr_status_t rec_parse(log_rec_t *rec, const char *data, apr_size_t avail)
+{
+    const unsigned char *b = (const unsigned char *)data;
+
+    if (avail < LOG_REC_HLEN) {
+        return APR_INCOMPLETE;
+    }
+    rec->op = (log_op_t)b[4];
+    rec->group = (md_store_group_t)b[5];
+    rec->vtype = (md_store_vtype_t)b[6];
+    rec->name_len = get16(b + 8);
+    rec->aspect_len = get16(b + 10);
+    rec->value_len = get32(b + 12);
+    rec->len = LOG_REC_HLEN + rec->name_len + rec->aspect_len + rec->value_len;
+    if (avail < rec->len) {
+        return APR_INCOMPLETE;
+    }
+    if (get32(b) != log_crc32(b + 4, rec->len - 4)
+        || rec->op < LOG_PUT || rec->op > LOG_COMMIT || rec->group >= MD_SG_COUNT) {
+        return APR_EINVAL;
+    }
+    rec->name = data + LOG_REC_HLEN;
+    rec->aspect = rec->name + rec->name_len;
+    rec->value = rec->aspect + rec->aspect_len;
+    return APR_SUCCESS;
+}
+
+/**************************************************************************************************/
+/* values */
+
+static apr_status_t val_encode(const char **pdata, apr_size_t *plen, md_store_log_t *s_log,
+                               md_store_vtype_t vtype, void *value, apr_pool_t *p)
+{
+    apr_array_header_t *chain;
+    const char *der;
+    apr_size_t der_len;
+    char *buf;
+    apr_status_t rv = APR_SUCCESS;
+    int i;
+
+    switch (vtype) {
+        case MD_SV_TEXT:
+            *pdata = value;
+            *plen = strlen(*pdata);
+            break;
+        case MD_SV_JSON:
+            *pdata = md_json_writep(value, p, MD_JSON_FMT_COMPACT);
+            *plen = *pdata? strlen(*pdata) : 0;
+            rv = *pdata? APR_SUCCESS : APR_EINVAL;
+            break;
+        case MD_SV_CERT:
+            rv = md_cert_to_der(pdata, plen, value, p);
+            break;
+        case MD_SV_PKEY:
+            rv = md_pkey_to_pem(pdata, plen, value, p, s_log->key, s_log->key_len);
+            break;
+        case MD_SV_CHAIN:
+            /* the DER of each certificate, prefixed by its length */
+            chain = value;
+            *pdata = "";
+            *plen = 0;
+            for (i = 0; i < chain->nelts && APR_SUCCESS == rv; ++i) {
+                rv = md_cert_to_der(&der, &der_len, APR_ARRAY_IDX(chain, i, md_cert_t *), p);
+                if (APR_SUCCESS == rv) {
+                    buf = apr_palloc(p, *plen + 4 + der_len);
+                    memcpy(buf, *pdata, *plen);
+                    put32((unsigned char *)buf + *plen, (apr_uint32_t)der_len);
+                    memcpy(buf + *plen + 4, der, der_len);
+                    *pdata = buf;
+                    *plen += 4 + der_len;
+                }
+            }
+            break;
+        default:
+            return APR_ENOTIMPL;
+    }
+    return rv;
+}
+
+static apr_status_t val_decode(void **pvalue, md_store_log_t *s_log, md_store_vtype_t vtype,
+                               const char *data, apr_size_t len, apr_pool_t *p)
+{
+    apr_array_header_t *chain;
+    md_json_t *json;
+    md_cert_t *cert;
+    md_pkey_t *pkey;
+    apr_size_t der_len;
+    apr_status_t rv = APR_SUCCESS;
+
+    *pvalue = NULL;
+    switch (vtype) {
+        case MD_SV_TEXT:
+            *pvalue = apr_pstrmemdup(p, data, len);
+            break;
+        case MD_SV_JSON:
+            if (APR_SUCCESS == (rv = md_json_readd(&json, p, data, len))) {
+                *pvalue = json;
+            }
+            break;
+        case MD_SV_CERT:
+            if (APR_SUCCESS == (rv = md_cert_from_der(&cert, p, data, len))) {
+                *pvalue = cert;
+            }
+            break;
+        case MD_SV_PKEY:
+            if (APR_SUCCESS == (rv = md_pkey_from_pem(&pkey, p, s_log->key, s_log->key_len,
+                                                      data, len))) {
+                *pvalue = pkey;
+            }
+            break;
+        case MD_SV_CHAIN:
+            chain = apr_array_make(p, 5, sizeof(md_cert_t *));
+            while (len > 0 && APR_SUCCESS == rv) {
+                der_len = (len >= 4)? get32((const unsigned char *)data) : 0;
+                if (len < 4 || len - 4 < der_len) {
+                    rv = APR_EINVAL;
+                }
+                else if (APR_SUCCESS == (rv = md_cert_intern_der(&cert, p, data + 4, der_len))) {
+                    APR_ARRAY_PUSH(chain, md_cert_t *) = cert;
+                    data += 4 + der_len;
+                    len -= 4 + der_len;
+                }
+            }
+            if (APR_SUCCESS == rv) {
+                *pvalue = chain;
+            }
+            break;
+        default:
+            return APR_ENOTIMPL;
+    }
+    return rv;
+}
+
+/**************************************************************************************************/
+/* index */
+
+static void *hash_val(apr_hash_index_t *hi)
+{
+    void *val;
+
+    apr_hash_this(hi, NULL, NULL, &val);
+    return val;
+}
+
+static log_name_t *idx_name(md_store_log_t *s_log, md_store_group_t group,
+                            const char *name, apr_size_t name_len)
+{
+    return apr_hash_get(s_log->groups[group], name, (apr_ssize_t)name_len);
+}
+
+static log_entry_t *idx_entry(md_store_log_t *s_log, md_store_group_t group,
+                              const char *name, const char *aspect)
+{
+    log_name_t *ln = idx_name(s_log, group, name, strlen(name));
+    return ln? apr_hash_get(ln->aspects, aspect, APR_HASH_KEY_STRING) : NULL;
+}
+
+static void idx_drop_name(md_store_log_t *s_log, md_store_group_t group, log_name_t *ln)
+{
+    apr_hash_index_t *hi;
+    log_entry_t *e;
+
+    for (hi = apr_hash_first(NULL, ln->aspects); hi; hi = apr_hash_next(hi)) {
+        e = hash_val(hi);
+        s_log->live -= (apr_off_t)e->rec_len;
+        --s_log->values;
+    }
+    apr_hash_set(s_log->groups[group], ln->name, APR_HASH_KEY_STRING, NULL);
+    --s_log->names;
+}
+
+/* Apply the record at log offset 'off' to the index. Names and aspects new to the
+ * index are copied, values stay where they are in the log. */
+static void idx_apply(md_store_log_t *s_log, const log_rec_t *rec, apr_off_t off)
+{
+    log_name_t *ln;
+    log_entry_t *e;
+
+    ln = idx_name(s_log, rec->group, rec->name, rec->name_len);
+    switch (rec->op) {
+        case LOG_PUT:
+            if (!ln) {
+                ln = apr_pcalloc(s_log->lpool, sizeof(*ln));
+                ln->name = apr_pstrmemdup(s_log->lpool, rec->name, rec->name_len);
+                ln->aspects = apr_hash_make(s_log->lpool);
+                apr_hash_set(s_log->groups[rec->group], ln->name, APR_HASH_KEY_STRING, ln);
+                ++s_log->names;
+            }
+            e = apr_hash_get(ln->aspects, rec->aspect, (apr_ssize_t)rec->aspect_len);
+            if (e) {
+                s_log->live -= (apr_off_t)e->rec_len;
+            }
+            else {
+                e = apr_pcalloc(s_log->lpool, sizeof(*e));
+                e->aspect = apr_pstrmemdup(s_log->lpool, rec->aspect, rec->aspect_len);
+                apr_hash_set(ln->aspects, e->aspect, APR_HASH_KEY_STRING, e);
+                ++s_log->values;
+            }
+            e->vtype = rec->vtype;
+            e->rec_off = off;
+            e->rec_len = rec->len;
+            e->val_off = off + (apr_off_t)(LOG_REC_HLEN + rec->name_len + rec->aspect_len);
+            e->val_len = rec->value_len;
+            e->materialized = 0;
+            s_log->live += (apr_off_t)rec->len;
+            break;
+        case LOG_DEL:
+            e = ln? apr_hash_get(ln->aspects, rec->aspect, (apr_ssize_t)rec->aspect_len) : NULL;
+            if (e) {
+                s_log->live -= (apr_off_t)e->rec_len;
+                --s_log->values;
+                apr_hash_set(ln->aspects, e->aspect, APR_HASH_KEY_STRING, NULL);
+                if (!apr_hash_count(ln->aspects)) {
+                    idx_drop_name(s_log, rec->group, ln);
+                }
+            }
+            break;
+        case LOG_PURGE:
+            if (ln) {
+                idx_drop_name(s_log, rec->group, ln);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/**************************************************************************************************/
+/* the log file */
+
+static apr_status_t log_map(md_store_log_t *s_log, apr_off_t size)
+{
+#if APR_HAS_MMAP
+    apr_status_t rv;
+
+    if (s_log->mm && s_log->mm->size >= (apr_size_t)size) {
+        return APR_SUCCESS;
+    }
+    if (s_log->mm) {
+        apr_mmap_delete(s_log->mm);
+        s_log->mm = NULL;
+    }
+    if (size > 0) {
+        rv = apr_mmap_create(&s_log->mm, s_log->f, 0, (apr_size_t)size,
+                             APR_MMAP_READ, s_log->lpool);
+        if (APR_SUCCESS != rv) {
+            /* reading the file then */
+            md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, s_log->p, "mmap %s", s_log->fpath);
+            s_log->mm = NULL;
+        }
+    }
+#else
+    (void)s_log;
+    (void)size;
+#endif
+    return APR_SUCCESS;
+}
+
+/* Get 'len' bytes of the log at offset 'off'. The data stays valid until the log
+ * is read further. */
+static apr_status_t log_read(const char **pdata, md_store_log_t *s_log, apr_off_t off,
+                             apr_size_t len, apr_pool_t *p)
+{
+    apr_size_t nread;
+    char *buf;
+    apr_status_t rv;
+
+#if APR_HAS_MMAP
+    if (s_log->mm && (apr_size_t)off + len <= s_log->mm->size) {
+        *pdata = (const char *)s_log->mm->mm + off;
+        return APR_SUCCESS;
+    }
+#endif
+    buf = apr_palloc(p, len + 1);
+    if (APR_SUCCESS == (rv = apr_file_seek(s_log->f, APR_SET, &off))
+        && APR_SUCCESS == (rv = apr_file_read_full(s_log->f, buf, len, &nread))) {
+        *pdata = buf;
+    }
+    return rv;
+}
+
+/* Whether a valid record starts anywhere after 'at' in the 'avail' bytes at 'data'. 
+ * A crash can only tear the batch at the end, so damage with valid records after it
+ * is not a torn batch. */
+static int rec_valid_after(const char *data, apr_size_t avail, apr_size_t at)
+{
+    log_rec_t rec;
+    apr_size_t i;
+
+    for (i = at + 1; i + LOG_REC_HLEN <= avail; ++i) {
+        if (APR_SUCCESS == rec_parse(&rec, data + i, avail - i)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Read the log from 'applied' on and apply all complete batches to the index. Fails
+ * when records are damaged before its end. */
+static apr_status_t log_replay(md_store_log_t *s_log, apr_pool_t *ptemp)
+{
+    apr_array_header_t *batch;
+    const char *data;
+    log_rec_t rec, *prec;
+    apr_off_t start, pos, end;
+    apr_status_t rv;
+    int i;
+
+    end = s_log->finfo.size;
+    if (s_log->applied == 0) {
+        if (end < LOG_MAGIC_LEN) {
+            return APR_SUCCESS;
+        }
+        if (APR_SUCCESS != (rv = log_read(&data, s_log, 0, LOG_MAGIC_LEN, ptemp))) {
+            return rv;
+        }
+        if (memcmp(data, LOG_MAGIC, LOG_MAGIC_LEN)) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_ERR, APR_EINVAL, ptemp,
+                          "%s: not a store log", s_log->fpath);
+            return APR_EINVAL;
+        }
+        s_log->applied = LOG_MAGIC_LEN;
+    }
+    if (end <= s_log->applied) {
+        return APR_SUCCESS;
+    }
+
+    if (APR_SUCCESS != (rv = log_map(s_log, end))
+        || APR_SUCCESS != (rv = log_read(&data, s_log, s_log->applied,
+                                         (apr_size_t)(end - s_log->applied), ptemp))) {
+        return rv;
+    }
+
+    batch = apr_array_make(ptemp, 10, sizeof(log_rec_t));
+    start = pos = s_log->applied;
+    while (pos < end) {
+        rv = rec_parse(&rec, data + (pos - start), (apr_size_t)(end - pos));
+        if (APR_SUCCESS != rv) {
+            /* a damaged length may also make a record look cut off */
+            if (rec_valid_after(data, (apr_size_t)(end - start), (apr_size_t)(pos - start))) {
+                md_log_perror(MD_LOG_MARK, MD_LOG_ERR, APR_EINVAL, ptemp, "%s: damaged record "
+                              "at %" APR_OFF_T_FMT " with valid ones after it, refusing to "
+                              "use the log", s_log->fpath, pos);
+                return APR_EINVAL;
+            }
+            if (APR_EINVAL == rv) {
+                md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, rv, ptemp, "%s: torn record at "
+                              "%" APR_OFF_T_FMT ", ignoring the rest", s_log->fpath, pos);
+            }
+            break;
+        }
+        if (LOG_COMMIT == rec.op) {
+            for (i = 0; i < batch->nelts; ++i) {
+                prec = &APR_ARRAY_IDX(batch, i, log_rec_t);
+                idx_apply(s_log, prec, start + (prec->name - LOG_REC_HLEN - data));
+            }
+            apr_array_clear(batch);
+            s_log->applied = pos + (apr_off_t)rec.len;
+        }
+        else {
+            APR_ARRAY_PUSH(batch, log_rec_t) = rec;
+        }
+        pos += (apr_off_t)rec.len;
+    }
+    return APR_SUCCESS;
+}
+
+static apr_status_t log_open(md_store_log_t *s_log, apr_pool_t *ptemp)
+{
+    apr_status_t rv;
+    int i;
+
+    /* drops the file, its lock, mapping and index */
+    if (s_log->lpool) {
+        apr_pool_destroy(s_log->lpool);
+    }
+    if (APR_SUCCESS != (rv = apr_pool_create(&s_log->lpool, s_log->p))) {
+        s_log->lpool = NULL;
+        return rv;
+    }
+    s_log->f = NULL;
+#if APR_HAS_MMAP
+    s_log->mm = NULL;
+#endif
+    s_log->applied = s_log->live = 0;
+    s_log->names = s_log->values = 0;
+    for (i = 0; i < MD_SG_COUNT; ++i) {
+        s_log->groups[i] = apr_hash_make(s_log->lpool);
+    }
+
+    rv = apr_file_open(&s_log->f, s_log->fpath,
+                       APR_FOPEN_READ|APR_FOPEN_WRITE|APR_FOPEN_CREATE|APR_FOPEN_BINARY,
+                       MD_FPROT_F_UONLY, s_log->lpool);
+    if (APR_SUCCESS == rv) {
+        rv = apr_file_info_get(&s_log->finfo, APR_FINFO_SIZE|APR_FINFO_INODE|APR_FINFO_DEV,
+                               s_log->f);
+        if (APR_SUCCESS == rv || APR_INCOMPLETE == rv) {
+            rv = log_replay(s_log, ptemp);
+        }
+    }
+    else {
+        s_log->f = NULL;
+    }
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ptemp, "open store log %s", s_log->fpath);
+    }
+    return rv;
+}
+
+/* Bring the index up to date with the log. Sets 'reopened' when the log was
+ * replaced by another process. */
+static apr_status_t log_refresh(md_store_log_t *s_log, int *preopened, apr_pool_t *ptemp)
+{
+    apr_finfo_t info;
+    apr_status_t rv;
+
+    if (preopened) *preopened = 0;
+    if (!s_log->f) {
+        if (preopened) *preopened = 1;
+        return log_open(s_log, ptemp);
+    }
+    rv = apr_stat(&info, s_log->fpath, APR_FINFO_SIZE|APR_FINFO_INODE|APR_FINFO_DEV, ptemp);
+    if (APR_SUCCESS != rv && APR_INCOMPLETE != rv) {
+        return rv;
+    }
+    if (((info.valid & APR_FINFO_INODE) && info.inode != s_log->finfo.inode)
+        || ((info.valid & APR_FINFO_DEV) && info.device != s_log->finfo.device)) {
+        if (preopened) *preopened = 1;
+        return log_open(s_log, ptemp);
+    }
+    if (info.size != s_log->finfo.size) {
+        s_log->finfo.size = info.size;
+        return log_replay(s_log, ptemp);
+    }
+    return APR_SUCCESS;
+}
+
+/* Lock the log for writing and bring the index up to date. Cuts off whatever
+ * follows the last complete batch, which the replay found to be torn by a crash. */
+static apr_status_t log_wlock(md_store_log_t *s_log, apr_pool_t *ptemp)
+{
+    apr_size_t len;
+    apr_off_t off;
+    apr_status_t rv;
+    int reopened;
+
+    do {
+        if (!s_log->f && APR_SUCCESS != (rv = log_open(s_log, ptemp))) {
+            return rv;
+        }
+        if (APR_SUCCESS != (rv = apr_file_lock(s_log->f, APR_FLOCK_EXCLUSIVE))) {
+            md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ptemp, "lock %s", s_log->fpath);
+            return rv;
+        }
+        /* on a log replaced by compaction, the lock was taken on the old one */
+        if (APR_SUCCESS != (rv = log_refresh(s_log, &reopened, ptemp))) {
+            if (!reopened) {
+                apr_file_unlock(s_log->f);
+            }
+            return rv;
+        }
+    } while (reopened);
+
+    if (s_log->finfo.size > s_log->applied) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_WARNING, 0, ptemp, "%s: dropping %" APR_OFF_T_FMT
+                      " bytes of an incomplete change", s_log->fpath,
+                      s_log->finfo.size - s_log->applied);
+        if (APR_SUCCESS != (rv = apr_file_trunc(s_log->f, s_log->applied))) {
+            goto out;
+        }
+        s_log->finfo.size = s_log->applied;
+    }
+    if (s_log->applied == 0) {
+        off = 0;
+        if (APR_SUCCESS != (rv = apr_file_seek(s_log->f, APR_SET, &off))
+            || APR_SUCCESS != (rv = apr_file_write_full(s_log->f, LOG_MAGIC,
+                                                        LOG_MAGIC_LEN, &len))) {
+            goto out;
+        }
+        s_log->applied = s_log->finfo.size = LOG_MAGIC_LEN;
+    }
+out:
+    if (APR_SUCCESS != rv) {
+        apr_file_unlock(s_log->f);
+    }
+    return rv;
+}
+
+static void log_unlock(md_store_log_t *s_log)
+{
+    if (s_log->f) {
+        apr_file_unlock(s_log->f);
+    }
+}
+
+/**************************************************************************************************/
+/* compaction */
+
+static int compact_due(md_store_log_t *s_log)
+{
+    apr_off_t size = s_log->finfo.size;
+
+    return (s_log->compact_ratio < 100 && size > s_log->compact_min
+            && (size - s_log->live) * 100 > size * s_log->compact_ratio);
+}
+
+/* Write all current values into a new log and replace the old one with it.
+ * Needs the write lock. */
+static apr_status_t log_compact(md_store_log_t *s_log, apr_pool_t *ptemp)
+{
+    apr_hash_index_t *hn, *ha;
+    apr_file_t *f;
+    apr_pool_t *prec;
+    log_name_t *ln;
+    log_entry_t *e;
+    const char *tmp, *data, *rec;
+    apr_size_t len, rec_len;
+    apr_off_t before = s_log->finfo.size;
+    apr_status_t rv;
+    int group;
+
+    tmp = apr_pstrcat(ptemp, s_log->fpath, LOG_COMPACT_EXT, NULL);
+    rv = apr_file_open(&f, tmp, APR_FOPEN_WRITE|APR_FOPEN_CREATE|APR_FOPEN_TRUNCATE
+                       |APR_FOPEN_BUFFERED|APR_FOPEN_BINARY, MD_FPROT_F_UONLY, ptemp);
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ptemp, "open %s", tmp);
+        return rv;
+    }
+    if (APR_SUCCESS != (rv = apr_pool_create(&prec, ptemp))) {
+        apr_file_close(f);
+        return rv;
+    }
+
+    rv = apr_file_write_full(f, LOG_MAGIC, LOG_MAGIC_LEN, &len);
+    for (group = 0; group < MD_SG_COUNT && APR_SUCCESS == rv; ++group) {
+        for (hn = apr_hash_first(ptemp, s_log->groups[group]); hn && APR_SUCCESS == rv;
+             hn = apr_hash_next(hn)) {
+            ln = hash_val(hn);
+            for (ha = apr_hash_first(ptemp, ln->aspects); ha && APR_SUCCESS == rv;
+                 ha = apr_hash_next(ha)) {
+                e = hash_val(ha);
+                apr_pool_clear(prec);
+                if (APR_SUCCESS == (rv = log_read(&data, s_log, e->val_off, e->val_len, prec))
+                    && APR_SUCCESS == (rv = rec_make(&rec, &rec_len, LOG_PUT, group, ln->name,
+                                                     e->aspect, e->vtype, data, e->val_len,
+                                                     prec))) {
+                    rv = apr_file_write_full(f, rec, rec_len, &len);
+                }
+            }
+        }
+    }
+    if (APR_SUCCESS == rv
+        && APR_SUCCESS == (rv = rec_make(&rec, &rec_len, LOG_COMMIT, MD_SG_NONE, NULL, NULL,
+                                         MD_SV_TEXT, NULL, 0, prec))
+        && APR_SUCCESS == (rv = apr_file_write_full(f, rec, rec_len, &len))
+        && APR_SUCCESS == (rv = apr_file_flush(f))) {
+        /* the old log goes away, whatever the durability settings say */
+        rv = apr_file_sync(f);
+    }
+    apr_file_close(f);
+    apr_pool_destroy(prec);
+
+    if (APR_SUCCESS == rv
+        && APR_SUCCESS == (rv = apr_file_rename(tmp, s_log->fpath, ptemp))) {
+        md_util_fsync_path(s_log->base, ptemp);
+        /* this also releases the lock held on the old log */
+        rv = log_open(s_log, ptemp);
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ptemp, "%s: compacted from %"
+                      APR_OFF_T_FMT " to %" APR_OFF_T_FMT " bytes", s_log->fpath,
+                      before, s_log->finfo.size);
+    }
+    else {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ptemp, "compacting %s", s_log->fpath);
+        apr_file_remove(tmp, ptemp);
+    }
+    return rv;
+}
+
+/**************************************************************************************************/
+/* writing */
+
+typedef struct {
+    apr_pool_t *p;
+    apr_array_header_t *recs;   /* const char * records */
+    apr_array_header_t *lens;   /* and their apr_size_t lengths */
+} log_batch_t;
+
+static log_batch_t *batch_make(apr_pool_t *p)
+{
+    log_batch_t *batch = apr_pcalloc(p, sizeof(*batch));
+    batch->p = p;
+    batch->recs = apr_array_make(p, 5, sizeof(const char *));
+    batch->lens = apr_array_make(p, 5, sizeof(apr_size_t));
+    return batch;
+}
+
+static apr_status_t batch_add(log_batch_t *batch, log_op_t op, md_store_group_t group,
+                              const char *name, const char *aspect, md_store_vtype_t vtype,
+                              const char *value, apr_size_t value_len)
+{
+    const char *rec;
+    apr_size_t len;
+    apr_status_t rv;
+
+    rv = rec_make(&rec, &len, op, group, name, aspect, vtype, value, value_len, batch->p);
+    if (APR_SUCCESS == rv) {
+        APR_ARRAY_PUSH(batch->recs, const char *) = rec;
+        APR_ARRAY_PUSH(batch->lens, apr_size_t) = len;
+    }
+    return rv;
+}
+
+/* Add the current values of 'name' in 'from' as values of 'to_name' in 'to'. */
+static apr_status_t batch_copy(log_batch_t *batch, md_store_log_t *s_log,
+                               md_store_group_t from, const char *name,
+                               md_store_group_t to, const char *to_name)
+{
+    apr_hash_index_t *hi;
+    log_name_t *ln;
+    log_entry_t *e;
+    const char *data;
+    apr_status_t rv = APR_SUCCESS;
+
+    ln = idx_name(s_log, from, name, strlen(name));
+    for (hi = ln? apr_hash_first(batch->p, ln->aspects) : NULL; hi && APR_SUCCESS == rv;
+         hi = apr_hash_next(hi)) {
+        e = hash_val(hi);
+        if (APR_SUCCESS == (rv = log_read(&data, s_log, e->val_off, e->val_len, batch->p))) {
+            rv = batch_add(batch, LOG_PUT, to, to_name, e->aspect, e->vtype, data, e->val_len);
+        }
+    }
+    return rv;
+}
+
+/* Append the batch to the log and apply it. Needs the write lock. */
+static apr_status_t log_commit(md_store_log_t *s_log, log_batch_t *batch, apr_pool_t *ptemp)
+{
+    apr_off_t off = s_log->applied;
+    apr_size_t len;
+    apr_status_t rv;
+    int i;
+
+    if (APR_SUCCESS != (rv = batch_add(batch, LOG_COMMIT, MD_SG_NONE, NULL, NULL,
+                                       MD_SV_TEXT, NULL, 0))
+        || APR_SUCCESS != (rv = apr_file_seek(s_log->f, APR_SET, &off))) {
+        return rv;
+    }
+    for (i = 0; i < batch->recs->nelts && APR_SUCCESS == rv; ++i) {
+        rv = apr_file_write_full(s_log->f, APR_ARRAY_IDX(batch->recs, i, const char *),
+                                 APR_ARRAY_IDX(batch->lens, i, apr_size_t), &len);
+    }
+    if (APR_SUCCESS == rv && s_log->sync) {
+        rv = md_util_fsync_file(s_log->f);
+    }
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, ptemp, "appending to %s", s_log->fpath);
+        apr_file_trunc(s_log->f, s_log->applied);
+        return rv;
+    }
+
+    if (APR_SUCCESS == (rv = apr_file_info_get(&s_log->finfo, APR_FINFO_SIZE, s_log->f))
+        && APR_SUCCESS == (rv = log_replay(s_log, ptemp))
+        && compact_due(s_log)) {
+        rv = log_compact(s_log, ptemp);
+    }
+    return rv;
+}
+
+/* Remove files written by get_fname for 'name', or one of its aspects. */
+static void unmaterialize(md_store_log_t *s_log, md_store_group_t group, const char *name,
+                          const char *aspect, apr_pool_t *ptemp)
+{
+    const char *path;
+
+    if (APR_SUCCESS == md_util_path_merge(&path, ptemp, s_log->files,
+                                          md_store_group_name(group), name, aspect, NULL)) {
+        md_util_rm_recursive(path, ptemp, 1);
+    }
+}
+
+/**************************************************************************************************/
+/* store operations */
+
+static apr_status_t plog_load(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_log_t *s_log = baton;
+    const char *name, *aspect, *data;
+    md_store_group_t group;
+    md_store_vtype_t vtype;
+    log_entry_t *e;
+    void **pvalue;
+    apr_status_t rv;
+
+    group = va_arg(ap, int);
+    name = va_arg(ap, const char *);
+    aspect = va_arg(ap, const char *);
+    vtype = va_arg(ap, int);
+    pvalue = va_arg(ap, void **);
+
+    lock_store(s_log);
+    if (APR_SUCCESS != (rv = log_refresh(s_log, NULL, ptemp))) {
+        goto out;
+    }
+    if (!(e = idx_entry(s_log, group, name, aspect))) {
+        rv = APR_ENOENT;
+        goto out;
+    }
+    /* text and JSON are both text, as they are in files */
+    if (e->vtype != vtype && !((MD_SV_TEXT == e->vtype || MD_SV_JSON == e->vtype)
+                               && (MD_SV_TEXT == vtype || MD_SV_JSON == vtype))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, APR_EINVAL, ptemp, "%s/%s/%s: stored as type "
+                      "%d, loaded as %d", md_store_group_name(group), name, aspect,
+                      e->vtype, vtype);
+        rv = APR_EINVAL;
+        goto out;
+    }
+    if (APR_SUCCESS == (rv = log_read(&data, s_log, e->val_off, e->val_len, ptemp))) {
+        if (pvalue) {
+            rv = val_decode(pvalue, s_log, vtype, data, e->val_len, p);
+        }
+    }
+out:
+    unlock_store(s_log);
+    return rv;
+}
+
+static apr_status_t plog_save(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_log_t *s_log = baton;
+    const char *name, *aspect, *data;
+    md_store_group_t group;
+    md_store_vtype_t vtype;
+    log_batch_t *batch;
+    apr_size_t len;
+    void *value;
+    int create;
+    apr_status_t rv;
+
+    group = va_arg(ap, int);
+    name = va_arg(ap, const char *);
+    aspect = va_arg(ap, const char *);
+    vtype = va_arg(ap, int);
+    value = va_arg(ap, void *);
+    create = va_arg(ap, int);
+
+    batch = batch_make(ptemp);
+    if (APR_SUCCESS != (rv = val_encode(&data, &len, s_log, vtype, value, ptemp))
+        || APR_SUCCESS != (rv = batch_add(batch, LOG_PUT, group, name, aspect,
+                                          vtype, data, len))) {
+        return rv;
+    }
+
+    lock_store(s_log);
+    if (APR_SUCCESS == (rv = log_wlock(s_log, ptemp))) {
+        if (create && idx_entry(s_log, group, name, aspect)) {
+            rv = APR_EEXIST;
+        }
+        else {
+            rv = log_commit(s_log, batch, ptemp);
+        }
+        log_unlock(s_log);
+    }
+    unlock_store(s_log);
+    return rv;
+}
+
+static apr_status_t plog_remove(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_log_t *s_log = baton;
+    const char *name, *aspect;
+    md_store_group_t group;
+    log_batch_t *batch;
+    int force;
+    apr_status_t rv;
+
+    group = va_arg(ap, int);
+    name = va_arg(ap, const char *);
+    aspect = va_arg(ap, const char *);
+    force = va_arg(ap, int);
+
+    lock_store(s_log);
+    if (APR_SUCCESS == (rv = log_wlock(s_log, ptemp))) {
+        if (!idx_entry(s_log, group, name, aspect)) {
+            rv = force? APR_SUCCESS : APR_ENOENT;
+        }
+        else {
+            batch = batch_make(ptemp);
+            if (APR_SUCCESS == (rv = batch_add(batch, LOG_DEL, group, name, aspect,
+                                               MD_SV_TEXT, NULL, 0))) {
+                rv = log_commit(s_log, batch, ptemp);
+            }
+        }
+        log_unlock(s_log);
+        unmaterialize(s_log, group, name, aspect, ptemp);
+    }
+    unlock_store(s_log);
+    return rv;
+}
+
+static apr_status_t plog_purge(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_log_t *s_log = baton;
+    const char *name;
+    md_store_group_t group;
+    log_batch_t *batch;
+    apr_status_t rv;
+
+    group = va_arg(ap, int);
+    name = va_arg(ap, const char *);
+
+    lock_store(s_log);
+    if (APR_SUCCESS == (rv = log_wlock(s_log, ptemp))) {
+        if (idx_name(s_log, group, name, strlen(name))) {
+            batch = batch_make(ptemp);
+            if (APR_SUCCESS == (rv = batch_add(batch, LOG_PURGE, group, name, NULL,
+                                               MD_SV_TEXT, NULL, 0))) {
+                rv = log_commit(s_log, batch, ptemp);
+            }
+        }
+        log_unlock(s_log);
+        unmaterialize(s_log, group, name, NULL, ptemp);
+    }
+    unlock_store(s_log);
+    md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, rv, ptemp, "purge %s/%s",
+                  md_store_group_name(group), name);
+    return rv;
+}
+
+static apr_status_t plog_move(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_log_t *s_log = baton;
+    const char *name, *arch_name = NULL;
+    md_store_group_t from, to;
+    log_batch_t *batch;
+    int archive, n;
+    apr_status_t rv;
+
+    from = va_arg(ap, int);
+    to = va_arg(ap, int);
+    name = va_arg(ap, const char *);
+    archive = va_arg(ap, int);
+
+    if (from == to) {
+        return APR_EINVAL;
+    }
+
+    lock_store(s_log);
+    if (APR_SUCCESS != (rv = log_wlock(s_log, ptemp))) {
+        goto out;
+    }
+    if (!idx_name(s_log, from, name, strlen(name))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, APR_ENOENT, ptemp, "move: no %s/%s",
+                      md_store_group_name(from), name);
+        rv = APR_ENOENT;
+        goto unlock;
+    }
+
+    /* all in one batch, the move happens completely or not at all */
+    batch = batch_make(ptemp);
+    if (idx_name(s_log, to, name, strlen(name))) {
+        if (archive) {
+            for (n = 1; ; ++n) {
+                arch_name = apr_psprintf(ptemp, "%s.%d", name, n);
+                if (!idx_name(s_log, MD_SG_ARCHIVE, arch_name, strlen(arch_name))) {
+                    break;
+                }
+            }
+            rv = batch_copy(batch, s_log, to, name, MD_SG_ARCHIVE, arch_name);
+        }
+        if (APR_SUCCESS == rv) {
+            rv = batch_add(batch, LOG_PURGE, to, name, NULL, MD_SV_TEXT, NULL, 0);
+        }
+    }
+    if (APR_SUCCESS == rv
+        && APR_SUCCESS == (rv = batch_copy(batch, s_log, from, name, to, name))
+        && APR_SUCCESS == (rv = batch_add(batch, LOG_PURGE, from, name, NULL,
+                                          MD_SV_TEXT, NULL, 0))) {
+        rv = log_commit(s_log, batch, ptemp);
+    }
+    unmaterialize(s_log, from, name, NULL, ptemp);
+    unmaterialize(s_log, to, name, NULL, ptemp);
+unlock:
+    log_unlock(s_log);
+out:
+    unlock_store(s_log);
+    return rv;
+}
+
+typedef struct {
+    const char *name;
+    const char *aspect;
+} iter_item_t;
+
+static apr_status_t plog_iterate(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_log_t *s_log = baton;
+    md_store_inspect *inspect;
+    void *inspect_baton;
+    md_store_group_t group;
+    md_store_vtype_t vtype;
+    const char *pattern, *aspect;
+    apr_array_header_t *items;
+    apr_hash_index_t *hn, *ha;
+    apr_pool_t *pitem;
+    iter_item_t *item;
+    log_name_t *ln;
+    log_entry_t *e;
+    void *value;
+    apr_status_t rv;
+    int i;
+
+    inspect = va_arg(ap, md_store_inspect *);
+    inspect_baton = va_arg(ap, void *);
+    group = va_arg(ap, int);
+    pattern = va_arg(ap, const char *);
+    aspect = va_arg(ap, const char *);
+    vtype = va_arg(ap, int);
+
+    /* Collect what matches first, so that inspectors may use the store */
+    items = apr_array_make(ptemp, 100, sizeof(iter_item_t));
+    lock_store(s_log);
+    if (APR_SUCCESS == (rv = log_refresh(s_log, NULL, ptemp))) {
+        for (hn = apr_hash_first(ptemp, s_log->groups[group]); hn; hn = apr_hash_next(hn)) {
+            ln = hash_val(hn);
+            if (APR_SUCCESS != apr_fnmatch(pattern, ln->name, 0)) {
+                continue;
+            }
+            for (ha = apr_hash_first(ptemp, ln->aspects); ha; ha = apr_hash_next(ha)) {
+                e = hash_val(ha);
+                if (APR_SUCCESS == apr_fnmatch(aspect, e->aspect, 0)) {
+                    item = apr_array_push(items);
+                    item->name = apr_pstrdup(ptemp, ln->name);
+                    item->aspect = apr_pstrdup(ptemp, e->aspect);
+                }
+            }
+        }
+    }
+    unlock_store(s_log);
+
+    if (APR_SUCCESS == rv && APR_SUCCESS == (rv = apr_pool_create(&pitem, ptemp))) {
+        for (i = 0; i < items->nelts; ++i) {
+            item = &APR_ARRAY_IDX(items, i, iter_item_t);
+            apr_pool_clear(pitem);
+            rv = log_load(&s_log->s, group, item->name, item->aspect, vtype, &value, p);
+            if (APR_STATUS_IS_ENOENT(rv)) {
+                /* removed in the meantime */
+                rv = APR_SUCCESS;
+                continue;
+            }
+            else if (APR_SUCCESS != rv) {
+                break;
+            }
+            if (!inspect(inspect_baton, item->name, item->aspect, vtype, value, pitem)) {
+                break;
+            }
+        }
+    }
+    return rv;
+}
+
+static apr_status_t log_names(apr_array_header_t **pnames, md_store_t *store, apr_pool_t *p,
+                              md_store_group_t group, const char *pattern, const char *aspect)
+{
+    md_store_log_t *s_log = LOG_STORE(store);
+    apr_array_header_t *names;
+    apr_hash_index_t *hn, *ha;
+    log_name_t *ln;
+    log_entry_t *e;
+    apr_status_t rv;
+
+    names = apr_array_make(p, 100, sizeof(const char *));
+    lock_store(s_log);
+    if (APR_SUCCESS == (rv = log_refresh(s_log, NULL, p))) {
+        for (hn = apr_hash_first(p, s_log->groups[group]); hn; hn = apr_hash_next(hn)) {
+            ln = hash_val(hn);
+            if (APR_SUCCESS != apr_fnmatch(pattern, ln->name, 0)) {
+                continue;
+            }
+            for (ha = apr_hash_first(p, ln->aspects); ha; ha = apr_hash_next(ha)) {
+                e = hash_val(ha);
+                if (APR_SUCCESS == apr_fnmatch(aspect, e->aspect, 0)) {
+                    APR_ARRAY_PUSH(names, const char *) = apr_pstrdup(p, ln->name);
+                    break;
+                }
+            }
+        }
+    }
+    unlock_store(s_log);
+    *pnames = (APR_SUCCESS == rv)? names : NULL;
+    return rv;
+}
+
+/* Write the value of an entry to its file, unless that has been done already. */
+static apr_status_t materialize(md_store_log_t *s_log, md_store_group_t group, 
+                                const char *dir, log_entry_t *e, apr_pool_t *ptemp)
+{
+    const char *fpath, *data;
+    int plain;
+    void *value;
+    apr_status_t rv;
+
+    if (APR_SUCCESS != (rv = md_util_path_merge(&fpath, ptemp, dir, e->aspect, NULL))) {
+        return rv;
+    }
+    if (e->materialized && APR_SUCCESS == md_util_is_file(fpath, ptemp)) {
+        return APR_SUCCESS;
+    }
+    if (APR_SUCCESS != (rv = log_read(&data, s_log, e->val_off, e->val_len, ptemp))
+        || APR_SUCCESS != (rv = val_decode(&value, s_log, e->vtype, data, e->val_len, 
+                                           ptemp))) {
+        return rv;
+    }
+    switch (e->vtype) {
+        case MD_SV_TEXT:
+            rv = md_text_freplace(fpath, MD_FPROT_F_UONLY, ptemp, value);
+            break;
+        case MD_SV_JSON:
+            rv = md_json_freplace(value, ptemp, MD_JSON_FMT_INDENT, fpath, MD_FPROT_F_UONLY);
+            break;
+        case MD_SV_CERT:
+            rv = md_cert_fsave(value, ptemp, fpath, MD_FPROT_F_UONLY);
+            break;
+        case MD_SV_PKEY:
+            /* as in the file system store, the server loads these */
+            plain = (MD_SG_DOMAINS == group || MD_SG_TMP == group);
+            rv = md_pkey_fsave(value, ptemp, plain? NULL : s_log->key, plain? 0 : s_log->key_len,
+                               fpath, MD_FPROT_F_UONLY);
+            break;
+        case MD_SV_CHAIN:
+            rv = md_chain_fsave(value, ptemp, fpath, MD_FPROT_F_UONLY);
+            break;
+        default:
+            rv = APR_ENOTIMPL;
+            break;
+    }
+    if (APR_SUCCESS == rv) {
+        e->materialized = 1;
+    }
+    return rv;
+}
+
+static apr_status_t plog_get_fname(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_log_t *s_log = baton;
+    const char **pfname, *name, *aspect, *dir, *fpath;
+    md_store_group_t group;
+    apr_hash_index_t *hi;
+    log_name_t *ln;
+    log_entry_t *e;
+    apr_status_t rv;
+
+    pfname = va_arg(ap, const char **);
+    group = va_arg(ap, int);
+    name = va_arg(ap, const char *);
+    aspect = va_arg(ap, const char *);
+
+    *pfname = NULL;
+    rv = md_util_path_merge(&dir, p, s_log->files, md_store_group_name(group), name, NULL);
+    if (APR_SUCCESS != rv || !name) {
+        *pfname = (APR_SUCCESS == rv)? dir : NULL;
+        return rv;
+    }
+
+    lock_store(s_log);
+    if (APR_SUCCESS != (rv = log_refresh(s_log, NULL, ptemp))) {
+        goto out;
+    }
+    ln = idx_name(s_log, group, name, strlen(name));
+    if (ln && APR_SUCCESS != (rv = apr_dir_make_recursive(dir, MD_FPROT_D_UONLY, ptemp))) {
+        goto out;
+    }
+    if (aspect) {
+        if (APR_SUCCESS != (rv = md_util_path_merge(&fpath, p, dir, aspect, NULL))) {
+            goto out;
+        }
+        e = ln? apr_hash_get(ln->aspects, aspect, APR_HASH_KEY_STRING) : NULL;
+        if (e) {
+            rv = materialize(s_log, group, dir, e, ptemp);
+        }
+        else {
+            /* nothing stale must be found there */
+            apr_file_remove(fpath, ptemp);
+        }
+        *pfname = fpath;
+    }
+    else {
+        for (hi = ln? apr_hash_first(ptemp, ln->aspects) : NULL; hi && APR_SUCCESS == rv;
+             hi = apr_hash_next(hi)) {
+            rv = materialize(s_log, group, dir, hash_val(hi), ptemp);
+        }
+        *pfname = dir;
+    }
+out:
+    unlock_store(s_log);
+    if (APR_SUCCESS != rv) {
+        *pfname = NULL;
+    }
+    return rv;
+}
+
+static apr_status_t log_load(md_store_t *store, md_store_group_t group,
+                             const char *name, const char *aspect,
+                             md_store_vtype_t vtype, void **pvalue, apr_pool_t *p)
+{
+    md_store_log_t *s_log = LOG_STORE(store);
+    return md_util_pool_vdo(plog_load, s_log, p, group, name, aspect, vtype, pvalue, NULL);
+}
+
+static apr_status_t log_save(md_store_t *store, apr_pool_t *p, md_store_group_t group,
+                             const char *name, const char *aspect,
+                             md_store_vtype_t vtype, void *value, int create)
+{
+    md_store_log_t *s_log = LOG_STORE(store);
+    return md_util_pool_vdo(plog_save, s_log, p, group, name, aspect,
+                            vtype, value, create, NULL);
+}
+
+static apr_status_t log_remove(md_store_t *store, md_store_group_t group,
+                               const char *name, const char *aspect,
+                               apr_pool_t *p, int force)
+{
+    md_store_log_t *s_log = LOG_STORE(store);
+    return md_util_pool_vdo(plog_remove, s_log, p, group, name, aspect, force, NULL);
+}
+
+static apr_status_t log_purge(md_store_t *store, apr_pool_t *p,
+                              md_store_group_t group, const char *name)
+{
+    md_store_log_t *s_log = LOG_STORE(store);
+    return md_util_pool_vdo(plog_purge, s_log, p, group, name, NULL);
+}
+
+static apr_status_t log_move(md_store_t *store, apr_pool_t *p,
+                             md_store_group_t from, md_store_group_t to,
+                             const char *name, int archive)
+{
+    md_store_log_t *s_log = LOG_STORE(store);
+    return md_util_pool_vdo(plog_move, s_log, p, from, to, name, archive, NULL);
+}
+
+static apr_status_t log_iterate(md_store_inspect *inspect, void *baton, md_store_t *store,
+                                apr_pool_t *p, md_store_group_t group, const char *pattern,
+                                const char *aspect, md_store_vtype_t vtype)
+{
+    md_store_log_t *s_log = LOG_STORE(store);
+    return md_util_pool_vdo(plog_iterate, s_log, p, inspect, baton, group, pattern,
+                            aspect, vtype, NULL);
+}
+
+static apr_status_t log_get_fname(const char **pfname,
+                                  md_store_t *store, md_store_group_t group,
+                                  const char *name, const char *aspect,
+                                  apr_pool_t *p)
+{
+    md_store_log_t *s_log = LOG_STORE(store);
+    return md_util_pool_vdo(plog_get_fname, s_log, p, pfname, group, name, aspect, NULL);
+}
+
+/**************************************************************************************************/
+/* transactions */
+
+/* A transaction is a batch purging the name, followed by the values put. */
+static apr_status_t log_txn_put(md_store_txn_t *txn, const char *aspect,
+                                md_store_vtype_t vtype, void *value)
+{
+    const char *data;
+    apr_size_t len;
+    apr_status_t rv;
+
+    if (APR_SUCCESS == (rv = val_encode(&data, &len, LOG_STORE(txn->store), vtype, value, 
+                                        txn->p))) {
+        rv = batch_add(txn->baton, LOG_PUT, txn->group, txn->name, aspect, vtype, data, len);
+    }
+    return rv;
+}
+
+static apr_status_t plog_txn_commit(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_log_t *s_log = baton;
+    md_store_txn_t *txn;
+    apr_status_t rv;
+
+    txn = va_arg(ap, md_store_txn_t *);
+
+    lock_store(s_log);
+    if (APR_SUCCESS == (rv = log_wlock(s_log, ptemp))) {
+        rv = log_commit(s_log, txn->baton, ptemp);
+        log_unlock(s_log);
+        unmaterialize(s_log, txn->group, txn->name, NULL, ptemp);
+    }
+    unlock_store(s_log);
+    return rv;
+}
+
+static apr_status_t log_txn_end(md_store_txn_t *txn, int commit)
+{
+    if (!commit) {
+        return APR_SUCCESS;
+    }
+    return md_util_pool_vdo(plog_txn_commit, LOG_STORE(txn->store), txn->p, txn, NULL);
+}
+
+static apr_status_t log_txn_begin(md_store_txn_t **ptxn, md_store_t *store, apr_pool_t *p,
+                                  md_store_group_t group, const char *name)
+{
+    md_store_txn_t *txn;
+    log_batch_t *batch;
+    apr_status_t rv;
+
+    *ptxn = NULL;
+    batch = batch_make(p);
+    if (APR_SUCCESS != (rv = batch_add(batch, LOG_PURGE, group, name, NULL,
+                                       MD_SV_TEXT, NULL, 0))) {
+        return rv;
+    }
+    txn = apr_pcalloc(p, sizeof(*txn));
+    txn->put = log_txn_put;
+    txn->end = log_txn_end;
+    txn->baton = batch;
+    *ptxn = txn;
+    return APR_SUCCESS;
+}
+
+/**************************************************************************************************/
+/* setup */
+
+/* Read the store key, or make one where there is none yet. */
+static apr_status_t key_setup(md_store_log_t *s_log, apr_pool_t *ptemp)
+{
+    unsigned char key[LOG_KEY_LEN];
+    const char *fpath, *key64;
+    md_json_t *json;
+    apr_status_t rv;
+
+    if (APR_SUCCESS != (rv = md_util_path_merge(&fpath, ptemp, s_log->base, LOG_KEY_FNAME, 
+                                                NULL))) {
+        return rv;
+    }
+    rv = md_json_readf(&json, ptemp, fpath);
+    if (APR_STATUS_IS_ENOENT(rv)) {
+        if (APR_SUCCESS != (rv = md_rand_bytes(key, sizeof(key), ptemp))) {
+            return rv;
+        }
+        json = md_json_create(ptemp);
+        md_json_sets(MOD_MD_VERSION, json, MD_KEY_VERSION, NULL);
+        md_json_sets(md_util_base64url_encode((char *)key, sizeof(key), ptemp), 
+                     json, MD_KEY_KEY, NULL);
+        memset(key, 0, sizeof(key));
+        rv = md_json_fcreatex(json, ptemp, MD_JSON_FMT_INDENT, fpath, MD_FPROT_F_UONLY);
+        if (APR_STATUS_IS_EEXIST(rv)) {
+            /* another process was faster */
+            rv = md_json_readf(&json, ptemp, fpath);
+        }
+    }
+    if (APR_SUCCESS != rv) {
+        return rv;
+    }
+    if (!(key64 = md_json_gets(json, MD_KEY_KEY, NULL))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, 0, ptemp, "missing key: %s", MD_KEY_KEY);
+        return APR_EINVAL;
+    }
+    s_log->key_len = md_util_base64url_decode(&s_log->key, key64, s_log->p);
+    if (s_log->key_len < LOG_KEY_LEN) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, 0, ptemp, "key too short: %d", 
+                      (int)s_log->key_len);
+        return APR_EINVAL;
+    }
+    return APR_SUCCESS;
+}
+
+static void log_destroy(md_store_t *store)
+{
+    md_store_log_t *s_log = LOG_STORE(store);
+
+    lock_store(s_log);
+    if (s_log->lpool) {
+        apr_pool_destroy(s_log->lpool);
+        s_log->lpool = NULL;
+        s_log->f = NULL;
+    }
+    unlock_store(s_log);
+}
+
+apr_status_t md_store_log_init(md_store_t **pstore, apr_pool_t *p, const char *path)
+{
+    md_store_log_t *s_log;
+    apr_pool_t *ptemp;
+    apr_status_t rv;
+
+    crc_init();
+
+    s_log = apr_pcalloc(p, sizeof(*s_log));
+    s_log->p = p;
+    s_log->s.destroy = log_destroy;
+    s_log->s.load = log_load;
+    s_log->s.save = log_save;
+    s_log->s.remove = log_remove;
+    s_log->s.move = log_move;
+    s_log->s.purge = log_purge;
+    s_log->s.iterate = log_iterate;
+    s_log->s.names = log_names;
+    s_log->s.get_fname = log_get_fname;
+    s_log->s.txn_begin = log_txn_begin;
+    s_log->compact_ratio = LOG_COMPACT_RATIO;
+    s_log->compact_min = LOG_COMPACT_MIN;
+
+    s_log->base = apr_pstrdup(p, path);
+    if (APR_SUCCESS != (rv = md_util_path_merge(&s_log->fpath, p, path, LOG_FNAME, NULL))
+        || APR_SUCCESS != (rv = md_util_path_merge(&s_log->files, p, path,
+                                                   LOG_FILES_DIR, NULL))) {
+        goto out;
+    }
+#if APR_HAS_THREADS
+    if (APR_SUCCESS != (rv = apr_thread_mutex_create(&s_log->mutex,
+                                                     APR_THREAD_MUTEX_DEFAULT, p))) {
+        goto out;
+    }
+#endif
+    if (APR_SUCCESS != (rv = md_util_is_dir(s_log->base, p))
+        && APR_STATUS_IS_ENOENT(rv)) {
+        rv = apr_dir_make_recursive(s_log->base, MD_FPROT_D_UONLY, p);
+    }
+    if (APR_SUCCESS == rv && APR_SUCCESS == (rv = apr_pool_create(&ptemp, p))) {
+        if (APR_SUCCESS == (rv = key_setup(s_log, ptemp))) {
+            rv = log_open(s_log, ptemp);
+        }
+        apr_pool_destroy(ptemp);
+    }
+out:
+    if (APR_SUCCESS != rv) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_ERR, rv, p, "init log store at %s", path);
+    }
+    *pstore = (APR_SUCCESS == rv)? &s_log->s : NULL;
+    return rv;
+}
+
+void md_store_log_compact_set(md_store_t *store, int garbage_percent, apr_off_t min_size)
+{
+    md_store_log_t *s_log = LOG_STORE(store);
+
+    lock_store(s_log);
+    s_log->compact_ratio = garbage_percent;
+    s_log->compact_min = min_size;
+    unlock_store(s_log);
+}
+
+void md_store_log_sync_set(md_store_t *store, int enabled)
+{
+    md_store_log_t *s_log = LOG_STORE(store);
+
+    lock_store(s_log);
+    s_log->sync = enabled;
+    unlock_store(s_log);
+}
+
+static apr_status_t plog_compact(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
+{
+    md_store_log_t *s_log = baton;
+    apr_status_t rv;
+
+    lock_store(s_log);
+    if (APR_SUCCESS == (rv = log_wlock(s_log, ptemp))) {
+        rv = log_compact(s_log, ptemp);
+        log_unlock(s_log);
+    }
+    unlock_store(s_log);
+    return rv;
+}
+
+apr_status_t md_store_log_compact(md_store_t *store, apr_pool_t *p)
+{
+    return md_util_pool_vdo(plog_compact, LOG_STORE(store), p, NULL);
+}
+
+void md_store_log_stats_get(md_store_log_stats_t *stats, md_store_t *store)
+{
+    md_store_log_t *s_log = LOG_STORE(store);
+
+    lock_store(s_log);
+    stats->size = s_log->finfo.size;
+    stats->live = s_log->live;
+    stats->names = s_log->names;
+    stats->values = s_log->values;
+    unlock_store(s_log);
+}
@@ -0,0 +1,61 @@
+/* Copyright 2017 greenbytes GmbH (https://www.greenbytes.de)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef mod_md_md_store_log_h
+#define mod_md_md_store_log_h
+
+struct md_store_t;
+
+/**
+ * Create a store that keeps all values in a single, append-only log file in
+ * directory 'path'. Values are found through an index kept in memory, which is
+ * rebuilt by reading the log when the store is opened. Several processes may use
+ * the same store, each sees the changes of the others.
+ *
+ * File names asked for by md_store_get_fname() are created on demand, in a
+ * directory tree below 'path' laid out as the file system store does.
+ */
+apr_status_t md_store_log_init(struct md_store_t **pstore, apr_pool_t *p,
+                               const char *path);
+
+/**
+ * Set when the log is compacted automatically: once it is larger than 'min_size'
+ * and more than 'garbage_percent' of it are replaced or removed values.
+ * A 'garbage_percent' of 100 or more disables automatic compaction.
+ */
+void md_store_log_compact_set(struct md_store_t *store, int garbage_percent,
+                              apr_off_t min_size);
+
+/**
+ * Set if every commit is synced to disk before it is applied. Off by default, 
+ * where a crash may lose the last commits, but never leaves a partial one.
+ */
+void md_store_log_sync_set(struct md_store_t *store, int enabled);
+
+/**
+ * Rewrite the log with only the values currently in the store.
+ */
+apr_status_t md_store_log_compact(struct md_store_t *store, apr_pool_t *p);
+
+typedef struct {
+    apr_off_t size;             /* of the log */
+    apr_off_t live;             /* bytes in the log holding current values */
+    unsigned int names;         /* over all groups */
+    unsigned int values;
+} md_store_log_stats_t;
+
+void md_store_log_stats_get(md_store_log_stats_t *stats, struct md_store_t *store);
+
+#endif /* mod_md_md_store_log_h */
@@ -0,0 +1,583 @@
+/* Copyright 2017 greenbytes GmbH (https://www.greenbytes.de)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <apr_lib.h>
+#include <apr_fnmatch.h>
+#include <apr_hash.h>
+#include <apr_strings.h>
+#include <apr_thread_mutex.h>
+#include <apr_time.h>
+
+#include "md.h"
+#include "md_crypt.h"
+#include "md_json.h"
+#include "md_log.h"
+#include "md_store.h"
+#include "md_store_mem.h"
+#include "md_util.h"
+
+/**************************************************************************************************/
+/* memory based implementation of md_store_t */
+
+#define MEM_FNAME_PREFIX    "mem:"
+
+typedef struct {
+    const char *aspect;
+    md_store_vtype_t vtype;
+    apr_pool_t *p;              /* of the value, replaced with it */
+    void *value;
+} mem_value_t;
+
+typedef struct {
+    const char *name;
+    apr_pool_t *p;              /* of the name and all its values */
+    apr_hash_t *aspects;        /* mem_value_t by aspect */
+} mem_name_t;
+
+typedef struct md_store_mem_t md_store_mem_t;
+struct md_store_mem_t {
+    md_store_t s;
+
+    apr_pool_t *p;
+    apr_hash_t *groups[MD_SG_COUNT]; /* mem_name_t by name */
+    apr_interval_time_t latency;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+};
+
+#define MEM_STORE(store)    (md_store_mem_t*)(((char*)store)-offsetof(md_store_mem_t, s))
+
+static void lock_store(md_store_mem_t *s_mem)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(s_mem->mutex);
+#endif
+}
+
+static void unlock_store(md_store_mem_t *s_mem)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(s_mem->mutex);
+#endif
+}
+
+static void simulate_latency(md_store_mem_t *s_mem)
+{
+    if (s_mem->latency > 0) {
+        apr_sleep(s_mem->latency);
+    }
+}
+
+/**************************************************************************************************/
+/* values */
+
+/* Copy 'value' into pool p, sharing nothing with the original. */
+static apr_status_t val_copy(void **pcopy, md_store_vtype_t vtype, void *value, apr_pool_t *p)
+{
+    apr_array_header_t *chain, *copy;
+    md_cert_t *cert;
+    md_pkey_t *pkey;
+    const char *data;
+    apr_size_t len;
+    apr_status_t rv = APR_SUCCESS;
+    int i;
+
+    *pcopy = NULL;
+    switch (vtype) {
+        case MD_SV_TEXT:
+            *pcopy = apr_pstrdup(p, value);
+            break;
+        case MD_SV_JSON:
+            *pcopy = md_json_clone(p, value);
+            break;
+        case MD_SV_CERT:
+            if (APR_SUCCESS == (rv = md_cert_to_der(&data, &len, value, p))
+                && APR_SUCCESS == (rv = md_cert_from_der(&cert, p, data, len))) {
+                *pcopy = cert;
+            }
+            break;
+        case MD_SV_PKEY:
+            if (APR_SUCCESS == (rv = md_pkey_to_pem(&data, &len, value, p, NULL, 0))
+                && APR_SUCCESS == (rv = md_pkey_from_pem(&pkey, p, NULL, 0, data, len))) {
+                *pcopy = pkey;
+            }
+            break;
+        case MD_SV_CHAIN:
+            chain = value;
+            copy = apr_array_make(p, chain->nelts, sizeof(md_cert_t *));
+            for (i = 0; i < chain->nelts && APR_SUCCESS == rv; ++i) {
+                rv = val_copy((void**)&cert, MD_SV_CERT,
+                              APR_ARRAY_IDX(chain, i, md_cert_t *), p);
+                if (APR_SUCCESS == rv) {
+                    APR_ARRAY_PUSH(copy, md_cert_t *) = cert;
+                }
+            }
+            if (APR_SUCCESS == rv) {
+                *pcopy = copy;
+            }
+            break;
+        default:
+            return APR_ENOTIMPL;
+    }
+    return rv;
+}
+
+/* Copy a stored value as 'vtype' into pool p. Text and JSON convert into each
+ * other, as they do when read from files. */
+static apr_status_t val_load(void **pvalue, mem_value_t *v, md_store_vtype_t vtype,
+                             apr_pool_t *p)
+{
+    md_json_t *json;
+    const char *s;
+    apr_status_t rv;
+
+    if (v->vtype == vtype) {
+        return val_copy(pvalue, vtype, v->value, p);
+    }
+    else if (MD_SV_TEXT == v->vtype && MD_SV_JSON == vtype) {
+        s = v->value;
+        if (APR_SUCCESS == (rv = md_json_readd(&json, p, s, strlen(s)))) {
+            *pvalue = json;
+        }
+        return rv;
+    }
+    else if (MD_SV_JSON == v->vtype && MD_SV_TEXT == vtype) {
+        *pvalue = (void*)md_json_writep(v->value, p, MD_JSON_FMT_INDENT);
+        return *pvalue? APR_SUCCESS : APR_EINVAL;
+    }
+    return APR_EINVAL;
+}
+
+static mem_name_t *name_get(md_store_mem_t *s_mem, md_store_group_t group, const char *name)
+{
+    return apr_hash_get(s_mem->groups[group], name, APR_HASH_KEY_STRING);
+}
+
+static apr_status_t name_make(mem_name_t **pmn, md_store_mem_t *s_mem,
+                              md_store_group_t group, const char *name)
+{
+    mem_name_t *mn;
+    apr_pool_t *p;
+    apr_status_t rv;
+
+    if (NULL == (mn = name_get(s_mem, group, name))) {
+        if (APR_SUCCESS != (rv = apr_pool_create(&p, s_mem->p))) {
+            return rv;
+        }
+        mn = apr_pcalloc(p, sizeof(*mn));
+        mn->p = p;
+        mn->name = apr_pstrdup(p, name);
+        mn->aspects = apr_hash_make(p);
+        apr_hash_set(s_mem->groups[group], mn->name, APR_HASH_KEY_STRING, mn);
+    }
+    *pmn = mn;
+    return APR_SUCCESS;
+}
+
+static void name_drop(md_store_mem_t *s_mem, md_store_group_t group, mem_name_t *mn)
+{
+    apr_hash_set(s_mem->groups[group], mn->name, APR_HASH_KEY_STRING, NULL);
+    apr_pool_destroy(mn->p);
+}
+
+/* Set the aspect of a name to a copy of 'value'. */
+static apr_status_t value_set(mem_name_t *mn, const char *aspect, md_store_vtype_t vtype,
+                              void *value)
+{
+    mem_value_t *v, *old;
+    apr_pool_t *p;
+    apr_status_t rv;
+
+    if (APR_SUCCESS != (rv = apr_pool_create(&p, mn->p))) {
+        return rv;
+    }
+    v = apr_pcalloc(p, sizeof(*v));
+    v->p = p;
+    v->aspect = apr_pstrdup(p, aspect);
+    v->vtype = vtype;
+    if (APR_SUCCESS != (rv = val_copy(&v->value, vtype, value, p))) {
+        apr_pool_destroy(p);
+        return rv;
+    }
+    /* the hash keeps the key of an existing entry, which goes away with it */
+    if ((old = apr_hash_get(mn->aspects, aspect, APR_HASH_KEY_STRING))) {
+        apr_hash_set(mn->aspects, old->aspect, APR_HASH_KEY_STRING, NULL);
+        apr_pool_destroy(old->p);
+    }
+    apr_hash_set(mn->aspects, v->aspect, APR_HASH_KEY_STRING, v);
+    return APR_SUCCESS;
+}
+
+/**************************************************************************************************/
+/* store operations */
+
+static apr_status_t mem_load(md_store_t *store, md_store_group_t group,
+                             const char *name, const char *aspect,
+                             md_store_vtype_t vtype, void **pvalue, apr_pool_t *p)
+{
+    md_store_mem_t *s_mem = MEM_STORE(store);
+    mem_name_t *mn;
+    mem_value_t *v;
+    void *value;
+    apr_status_t rv = APR_ENOENT;
+
+    simulate_latency(s_mem);
+    lock_store(s_mem);
+    if ((mn = name_get(s_mem, group, name))
+        && (v = apr_hash_get(mn->aspects, aspect, APR_HASH_KEY_STRING))) {
+        if (APR_SUCCESS == (rv = val_load(&value, v, vtype, p)) && pvalue) {
+            *pvalue = value;
+        }
+    }
+    unlock_store(s_mem);
+    return rv;
+}
+
+static apr_status_t mem_save(md_store_t *store, apr_pool_t *p, md_store_group_t group,
+                             const char *name, const char *aspect,
+                             md_store_vtype_t vtype, void *value, int create)
+{
+    md_store_mem_t *s_mem = MEM_STORE(store);
+    mem_name_t *mn;
+    apr_status_t rv;
+
+    simulate_latency(s_mem);
+    lock_store(s_mem);
+    if (APR_SUCCESS == (rv = name_make(&mn, s_mem, group, name))) {
+        if (create && apr_hash_get(mn->aspects, aspect, APR_HASH_KEY_STRING)) {
+            rv = APR_EEXIST;
+        }
+        else {
+            rv = value_set(mn, aspect, vtype, value);
+        }
+        if (!apr_hash_count(mn->aspects)) {
+            name_drop(s_mem, group, mn);
+        }
+    }
+    unlock_store(s_mem);
+    return rv;
+}
+
+static apr_status_t mem_remove(md_store_t *store, md_store_group_t group,
+                               const char *name, const char *aspect,
+                               apr_pool_t *p, int force)
+{
+    md_store_mem_t *s_mem = MEM_STORE(store);
+    mem_name_t *mn;
+    mem_value_t *v = NULL;
+    apr_status_t rv = APR_SUCCESS;
+
+    simulate_latency(s_mem);
+    lock_store(s_mem);
+    if ((mn = name_get(s_mem, group, name))
+        && (v = apr_hash_get(mn->aspects, aspect, APR_HASH_KEY_STRING))) {
+        apr_hash_set(mn->aspects, aspect, APR_HASH_KEY_STRING, NULL);
+        apr_pool_destroy(v->p);
+        if (!apr_hash_count(mn->aspects)) {
+            name_drop(s_mem, group, mn);
+        }
+    }
+    else if (!force) {
+        rv = APR_ENOENT;
+    }
+    unlock_store(s_mem);
+    return rv;
+}
+
+static apr_status_t mem_purge(md_store_t *store, apr_pool_t *p,
+                              md_store_group_t group, const char *name)
+{
+    md_store_mem_t *s_mem = MEM_STORE(store);
+    mem_name_t *mn;
+
+    simulate_latency(s_mem);
+    lock_store(s_mem);
+    if ((mn = name_get(s_mem, group, name))) {
+        name_drop(s_mem, group, mn);
+    }
+    unlock_store(s_mem);
+    return APR_SUCCESS;
+}
+
+static apr_status_t mem_move(md_store_t *store, apr_pool_t *p,
+                             md_store_group_t from, md_store_group_t to,
+                             const char *name, int archive)
+{
+    md_store_mem_t *s_mem = MEM_STORE(store);
+    mem_name_t *mn, *existing;
+    const char *arch_name;
+    int n;
+    apr_status_t rv = APR_SUCCESS;
+
+    if (from == to) {
+        return APR_EINVAL;
+    }
+    simulate_latency(s_mem);
+    lock_store(s_mem);
+    if (NULL == (mn = name_get(s_mem, from, name))) {
+        md_log_perror(MD_LOG_MARK, MD_LOG_DEBUG, APR_ENOENT, p, "move: no %s/%s",
+                      md_store_group_name(from), name);
+        rv = APR_ENOENT;
+        goto out;
+    }
+    if ((existing = name_get(s_mem, to, name))) {
+        apr_hash_set(s_mem->groups[to], existing->name, APR_HASH_KEY_STRING, NULL);
+        if (archive) {
+            /* the values stay where they are, under their archive name */
+            for (n = 1; ; ++n) {
+                arch_name = apr_psprintf(p, "%s.%d", name, n);
+                if (!name_get(s_mem, MD_SG_ARCHIVE, arch_name)) {
+                    break;
+                }
+            }
+            existing->name = apr_pstrdup(existing->p, arch_name);
+            apr_hash_set(s_mem->groups[MD_SG_ARCHIVE], existing->name,
+                         APR_HASH_KEY_STRING, existing);
+        }
+        else {
+            apr_pool_destroy(existing->p);
+        }
+    }
+    apr_hash_set(s_mem->groups[from], mn->name, APR_HASH_KEY_STRING, NULL);
+    apr_hash_set(s_mem->groups[to], mn->name, APR_HASH_KEY_STRING, mn);
+out:
+    unlock_store(s_mem);
+    return rv;
+}
+
+typedef struct {
+    const char *name;
+    const char *aspect;
+} iter_item_t;
+
+static apr_status_t mem_iterate(md_store_inspect *inspect, void *baton, md_store_t *store,
+                                apr_pool_t *p, md_store_group_t group, const char *pattern,
+                                const char *aspect, md_store_vtype_t vtype)
+{
+    md_store_mem_t *s_mem = MEM_STORE(store);
+    apr_array_header_t *items;
+    apr_hash_index_t *hn, *ha;
+    apr_pool_t *ptemp;
+    iter_item_t *item;
+    mem_name_t *mn;
+    mem_value_t *v;
+    const void *key;
+    void *val, *value;
+    apr_status_t rv;
+    int i;
+
+    if (APR_SUCCESS != (rv = apr_pool_create(&ptemp, p))) {
+        return rv;
+    }
+
+    /* Collect what matches first, so that inspectors may use the store */
+    items = apr_array_make(ptemp, 100, sizeof(iter_item_t));
+    simulate_latency(s_mem);
+    lock_store(s_mem);
+    for (hn = apr_hash_first(ptemp, s_mem->groups[group]); hn; hn = apr_hash_next(hn)) {
+        apr_hash_this(hn, &key, NULL, &val);
+        mn = val;
+        if (APR_SUCCESS != apr_fnmatch(pattern, mn->name, 0)) {
+            continue;
+        }
+        for (ha = apr_hash_first(ptemp, mn->aspects); ha; ha = apr_hash_next(ha)) {
+            apr_hash_this(ha, &key, NULL, &val);
+            v = val;
+            if (APR_SUCCESS == apr_fnmatch(aspect, v->aspect, 0)) {
+                item = apr_array_push(items);
+                item->name = apr_pstrdup(ptemp, mn->name);
+                item->aspect = apr_pstrdup(ptemp, v->aspect);
+            }
+        }
+    }
+    unlock_store(s_mem);
+
+    for (i = 0; i < items->nelts; ++i) {
+        item = &APR_ARRAY_IDX(items, i, iter_item_t);
+        rv = mem_load(store, group, item->name, item->aspect, vtype, &value, p);
+        if (APR_STATUS_IS_ENOENT(rv)) {
+            /* removed in the meantime */
+            rv = APR_SUCCESS;
+            continue;
+        }
+        else if (APR_SUCCESS != rv) {
+            break;
+        }
+        if (!inspect(baton, item->name, item->aspect, vtype, value, ptemp)) {
+            break;
+        }
+    }
+    apr_pool_destroy(ptemp);
+    return rv;
+}
+
+static apr_status_t mem_names(apr_array_header_t **pnames, md_store_t *store, apr_pool_t *p,
+                              md_store_group_t group, const char *pattern, const char *aspect)
+{
+    md_store_mem_t *s_mem = MEM_STORE(store);
+    apr_array_header_t *names;
+    apr_hash_index_t *hn, *ha;
+    mem_name_t *mn;
+    mem_value_t *v;
+    const void *key;
+    void *val;
+
+    names = apr_array_make(p, 100, sizeof(const char *));
+    simulate_latency(s_mem);
+    lock_store(s_mem);
+    for (hn = apr_hash_first(p, s_mem->groups[group]); hn; hn = apr_hash_next(hn)) {
+        apr_hash_this(hn, &key, NULL, &val);
+        mn = val;
+        if (APR_SUCCESS != apr_fnmatch(pattern, mn->name, 0)) {
+            continue;
+        }
+        for (ha = apr_hash_first(p, mn->aspects); ha; ha = apr_hash_next(ha)) {
+            apr_hash_this(ha, &key, NULL, &val);
+            v = val;
+            if (APR_SUCCESS == apr_fnmatch(aspect, v->aspect, 0)) {
+                APR_ARRAY_PUSH(names, const char *) = apr_pstrdup(p, mn->name);
+                break;
+            }
+        }
+    }
+    unlock_store(s_mem);
+    *pnames = names;
+    return APR_SUCCESS;
+}
+
+static apr_status_t mem_get_fname(const char **pfname,
+                                  md_store_t *store, md_store_group_t group,
+                                  const char *name, const char *aspect,
+                                  apr_pool_t *p)
+{
+    return md_util_path_merge(pfname, p, MEM_FNAME_PREFIX, md_store_group_name(group),
+                              name, aspect, NULL);
+}
+
+/**************************************************************************************************/
+/* transactions */
+
+/* Values put are collected in a name of their own, which replaces the
+ * current one on commit. */
+static apr_status_t mem_txn_put(md_store_txn_t *txn, const char *aspect,
+                                md_store_vtype_t vtype, void *value)
+{
+    md_store_mem_t *s_mem = MEM_STORE(txn->store);
+    apr_status_t rv;
+
+    lock_store(s_mem);
+    rv = value_set(txn->baton, aspect, vtype, value);
+    unlock_store(s_mem);
+    return rv;
+}
+
+static apr_status_t mem_txn_end(md_store_txn_t *txn, int commit)
+{
+    md_store_mem_t *s_mem = MEM_STORE(txn->store);
+    mem_name_t *mn = txn->baton, *existing;
+
+    if (!commit) {
+        lock_store(s_mem);
+        apr_pool_destroy(mn->p);
+        unlock_store(s_mem);
+        return APR_SUCCESS;
+    }
+    simulate_latency(s_mem);
+    lock_store(s_mem);
+    if ((existing = name_get(s_mem, txn->group, txn->name))) {
+        name_drop(s_mem, txn->group, existing);
+    }
+    if (apr_hash_count(mn->aspects)) {
+        mn->name = apr_pstrdup(mn->p, txn->name);
+        apr_hash_set(s_mem->groups[txn->group], mn->name, APR_HASH_KEY_STRING, mn);
+    }
+    else {
+        apr_pool_destroy(mn->p);
+    }
+    unlock_store(s_mem);
+    return APR_SUCCESS;
+}
+
+static apr_status_t mem_txn_begin(md_store_txn_t **ptxn, md_store_t *store, apr_pool_t *p,
+                                  md_store_group_t group, const char *name)
+{
+    md_store_mem_t *s_mem = MEM_STORE(store);
+    md_store_txn_t *txn;
+    mem_name_t *mn;
+    apr_pool_t *np;
+    apr_status_t rv;
+
+    *ptxn = NULL;
+    lock_store(s_mem);
+    rv = apr_pool_create(&np, s_mem->p);
+    unlock_store(s_mem);
+    if (APR_SUCCESS != rv) {
+        return rv;
+    }
+    mn = apr_pcalloc(np, sizeof(*mn));
+    mn->p = np;
+    mn->aspects = apr_hash_make(np);
+
+    txn = apr_pcalloc(p, sizeof(*txn));
+    txn->put = mem_txn_put;
+    txn->end = mem_txn_end;
+    txn->baton = mn;
+    *ptxn = txn;
+    return APR_SUCCESS;
+}
+
+/**************************************************************************************************/
+/* setup */
+
+apr_status_t md_store_mem_init(md_store_t **pstore, apr_pool_t *p)
+{
+    md_store_mem_t *s_mem;
+    apr_status_t rv = APR_SUCCESS;
+    int i;
+
+    s_mem = apr_pcalloc(p, sizeof(*s_mem));
+    s_mem->p = p;
+    s_mem->s.load = mem_load;
+    s_mem->s.save = mem_save;
+    s_mem->s.remove = mem_remove;
+    s_mem->s.move = mem_move;
+    s_mem->s.purge = mem_purge;
+    s_mem->s.iterate = mem_iterate;
+    s_mem->s.names = mem_names;
+    s_mem->s.get_fname = mem_get_fname;
+    s_mem->s.txn_begin = mem_txn_begin;
+    for (i = 0; i < MD_SG_COUNT; ++i) {
+        s_mem->groups[i] = apr_hash_make(p);
+    }
+#if APR_HAS_THREADS
+    rv = apr_thread_mutex_create(&s_mem->mutex, APR_THREAD_MUTEX_DEFAULT, p);
+#endif
+    *pstore = (APR_SUCCESS == rv)? &s_mem->s : NULL;
+    return rv;
+}
+
+void md_store_mem_latency_set(md_store_t *store, apr_interval_time_t latency)
+{
+    md_store_mem_t *s_mem = MEM_STORE(store);
+
+    lock_store(s_mem);
+    s_mem->latency = latency;
+    unlock_store(s_mem);
+}
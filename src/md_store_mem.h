@@ -0,0 +1,41 @@
+/* Copyright 2017 greenbytes GmbH (https://www.greenbytes.de)
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef mod_md_md_store_mem_h
+#define mod_md_md_store_mem_h
+
+struct md_store_t;
+
+/**
+ * Create a store that keeps all values in memory, allocated from pool 'p'.
+ * Values are held as parsed objects and copied on save and load, so callers
+ * may change what they got without affecting the store.
+ *
+ * There are no files behind the values. md_store_get_fname() gives paths
+ * below "mem:" which identify the value, but do not exist.
+ *
+ * Meant for tests and benchmarks of code using a store, without the noise of
+ * a file system.
+ */
+apr_status_t md_store_mem_init(struct md_store_t **pstore, apr_pool_t *p);
+
+/**
+ * Make every store operation take at least 'latency', as a slower store would.
+ * The waiting is done without blocking other threads using the store.
+ * A 'latency' of 0 disables this, which is the default.
+ */
+void md_store_mem_latency_set(struct md_store_t *store, apr_interval_time_t latency);
+
+#endif /* mod_md_md_store_mem_h */
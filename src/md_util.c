@@ -13,10 +13,27 @@
  * limitations under the License.
  */
 
+#if defined(MD_HAVE_SYNCFS) || defined(MD_HAVE_OPENAT) || defined(MD_HAVE_RENAMEAT2)
+#define _GNU_SOURCE         /* for syncfs(), openat(), dirfd() and renameat2() */
+#endif
+
 #include <stdio.h>
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#if defined(MD_HAVE_OPENAT) || defined(MD_HAVE_RENAMEAT2)
+#include <errno.h>
+#endif
+#ifdef MD_HAVE_OPENAT
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
 
 #include <apr_lib.h>
+#include <apr_atomic.h>
 #include <apr_strings.h>
+#include <apr_portable.h>
 #include <apr_file_io.h>
 #include <apr_file_info.h>
 #include <apr_fnmatch.h>
@@ -27,6 +44,11 @@
 #include "md_log.h"
 #include "md_util.h"
 
+/* getpid for Windows */
+#if APR_HAVE_PROCESS_H
+#include <process.h>
+#endif
+
 /**************************************************************************************************/
 /* pool utils */
 
@@ -235,41 +257,127 @@ apr_status_t md_util_path_merge(const char **ppath, apr_pool_t *p, ...)
     return rv;
 }
 
+static apr_uint32_t freplace_seq;
+
+const char *md_util_tmp_path(const char *fpath, apr_pool_t *p)
+{
+    return apr_psprintf(p, "%s.%" APR_PID_T_FMT ".%u.tmp", fpath, (apr_pid_t)getpid(), 
+                        (unsigned int)apr_atomic_inc32(&freplace_seq));
+}
+
 apr_status_t md_util_freplace(const char *fpath, apr_fileperms_t perms, apr_pool_t *p, 
                               md_util_file_cb *write_cb, void *baton)
 {
-    apr_status_t rv = APR_EEXIST;
+    apr_status_t rv;
     apr_file_t *f;
     const char *tmp;
-    int i, max;
     
-    tmp = apr_psprintf(p, "%s.tmp", fpath);
-    i = 0; max = 20;
-creat:
-    while (i < max && APR_EEXIST == (rv = md_util_fcreatex(&f, tmp, perms, p))) {
-        ++i;
-        apr_sleep(apr_time_msec(50));
-    } 
-    if (APR_EEXIST == rv 
-        && APR_SUCCESS == (rv = apr_file_remove(tmp, p))
-        && max <= 20) {
-        max *= 2;
-        goto creat;
+    /* Every writer has a temporary file of its own and the last rename wins. 
+     * Writers that need more than that coordinate via locks, e.g. the store's. */
+    tmp = md_util_tmp_path(fpath, p);
+    rv = md_util_fcreatex(&f, tmp, perms, p);
+    if (APR_STATUS_IS_EEXIST(rv)) {
+        /* left behind by a process that had our pid before */
+        apr_file_remove(tmp, p);
+        rv = md_util_fcreatex(&f, tmp, perms, p);
     }
     
     if (APR_SUCCESS == rv) {
         rv = write_cb(baton, f, p);
+        if (APR_SUCCESS == rv) {
+            /* or the rename may reach the disk before the content */
+            rv = md_util_fsync_file(f);
+        }
         apr_file_close(f);
         
         if (APR_SUCCESS == rv) {
             rv = apr_file_rename(tmp, fpath, p);
-            if (APR_SUCCESS != rv) {
-                apr_file_remove(tmp, p);
-            }
+        }
+        if (APR_SUCCESS != rv) {
+            apr_file_remove(tmp, p);
         }
     }
     return rv;
-}                            
+}
+
+apr_status_t md_util_fsync_path(const char *path, apr_pool_t *p)
+{
+#ifdef WIN32
+    /* directory entries cannot be flushed on their own there */
+    (void)path;
+    (void)p;
+    return APR_SUCCESS;
+#else
+    apr_status_t rv = APR_SUCCESS;
+    int fd;
+    
+    (void)p;
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return errno;
+    }
+    if (fsync(fd) < 0) {
+        rv = errno;
+    }
+    close(fd);
+    return rv;
+#endif
+}
+
+apr_status_t md_util_syncfs(const char *path, apr_pool_t *p)
+{
+#ifdef MD_HAVE_SYNCFS
+    apr_status_t rv = APR_SUCCESS;
+    int fd;
+    
+    (void)p;
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return errno;
+    }
+    if (syncfs(fd) < 0) {
+        rv = errno;
+    }
+    close(fd);
+    return rv;
+#else
+    (void)path;
+    (void)p;
+    return APR_ENOTIMPL;
+#endif
+}
+
+apr_status_t md_util_rename_exchange(const char *path1, const char *path2, apr_pool_t *p)
+{
+#if defined(MD_HAVE_RENAMEAT2) && defined(RENAME_EXCHANGE)
+    (void)p;
+    if (renameat2(AT_FDCWD, path1, AT_FDCWD, path2, RENAME_EXCHANGE) < 0) {
+        /* older kernels and some file systems do not know the flag */
+        return (EINVAL == errno || ENOSYS == errno)? APR_ENOTIMPL : errno;
+    }
+    return APR_SUCCESS;
+#else
+    (void)path1;
+    (void)path2;
+    (void)p;
+    return APR_ENOTIMPL;
+#endif
+}
+
+apr_status_t md_util_fsync_file(apr_file_t *f)
+{
+#ifndef WIN32
+    apr_os_file_t fd;
+    apr_status_t rv;
+    
+    if (APR_SUCCESS != (rv = apr_file_flush(f))
+        || APR_SUCCESS != (rv = apr_os_file_get(&fd, f))) {
+        return rv;
+    }
+    if (fsync(fd) < 0) {
+        return errno;
+    }
+#endif
+    return APR_SUCCESS;
+}
 
 /**************************************************************************************************/
 /* text files */
@@ -433,10 +541,137 @@ static apr_status_t match_and_do(md_util_fwalk_t *ctx, const char *path, int dep
     return rv;
 }
 
+#ifdef MD_HAVE_OPENAT
+
+/* The same as match_and_do(), but reading directories relative to the handle of
+ * their parent. The file types come from the directory entries, so only file
+ * systems that do not report them cost a stat. Path strings are only made for
+ * directories, not for every entry, and the pool handed to the callback is
+ * cleared after each entry. */
+
+static int walk_at = 1;
+
+static apr_filetype_e dirent_type(DIR *d, struct dirent *de)
+{
+    struct stat st;
+
+    switch (de->d_type) {
+        case DT_REG: return APR_REG;
+        case DT_DIR: return APR_DIR;
+        case DT_LNK: return APR_LNK;
+        case DT_CHR: return APR_CHR;
+        case DT_BLK: return APR_BLK;
+        case DT_FIFO: return APR_PIPE;
+        case DT_SOCK: return APR_SOCK;
+        default:
+            break;
+    }
+    if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+        return APR_NOFILE;
+    }
+    switch (st.st_mode & S_IFMT) {
+        case S_IFREG: return APR_REG;
+        case S_IFDIR: return APR_DIR;
+        case S_IFLNK: return APR_LNK;
+        case S_IFCHR: return APR_CHR;
+        case S_IFBLK: return APR_BLK;
+        case S_IFIFO: return APR_PIPE;
+        case S_IFSOCK: return APR_SOCK;
+        default: return APR_UNKFILE;
+    }
+}
+
+static const char *path_join(apr_pool_t *p, const char *dir, const char *name)
+{
+    apr_size_t len = strlen(dir);
+
+    /* names read from a directory never hold a '/' and are not "." or ".." */
+    return apr_pstrcat(p, dir, (len && dir[len-1] == '/')? "" : "/", name, NULL);
+}
+
+/* Walk the directory open as 'fd', which is closed when done. */
+static apr_status_t match_and_do_at(md_util_fwalk_t *ctx, int fd, const char *path, 
+                                    int depth, apr_pool_t *p, apr_pool_t *ptemp)
+{
+    apr_status_t rv = APR_SUCCESS;
+    const char *pattern, *name;
+    apr_filetype_e ftype;
+    apr_pool_t *pentry;
+    struct dirent *de;
+    DIR *d;
+    int nfd, ndepth = depth + 1;
+
+    pattern = APR_ARRAY_IDX(ctx->patterns, depth, const char *);
+    if (NULL == (d = fdopendir(fd))) {
+        rv = APR_FROM_OS_ERROR(errno);
+        close(fd);
+        return rv;
+    }
+    if (APR_SUCCESS != (rv = apr_pool_create(&pentry, ptemp))) {
+        closedir(d);
+        return rv;
+    }
+    
+    while (APR_SUCCESS == rv) {
+        errno = 0;
+        if (NULL == (de = readdir(d))) {
+            rv = errno? APR_FROM_OS_ERROR(errno) : APR_SUCCESS;
+            break;
+        }
+        name = de->d_name;
+        if ((name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+            || APR_SUCCESS != apr_fnmatch(pattern, name, 0)) {
+            continue;
+        }
+        apr_pool_clear(pentry);
+        ftype = dirent_type(d, de);
+        if (ndepth < ctx->patterns->nelts) {
+            if (APR_DIR == ftype) {
+                nfd = openat(dirfd(d), name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+                if (nfd < 0) {
+                    rv = APR_FROM_OS_ERROR(errno);
+                }
+                else {
+                    rv = match_and_do_at(ctx, nfd, path_join(pentry, path, name), 
+                                         ndepth, p, pentry);
+                }
+                if (APR_STATUS_IS_ENOENT(rv)) {
+                    /* gone in the meantime */
+                    rv = APR_SUCCESS;
+                }
+            }
+        }
+        else if (APR_NOFILE != ftype) {
+            rv = ctx->cb(ctx->baton, p, pentry, path, name, ftype);
+        }
+    }
+
+    apr_pool_destroy(pentry);
+    closedir(d);
+    return rv;
+}
+
+void md_util_walk_at_set(int enabled)
+{
+    walk_at = enabled;
+}
+
+#else /* MD_HAVE_OPENAT */
+
+void md_util_walk_at_set(int enabled)
+{
+    (void)enabled;
+}
+
+#endif /* MD_HAVE_OPENAT, else part */
+
 static apr_status_t files_do_start(void *baton, apr_pool_t *p, apr_pool_t *ptemp, va_list ap)
 {
     md_util_fwalk_t *ctx = baton;
     const char *segment;
+#ifdef MD_HAVE_OPENAT
+    int fd;
+#endif
 
     ctx->patterns = apr_array_make(ptemp, 5, sizeof(const char*));
     
@@ -445,7 +680,18 @@ static apr_status_t files_do_start(void *baton, apr_pool_t *p, apr_pool_t *ptemp
         APR_ARRAY_PUSH(ctx->patterns, const char *) = segment;
         segment = va_arg(ap, char *);
     }
+    if (!ctx->patterns->nelts) {
+        return APR_SUCCESS;
+    }
     
+#ifdef MD_HAVE_OPENAT
+    if (walk_at) {
+        if ((fd = open(ctx->path, O_RDONLY|O_DIRECTORY|O_CLOEXEC)) < 0) {
+            return APR_FROM_OS_ERROR(errno);
+        }
+        return match_and_do_at(ctx, fd, ctx->path, 0, p, ptemp);
+    }
+#endif
     return match_and_do(ctx, ctx->path, 0, p, ptemp);
 }
 
@@ -493,7 +739,7 @@ static apr_status_t tree_do(void *baton, apr_pool_t *p, apr_pool_t *ptemp, const
             if (APR_LNK == ftype && ctx->follow_links) {
                 rv = md_util_path_merge(&fpath, ptemp, path, name, NULL);
                 if (APR_SUCCESS == rv) {
-                    rv = apr_stat(&finfo, ctx->path, wanted, ptemp);
+                    rv = apr_stat(&finfo, fpath, wanted, ptemp);
                 }
             }
             
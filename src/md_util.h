@@ -75,9 +75,43 @@ apr_status_t md_util_is_file(const char *path, apr_pool_t *pool);
 
 typedef apr_status_t md_util_file_cb(void *baton, struct apr_file_t *f, apr_pool_t *p);
 
+/**
+ * Replace the file at 'fpath' with what 'write' puts into a temporary file. The
+ * content is on disk before the rename, so that a crash leaves either the old or
+ * the new file. Syncing the directory entry is left to the caller.
+ */
 apr_status_t md_util_freplace(const char *fpath, apr_fileperms_t perms, apr_pool_t *p, 
                               md_util_file_cb *write, void *baton);
 
+/**
+ * A temporary path next to 'fpath' that no other writer in any process uses at the
+ * same time, "<fpath>.<pid>.<seq>.tmp", as md_util_freplace() writes to.
+ */
+const char *md_util_tmp_path(const char *fpath, apr_pool_t *p);
+
+/**
+ * Flush a file, or the entries of a directory, at 'path' to disk, so that changes
+ * made survive a crash. Does nothing where this is not supported.
+ */
+apr_status_t md_util_fsync_path(const char *path, apr_pool_t *p);
+
+/**
+ * Flush everything written to the file system holding 'path' to disk. 
+ * Returns APR_ENOTIMPL where the platform has no syncfs().
+ */
+apr_status_t md_util_syncfs(const char *path, apr_pool_t *p);
+
+/**
+ * Atomically swap the files or directories at 'path1' and 'path2', both of which 
+ * must exist. Returns APR_ENOTIMPL where the platform or file system cannot do this.
+ */
+apr_status_t md_util_rename_exchange(const char *path1, const char *path2, apr_pool_t *p);
+
+/**
+ * Flush the content written to 'f' to disk.
+ */
+apr_status_t md_util_fsync_file(struct apr_file_t *f);
+
 /** 
  * Remove a file/directory and all files/directories contain up to max_level. If max_level == 0,
  * only an empty directory or a file can be removed.
@@ -91,6 +125,13 @@ typedef apr_status_t md_util_fdo_cb(void *baton, apr_pool_t *p, apr_pool_t *ptem
 apr_status_t md_util_files_do(md_util_fdo_cb *cb, void *baton, apr_pool_t *p, 
                               const char *path, ...);
 
+/**
+ * Set if md_util_files_do() reads directories relative to the handles of their
+ * parents, where the platform supports this. Otherwise, it opens every directory
+ * by its full path. This applies to the whole process and is on by default.
+ */
+void md_util_walk_at_set(int enabled);
+
 /**
  * Depth first traversal of directory tree starting at path.
  */
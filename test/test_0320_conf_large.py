@@ -0,0 +1,129 @@
+# test mod_md with large, generated configurations
+
+import os
+import re
+import time
+
+from ConfigParser import SafeConfigParser
+from test_base import TestEnv
+
+config = SafeConfigParser()
+config.read('test.ini')
+PREFIX = config.get('global', 'prefix')
+
+# number of virtual hosts, each with its own managed domain, override with
+# the environment variable MD_LARGE_VHOSTS to time really big setups
+VHOST_COUNT = int(os.environ.get('MD_LARGE_VHOSTS', '2000'))
+
+def setup_module(module):
+    print("setup_module    module:%s" % module.__name__)
+    TestEnv.init()
+    TestEnv.apache_err_reset()
+    TestEnv.clear_store()
+
+def teardown_module(module):
+    print("teardown_module module:%s" % module.__name__)
+    TestEnv.install_test_conf(None);
+    assert TestEnv.apache_stop() == 0
+
+
+def gen_large_conf(name, count, overlap=False, uncovered=False):
+    # 'count' vhosts, each with a ServerName and two aliases, all covered
+    # by a managed domain of its own
+    if not os.path.exists(TestEnv.GEN_DIR):
+        os.makedirs(TestEnv.GEN_DIR)
+    path = os.path.join(TestEnv.GEN_DIR, name + ".conf")
+    fd = open(path, 'w')
+    fd.write("# generated: %d vhosts with managed domains\n\n" % (count))
+    fd.write("MDDriveMode manual\n\n")
+    for i in range(count):
+        domain = "site%d.example.org" % (i)
+        names = [ domain, "www." + domain, "mail." + domain ]
+        if overlap and i == count - 1:
+            names.append("www.site0.example.org")
+        fd.write("ManagedDomain %s\n" % (" ".join(names)))
+        fd.write("<VirtualHost *:%s>\n" % (TestEnv.HTTP_PORT))
+        fd.write("    ServerName %s\n" % (domain))
+        fd.write("    ServerAlias www.%s mail.%s\n" % (domain, domain))
+        if uncovered and i == count - 1:
+            fd.write("    ServerAlias other.%s\n" % (domain))
+        fd.write("</VirtualHost>\n\n")
+    fd.close()
+    return path
+
+def err_log_count(text):
+    if not os.path.isfile(TestEnv.ERROR_LOG):
+        return 0
+    return len([l for l in open(TestEnv.ERROR_LOG) if text in l])
+
+def last_vhost_checks():
+    # the number of MD/server pairs post_config looked at in the last run, as
+    # logged at debug level
+    checks = None
+    if os.path.isfile(TestEnv.ERROR_LOG):
+        for l in open(TestEnv.ERROR_LOG):
+            m = re.search(r'mapped to virtual hosts in \d+ ms, (\d+) server checks', l)
+            if m:
+                checks = int(m.group(1))
+    return checks
+
+def timed_restart():
+    start = time.time()
+    rv = TestEnv.apache_restart()
+    return (rv, time.time() - start)
+
+
+class TestConfLarge:
+
+    def setup_method(self, method):
+        print("setup_method: %s" % method.__name__)
+
+    def teardown_method(self, method):
+        print("teardown_method: %s" % method.__name__)
+
+    # --------- tests ---------
+
+    def test_320_001(self):
+        # many vhosts, each with its own MD, are mapped with work linear to their
+        # number: each of the 3 names of an MD finds its one server
+        TestEnv.install_test_conf(gen_large_conf("large_half", VHOST_COUNT / 2))
+        assert TestEnv.apache_stop() == 0
+        assert TestEnv.apache_start() == 0
+        (rv, t_half) = timed_restart()
+        assert rv == 0
+        checks_half = last_vhost_checks()
+        TestEnv.install_test_conf(gen_large_conf("large_full", VHOST_COUNT))
+        (rv, t_full) = timed_restart()
+        assert rv == 0
+        checks_full = last_vhost_checks()
+        # timings depend on the machine, they are for information only
+        print "restart with %d vhosts: %.2fs, with %d: %.2fs" % (
+            VHOST_COUNT / 2, t_half, VHOST_COUNT, t_full)
+        assert checks_half == 3 * (VHOST_COUNT / 2)
+        assert checks_full == 3 * VHOST_COUNT
+
+    def test_320_002(self):
+        # the last MD overlaps the first one
+        assert TestEnv.apache_stop() == 0
+        TestEnv.install_test_conf(gen_large_conf("large_overlap", VHOST_COUNT, overlap=True))
+        assert TestEnv.apache_fail() == 0
+
+    def test_320_003(self):
+        # the last vhost has an alias its MD does not cover
+        assert TestEnv.apache_stop() == 0
+        TestEnv.install_test_conf(gen_large_conf("large_uncovered", VHOST_COUNT, uncovered=True))
+        assert TestEnv.apache_fail() == 0
+
+    def test_320_004(self):
+        # the dry run syncs the store, the real run and restarts without changes do not
+        assert TestEnv.apache_stop() == 0
+        TestEnv.apache_err_reset()
+        TestEnv.install_test_conf(gen_large_conf("large_same", 100))
+        assert TestEnv.apache_start() == 0
+        assert err_log_count("sync skipped") == 1
+        assert TestEnv.apache_restart() == 0
+        assert err_log_count("sync skipped") == 2
+        # a changed MD needs a sync again
+        TestEnv.install_test_conf(gen_large_conf("large_changed", 101))
+        assert TestEnv.apache_restart() == 0
+        assert err_log_count("sync skipped") == 2
@@ -20,7 +20,14 @@ static Suite *main_test_suite(void)
 {
     Suite *suite = suite_create("main");
 
+    suite_add_tcase(suite, md_domain_set_test_case());
     suite_add_tcase(suite, md_json_test_case());
+    suite_add_tcase(suite, md_json_arena_test_case());
+    suite_add_tcase(suite, md_json_arena_late_test_case());
+    suite_add_tcase(suite, md_reg_test_case());
+    suite_add_tcase(suite, md_store_fs_test_case());
+    suite_add_tcase(suite, md_store_log_test_case());
+    suite_add_tcase(suite, md_store_mem_test_case());
     suite_add_tcase(suite, md_util_test_case());
 
     return suite;
@@ -16,9 +16,17 @@
  * Common headers and declarations needed by most/all test source files.
  */
 
+#include <stdlib.h>
 #include <apr.h>   /* for pid_t on Windows, needed by Check */
 #include <check.h>
 
+/*
+ * Benchmarks are only added to their test cases when the environment variable
+ * MD_UNIT_BENCH is set, e.g. "MD_UNIT_BENCH=1 ./unit_main". They print their
+ * numbers to stderr.
+ */
+#define MD_UNIT_BENCH_ENABLED()     (getenv("MD_UNIT_BENCH") != NULL)
+
 /*
  * Compatibility ck_assert macros for Check < 0.11.
  */
@@ -40,5 +48,12 @@
  * main_test_suite() in main.c.
  */
 
+TCase *md_domain_set_test_case(void);
 TCase *md_json_test_case(void);
+TCase *md_json_arena_test_case(void);
+TCase *md_json_arena_late_test_case(void);
+TCase *md_reg_test_case(void);
+TCase *md_store_fs_test_case(void);
+TCase *md_store_log_test_case(void);
+TCase *md_store_mem_test_case(void);
 TCase *md_util_test_case(void);
@@ -0,0 +1,351 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <apr_strings.h>
+#include <apr_tables.h>
+#include <apr_time.h>
+
+#include "test_common.h"
+#include "md.h"
+#include "md_domain_set.h"
+#include "md_json.h"
+#include "md_util.h"
+
+/* number of domain names in the managed domain for the lookup benchmark */
+#define BENCH_NAME_COUNT    20000
+/* number of managed domains, and copies of each, for the interning benchmark */
+#define BENCH_MD_COUNT      5000
+#define BENCH_MD_COPIES     4
+
+/*
+ * Helpers
+ */
+
+static md_domain_set_t *make_set(apr_pool_t *p, const char *names)
+{
+    md_domain_set_t *set;
+    char *list, *name, *last;
+
+    set = md_domain_set_make(p, 0);
+    list = apr_pstrdup(p, names);
+    for (name = apr_strtok(list, " ", &last); name; name = apr_strtok(NULL, " ", &last)) {
+        md_domain_set_add(set, name);
+    }
+    return set;
+}
+
+static const char *set_str(const md_domain_set_t *set, apr_pool_t *p)
+{
+    return apr_array_pstrcat(p, md_domain_set_names(set), ' ');
+}
+
+/* clone 'mds' BENCH_MD_COPIES times, as config, registry and store would, and
+ * compare the domains of each with the original */
+static apr_interval_time_t bench_clones(apr_array_header_t *mds, apr_pool_t *p)
+{
+    apr_time_t start;
+    md_t *md, *copies[BENCH_MD_COPIES];
+    apr_size_t hits = 0;
+    int i, j;
+
+    start = apr_time_now();
+    for (i = 0; i < mds->nelts; ++i) {
+        md = APR_ARRAY_IDX(mds, i, md_t *);
+        for (j = 0; j < BENCH_MD_COPIES; ++j) {
+            copies[j] = md_clone(p, md);
+        }
+        for (j = 0; j < BENCH_MD_COPIES; ++j) {
+            hits += md_common_name_count(md, copies[j]);
+            ck_assert( md_equal_domains(copies[j], md) );
+        }
+    }
+    ck_assert_int_eq( (int)hits, mds->nelts * BENCH_MD_COPIES * 3 );
+    return apr_time_now() - start;
+}
+
+static apr_array_header_t *bench_mds(apr_pool_t *p)
+{
+    apr_array_header_t *mds, *domains;
+    const char *name;
+    md_t *md;
+    int i;
+
+    mds = apr_array_make(p, BENCH_MD_COUNT, sizeof(md_t *));
+    for (i = 0; i < BENCH_MD_COUNT; ++i) {
+        name = apr_psprintf(p, "Site%d.Bench.example.org", i);
+        domains = apr_array_make(p, 3, sizeof(const char *));
+        APR_ARRAY_PUSH(domains, const char *) = name;
+        APR_ARRAY_PUSH(domains, const char *) = apr_pstrcat(p, "www.", name, NULL);
+        APR_ARRAY_PUSH(domains, const char *) = apr_pstrcat(p, "mail.", name, NULL);
+        ck_assert_ptr_eq( md_create(&md, p, domains), NULL );
+        APR_ARRAY_PUSH(mds, md_t *) = md;
+    }
+    return mds;
+}
+
+/*
+ * Test Fixture -- runs once per test
+ */
+
+static apr_pool_t *g_pool;
+
+static void md_domain_set_setup(void)
+{
+    if (apr_pool_create(&g_pool, NULL) != APR_SUCCESS) {
+        exit(1);
+    }
+}
+
+static void md_domain_set_teardown(void)
+{
+    apr_pool_destroy(g_pool);
+}
+
+/*
+ * Tests
+ */
+
+START_TEST(set_add_keeps_order_and_lowercases)
+{
+    md_domain_set_t *set;
+
+    set = md_domain_set_make(g_pool, 0);
+    ck_assert_int_eq( md_domain_set_count(set), 0 );
+    ck_assert_int_eq( md_domain_set_count(NULL), 0 );
+    ck_assert_int_eq( md_domain_set_add(set, "b.test"), 1 );
+    ck_assert_int_eq( md_domain_set_add(set, "A.Test"), 1 );
+    ck_assert_int_eq( md_domain_set_add(set, "B.TEST"), 0 );
+    ck_assert_int_eq( md_domain_set_count(set), 2 );
+    ck_assert_str_eq( md_domain_set_get(set, 0), "b.test" );
+    ck_assert_str_eq( md_domain_set_get(set, 1), "a.test" );
+    ck_assert_int_eq( md_domain_set_index(set, "a.TEST"), 1 );
+    ck_assert_int_eq( md_domain_set_index(set, "c.test"), -1 );
+    ck_assert( md_domain_set_contains(set, "B.test") );
+    ck_assert( !md_domain_set_contains(set, "b.test.") );
+    ck_assert( !md_domain_set_contains(NULL, "b.test") );
+}
+END_TEST
+
+START_TEST(set_grows_and_removes)
+{
+    md_domain_set_t *set, *copy;
+    int i;
+
+    set = md_domain_set_make(g_pool, 1);
+    for (i = 0; i < 1000; ++i) {
+        ck_assert_int_eq( md_domain_set_add(set, apr_psprintf(g_pool, "n%d.test", i)), 1 );
+    }
+    ck_assert_int_eq( md_domain_set_count(set), 1000 );
+    for (i = 0; i < 1000; ++i) {
+        ck_assert_int_eq( md_domain_set_index(set, apr_psprintf(g_pool, "N%d.test", i)), i );
+    }
+
+    copy = md_domain_set_copy(g_pool, set);
+    ck_assert_int_eq( md_domain_set_remove(set, "n10.test"), 1 );
+    ck_assert_int_eq( md_domain_set_remove(set, "n10.test"), 0 );
+    ck_assert_int_eq( md_domain_set_count(set), 999 );
+    ck_assert_int_eq( md_domain_set_index(set, "n11.test"), 10 );
+    ck_assert_int_eq( md_domain_set_index(set, "n999.test"), 998 );
+    /* the copy is left alone */
+    ck_assert_int_eq( md_domain_set_count(copy), 1000 );
+    ck_assert_int_eq( md_domain_set_index(copy, "n10.test"), 10 );
+}
+END_TEST
+
+START_TEST(set_operations)
+{
+    md_domain_set_t *a, *b, *diff;
+
+    a = make_set(g_pool, "a.test b.test c.test");
+    b = make_set(g_pool, "D.test C.test b.test");
+
+    ck_assert_int_eq( md_domain_set_intersect_count(a, b), 2 );
+    ck_assert_str_eq( md_domain_set_common(a, b), "b.test" );
+    ck_assert_str_eq( md_domain_set_common(b, a), "c.test" );
+    ck_assert_ptr_eq( md_domain_set_common(a, make_set(g_pool, "x.test")), NULL );
+
+    diff = md_domain_set_diff(g_pool, b, a);
+    ck_assert_str_eq( set_str(diff, g_pool), "d.test" );
+    ck_assert( !md_domain_set_contains_all(a, b) );
+    ck_assert_int_eq( md_domain_set_add_all(a, b), 1 );
+    ck_assert_str_eq( set_str(a, g_pool), "a.test b.test c.test d.test" );
+    ck_assert( md_domain_set_contains_all(a, b) );
+    ck_assert( !md_domain_set_equal(a, b) );
+    ck_assert( md_domain_set_equal(make_set(g_pool, "x.test Y.test"),
+                                   make_set(g_pool, "y.test x.test")) );
+}
+END_TEST
+
+START_TEST(md_domains_json_keep_order)
+{
+    apr_array_header_t *domains;
+    md_json_t *json;
+    md_t *md, *md2;
+
+    domains = apr_array_make(g_pool, 5, sizeof(const char *));
+    APR_ARRAY_PUSH(domains, const char *) = "z.test";
+    APR_ARRAY_PUSH(domains, const char *) = "WWW.z.test";
+    APR_ARRAY_PUSH(domains, const char *) = "a.test";
+    APR_ARRAY_PUSH(domains, const char *) = "www.Z.test";
+    ck_assert_ptr_eq( md_create(&md, g_pool, domains), NULL );
+    ck_assert_str_eq( md->name, "z.test" );
+    ck_assert_str_eq( set_str(md->domains, g_pool), "z.test www.z.test a.test" );
+
+    json = md_to_json(md, g_pool);
+    domains = apr_array_make(g_pool, 5, sizeof(const char *));
+    ck_assert_int_eq( md_json_dupsa(domains, g_pool, json, MD_KEY_DOMAINS, NULL), APR_SUCCESS );
+    ck_assert_str_eq( apr_array_pstrcat(g_pool, domains, ' '), "z.test www.z.test a.test" );
+    md2 = md_from_json(json, g_pool);
+    ck_assert_str_eq( set_str(md2->domains, g_pool), "z.test www.z.test a.test" );
+    ck_assert( md_equal_domains(md, md2) );
+    ck_assert( md_contains(md2, "A.TEST") );
+    ck_assert_int_eq( md_common_name_count(md, md_clone(g_pool, md2)), 3 );
+}
+END_TEST
+
+START_TEST(intern_gives_one_string)
+{
+    apr_array_header_t *domains;
+    const char *a, *b;
+    apr_size_t bytes, saved;
+    md_t *md, *md2;
+    int count;
+
+    /* without a table, names are lowercase copies */
+    a = md_domain_intern(g_pool, "A.Test");
+    b = md_domain_intern(g_pool, "a.test");
+    ck_assert_str_eq( a, "a.test" );
+    ck_assert_str_eq( b, "a.test" );
+    ck_assert( a != b );
+    md_domain_intern_stats(&count, &bytes, &saved);
+    ck_assert_int_eq( count, 0 );
+
+    ck_assert_int_eq( md_domain_intern_init(g_pool), APR_SUCCESS );
+    a = md_domain_intern(g_pool, "A.Test");
+    b = md_domain_intern(g_pool, "a.test");
+    ck_assert_str_eq( a, "a.test" );
+    ck_assert_ptr_eq( a, b );
+    ck_assert_ptr_eq( md_domain_intern(g_pool, "a.TEST"), a );
+    ck_assert( md_domain_intern(g_pool, "b.test") != a );
+    md_domain_intern_stats(&count, &bytes, &saved);
+    ck_assert_int_eq( count, 2 );
+    ck_assert_int_eq( (int)bytes, 14 );
+    ck_assert_int_eq( (int)saved, 14 );
+
+    /* clones and parsed copies share the names */
+    domains = apr_array_make(g_pool, 2, sizeof(const char *));
+    APR_ARRAY_PUSH(domains, const char *) = "a.test";
+    APR_ARRAY_PUSH(domains, const char *) = "WWW.a.test";
+    ck_assert_ptr_eq( md_create(&md, g_pool, domains), NULL );
+    ck_assert_ptr_eq( md_domain_set_get(md->domains, 0), a );
+    md2 = md_clone(g_pool, md);
+    ck_assert_ptr_eq( md_domain_set_get(md2->domains, 1), md_domain_set_get(md->domains, 1) );
+    md2 = md_from_json(md_to_json(md, g_pool), g_pool);
+    ck_assert_ptr_eq( md_domain_set_get(md2->domains, 1), md_domain_set_get(md->domains, 1) );
+}
+END_TEST
+
+START_TEST(bench_interned_clones)
+{
+    apr_array_header_t *mds;
+    apr_pool_t *p;
+    apr_interval_time_t t_copied, t_interned;
+    apr_size_t bytes, saved;
+    int count;
+
+    ck_assert_int_eq( apr_pool_create(&p, g_pool), APR_SUCCESS );
+    mds = bench_mds(p);
+    t_copied = bench_clones(mds, p);
+    apr_pool_destroy(p);
+
+    ck_assert_int_eq( apr_pool_create(&p, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( md_domain_intern_init(p), APR_SUCCESS );
+    mds = bench_mds(p);
+    t_interned = bench_clones(mds, p);
+    md_domain_intern_stats(&count, &bytes, &saved);
+    apr_pool_destroy(p);
+
+    fprintf(stderr, "# %d mds cloned %d times: copied names %" APR_TIME_T_FMT "us, "
+            "interned %" APR_TIME_T_FMT "us\n", BENCH_MD_COUNT, BENCH_MD_COPIES,
+            t_copied, t_interned);
+    fprintf(stderr, "# %d names interned in %lu bytes, %lu bytes of copies saved\n",
+            count, (unsigned long)bytes, (unsigned long)saved);
+    ck_assert_int_eq( count, BENCH_MD_COUNT * 3 );
+    ck_assert( saved >= BENCH_MD_COPIES * bytes );
+}
+END_TEST
+
+START_TEST(bench_large_md_lookups)
+{
+    apr_array_header_t *domains;
+    apr_time_t start;
+    apr_interval_time_t t_array, t_set;
+    md_t *md;
+    int i, found;
+
+    domains = apr_array_make(g_pool, BENCH_NAME_COUNT, sizeof(const char *));
+    for (i = 0; i < BENCH_NAME_COUNT; ++i) {
+        APR_ARRAY_PUSH(domains, const char *) = apr_psprintf(g_pool, "n%d.bench.test", i);
+    }
+
+    /* what md_contains() did before, for every name of the MD */
+    start = apr_time_now();
+    for (i = found = 0; i < BENCH_NAME_COUNT; ++i) {
+        if (md_array_str_index(domains, APR_ARRAY_IDX(domains, i, const char *), 0, 0) >= 0) {
+            ++found;
+        }
+    }
+    t_array = apr_time_now() - start;
+    ck_assert_int_eq( found, BENCH_NAME_COUNT );
+
+    start = apr_time_now();
+    ck_assert_ptr_eq( md_create(&md, g_pool, domains), NULL );
+    for (i = found = 0; i < BENCH_NAME_COUNT; ++i) {
+        if (md_contains(md, APR_ARRAY_IDX(domains, i, const char *))) {
+            ++found;
+        }
+    }
+    t_set = apr_time_now() - start;
+    ck_assert_int_eq( found, BENCH_NAME_COUNT );
+
+    fprintf(stderr, "# %d lookups in a MD of %d names: array %" APR_TIME_T_FMT "us, "
+            "set (incl. creation) %" APR_TIME_T_FMT "us\n",
+            BENCH_NAME_COUNT, BENCH_NAME_COUNT, t_array, t_set);
+}
+END_TEST
+
+TCase *md_domain_set_test_case(void)
+{
+    TCase *testcase = tcase_create("md_domain_set");
+
+    tcase_add_checked_fixture(testcase, md_domain_set_setup, md_domain_set_teardown);
+    tcase_set_timeout(testcase, 60);
+
+    tcase_add_test(testcase, set_add_keeps_order_and_lowercases);
+    tcase_add_test(testcase, set_grows_and_removes);
+    tcase_add_test(testcase, set_operations);
+    tcase_add_test(testcase, md_domains_json_keep_order);
+    tcase_add_test(testcase, intern_gives_one_string);
+    
+    if (MD_UNIT_BENCH_ENABLED()) {
+        tcase_set_timeout(testcase, 600);
+        tcase_add_test(testcase, bench_interned_clones);
+        tcase_add_test(testcase, bench_large_md_lookups);
+    }
+
+    return testcase;
+}
@@ -13,6 +13,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "test_common.h"
 #include "md_json.h"
@@ -317,6 +318,103 @@ START_TEST(json_writep_returns_NULL_for_corrupted_json_struct)
 }
 END_TEST
 
+START_TEST(compiled_paths)
+{
+    static const md_json_path_t a_b = MD_JSON_PATH2("a", "b");
+    md_json_t *json = md_json_create(g_pool);
+    md_json_path_t *a_c;
+    apr_array_header_t *a;
+    const char *s;
+
+    a_c = md_json_path_make(g_pool, "a", "c", NULL);
+    ck_assert_ptr_nonnull( a_c );
+    ck_assert_ptr_eq( md_json_path_make(g_pool, "1", "2", "3", "4", "5", "6", "7", "8", NULL), 
+                      NULL );
+
+    ck_assert_int_eq( md_json_path_has_key(json, &a_b), 0 );
+    ck_assert_int_eq( md_json_path_sets("text", json, &a_b), 0 );
+    ck_assert_int_eq( md_json_path_has_key(json, &a_b), 1 );
+    ck_assert_str_eq( md_json_path_gets(json, &a_b), "text" );
+    ck_assert_str_eq( md_json_gets(json, "a", "b", NULL), "text" );
+
+    ck_assert_int_eq( md_json_path_setl(42, json, a_c), 0 );
+    ck_assert_int_eq( md_json_path_getl(json, a_c), 42 );
+    ck_assert_int_eq( md_json_path_getb(json, a_c), 0 );
+
+    a = apr_array_make(g_pool, 1, sizeof(char*));
+    APR_ARRAY_PUSH(a, const char*) = "x";
+    ck_assert_int_eq( md_json_path_setsa(a, json, &a_b), 0 );
+    s = md_json_writep(json, g_pool, MD_JSON_FMT_COMPACT);
+    ck_assert_str_eq(s, "{\"a\":{\"b\":[\"x\"],\"c\":42}}");
+    
+    apr_array_clear(a);
+    ck_assert_int_eq( md_json_path_getsa(a, json, &a_b), 0 );
+    ck_assert_int_eq( a->nelts, 1 );
+    ck_assert_str_eq( APR_ARRAY_IDX(a, 0, const char*), "x" );
+}
+END_TEST
+
+typedef struct {
+    const char *name;
+    int state;
+    long count;
+    apr_array_header_t *tags;
+    const char *url;
+    apr_array_header_t *extra;
+} codec_test_t;
+
+static const md_json_field_t CODEC_SUB_FIELDS[] = {
+    MD_JSON_FIELD("url", MD_JSON_FIELD_STR, codec_test_t, url),
+    MD_JSON_FIELD_OPT("extra", MD_JSON_FIELD_STRA, codec_test_t, extra),
+    MD_JSON_FIELD_END
+};
+
+static const md_json_field_t CODEC_FIELDS[] = {
+    MD_JSON_FIELD("name", MD_JSON_FIELD_STR, codec_test_t, name),
+    MD_JSON_FIELD("state", MD_JSON_FIELD_ENUM, codec_test_t, state),
+    MD_JSON_FIELD("count", MD_JSON_FIELD_LONG, codec_test_t, count),
+    MD_JSON_FIELD("tags", MD_JSON_FIELD_STRA, codec_test_t, tags),
+    MD_JSON_FIELD_SUB("sub", CODEC_SUB_FIELDS),
+    MD_JSON_FIELD_END
+};
+
+START_TEST(struct_codec_roundtrip)
+{
+    md_json_t *json = md_json_create(g_pool);
+    codec_test_t in, out;
+    const char *s;
+
+    memset(&in, 0, sizeof(in));
+    in.name = "test";
+    in.state = 2;
+    in.count = 4711;
+    in.tags = apr_array_make(g_pool, 1, sizeof(char*));
+    APR_ARRAY_PUSH(in.tags, const char*) = "t1";
+    in.extra = apr_array_make(g_pool, 1, sizeof(char*));
+    
+    ck_assert_int_eq( md_json_encode(CODEC_FIELDS, &in, json, g_pool), 0 );
+    s = md_json_writep(json, g_pool, MD_JSON_FMT_COMPACT);
+    /* NULL strings, empty optional arrays and then empty objects are left out */
+    ck_assert_str_eq(s, "{\"name\":\"test\",\"state\":2,\"count\":4711,\"tags\":[\"t1\"]}");
+
+    in.url = "https://example.org";
+    APR_ARRAY_PUSH(in.extra, const char*) = "e1";
+    json = md_json_create(g_pool);
+    ck_assert_int_eq( md_json_encode(CODEC_FIELDS, &in, json, g_pool), 0 );
+    
+    memset(&out, 0, sizeof(out));
+    ck_assert_int_eq( md_json_decode(CODEC_FIELDS, &out, json, g_pool), 0 );
+    ck_assert_str_eq( out.name, "test" );
+    ck_assert_int_eq( out.state, 2 );
+    ck_assert_int_eq( out.count, 4711 );
+    ck_assert_int_eq( out.tags->nelts, 1 );
+    ck_assert_str_eq( APR_ARRAY_IDX(out.tags, 0, const char*), "t1" );
+    ck_assert_str_eq( out.url, "https://example.org" );
+    ck_assert_int_eq( out.extra->nelts, 1 );
+    ck_assert_str_eq( APR_ARRAY_IDX(out.extra, 0, const char*), "e1" );
+}
+END_TEST
+
 TCase *md_json_test_case(void)
 {
     TCase *testcase = tcase_create("md_json");
@@ -337,5 +435,8 @@ TCase *md_json_test_case(void)
 
     tcase_add_test(testcase, json_writep_returns_NULL_for_corrupted_json_struct);
 
+    tcase_add_test(testcase, compiled_paths);
+    tcase_add_test(testcase, struct_codec_roundtrip);
+
     return testcase;
 }
@@ -0,0 +1,327 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <apr_file_info.h>
+#include <apr_strings.h>
+#include <apr_time.h>
+
+#include "test_common.h"
+#include "md.h"
+#include "md_json.h"
+#include "md_store.h"
+#include "md_store_fs.h"
+#include "md_util.h"
+
+/* number of managed domains in the store for the iteration benchmark */
+#define BENCH_MD_COUNT      10000
+
+/*
+ * Helpers
+ */
+
+static md_t *bench_md(apr_pool_t *p, int i)
+{
+    apr_array_header_t *domains;
+    md_t *md;
+    int j;
+
+    domains = apr_array_make(p, 5, sizeof(const char *));
+    for (j = 0; j < 5; ++j) {
+        APR_ARRAY_PUSH(domains, const char *) = apr_psprintf(p, "%s%d.bench.example.org",
+                                                             j? "alt" : "www", i);
+    }
+    ck_assert_ptr_eq(md_create(&md, p, domains), NULL);
+    md->ca_url = "https://acme.example.org/directory";
+    md->ca_proto = "ACME";
+    return md;
+}
+
+typedef struct {
+    int count;
+} bench_ctx;
+
+static int bench_insp(void *baton, const char *name, const char *aspect,
+                      md_store_vtype_t vtype, void *value, apr_pool_t *ptemp)
+{
+    bench_ctx *ctx = baton;
+
+    if (md_from_json(value, ptemp)) {
+        ++ctx->count;
+    }
+    return 1;
+}
+
+static int bench_md_insp(void *baton, md_store_t *store, md_t *md, apr_pool_t *ptemp)
+{
+    bench_ctx *ctx = baton;
+
+    ++ctx->count;
+    return 1;
+}
+
+/*
+ * Test Fixture -- runs once per test
+ */
+
+static apr_pool_t *g_pool;
+static const char *g_store_dir;
+
+static void md_json_arena_setup_fixture(void)
+{
+    const char *tmpdir;
+
+    if (md_json_arena_setup() != APR_SUCCESS) {
+        exit(1);
+    }
+    if (apr_pool_create(&g_pool, NULL) != APR_SUCCESS) {
+        exit(1);
+    }
+    if (apr_temp_dir_get(&tmpdir, g_pool) != APR_SUCCESS
+        || md_util_path_merge(&g_store_dir, g_pool, tmpdir,
+                              apr_psprintf(g_pool, "md-unit-%d", (int)getpid()),
+                              NULL) != APR_SUCCESS) {
+        exit(1);
+    }
+}
+
+static void md_json_arena_teardown(void)
+{
+    md_util_rm_recursive(g_store_dir, g_pool, 5);
+    apr_pool_destroy(g_pool);
+}
+
+/*
+ * Tests
+ */
+
+START_TEST(arena_parse_allocates_from_pool)
+{
+    static const char *doc = "{\"name\":\"test\",\"domains\":[\"a.org\",\"b.org\"]}";
+    apr_pool_t *p;
+    md_json_t *json;
+    apr_uint32_t heap0, pool0, heap1, pool1;
+
+    ck_assert_int_eq( apr_pool_create(&p, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( md_json_arena_enable(p), APR_SUCCESS );
+
+    md_json_arena_counts(&heap0, &pool0);
+    ck_assert_int_eq( md_json_readd(&json, p, doc, strlen(doc)), APR_SUCCESS );
+    md_json_arena_counts(&heap1, &pool1);
+
+    ck_assert_int_eq( heap1, heap0 );
+    ck_assert_int_gt( pool1, pool0 );
+    ck_assert_str_eq( md_json_gets(json, "name", NULL), "test" );
+
+    /* destroying early is allowed, the memory stays with the pool */
+    md_json_destroy(json);
+    apr_pool_destroy(p);
+}
+END_TEST
+
+START_TEST(arena_applies_to_sub_pools_only)
+{
+    static const char *doc = "{\"name\":\"test\"}";
+    apr_pool_t *p, *psub;
+    md_json_t *json;
+    apr_uint32_t heap0, heap1;
+
+    ck_assert_int_eq( apr_pool_create(&p, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( apr_pool_create(&psub, p), APR_SUCCESS );
+    ck_assert_int_eq( md_json_arena_enable(p), APR_SUCCESS );
+
+    md_json_arena_counts(&heap0, NULL);
+    ck_assert_int_eq( md_json_readd(&json, psub, doc, strlen(doc)), APR_SUCCESS );
+    md_json_arena_counts(&heap1, NULL);
+    ck_assert_int_eq( heap1, heap0 );
+
+    md_json_arena_counts(&heap0, NULL);
+    ck_assert_int_eq( md_json_readd(&json, g_pool, doc, strlen(doc)), APR_SUCCESS );
+    md_json_arena_counts(&heap1, NULL);
+    ck_assert_int_gt( heap1, heap0 );
+
+    /* created, not parsed, documents are always on the heap */
+    md_json_arena_counts(&heap0, NULL);
+    json = md_json_create(psub);
+    md_json_arena_counts(&heap1, NULL);
+    ck_assert_int_gt( heap1, heap0 );
+
+    apr_pool_destroy(p);
+}
+END_TEST
+
+START_TEST(arena_docs_shared_as_copies)
+{
+    static const char *doc = "{\"name\":\"test\",\"domains\":[\"a.org\",\"b.org\"]}";
+    apr_pool_t *p;
+    md_json_t *json, *heap, *copy;
+
+    ck_assert_int_eq( apr_pool_create(&p, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( md_json_arena_enable(p), APR_SUCCESS );
+    ck_assert_int_eq( md_json_readd(&json, p, doc, strlen(doc)), APR_SUCCESS );
+
+    heap = md_json_create(g_pool);
+    ck_assert_int_eq( md_json_setj(json, heap, "md", NULL), APR_SUCCESS );
+    ck_assert_int_eq( md_json_addj(json, heap, "all", NULL), APR_SUCCESS );
+    copy = md_json_copy(g_pool, json);
+    apr_pool_destroy(p);
+
+    /* nothing refers to the arena any more */
+    ck_assert_str_eq( md_json_gets(heap, "md", "name", NULL), "test" );
+    ck_assert_str_eq( md_json_gets(copy, "name", NULL), "test" );
+    ck_assert_int_eq( md_json_setl(1, copy, "count", NULL), APR_SUCCESS );
+    md_json_destroy(heap);
+    md_json_destroy(copy);
+}
+END_TEST
+
+START_TEST(arena_docs_modified_as_copies)
+{
+    static const char *doc = "{\"name\":\"test\",\"domains\":[\"a.org\",\"b.org\"]}";
+    apr_pool_t *p;
+    md_json_t *json, *domains;
+    apr_array_header_t *names;
+
+    ck_assert_int_eq( apr_pool_create(&p, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( md_json_arena_enable(p), APR_SUCCESS );
+    ck_assert_int_eq( md_json_readd(&json, p, doc, strlen(doc)), APR_SUCCESS );
+
+    ck_assert_int_eq( md_json_sets("other", json, "name", NULL), APR_SUCCESS );
+    ck_assert_str_eq( md_json_gets(json, "name", NULL), "other" );
+    ck_assert_int_eq( md_json_del(json, "name", NULL), APR_SUCCESS );
+    ck_assert_ptr_eq( md_json_gets(json, "name", NULL), NULL );
+
+    /* once copied, parts got from the document change with it */
+    domains = md_json_getj(json, "domains", NULL);
+    ck_assert_ptr_ne( domains, NULL );
+    ck_assert_int_eq( md_json_clr(domains, NULL), APR_SUCCESS );
+    names = apr_array_make(p, 5, sizeof(const char *));
+    ck_assert_int_eq( md_json_getsa(names, json, "domains", NULL), APR_SUCCESS );
+    ck_assert_int_eq( names->nelts, 0 );
+
+    apr_pool_destroy(p);
+}
+END_TEST
+
+START_TEST(bench_store_md_iter_mallocs)
+{
+    md_store_t *store;
+    apr_pool_t *p;
+    bench_ctx ctx;
+    apr_uint32_t heap0, pool0, heap1, pool1, heap_plain, heap_arena, pool_arena;
+    apr_time_t start, t_plain, t_arena;
+    int i;
+
+    ck_assert_int_eq( md_store_fs_init(&store, g_pool, g_store_dir), APR_SUCCESS );
+    for (i = 0; i < BENCH_MD_COUNT; ++i) {
+        ck_assert_int_eq( apr_pool_create(&p, g_pool), APR_SUCCESS );
+        ck_assert_int_eq( md_save(store, p, MD_SG_DOMAINS, bench_md(p, i), 1), APR_SUCCESS );
+        apr_pool_destroy(p);
+    }
+
+    /* every md.json parsed onto the heap, as md_store_md_iter() did before */
+    ck_assert_int_eq( apr_pool_create(&p, g_pool), APR_SUCCESS );
+    ctx.count = 0;
+    md_json_arena_counts(&heap0, &pool0);
+    start = apr_time_now();
+    ck_assert_int_eq( md_store_iter(bench_insp, &ctx, store, p, MD_SG_DOMAINS, "*",
+                                    MD_FN_MD, MD_SV_JSON), APR_SUCCESS );
+    apr_pool_destroy(p);
+    t_plain = apr_time_now() - start;
+    md_json_arena_counts(&heap1, &pool1);
+    ck_assert_int_eq( ctx.count, BENCH_MD_COUNT );
+    heap_plain = heap1 - heap0;
+
+    /* the same through md_store_md_iter(), which parses into a pool arena */
+    ck_assert_int_eq( apr_pool_create(&p, g_pool), APR_SUCCESS );
+    ctx.count = 0;
+    md_json_arena_counts(&heap0, &pool0);
+    start = apr_time_now();
+    ck_assert_int_eq( md_store_md_iter(bench_md_insp, &ctx, store, p, MD_SG_DOMAINS, "*"),
+                      APR_SUCCESS );
+    apr_pool_destroy(p);
+    t_arena = apr_time_now() - start;
+    md_json_arena_counts(&heap1, &pool1);
+    ck_assert_int_eq( ctx.count, BENCH_MD_COUNT );
+    heap_arena = heap1 - heap0;
+    pool_arena = pool1 - pool0;
+
+    fprintf(stderr, "# md_store_md_iter over %d mds: heap  mallocs %u, %" APR_TIME_T_FMT "us\n",
+            BENCH_MD_COUNT, heap_plain, t_plain);
+    fprintf(stderr, "# md_store_md_iter over %d mds: arena mallocs %u (pool allocs %u), %"
+            APR_TIME_T_FMT "us\n", BENCH_MD_COUNT, heap_arena, pool_arena, t_arena);
+
+    ck_assert_int_lt( heap_arena, heap_plain );
+}
+END_TEST
+
+START_TEST(arena_setup_after_json)
+{
+    static const char *doc = "{\"name\":\"test\"}";
+    apr_pool_t *p, *parena;
+    md_json_t *json, *parsed;
+    apr_uint32_t pool0, pool1;
+
+    /* json that may have been made before the arena was there, in this process or not */
+    ck_assert_int_eq( apr_pool_create(&p, NULL), APR_SUCCESS );
+    json = md_json_create(p);
+    ck_assert_int_eq( md_json_sets("test", json, "name", NULL), APR_SUCCESS );
+    
+    ck_assert_int_eq( md_json_arena_setup(), APR_SUCCESS );
+    ck_assert_int_eq( apr_pool_create(&parena, p), APR_SUCCESS );
+    ck_assert_int_eq( md_json_arena_enable(parena), APR_SUCCESS );
+    md_json_arena_counts(NULL, &pool0);
+    ck_assert_int_eq( md_json_readd(&parsed, parena, doc, strlen(doc)), APR_SUCCESS );
+    md_json_arena_counts(NULL, &pool1);
+    ck_assert_int_gt( pool1, pool0 );
+    
+    /* the older json is changed and freed by the allocator it came from */
+    ck_assert_int_eq( md_json_sets("other", json, "name", NULL), APR_SUCCESS );
+    md_json_destroy(json);
+    apr_pool_destroy(p);
+}
+END_TEST
+
+TCase *md_json_arena_test_case(void)
+{
+    TCase *testcase = tcase_create("md_json_arena");
+
+    tcase_add_checked_fixture(testcase, md_json_arena_setup_fixture, md_json_arena_teardown);
+
+    tcase_add_test(testcase, arena_parse_allocates_from_pool);
+    tcase_add_test(testcase, arena_applies_to_sub_pools_only);
+    tcase_add_test(testcase, arena_docs_shared_as_copies);
+    tcase_add_test(testcase, arena_docs_modified_as_copies);
+    
+    if (MD_UNIT_BENCH_ENABLED()) {
+        tcase_set_timeout(testcase, 600);
+        tcase_add_test(testcase, bench_store_md_iter_mallocs);
+    }
+
+    return testcase;
+}
+
+TCase *md_json_arena_late_test_case(void)
+{
+    /* no fixture, these tests pass with or without the arena installed at start */
+    TCase *testcase = tcase_create("md_json_arena_late");
+
+    tcase_add_test(testcase, arena_setup_after_json);
+
+    return testcase;
+}
@@ -0,0 +1,479 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <apr_file_info.h>
+#include <apr_strings.h>
+#include <apr_time.h>
+
+#include "test_common.h"
+#include "md.h"
+#include "md_crypt.h"
+#include "md_log.h"
+#include "md_reg.h"
+#include "md_store.h"
+#include "md_store_fs.h"
+#include "md_util.h"
+
+/* number of managed domains assessed by the benchmark */
+#define BENCH_ASSESS_COUNT  10000
+/* number of managed domains for the parallel assessment test */
+#define PAR_MD_COUNT        100
+/* configured managed domains in the sync tests */
+#define SYNC_MD_COUNT       10
+
+static apr_pool_t *g_pool;
+static const char *g_store_dir;
+static md_store_t *g_store;
+static md_reg_t *g_reg;
+static md_pkey_t *g_pkey;
+static md_cert_t *g_cert;
+static const char *g_last_sync;    /* the last "sync: ..." message md_reg_sync() logged */
+
+/*
+ * Helpers
+ */
+
+/* save md 'name' for 'domain', with the shared key and certificate when 'creds' is set */
+static void save_test_md(const char *name, const char *domain, int creds, apr_pool_t *pool)
+{
+    apr_array_header_t *domains, *chain;
+    apr_pool_t *p;
+    md_t *md;
+
+    ck_assert_int_eq( apr_pool_create(&p, pool), APR_SUCCESS );
+    domains = apr_array_make(p, 1, sizeof(const char *));
+    APR_ARRAY_PUSH(domains, const char *) = domain;
+    ck_assert_ptr_eq( md_create(&md, p, domains), NULL );
+    md->name = name;
+    md->renew_window = apr_time_from_sec(14 * MD_SECS_PER_DAY);
+    md->ca_url = "https://acme.example.org/directory";
+    md->ca_proto = "ACME";
+    ck_assert_int_eq( md_save(g_store, p, MD_SG_DOMAINS, md, 1), APR_SUCCESS );
+    if (creds) {
+        chain = apr_array_make(p, 1, sizeof(md_cert_t *));
+        APR_ARRAY_PUSH(chain, md_cert_t *) = g_cert;
+        ck_assert_int_eq( md_pkey_save(g_store, p, MD_SG_DOMAINS, name, g_pkey, 1),
+                          APR_SUCCESS );
+        ck_assert_int_eq( md_cert_save(g_store, p, MD_SG_DOMAINS, name, g_cert, 1),
+                          APR_SUCCESS );
+        ck_assert_int_eq( md_chain_save(g_store, p, MD_SG_DOMAINS, name, chain, 1),
+                          APR_SUCCESS );
+    }
+    apr_pool_destroy(p);
+}
+
+static md_t *make_test_md(const char *name, apr_pool_t *p)
+{
+    apr_array_header_t *domains;
+    md_t *md;
+
+    domains = apr_array_make(p, 2, sizeof(const char *));
+    APR_ARRAY_PUSH(domains, const char *) = name;
+    APR_ARRAY_PUSH(domains, const char *) = apr_pstrcat(p, "www.", name, NULL);
+    ck_assert_ptr_eq( md_create(&md, p, domains), NULL );
+    return md;
+}
+
+static apr_array_header_t *test_names(int count, apr_pool_t *p)
+{
+    apr_array_header_t *names;
+    int i;
+
+    names = apr_array_make(p, count, sizeof(const char *));
+    for (i = 0; i < count; ++i) {
+        APR_ARRAY_PUSH(names, const char *) = apr_psprintf(p, "md%d.test", i);
+    }
+    return names;
+}
+
+static int sync_log_level(void *baton, apr_pool_t *p, md_log_level_t level)
+{
+    (void)baton;
+    (void)p;
+    return level <= MD_LOG_DEBUG;
+}
+
+static void sync_log_print(const char *file, int line, md_log_level_t level, 
+                           apr_status_t rv, void *baton, apr_pool_t *p, 
+                           const char *fmt, va_list ap)
+{
+    (void)file;
+    (void)line;
+    (void)level;
+    (void)rv;
+    (void)baton;
+    (void)p;
+    if (!strncmp("sync: ", fmt, 6)) {
+        g_last_sync = apr_pvsprintf(g_pool, fmt, ap);
+    }
+}
+
+/* the configuration of SYNC_MD_COUNT mds "md<i>.test" with their "www." names */
+static apr_array_header_t *sync_conf(apr_pool_t *p)
+{
+    apr_array_header_t *mds;
+    md_t *md;
+    int i;
+
+    mds = apr_array_make(p, SYNC_MD_COUNT, sizeof(md_t *));
+    for (i = 0; i < SYNC_MD_COUNT; ++i) {
+        md = make_test_md(apr_psprintf(p, "md%d.test", i), p);
+        md->ca_url = "https://acme.example.org/directory";
+        md->ca_proto = "ACME";
+        APR_ARRAY_PUSH(mds, md_t *) = md;
+    }
+    return mds;
+}
+
+static void sync_run(apr_array_header_t *mds)
+{
+    apr_pool_t *ptemp;
+
+    g_last_sync = NULL;
+    ck_assert_int_eq( apr_pool_create(&ptemp, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( md_reg_sync(g_reg, g_pool, ptemp, mds, 1, 1), APR_SUCCESS );
+    apr_pool_destroy(ptemp);
+    ck_assert_ptr_nonnull( g_last_sync );
+}
+
+/* the names of the mds changed in the store since 'since', the last change in *plast */
+static apr_array_header_t *sync_changed(apr_int64_t since, apr_int64_t *plast)
+{
+    apr_array_header_t *names;
+
+    ck_assert_int_eq( md_store_changed_names(&names, plast, g_store, MD_SG_DOMAINS, since, 
+                                             g_pool), APR_SUCCESS );
+    return names;
+}
+
+static md_t *store_md(const char *name)
+{
+    md_t *md;
+
+    ck_assert_int_eq( md_load(g_store, MD_SG_DOMAINS, name, &md, g_pool), APR_SUCCESS );
+    return md;
+}
+
+/*
+ * Test Fixture -- runs once per test
+ */
+
+static void md_reg_setup(void)
+{
+    const char *tmpdir;
+
+    if (apr_pool_create(&g_pool, NULL) != APR_SUCCESS) {
+        exit(1);
+    }
+    if (apr_temp_dir_get(&tmpdir, g_pool) != APR_SUCCESS
+        || md_util_path_merge(&g_store_dir, g_pool, tmpdir,
+                              apr_psprintf(g_pool, "md-unit-reg-%d", (int)getpid()),
+                              NULL) != APR_SUCCESS
+        || md_store_fs_init(&g_store, g_pool, g_store_dir) != APR_SUCCESS
+        || md_reg_init(&g_reg, g_pool, g_store) != APR_SUCCESS
+        || md_pkey_gen_rsa(&g_pkey, g_pool, 2048) != APR_SUCCESS
+        || md_cert_self_sign(&g_cert, "bench.test", "bench.test", g_pkey,
+                             apr_time_from_sec(90 * MD_SECS_PER_DAY), g_pool) != APR_SUCCESS) {
+        exit(1);
+    }
+}
+
+static void md_reg_teardown(void)
+{
+    md_util_rm_recursive(g_store_dir, g_pool, 5);
+    apr_pool_destroy(g_pool);
+}
+
+/*
+ * Tests
+ */
+
+START_TEST(assess_all_like_get_and_assess)
+{
+    apr_array_header_t *names, *results;
+    const md_reg_assessment_t *result;
+    md_t *md;
+    int nthreads;
+
+    save_test_md("complete.test", "bench.test", 1, g_pool);
+    save_test_md("incomplete.test", "incomplete.test", 0, g_pool);
+    save_test_md("uncovered.test", "uncovered.test", 1, g_pool);
+    names = apr_array_make(g_pool, 4, sizeof(const char *));
+    APR_ARRAY_PUSH(names, const char *) = "complete.test";
+    APR_ARRAY_PUSH(names, const char *) = "incomplete.test";
+    APR_ARRAY_PUSH(names, const char *) = "missing.test";
+    APR_ARRAY_PUSH(names, const char *) = "uncovered.test";
+
+    for (nthreads = 1; nthreads <= 4; nthreads += 3) {
+        ck_assert_int_eq( md_reg_assess_all(&results, g_reg, names, nthreads, g_pool),
+                          APR_SUCCESS );
+        ck_assert_int_eq( results->nelts, 4 );
+
+        result = &APR_ARRAY_IDX(results, 0, md_reg_assessment_t);
+        ck_assert_int_eq( result->rv, APR_SUCCESS );
+        ck_assert_str_eq( result->md->name, "complete.test" );
+        ck_assert_int_eq( result->md->state, MD_S_COMPLETE );
+        ck_assert( result->md->expires > apr_time_now() );
+        ck_assert_int_eq( result->errored, 0 );
+        ck_assert_int_eq( result->renew, 0 );
+
+        result = &APR_ARRAY_IDX(results, 1, md_reg_assessment_t);
+        ck_assert_str_eq( result->md->name, "incomplete.test" );
+        ck_assert_int_eq( result->md->state, MD_S_INCOMPLETE );
+        ck_assert_int_eq( result->renew, 1 );
+
+        result = &APR_ARRAY_IDX(results, 2, md_reg_assessment_t);
+        ck_assert_ptr_null( result->md );
+        ck_assert( APR_STATUS_IS_ENOENT(result->rv) );
+
+        result = &APR_ARRAY_IDX(results, 3, md_reg_assessment_t);
+        ck_assert_str_eq( result->md->name, "uncovered.test" );
+        ck_assert_int_eq( result->md->state, MD_S_INCOMPLETE );
+        ck_assert_int_eq( result->renew, 1 );
+    }
+
+    /* a changed state is saved, as md_reg_get() does */
+    ck_assert_int_eq( md_load(g_store, MD_SG_DOMAINS, "complete.test", &md, g_pool),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md->state, MD_S_COMPLETE );
+    ck_assert_int_eq( md_load(g_store, MD_SG_DOMAINS, "incomplete.test", &md, g_pool),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md->state, MD_S_INCOMPLETE );
+
+    /* nothing to assess */
+    names = apr_array_make(g_pool, 1, sizeof(const char *));
+    ck_assert_int_eq( md_reg_assess_all(&results, g_reg, names, 4, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( results->nelts, 0 );
+}
+END_TEST
+
+START_TEST(assess_all_threads_deliver_all)
+{
+    apr_array_header_t *names, *results;
+    const md_reg_assessment_t *result;
+    int i;
+
+    names = test_names(PAR_MD_COUNT, g_pool);
+    for (i = 0; i < PAR_MD_COUNT; ++i) {
+        save_test_md(APR_ARRAY_IDX(names, i, const char *), "bench.test", i % 2, g_pool);
+    }
+    ck_assert_int_eq( md_reg_assess_all(&results, g_reg, names, 8, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( results->nelts, PAR_MD_COUNT );
+    for (i = 0; i < PAR_MD_COUNT; ++i) {
+        result = &APR_ARRAY_IDX(results, i, md_reg_assessment_t);
+        ck_assert_int_eq( result->rv, APR_SUCCESS );
+        ck_assert_str_eq( result->md->name, APR_ARRAY_IDX(names, i, const char *) );
+        ck_assert_int_eq( result->md->state, (i % 2)? MD_S_COMPLETE : MD_S_INCOMPLETE );
+        ck_assert_int_eq( result->renew, !(i % 2) );
+    }
+}
+END_TEST
+
+static int reg_do_collect(void *baton, md_reg_t *reg, md_t *md)
+{
+    apr_array_header_t *names = baton;
+
+    (void)reg;
+    APR_ARRAY_PUSH(names, const char *) = apr_pstrdup(names->pool, md->name);
+    return 1;
+}
+
+START_TEST(reg_do_loads_on_threads)
+{
+    apr_array_header_t *names, *seen;
+    int i;
+
+    names = test_names(PAR_MD_COUNT, g_pool);
+    for (i = 0; i < PAR_MD_COUNT; ++i) {
+        save_test_md(APR_ARRAY_IDX(names, i, const char *), "bench.test", 0, g_pool);
+    }
+    ck_assert_int_eq( md_store_names(&names, g_store, g_pool, MD_SG_DOMAINS, "*", MD_FN_MD),
+                      APR_SUCCESS );
+    md_reg_load_threads_set(g_reg, 4);
+    seen = apr_array_make(g_pool, PAR_MD_COUNT, sizeof(const char *));
+    md_reg_do(reg_do_collect, seen, g_reg, g_pool);
+    /* in the order of the store, as on one thread */
+    ck_assert_int_eq( seen->nelts, PAR_MD_COUNT );
+    for (i = 0; i < PAR_MD_COUNT; ++i) {
+        ck_assert_str_eq( APR_ARRAY_IDX(seen, i, const char *), 
+                          APR_ARRAY_IDX(names, i, const char *) );
+    }
+}
+END_TEST
+
+START_TEST(sync_updates_one_edited_md)
+{
+    apr_array_header_t *mds, *names;
+    apr_int64_t last;
+    md_t *md;
+
+    md_log_set(sync_log_level, sync_log_print, NULL);
+    ck_assert_int_eq( md_store_fs_journal_set(g_store, 1, 0), APR_SUCCESS );
+    mds = sync_conf(g_pool);
+    sync_run(mds);
+    ck_assert_str_eq( g_last_sync, "sync: found 0 mds in store" );
+    
+    /* nothing changed, nothing is loaded */
+    sync_run(mds);
+    ck_assert_str_eq( g_last_sync, 
+                      "sync: 0 of 10 mds changed in config, 0 in store, 0 mds loaded" );
+    
+    /* one md gets another name, only that one is loaded and updated */
+    sync_changed(APR_INT64_MAX, &last);
+    md = APR_ARRAY_IDX(mds, 3, md_t *);
+    md_domain_set_add(md->domains, "mail.md3.test");
+    sync_run(mds);
+    ck_assert_str_eq( g_last_sync, 
+                      "sync: 1 of 10 mds changed in config, 0 in store, 1 mds loaded" );
+    names = sync_changed(last, &last);
+    ck_assert_int_eq( names->nelts, 1 );
+    ck_assert_str_eq( APR_ARRAY_IDX(names, 0, const char *), "md3.test" );
+    ck_assert( md_contains(store_md("md3.test"), "mail.md3.test") );
+}
+END_TEST
+
+START_TEST(sync_follows_store_changes)
+{
+    apr_array_header_t *mds;
+    md_t *md;
+
+    md_log_set(sync_log_level, sync_log_print, NULL);
+    ck_assert_int_eq( md_store_fs_journal_set(g_store, 1, 0), APR_SUCCESS );
+    mds = sync_conf(g_pool);
+    sync_run(mds);
+    
+    /* a2md takes a name away from an md in the store, the config still has it */
+    md = store_md("md5.test");
+    ck_assert( md_domain_set_remove(md->domains, "www.md5.test") );
+    ck_assert_int_eq( md_save(g_store, g_pool, MD_SG_DOMAINS, md, 0), APR_SUCCESS );
+    sync_run(mds);
+    ck_assert_str_eq( g_last_sync, 
+                      "sync: 1 of 10 mds changed in config, 1 in store, 1 mds loaded" );
+    ck_assert( md_contains(store_md("md5.test"), "www.md5.test") );
+}
+END_TEST
+
+START_TEST(sync_moves_domain_between_mds)
+{
+    apr_array_header_t *mds;
+    md_t *md1, *md2;
+
+    md_log_set(sync_log_level, sync_log_print, NULL);
+    ck_assert_int_eq( md_store_fs_journal_set(g_store, 1, 0), APR_SUCCESS );
+    mds = sync_conf(g_pool);
+    sync_run(mds);
+    
+    /* www.md2.test now belongs to md1 */
+    md1 = APR_ARRAY_IDX(mds, 1, md_t *);
+    md2 = APR_ARRAY_IDX(mds, 2, md_t *);
+    ck_assert( md_domain_set_remove(md2->domains, "www.md2.test") );
+    md_domain_set_add(md1->domains, "www.md2.test");
+    sync_run(mds);
+    ck_assert_str_eq( g_last_sync, 
+                      "sync: 2 of 10 mds changed in config, 0 in store, 2 mds loaded" );
+    ck_assert( md_contains(store_md("md1.test"), "www.md2.test") );
+    ck_assert( !md_contains(store_md("md2.test"), "www.md2.test") );
+    ck_assert( md_contains(store_md("md2.test"), "md2.test") );
+}
+END_TEST
+
+START_TEST(sync_rotated_journal_is_full)
+{
+    apr_array_header_t *mds;
+    md_t *md;
+    int i;
+
+    md_log_set(sync_log_level, sync_log_print, NULL);
+    ck_assert_int_eq( md_store_fs_journal_set(g_store, 1, 4096), APR_SUCCESS );
+    mds = sync_conf(g_pool);
+    sync_run(mds);
+    
+    /* more changes than the journal keeps, the last sync's position is rotated out */
+    md = store_md("md7.test");
+    ck_assert( md_domain_set_remove(md->domains, "www.md7.test") );
+    for (i = 0; i < 400; ++i) {
+        ck_assert_int_eq( md_save(g_store, g_pool, MD_SG_DOMAINS, md, 0), APR_SUCCESS );
+    }
+    sync_run(mds);
+    ck_assert_str_eq( g_last_sync, "sync: found 10 mds in store" );
+    ck_assert( md_contains(store_md("md7.test"), "www.md7.test") );
+    
+    /* and the next one is incremental again */
+    sync_run(mds);
+    ck_assert_str_eq( g_last_sync, 
+                      "sync: 0 of 10 mds changed in config, 0 in store, 0 mds loaded" );
+}
+END_TEST
+
+/* Prints the time md_reg_assess_all() takes with 1 to 32 threads, it asserts nothing about
+ * them. No numbers are recorded here, they depend on the machine and its disks. To get them,
+ * run "MD_UNIT_BENCH=1 ./unit_main". */
+START_TEST(bench_assess_threads)
+{
+    static const int nthreads[] = { 1, 2, 4, 8, 16, 32 };
+    apr_array_header_t *names, *results;
+    apr_pool_t *p;
+    apr_time_t start, elapsed;
+    int i;
+
+    names = test_names(BENCH_ASSESS_COUNT, g_pool);
+    for (i = 0; i < BENCH_ASSESS_COUNT; ++i) {
+        save_test_md(APR_ARRAY_IDX(names, i, const char *), "bench.test", 1, g_pool);
+    }
+    ck_assert_int_eq( apr_pool_create(&p, g_pool), APR_SUCCESS );
+    for (i = 0; i < (int)(sizeof(nthreads)/sizeof(nthreads[0])); ++i) {
+        start = apr_time_now();
+        ck_assert_int_eq( md_reg_assess_all(&results, g_reg, names, nthreads[i], p),
+                          APR_SUCCESS );
+        elapsed = apr_time_now() - start;
+        ck_assert_int_eq( results->nelts, BENCH_ASSESS_COUNT );
+        ck_assert_int_eq( APR_ARRAY_IDX(results, BENCH_ASSESS_COUNT - 1,
+                                        md_reg_assessment_t).md->state, MD_S_COMPLETE );
+        apr_pool_clear(p);
+        fprintf(stderr, "# md_reg_assess_all over %d mds, %2d threads: %"
+                APR_TIME_T_FMT "us\n", BENCH_ASSESS_COUNT, nthreads[i], elapsed);
+    }
+    apr_pool_destroy(p);
+}
+END_TEST
+
+TCase *md_reg_test_case(void)
+{
+    TCase *testcase = tcase_create("md_reg");
+
+    tcase_add_checked_fixture(testcase, md_reg_setup, md_reg_teardown);
+    /* the sync tests save all their mds several times */
+    tcase_set_timeout(testcase, 60);
+
+    tcase_add_test(testcase, assess_all_like_get_and_assess);
+    tcase_add_test(testcase, assess_all_threads_deliver_all);
+    tcase_add_test(testcase, reg_do_loads_on_threads);
+    tcase_add_test(testcase, sync_updates_one_edited_md);
+    tcase_add_test(testcase, sync_follows_store_changes);
+    tcase_add_test(testcase, sync_moves_domain_between_mds);
+    tcase_add_test(testcase, sync_rotated_journal_is_full);
+    
+    if (MD_UNIT_BENCH_ENABLED()) {
+        /* the benchmark saves and assesses many mds */
+        tcase_set_timeout(testcase, 600);
+        tcase_add_test(testcase, bench_assess_threads);
+    }
+
+    return testcase;
+}
@@ -0,0 +1,1310 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <apr_file_info.h>
+#include <apr_strings.h>
+#include <apr_thread_proc.h>
+#include <apr_time.h>
+
+#include "test_common.h"
+#include "md.h"
+#include "md_crypt.h"
+#include "md_store.h"
+#include "md_store_fs.h"
+#include "md_util.h"
+
+/* number of managed domains for the parallel iteration benchmark */
+#define BENCH_MD_COUNT      500
+/* number of managed domains whose certificates the DER cache benchmark loads, 
+ * as a post_config with that many MDs would */
+#define BENCH_CHAIN_COUNT   10000
+/* number of managed domains saved per durability mode */
+#define BENCH_SAVE_COUNT    200
+/* number of processes competing for a lease */
+#define LEASE_PROCS         4
+/* number of managed domains walked by the iteration benchmark */
+#define BENCH_ITER_COUNT    50000
+/* number of managed domains for the parallel iteration tests */
+#define PAR_MD_COUNT        200
+
+/*
+ * Helpers
+ */
+
+static md_cert_t *make_test_cert(md_pkey_t *pkey, const char *cn, apr_pool_t *p)
+{
+    md_cert_t *cert;
+
+    ck_assert_int_eq( md_cert_self_sign(&cert, cn, cn, pkey,
+                                        apr_time_from_sec(90 * MD_SECS_PER_DAY), p),
+                      APR_SUCCESS );
+    return cert;
+}
+
+static int count_files(const char *dir, apr_pool_t *p)
+{
+    apr_dir_t *d;
+    apr_finfo_t finfo;
+    int n = 0;
+
+    if (apr_dir_open(&d, dir, p) != APR_SUCCESS) {
+        return 0;
+    }
+    while (apr_dir_read(&finfo, APR_FINFO_TYPE, d) == APR_SUCCESS) {
+        if (finfo.filetype == APR_REG) {
+            ++n;
+        }
+    }
+    apr_dir_close(d);
+    return n;
+}
+
+static int count_dirs(const char *dir, apr_pool_t *p)
+{
+    apr_dir_t *d;
+    apr_finfo_t finfo;
+    int n = 0;
+
+    if (apr_dir_open(&d, dir, p) != APR_SUCCESS) {
+        return 0;
+    }
+    while (apr_dir_read(&finfo, APR_FINFO_TYPE|APR_FINFO_NAME, d) == APR_SUCCESS) {
+        if (finfo.filetype == APR_DIR && finfo.name[0] != '.') {
+            ++n;
+        }
+    }
+    apr_dir_close(d);
+    return n;
+}
+
+static int count_insp(void *baton, const char *name, const char *aspect,
+                      md_store_vtype_t vtype, void *value, apr_pool_t *ptemp)
+{
+    int *pcount = baton;
+
+    ++(*pcount);
+    return 1;
+}
+
+typedef struct {
+    apr_array_header_t *names;
+    int stop_after;
+} md_seen_ctx;
+
+static int md_seen(void *baton, md_store_t *store, md_t *md, apr_pool_t *ptemp)
+{
+    md_seen_ctx *ctx = baton;
+
+    APR_ARRAY_PUSH(ctx->names, const char *) = apr_pstrdup(ctx->names->pool, md->name);
+    return ctx->names->nelts != ctx->stop_after;
+}
+
+static void save_test_mds(md_store_t *store, int count, apr_pool_t *pool)
+{
+    apr_array_header_t *domains;
+    apr_pool_t *p;
+    md_t *md;
+    int i;
+
+    ck_assert_int_eq( apr_pool_create(&p, pool), APR_SUCCESS );
+    for (i = 0; i < count; ++i) {
+        domains = apr_array_make(p, 1, sizeof(const char *));
+        APR_ARRAY_PUSH(domains, const char *) = apr_psprintf(p, "md%d.test", i);
+        ck_assert_ptr_eq( md_create(&md, p, domains), NULL );
+        md->ca_url = "https://acme.example.org/directory";
+        md->ca_proto = "ACME";
+        ck_assert_int_eq( md_save(store, p, MD_SG_DOMAINS, md, 1), APR_SUCCESS );
+        apr_pool_clear(p);
+    }
+    apr_pool_destroy(p);
+}
+
+typedef struct {
+    md_store_t *store;
+    md_store_fs_lock_mode_t mode;
+    apr_interval_time_t timeout;
+    apr_status_t rv;
+} lock_ctx;
+
+static void * APR_THREAD_FUNC lock_thread(apr_thread_t *thread, void *data)
+{
+    lock_ctx *ctx = data;
+    md_store_fs_lock_t *lock;
+    apr_pool_t *p;
+
+    ctx->rv = apr_pool_create(&p, NULL);
+    if (ctx->rv == APR_SUCCESS) {
+        ctx->rv = md_store_fs_lock(&lock, ctx->store, p, MD_SG_DOMAINS, "a.test",
+                                   ctx->mode, ctx->timeout);
+        apr_pool_destroy(p);
+    }
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+/* try to lock "a.test" from another thread, which may not share our locks */
+static apr_status_t lock_elsewhere(md_store_t *store, md_store_fs_lock_mode_t mode,
+                                   apr_interval_time_t timeout, apr_pool_t *p)
+{
+    apr_thread_t *thread;
+    apr_status_t rv;
+    lock_ctx ctx;
+
+    ctx.store = store;
+    ctx.mode = mode;
+    ctx.timeout = timeout;
+    ctx.rv = APR_EGENERAL;
+    ck_assert_int_eq( apr_thread_create(&thread, NULL, lock_thread, &ctx, p), APR_SUCCESS );
+    ck_assert_int_eq( apr_thread_join(&rv, thread), APR_SUCCESS );
+    return ctx.rv;
+}
+
+static void assert_same_cert(md_cert_t *c1, md_cert_t *c2, apr_pool_t *p)
+{
+    const char *d1, *d2;
+    apr_size_t l1, l2;
+
+    ck_assert_int_eq( md_cert_to_der(&d1, &l1, c1, p), APR_SUCCESS );
+    ck_assert_int_eq( md_cert_to_der(&d2, &l2, c2, p), APR_SUCCESS );
+    ck_assert_int_eq( l1, l2 );
+    ck_assert_mem_eq( d1, d2, l1 );
+}
+
+/*
+ * Test Fixture -- runs once per test
+ */
+
+static apr_pool_t *g_pool;
+static const char *g_store_dir;
+static md_store_t *g_store;
+static apr_array_header_t *g_chain;
+
+static void md_store_fs_setup(void)
+{
+    const char *tmpdir;
+    md_pkey_t *pkey;
+
+    if (apr_pool_create(&g_pool, NULL) != APR_SUCCESS) {
+        exit(1);
+    }
+    if (apr_temp_dir_get(&tmpdir, g_pool) != APR_SUCCESS
+        || md_util_path_merge(&g_store_dir, g_pool, tmpdir,
+                              apr_psprintf(g_pool, "md-unit-%d", (int)getpid()),
+                              NULL) != APR_SUCCESS
+        || md_store_fs_init(&g_store, g_pool, g_store_dir) != APR_SUCCESS
+        || md_pkey_gen_rsa(&pkey, g_pool, 2048) != APR_SUCCESS) {
+        exit(1);
+    }
+
+    g_chain = apr_array_make(g_pool, 2, sizeof(md_cert_t *));
+    APR_ARRAY_PUSH(g_chain, md_cert_t *) = make_test_cert(pkey, "intermediate.test", g_pool);
+    APR_ARRAY_PUSH(g_chain, md_cert_t *) = make_test_cert(pkey, "root.test", g_pool);
+}
+
+static void md_store_fs_teardown(void)
+{
+    md_util_rm_recursive(g_store_dir, g_pool, 5);
+    apr_pool_destroy(g_pool);
+}
+
+/*
+ * Tests
+ */
+
+/* try to acquire the lease on "a.test" in a separate process, as another server
+ * on the same store would. Returns the status and the token obtained. */
+static apr_status_t lease_elsewhere(long *ptoken, const char *owner, int wait)
+{
+    md_store_lease_t *lease;
+    apr_status_t rv;
+    int fds[2], status;
+    long token = 0;
+    pid_t pid;
+
+    ck_assert_int_eq( pipe(fds), 0 );
+    pid = fork();
+    ck_assert_int_ge( pid, 0 );
+    if (pid == 0) {
+        rv = md_store_lease_acquire(&lease, g_store, g_pool, MD_SG_STAGING, "a.test", owner,
+                                    apr_time_from_sec(60));
+        if (rv == APR_SUCCESS) {
+            token = lease->token;
+        }
+        if (wait && write(fds[1], &token, sizeof(token)) != sizeof(token)) {
+            rv = APR_EGENERAL;
+        }
+        /* leave without running pool cleanups, the lease stays */
+        _exit(rv == APR_SUCCESS? 0 : (APR_STATUS_IS_EBUSY(rv)? 1 : 2));
+    }
+    close(fds[1]);
+    if (!wait) {
+        close(fds[0]);
+        return APR_SUCCESS;
+    }
+    ck_assert_int_eq( read(fds[0], &token, sizeof(token)), sizeof(token) );
+    close(fds[0]);
+    ck_assert_int_eq( waitpid(pid, &status, 0), pid );
+    ck_assert( WIFEXITED(status) );
+    *ptoken = token;
+    return (WEXITSTATUS(status) == 0)? APR_SUCCESS : 
+           ((WEXITSTATUS(status) == 1)? APR_EBUSY : APR_EGENERAL);
+}
+
+START_TEST(der_cache_shares_chain_certs)
+{
+    apr_array_header_t *chain;
+    const char *der_dir, *fpath;
+    apr_finfo_t finfo;
+    int i;
+
+    ck_assert_int_eq( md_store_fs_der_cache_set(g_store, 1), APR_SUCCESS );
+    ck_assert_int_eq( md_chain_save(g_store, g_pool, MD_SG_DOMAINS, "a.test", g_chain, 1),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_chain_save(g_store, g_pool, MD_SG_DOMAINS, "b.test", g_chain, 1),
+                      APR_SUCCESS );
+
+    /* saving wrote the cache */
+    ck_assert_int_eq( md_store_get_fname(&fpath, g_store, MD_SG_DOMAINS, "a.test",
+                                         MD_FN_CHAIN ".der", g_pool), APR_SUCCESS );
+    ck_assert_int_eq( apr_stat(&finfo, fpath, APR_FINFO_SIZE, g_pool), APR_SUCCESS );
+
+    /* both domains share the same two blobs */
+    ck_assert_int_eq( md_util_path_merge(&der_dir, g_pool, g_store_dir, "der", NULL),
+                      APR_SUCCESS );
+    ck_assert_int_eq( count_files(der_dir, g_pool), 2 );
+
+    /* loaded from the cache, the same certificates */
+    ck_assert_int_eq( md_chain_load(g_store, MD_SG_DOMAINS, "a.test", &chain, g_pool),
+                      APR_SUCCESS );
+    ck_assert_int_eq( chain->nelts, 2 );
+    for (i = 0; i < chain->nelts; ++i) {
+        assert_same_cert(APR_ARRAY_IDX(chain, i, md_cert_t *),
+                         APR_ARRAY_IDX(g_chain, i, md_cert_t *), g_pool);
+    }
+}
+END_TEST
+
+START_TEST(der_cache_follows_pem_changes)
+{
+    apr_array_header_t *chain, *shorter;
+    const char *fpath;
+    md_cert_t *cert;
+
+    ck_assert_int_eq( md_store_fs_der_cache_set(g_store, 1), APR_SUCCESS );
+    ck_assert_int_eq( md_chain_save(g_store, g_pool, MD_SG_DOMAINS, "a.test", g_chain, 1),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_cert_save(g_store, g_pool, MD_SG_DOMAINS, "a.test",
+                                   APR_ARRAY_IDX(g_chain, 0, md_cert_t *), 1), APR_SUCCESS );
+    ck_assert_int_eq( md_chain_load(g_store, MD_SG_DOMAINS, "a.test", &chain, g_pool),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_cert_load(g_store, MD_SG_DOMAINS, "a.test", &cert, g_pool),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_cert_load(g_store, MD_SG_DOMAINS, "a.test", &cert, g_pool),
+                      APR_SUCCESS );
+    assert_same_cert(cert, APR_ARRAY_IDX(g_chain, 0, md_cert_t *), g_pool);
+
+    shorter = apr_array_make(g_pool, 1, sizeof(md_cert_t *));
+    APR_ARRAY_PUSH(shorter, md_cert_t *) = APR_ARRAY_IDX(g_chain, 1, md_cert_t *);
+    ck_assert_int_eq( md_chain_save(g_store, g_pool, MD_SG_DOMAINS, "a.test", shorter, 0),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_chain_load(g_store, MD_SG_DOMAINS, "a.test", &chain, g_pool),
+                      APR_SUCCESS );
+    ck_assert_int_eq( chain->nelts, 1 );
+    assert_same_cert(APR_ARRAY_IDX(chain, 0, md_cert_t *),
+                     APR_ARRAY_IDX(g_chain, 1, md_cert_t *), g_pool);
+    
+    /* another writer replaces the PEM, without knowing about the cache */
+    ck_assert_int_eq( md_store_get_fname(&fpath, g_store, MD_SG_DOMAINS, "a.test",
+                                         MD_FN_CERT, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( md_cert_fsave(APR_ARRAY_IDX(g_chain, 1, md_cert_t *), g_pool, fpath, 
+                                    MD_FPROT_F_UALL_WREAD), APR_SUCCESS );
+    ck_assert_int_eq( md_cert_load(g_store, MD_SG_DOMAINS, "a.test", &cert, g_pool),
+                      APR_SUCCESS );
+    assert_same_cert(cert, APR_ARRAY_IDX(g_chain, 1, md_cert_t *), g_pool);
+}
+END_TEST
+
+static const char *der_blob_of(const md_cert_t *cert, apr_pool_t *p)
+{
+    const char *der, *hex, *fpath;
+    apr_size_t der_len;
+    
+    ck_assert_int_eq( md_cert_to_der(&der, &der_len, cert, p), APR_SUCCESS );
+    ck_assert_int_eq( md_crypt_sha256_digest_hex(&hex, p, der, der_len), APR_SUCCESS );
+    ck_assert_int_eq( md_util_path_merge(&fpath, p, g_store_dir, "der", 
+                                         apr_pstrcat(p, hex, ".der", NULL), NULL), 
+                      APR_SUCCESS );
+    return fpath;
+}
+
+START_TEST(der_cache_checks_blobs)
+{
+    apr_array_header_t *chain;
+    const char *fpath;
+    apr_file_t *f;
+    int i;
+
+    ck_assert_int_eq( md_store_fs_der_cache_set(g_store, 1), APR_SUCCESS );
+    ck_assert_int_eq( md_chain_save(g_store, g_pool, MD_SG_DOMAINS, "a.test", g_chain, 1),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_chain_load(g_store, MD_SG_DOMAINS, "a.test", &chain, g_pool),
+                      APR_SUCCESS );
+    
+    /* a blob that no longer matches its name is not used, removed and made on the next save */
+    fpath = der_blob_of(APR_ARRAY_IDX(g_chain, 0, md_cert_t *), g_pool);
+    ck_assert_int_eq( apr_file_open(&f, fpath, APR_FOPEN_WRITE|APR_FOPEN_TRUNCATE, 
+                                    APR_FPROT_OS_DEFAULT, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( apr_file_puts("not a certificate", f), APR_SUCCESS );
+    apr_file_close(f);
+    
+    for (i = 0; i < 2; ++i) {
+        ck_assert_int_eq( md_chain_load(g_store, MD_SG_DOMAINS, "a.test", &chain, g_pool),
+                          APR_SUCCESS );
+        ck_assert_int_eq( chain->nelts, 2 );
+        assert_same_cert(APR_ARRAY_IDX(chain, 0, md_cert_t *),
+                         APR_ARRAY_IDX(g_chain, 0, md_cert_t *), g_pool);
+    }
+    ck_assert( APR_STATUS_IS_ENOENT(md_util_is_file(fpath, g_pool)) );
+    ck_assert_int_eq( md_chain_save(g_store, g_pool, MD_SG_DOMAINS, "a.test", g_chain, 0),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_util_is_file(fpath, g_pool), APR_SUCCESS );
+}
+END_TEST
+
+START_TEST(der_cache_collects_blobs)
+{
+    apr_array_header_t *chain, *shorter;
+    const char *der_dir;
+
+    ck_assert_int_eq( md_store_fs_der_cache_set(g_store, 1), APR_SUCCESS );
+    ck_assert_int_eq( md_chain_save(g_store, g_pool, MD_SG_DOMAINS, "a.test", g_chain, 1),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_chain_load(g_store, MD_SG_DOMAINS, "a.test", &chain, g_pool),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_util_path_merge(&der_dir, g_pool, g_store_dir, "der", NULL),
+                      APR_SUCCESS );
+    ck_assert_int_eq( count_files(der_dir, g_pool), 2 );
+
+    /* the intermediate is no longer referred to */
+    shorter = apr_array_make(g_pool, 1, sizeof(md_cert_t *));
+    APR_ARRAY_PUSH(shorter, md_cert_t *) = APR_ARRAY_IDX(g_chain, 1, md_cert_t *);
+    ck_assert_int_eq( md_chain_save(g_store, g_pool, MD_SG_DOMAINS, "a.test", shorter, 0),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_chain_load(g_store, MD_SG_DOMAINS, "a.test", &chain, g_pool),
+                      APR_SUCCESS );
+    
+    /* too young to go */
+    ck_assert_int_eq( md_store_fs_archive_compact(g_store, g_pool, apr_time_from_sec(3600)), 
+                      APR_SUCCESS );
+    ck_assert_int_eq( count_files(der_dir, g_pool), 2 );
+    
+    ck_assert_int_eq( md_store_fs_archive_compact(g_store, g_pool, 0), APR_SUCCESS );
+    ck_assert_int_eq( count_files(der_dir, g_pool), 1 );
+    ck_assert_int_eq( md_util_is_file(der_blob_of(APR_ARRAY_IDX(g_chain, 1, md_cert_t *), 
+                                                  g_pool), g_pool), APR_SUCCESS );
+    ck_assert_int_eq( md_chain_load(g_store, MD_SG_DOMAINS, "a.test", &chain, g_pool),
+                      APR_SUCCESS );
+    ck_assert_int_eq( chain->nelts, 1 );
+}
+END_TEST
+
+START_TEST(chains_share_interned_certs)
+{
+    apr_array_header_t *chain_a, *chain_b;
+    apr_pool_t *pa, *pb;
+    int i;
+
+    ck_assert_int_eq( md_crypt_init(g_pool), APR_SUCCESS );
+    ck_assert_int_eq( md_chain_save(g_store, g_pool, MD_SG_DOMAINS, "a.test", g_chain, 1),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_chain_save(g_store, g_pool, MD_SG_DOMAINS, "b.test", g_chain, 1),
+                      APR_SUCCESS );
+
+    ck_assert_int_eq( apr_pool_create(&pa, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( apr_pool_create(&pb, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( md_chain_load(g_store, MD_SG_DOMAINS, "a.test", &chain_a, pa),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_chain_load(g_store, MD_SG_DOMAINS, "b.test", &chain_b, pb),
+                      APR_SUCCESS );
+    ck_assert_int_eq( chain_a->nelts, 2 );
+    ck_assert_int_eq( chain_b->nelts, 2 );
+    ck_assert_int_eq( md_cert_interned_count(), 2 );
+    for (i = 0; i < chain_a->nelts; ++i) {
+        ck_assert_ptr_eq( APR_ARRAY_IDX(chain_a, i, md_cert_t *),
+                          APR_ARRAY_IDX(chain_b, i, md_cert_t *) );
+        assert_same_cert(APR_ARRAY_IDX(chain_a, i, md_cert_t *),
+                         APR_ARRAY_IDX(g_chain, i, md_cert_t *), g_pool);
+    }
+
+    /* still referenced by the chain of b */
+    apr_pool_destroy(pa);
+    ck_assert_int_eq( md_cert_interned_count(), 2 );
+    ck_assert( md_cert_covers_domain(APR_ARRAY_IDX(chain_b, 1, md_cert_t *), "root.test") );
+    apr_pool_destroy(pb);
+    ck_assert_int_eq( md_cert_interned_count(), 0 );
+}
+END_TEST
+
+START_TEST(chain_files_are_shared)
+{
+    apr_array_header_t *chain;
+    const char *chains_dir, *fpath_a, *fpath_b;
+    apr_finfo_t finfo;
+
+    ck_assert_int_eq( md_chain_save(g_store, g_pool, MD_SG_DOMAINS, "a.test", g_chain, 1),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_chain_save(g_store, g_pool, MD_SG_STAGING, "a.test", g_chain, 1),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_chain_save(g_store, g_pool, MD_SG_DOMAINS, "b.test", g_chain, 1),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_util_path_merge(&chains_dir, g_pool, g_store_dir, "chains", NULL),
+                      APR_SUCCESS );
+    /* one for the domains, one for staging with its other permissions */
+    ck_assert_int_eq( count_files(chains_dir, g_pool), 2 );
+
+    /* what mod_ssl gets is a plain file with the chain */
+    ck_assert_int_eq( md_store_get_fname(&fpath_a, g_store, MD_SG_DOMAINS, "a.test",
+                                         MD_FN_CHAIN, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( md_store_get_fname(&fpath_b, g_store, MD_SG_DOMAINS, "b.test",
+                                         MD_FN_CHAIN, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( md_chain_fload(&chain, g_pool, fpath_a), APR_SUCCESS );
+    ck_assert_int_eq( chain->nelts, 2 );
+    ck_assert_int_eq( apr_stat(&finfo, fpath_b, APR_FINFO_NLINK|APR_FINFO_PROT, g_pool), 
+                      APR_SUCCESS );
+    ck_assert_int_eq( finfo.nlink, 3 );
+    ck_assert( !(finfo.protection & (APR_FPROT_GREAD|APR_FPROT_WREAD)) );
+
+    /* collected when the last MD no longer links it */
+    md_store_purge(g_store, g_pool, MD_SG_STAGING, "a.test");
+    ck_assert_int_eq( md_store_remove(g_store, MD_SG_DOMAINS, "a.test", MD_FN_CHAIN, g_pool, 0),
+                      APR_SUCCESS );
+    ck_assert_int_eq( count_files(chains_dir, g_pool), 1 );
+    ck_assert_int_eq( apr_stat(&finfo, fpath_b, APR_FINFO_NLINK, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( finfo.nlink, 2 );
+    ck_assert_int_eq( md_store_remove(g_store, MD_SG_DOMAINS, "b.test", MD_FN_CHAIN, g_pool, 0),
+                      APR_SUCCESS );
+    ck_assert_int_eq( count_files(chains_dir, g_pool), 0 );
+}
+END_TEST
+
+START_TEST(archive_retention_compact_restore)
+{
+    apr_array_header_t *domains, *gens;
+    const char *arch_dir, *fpath;
+    md_t *md;
+    int i;
+
+    ck_assert_int_eq( md_store_fs_archive_retention_set(g_store, 2, 0), APR_SUCCESS );
+    domains = apr_array_make(g_pool, 1, sizeof(const char *));
+    APR_ARRAY_PUSH(domains, const char *) = "a.test";
+    for (i = 0; i < 4; ++i) {
+        ck_assert_ptr_eq( md_create(&md, g_pool, domains), NULL );
+        md->ca_url = apr_psprintf(g_pool, "https://ca.test/%d", i);
+        ck_assert_int_eq( md_save(g_store, g_pool, MD_SG_STAGING, md, 1), APR_SUCCESS );
+        ck_assert_int_eq( md_store_move(g_store, g_pool, MD_SG_STAGING, MD_SG_DOMAINS,
+                                        "a.test", 1), APR_SUCCESS );
+    }
+
+    /* three generations archived, the first one pruned */
+    ck_assert_int_eq( md_store_fs_archive_list(&gens, g_store, "a.test", g_pool), APR_SUCCESS );
+    ck_assert_int_eq( gens->nelts, 2 );
+    ck_assert_int_eq( APR_ARRAY_IDX(gens, 0, md_store_fs_gen_t *)->n, 2 );
+    ck_assert_int_eq( APR_ARRAY_IDX(gens, 1, md_store_fs_gen_t *)->n, 3 );
+    ck_assert_int_eq( md_util_path_merge(&arch_dir, g_pool, g_store_dir, "archive", NULL),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_util_path_merge(&fpath, g_pool, arch_dir, "a.test.1", NULL),
+                      APR_SUCCESS );
+    ck_assert_int_ne( md_util_is_dir(fpath, g_pool), APR_SUCCESS );
+
+    /* all but the newest go into the tarball */
+    ck_assert_int_eq( md_store_fs_archive_compact(g_store, g_pool, 0), APR_SUCCESS );
+    ck_assert_int_eq( md_store_fs_archive_list(&gens, g_store, "a.test", g_pool), APR_SUCCESS );
+    ck_assert( APR_ARRAY_IDX(gens, 0, md_store_fs_gen_t *)->packed );
+    ck_assert( !APR_ARRAY_IDX(gens, 1, md_store_fs_gen_t *)->packed );
+    ck_assert_int_eq( md_util_path_merge(&fpath, g_pool, arch_dir, "a.test.2", NULL),
+                      APR_SUCCESS );
+    ck_assert_int_ne( md_util_is_dir(fpath, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( md_util_path_merge(&fpath, g_pool, arch_dir, "a.test.tar", NULL),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_util_is_file(fpath, g_pool), APR_SUCCESS );
+
+    /* restore the packed one, the current one becomes generation 4 */
+    ck_assert_int_eq( md_store_fs_archive_restore(g_store, g_pool, "a.test", 2), APR_SUCCESS );
+    ck_assert_int_eq( md_load(g_store, MD_SG_DOMAINS, "a.test", &md, g_pool), APR_SUCCESS );
+    ck_assert_str_eq( md->ca_url, "https://ca.test/1" );
+    ck_assert_int_eq( md_store_fs_archive_list(&gens, g_store, "a.test", g_pool), APR_SUCCESS );
+    ck_assert_int_eq( gens->nelts, 2 );
+    ck_assert_int_eq( APR_ARRAY_IDX(gens, 0, md_store_fs_gen_t *)->n, 3 );
+    ck_assert_int_eq( APR_ARRAY_IDX(gens, 1, md_store_fs_gen_t *)->n, 4 );
+    ck_assert_int_ne( md_util_is_file(fpath, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( md_store_fs_archive_restore(g_store, g_pool, "a.test", 2), APR_ENOENT );
+}
+END_TEST
+
+START_TEST(archive_index_rebuilt)
+{
+    apr_array_header_t *domains, *gens;
+    const char *fpath;
+    md_t *md;
+    int i;
+
+    domains = apr_array_make(g_pool, 1, sizeof(const char *));
+    APR_ARRAY_PUSH(domains, const char *) = "a.test";
+    for (i = 0; i < 3; ++i) {
+        ck_assert_ptr_eq( md_create(&md, g_pool, domains), NULL );
+        ck_assert_int_eq( md_save(g_store, g_pool, MD_SG_STAGING, md, 1), APR_SUCCESS );
+        ck_assert_int_eq( md_store_move(g_store, g_pool, MD_SG_STAGING, MD_SG_DOMAINS,
+                                        "a.test", 1), APR_SUCCESS );
+    }
+    ck_assert_int_eq( md_store_fs_archive_compact(g_store, g_pool, 0), APR_SUCCESS );
+    
+    /* a damaged index is rebuilt from the tarball and the directories */
+    ck_assert_int_eq( md_util_path_merge(&fpath, g_pool, g_store_dir, "archive", 
+                                         "a.test.idx", NULL), APR_SUCCESS );
+    ck_assert_int_eq( md_text_freplace(fpath, MD_FPROT_F_UONLY, g_pool, "{ damaged"), 
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_store_fs_archive_list(&gens, g_store, "a.test", g_pool), APR_SUCCESS );
+    ck_assert_int_eq( gens->nelts, 2 );
+    ck_assert_int_eq( APR_ARRAY_IDX(gens, 0, md_store_fs_gen_t *)->n, 1 );
+    ck_assert( APR_ARRAY_IDX(gens, 0, md_store_fs_gen_t *)->packed );
+    ck_assert_int_eq( APR_ARRAY_IDX(gens, 1, md_store_fs_gen_t *)->n, 2 );
+    ck_assert( !APR_ARRAY_IDX(gens, 1, md_store_fs_gen_t *)->packed );
+    
+    /* archiving goes on from there */
+    ck_assert_ptr_eq( md_create(&md, g_pool, domains), NULL );
+    ck_assert_int_eq( md_save(g_store, g_pool, MD_SG_STAGING, md, 1), APR_SUCCESS );
+    ck_assert_int_eq( md_store_move(g_store, g_pool, MD_SG_STAGING, MD_SG_DOMAINS,
+                                    "a.test", 1), APR_SUCCESS );
+    ck_assert_int_eq( md_store_fs_archive_list(&gens, g_store, "a.test", g_pool), APR_SUCCESS );
+    ck_assert_int_eq( gens->nelts, 3 );
+    ck_assert_int_eq( APR_ARRAY_IDX(gens, 2, md_store_fs_gen_t *)->n, 3 );
+    ck_assert_int_eq( md_store_fs_archive_restore(g_store, g_pool, "a.test", 1), APR_SUCCESS );
+}
+END_TEST
+
+START_TEST(txn_replaces_all_aspects)
+{
+    apr_array_header_t *domains, *chain;
+    md_store_txn_t *txn;
+    md_cert_t *cert;
+    const char *fpath, *txn_dir;
+    apr_pool_t *p;
+    md_t *md;
+
+    domains = apr_array_make(g_pool, 1, sizeof(const char *));
+    APR_ARRAY_PUSH(domains, const char *) = "a.test";
+    ck_assert_ptr_eq( md_create(&md, g_pool, domains), NULL );
+    md->ca_url = "https://ca.test/old";
+    ck_assert_int_eq( md_save(g_store, g_pool, MD_SG_TMP, md, 1), APR_SUCCESS );
+    ck_assert_int_eq( md_cert_save(g_store, g_pool, MD_SG_TMP, "a.test",
+                                   APR_ARRAY_IDX(g_chain, 0, md_cert_t *), 1), APR_SUCCESS );
+
+    /* nothing is visible before commit */
+    md->ca_url = "https://ca.test/new";
+    ck_assert_int_eq( md_store_txn_begin(&txn, g_store, g_pool, MD_SG_TMP, "a.test"),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_store_txn_put_md(txn, md), APR_SUCCESS );
+    ck_assert_int_eq( md_store_txn_put(txn, MD_FN_CHAIN, MD_SV_CHAIN, g_chain), APR_SUCCESS );
+    ck_assert_int_eq( md_load(g_store, MD_SG_TMP, "a.test", &md, g_pool), APR_SUCCESS );
+    ck_assert_str_eq( md->ca_url, "https://ca.test/old" );
+    ck_assert_int_eq( md_chain_load(g_store, MD_SG_TMP, "a.test", &chain, g_pool), APR_ENOENT );
+
+    /* after it, exactly the aspects put */
+    ck_assert_int_eq( md_store_txn_commit(txn), APR_SUCCESS );
+    ck_assert_int_eq( md_store_txn_commit(txn), APR_EINVAL );
+    ck_assert_int_eq( md_load(g_store, MD_SG_TMP, "a.test", &md, g_pool), APR_SUCCESS );
+    ck_assert_str_eq( md->ca_url, "https://ca.test/new" );
+    ck_assert_int_eq( md_chain_load(g_store, MD_SG_TMP, "a.test", &chain, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( chain->nelts, 2 );
+    ck_assert_int_eq( md_cert_load(g_store, MD_SG_TMP, "a.test", &cert, g_pool), APR_ENOENT );
+
+    /* aborted, here by destroying its pool, it leaves no trace */
+    ck_assert_int_eq( apr_pool_create(&p, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( md_store_txn_begin(&txn, g_store, p, MD_SG_TMP, "a.test"), APR_SUCCESS );
+    ck_assert_int_eq( md_store_txn_put(txn, MD_FN_CERT, MD_SV_CERT,
+                                       APR_ARRAY_IDX(g_chain, 0, md_cert_t *)), APR_SUCCESS );
+    apr_pool_destroy(p);
+    ck_assert_int_eq( md_cert_load(g_store, MD_SG_TMP, "a.test", &cert, g_pool), APR_ENOENT );
+    ck_assert_int_eq( md_util_path_merge(&txn_dir, g_pool, g_store_dir, "txn", "tmp", NULL),
+                      APR_SUCCESS );
+    ck_assert_int_eq( count_dirs(txn_dir, g_pool), 0 );
+    ck_assert_int_eq( md_store_get_fname(&fpath, g_store, MD_SG_TMP, "a.test",
+                                         MD_FN_MD, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( md_util_is_file(fpath, g_pool), APR_SUCCESS );
+}
+END_TEST
+
+START_TEST(txn_recovers_interrupted_commit)
+{
+    apr_array_header_t *domains;
+    md_store_txn_t *txn;
+    md_store_t *store;
+    const char *txn_dir, *target, *old, *pending;
+    apr_pool_t *p;
+    md_t *md;
+
+    domains = apr_array_make(g_pool, 1, sizeof(const char *));
+    APR_ARRAY_PUSH(domains, const char *) = "a.test";
+    ck_assert_ptr_eq( md_create(&md, g_pool, domains), NULL );
+    md->ca_url = "https://ca.test/old";
+    ck_assert_int_eq( md_save(g_store, g_pool, MD_SG_DOMAINS, md, 1), APR_SUCCESS );
+    
+    /* a process died after moving the previous version away, before the new one 
+     * was in place */
+    ck_assert_int_eq( md_util_path_merge(&txn_dir, g_pool, g_store_dir, "txn", "domains", 
+                                         NULL), APR_SUCCESS );
+    ck_assert_int_eq( apr_dir_make_recursive(txn_dir, APR_FPROT_OS_DEFAULT, g_pool), 
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_util_path_merge(&target, g_pool, g_store_dir, "domains", "a.test",
+                                         NULL), APR_SUCCESS );
+    ck_assert_int_eq( md_util_path_merge(&old, g_pool, txn_dir, "99999-1+a.test", NULL),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_util_path_merge(&pending, g_pool, txn_dir, "99999-1-a.test", NULL),
+                      APR_SUCCESS );
+    ck_assert_int_eq( apr_file_rename(target, old, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( apr_dir_make(pending, APR_FPROT_OS_DEFAULT, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( md_load(g_store, MD_SG_DOMAINS, "a.test", &md, g_pool), APR_ENOENT );
+    
+    /* the next start puts it back and drops the unfinished one */
+    ck_assert_int_eq( md_store_fs_init(&store, g_pool, g_store_dir), APR_SUCCESS );
+    ck_assert_int_eq( md_load(store, MD_SG_DOMAINS, "a.test", &md, g_pool), APR_SUCCESS );
+    ck_assert_str_eq( md->ca_url, "https://ca.test/old" );
+    ck_assert_int_eq( count_dirs(txn_dir, g_pool), 0 );
+    
+    /* a process died after the new version was in place, before the previous one 
+     * was removed */
+    ck_assert_int_eq( md_util_path_merge(&old, g_pool, txn_dir, "99999-2+a.test", NULL),
+                      APR_SUCCESS );
+    ck_assert_int_eq( apr_dir_make(old, APR_FPROT_OS_DEFAULT, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( apr_pool_create(&p, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( md_store_txn_begin(&txn, g_store, p, MD_SG_DOMAINS, "b.test"), 
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_util_is_dir(old, g_pool), APR_ENOENT );
+    apr_pool_destroy(p);
+    ck_assert_int_eq( count_dirs(txn_dir, g_pool), 0 );
+    ck_assert_int_eq( md_load(g_store, MD_SG_DOMAINS, "a.test", &md, g_pool), APR_SUCCESS );
+    ck_assert_str_eq( md->ca_url, "https://ca.test/old" );
+}
+END_TEST
+
+START_TEST(init_removes_stale_tmp)
+{
+    apr_array_header_t *domains;
+    md_store_t *store;
+    const char *stale, *fresh;
+    md_t *md;
+
+    domains = apr_array_make(g_pool, 1, sizeof(const char *));
+    APR_ARRAY_PUSH(domains, const char *) = "a.test";
+    ck_assert_ptr_eq( md_create(&md, g_pool, domains), NULL );
+    ck_assert_int_eq( md_save(g_store, g_pool, MD_SG_DOMAINS, md, 1), APR_SUCCESS );
+    
+    /* left by writers that died, one long ago */
+    ck_assert_int_eq( md_util_path_merge(&stale, g_pool, g_store_dir, "domains", "a.test",
+                                         "md.json.99999.1.tmp", NULL), APR_SUCCESS );
+    ck_assert_int_eq( md_util_path_merge(&fresh, g_pool, g_store_dir, "domains", "a.test",
+                                         "md.json.99999.2.tmp", NULL), APR_SUCCESS );
+    ck_assert_int_eq( md_text_fcreatex(stale, MD_FPROT_F_UONLY, g_pool, "{"), APR_SUCCESS );
+    ck_assert_int_eq( md_text_fcreatex(fresh, MD_FPROT_F_UONLY, g_pool, "{"), APR_SUCCESS );
+    ck_assert_int_eq( apr_file_mtime_set(stale, apr_time_now() - apr_time_from_sec(3600), 
+                                         g_pool), APR_SUCCESS );
+    
+    ck_assert_int_eq( md_store_fs_init(&store, g_pool, g_store_dir), APR_SUCCESS );
+    ck_assert_int_eq( md_util_is_file(stale, g_pool), APR_ENOENT );
+    ck_assert_int_eq( md_util_is_file(fresh, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( md_load(store, MD_SG_DOMAINS, "a.test", &md, g_pool), APR_SUCCESS );
+}
+END_TEST
+
+START_TEST(lock_shared_exclusive)
+{
+    apr_array_header_t *domains;
+    md_store_fs_lock_t *lock;
+    md_store_fs_lock_stats_t stats;
+    md_t *md;
+
+    domains = apr_array_make(g_pool, 1, sizeof(const char *));
+    APR_ARRAY_PUSH(domains, const char *) = "a.test";
+    ck_assert_ptr_eq( md_create(&md, g_pool, domains), NULL );
+    ck_assert_int_eq( md_save(g_store, g_pool, MD_SG_DOMAINS, md, 1), APR_SUCCESS );
+
+    /* readers share, writers wait for them */
+    ck_assert_int_eq( md_store_fs_lock(&lock, g_store, g_pool, MD_SG_DOMAINS, "a.test",
+                                       MD_S_FS_LOCK_SHARED, 0), APR_SUCCESS );
+    ck_assert_int_eq( lock_elsewhere(g_store, MD_S_FS_LOCK_SHARED, 0, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( lock_elsewhere(g_store, MD_S_FS_LOCK_EXCLUSIVE, apr_time_from_msec(50),
+                                     g_pool), APR_TIMEUP );
+    ck_assert_int_eq( md_load(g_store, MD_SG_DOMAINS, "a.test", &md, g_pool), APR_SUCCESS );
+    md_store_fs_unlock(lock);
+    ck_assert_int_eq( lock_elsewhere(g_store, MD_S_FS_LOCK_EXCLUSIVE, 0, g_pool), APR_SUCCESS );
+
+    /* the holder of an exclusive lock may write, nobody else */
+    ck_assert_int_eq( md_store_fs_lock(&lock, g_store, g_pool, MD_SG_DOMAINS, "a.test",
+                                       MD_S_FS_LOCK_EXCLUSIVE, -1), APR_SUCCESS );
+    ck_assert_int_eq( md_save(g_store, g_pool, MD_SG_DOMAINS, md, 0), APR_SUCCESS );
+    ck_assert_int_eq( lock_elsewhere(g_store, MD_S_FS_LOCK_SHARED, 0, g_pool), APR_TIMEUP );
+    md_store_fs_unlock(lock);
+
+    md_store_fs_lock_stats_get(&stats, g_store);
+    ck_assert_int_eq( stats.timeouts, 2 );
+    ck_assert_int_eq( stats.contended, 0 );
+    ck_assert_int_ge( stats.wait_max, apr_time_from_msec(50) );
+    ck_assert_int_ge( stats.wait_total, stats.wait_max );
+}
+END_TEST
+
+START_TEST(lease_held_across_processes)
+{
+    md_store_lease_t *lease;
+    long token;
+
+    ck_assert_int_eq( md_store_lease_acquire(&lease, g_store, g_pool, MD_SG_STAGING, "a.test",
+                                             "node-a", apr_time_from_sec(60)), APR_SUCCESS );
+    ck_assert_int_eq( lease->token, 1 );
+    ck_assert_int_eq( lease_elsewhere(&token, "node-b", 1), APR_EBUSY );
+    ck_assert_int_eq( md_store_lease_renew(lease, g_pool), APR_SUCCESS );
+
+    /* once released, the next owner gets it with a new token */
+    md_store_lease_release(lease);
+    ck_assert_int_eq( md_store_lease_renew(lease, g_pool), APR_EINVAL );
+    ck_assert_int_eq( lease_elsewhere(&token, "node-b", 1), APR_SUCCESS );
+    ck_assert_int_eq( token, 2 );
+    ck_assert_int_eq( md_store_lease_acquire(&lease, g_store, g_pool, MD_SG_STAGING, "a.test",
+                                             "node-a", apr_time_from_sec(60)), APR_EBUSY );
+}
+END_TEST
+
+START_TEST(lease_expires_and_fences)
+{
+    md_store_lease_t *lease, *lease2;
+    long token;
+
+    ck_assert_int_eq( md_store_lease_acquire(&lease, g_store, g_pool, MD_SG_STAGING, "a.test",
+                                             "node-a", apr_time_from_msec(100)), APR_SUCCESS );
+    apr_sleep(apr_time_from_msec(200));
+    
+    /* taken over after expiry, the former owner learns about it on renewal */
+    ck_assert_int_eq( lease_elsewhere(&token, "node-b", 1), APR_SUCCESS );
+    ck_assert_int_eq( token, lease->token + 1 );
+    ck_assert_int_eq( md_store_lease_renew(lease, g_pool), APR_EBUSY );
+    md_store_lease_release(lease);
+    ck_assert_int_eq( md_store_lease_acquire(&lease2, g_store, g_pool, MD_SG_STAGING, "a.test",
+                                             "node-a", apr_time_from_sec(60)), APR_EBUSY );
+}
+END_TEST
+
+START_TEST(lease_granted_once)
+{
+    int i, status, granted = 0, busy = 0;
+    long token;
+
+    for (i = 0; i < LEASE_PROCS; ++i) {
+        lease_elsewhere(&token, apr_psprintf(g_pool, "node-%d", i), 0);
+    }
+    for (i = 0; i < LEASE_PROCS; ++i) {
+        ck_assert_int_gt( wait(&status), 0 );
+        ck_assert( WIFEXITED(status) );
+        if (WEXITSTATUS(status) == 0) {
+            ++granted;
+        }
+        else if (WEXITSTATUS(status) == 1) {
+            ++busy;
+        }
+    }
+    ck_assert_int_eq( granted, 1 );
+    ck_assert_int_eq( busy, LEASE_PROCS - 1 );
+}
+END_TEST
+
+START_TEST(watch_reports_changed_mds)
+{
+    md_store_fs_watch_t *watch;
+    md_store_t *other;
+    apr_array_header_t *names, *chain;
+    apr_file_t *f;
+    apr_finfo_t finfo;
+    md_cert_t *cert, *changed;
+    md_pkey_t *pkey;
+    const char *fpath;
+    apr_status_t rv;
+    int all;
+
+    rv = md_store_fs_watch(&watch, g_store, g_pool, apr_time_from_msec(100));
+    if (APR_ENOTIMPL == rv) {
+        return;
+    }
+    ck_assert_int_eq( rv, APR_SUCCESS );
+    /* another process writing the store, e.g. a2md */
+    ck_assert_int_eq( md_store_fs_init(&other, g_pool, g_store_dir), APR_SUCCESS );
+
+    /* the domains group directory does not exist yet */
+    ck_assert_int_eq( md_store_fs_der_cache_set(g_store, 1), APR_SUCCESS );
+    cert = APR_ARRAY_IDX(g_chain, 0, md_cert_t *);
+    ck_assert_int_eq( md_cert_save(other, g_pool, MD_SG_DOMAINS, "a.test", cert, 1),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_store_fs_watch_poll(&names, &all, watch, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( names->nelts, 0 );
+    apr_sleep(apr_time_from_msec(150));
+    ck_assert_int_eq( md_store_fs_watch_poll(&names, &all, watch, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( names->nelts, 1 );
+    ck_assert_str_eq( APR_ARRAY_IDX(names, 0, const char *), "a.test" );
+    ck_assert_int_eq( all, 0 );
+    ck_assert_int_eq( md_store_fs_watch_poll(&names, &all, watch, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( names->nelts, 0 );
+
+    /* loading is no change */
+    ck_assert_int_eq( md_cert_load(g_store, MD_SG_DOMAINS, "a.test", &cert, g_pool),
+                      APR_SUCCESS );
+    apr_sleep(apr_time_from_msec(150));
+    ck_assert_int_eq( md_store_fs_watch_poll(&names, &all, watch, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( names->nelts, 0 );
+
+    /* another cert, as a tool might write it, with the old mtime */
+    ck_assert_int_eq( md_store_get_fname(&fpath, g_store, MD_SG_DOMAINS, "a.test", 
+                                         MD_FN_CERT, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( apr_stat(&finfo, fpath, APR_FINFO_MTIME, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( md_pkey_gen_rsa(&pkey, g_pool, 2048), APR_SUCCESS );
+    changed = make_test_cert(pkey, "a.test", g_pool);
+    ck_assert_int_eq( md_cert_fsave(changed, g_pool, fpath, MD_FPROT_F_UONLY), APR_SUCCESS );
+    ck_assert_int_eq( apr_file_mtime_set(fpath, finfo.mtime, g_pool), APR_SUCCESS );
+    apr_sleep(apr_time_from_msec(150));
+    ck_assert_int_eq( md_store_fs_watch_poll(&names, &all, watch, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( names->nelts, 1 );
+    ck_assert_int_eq( md_cert_load(g_store, MD_SG_DOMAINS, "a.test", &cert, g_pool),
+                      APR_SUCCESS );
+    assert_same_cert(cert, changed, g_pool);
+
+    /* changes made by the watcher itself are not reported, the others' still are */
+    ck_assert_int_eq( md_cert_save(other, g_pool, MD_SG_STAGING, "c.test", cert, 1),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_cert_save(g_store, g_pool, MD_SG_STAGING, "b.test", cert, 1),
+                      APR_SUCCESS );
+    apr_sleep(apr_time_from_msec(150));
+    ck_assert_int_eq( md_store_fs_watch_poll(&names, &all, watch, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( names->nelts, 1 );
+    ck_assert_str_eq( APR_ARRAY_IDX(names, 0, const char *), "c.test" );
+
+    /* a staged md moving into domains */
+    ck_assert_int_eq( md_store_move(other, g_pool, MD_SG_STAGING, MD_SG_DOMAINS, 
+                                    "b.test", 0), APR_SUCCESS );
+    apr_sleep(apr_time_from_msec(150));
+    ck_assert_int_eq( md_store_fs_watch_poll(&names, &all, watch, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( names->nelts, 1 );
+    ck_assert_str_eq( APR_ARRAY_IDX(names, 0, const char *), "b.test" );
+
+    /* shared chain certs kept in memory are read again after others changed an md */
+    ck_assert_int_eq( md_store_fs_der_cache_set(other, 1), APR_SUCCESS );
+    ck_assert_int_eq( md_chain_save(other, g_pool, MD_SG_DOMAINS, "d.test", g_chain, 1),
+                      APR_SUCCESS );
+    apr_sleep(apr_time_from_msec(150));
+    ck_assert_int_eq( md_store_fs_watch_poll(&names, &all, watch, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( md_chain_load(g_store, MD_SG_DOMAINS, "d.test", &chain, g_pool),
+                      APR_SUCCESS );
+    fpath = der_blob_of(APR_ARRAY_IDX(g_chain, 0, md_cert_t *), g_pool);
+    ck_assert_int_eq( apr_file_open(&f, fpath, APR_FOPEN_WRITE|APR_FOPEN_TRUNCATE, 
+                                    APR_FPROT_OS_DEFAULT, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( apr_file_puts("not a certificate", f), APR_SUCCESS );
+    apr_file_close(f);
+    ck_assert_int_eq( md_chain_load(g_store, MD_SG_DOMAINS, "d.test", &chain, g_pool),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_util_is_file(fpath, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( md_chain_save(other, g_pool, MD_SG_DOMAINS, "d.test", g_chain, 0),
+                      APR_SUCCESS );
+    apr_sleep(apr_time_from_msec(150));
+    ck_assert_int_eq( md_store_fs_watch_poll(&names, &all, watch, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( names->nelts, 1 );
+    ck_assert_str_eq( APR_ARRAY_IDX(names, 0, const char *), "d.test" );
+    ck_assert_int_eq( md_chain_load(g_store, MD_SG_DOMAINS, "d.test", &chain, g_pool),
+                      APR_SUCCESS );
+    ck_assert_int_eq( chain->nelts, 2 );
+    ck_assert( APR_STATUS_IS_ENOENT(md_util_is_file(fpath, g_pool)) );
+}
+END_TEST
+
+START_TEST(journal_lists_changes_since)
+{
+    md_store_t *other;
+    apr_array_header_t *changes;
+    md_store_fs_change_t *change;
+    const char *fpath;
+    apr_int64_t last;
+    int i;
+
+    ck_assert_int_eq( md_store_fs_changes(&changes, &last, g_store, 0, g_pool), APR_ENOENT );
+    ck_assert_int_eq( md_store_fs_journal_set(g_store, 1, 0), APR_SUCCESS );
+    ck_assert_int_eq( md_store_fs_changes(&changes, &last, g_store, 0, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( changes->nelts, 0 );
+    ck_assert_int_eq( last, 0 );
+
+    save_test_mds(g_store, 3, g_pool);
+    ck_assert_int_eq( md_store_fs_changes(&changes, &last, g_store, 0, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( changes->nelts, 3 );
+    ck_assert_int_eq( last, 3 );
+    for (i = 0; i < changes->nelts; ++i) {
+        change = &APR_ARRAY_IDX(changes, i, md_store_fs_change_t);
+        ck_assert_int_eq( change->seq, i + 1 );
+        ck_assert_int_eq( change->op, MD_S_FS_CH_SAVE );
+        ck_assert_int_eq( change->group, MD_SG_DOMAINS );
+        ck_assert_str_eq( change->name, apr_psprintf(g_pool, "md%d.test", i) );
+        ck_assert_str_eq( change->aspect, MD_FN_MD );
+    }
+
+    ck_assert_int_eq( md_store_remove(g_store, MD_SG_DOMAINS, "md1.test", MD_FN_MD, g_pool, 0),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_store_purge(g_store, g_pool, MD_SG_DOMAINS, "md2.test"), APR_SUCCESS );
+    ck_assert_int_eq( md_store_move(g_store, g_pool, MD_SG_DOMAINS, MD_SG_STAGING, 
+                                    "md0.test", 0), APR_SUCCESS );
+    ck_assert_int_eq( md_store_fs_changes(&changes, &last, g_store, 3, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( changes->nelts, 4 );
+    ck_assert_int_eq( last, 7 );
+    change = &APR_ARRAY_IDX(changes, 0, md_store_fs_change_t);
+    ck_assert_int_eq( change->seq, 4 );
+    ck_assert_int_eq( change->op, MD_S_FS_CH_REMOVE );
+    ck_assert_str_eq( change->name, "md1.test" );
+    change = &APR_ARRAY_IDX(changes, 1, md_store_fs_change_t);
+    ck_assert_int_eq( change->op, MD_S_FS_CH_PURGE );
+    ck_assert_str_eq( change->name, "md2.test" );
+    ck_assert_ptr_null( change->aspect );
+    change = &APR_ARRAY_IDX(changes, 2, md_store_fs_change_t);
+    ck_assert_int_eq( change->op, MD_S_FS_CH_MOVE );
+    ck_assert_int_eq( change->group, MD_SG_DOMAINS );
+    change = &APR_ARRAY_IDX(changes, 3, md_store_fs_change_t);
+    ck_assert_int_eq( change->op, MD_S_FS_CH_MOVE );
+    ck_assert_int_eq( change->group, MD_SG_STAGING );
+    ck_assert_str_eq( change->name, "md0.test" );
+    ck_assert_int_eq( md_store_fs_changes(&changes, &last, g_store, 7, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( changes->nelts, 0 );
+
+    /* another process opening the store journals its changes as well */
+    ck_assert_int_eq( md_store_fs_init(&other, g_pool, g_store_dir), APR_SUCCESS );
+    ck_assert_int_eq( md_store_purge(other, g_pool, MD_SG_DOMAINS, "md1.test"), APR_SUCCESS );
+    ck_assert_int_eq( md_store_fs_changes(&changes, &last, g_store, 7, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( changes->nelts, 1 );
+    ck_assert_int_eq( last, 8 );
+
+    /* a rotated journal keeps the newer changes, older ones need a full read */
+    ck_assert_int_eq( md_store_fs_journal_set(g_store, 1, 8192), APR_SUCCESS );
+    save_test_mds(g_store, 400, g_pool);
+    ck_assert_int_eq( md_store_fs_changes(&changes, &last, g_store, 7, g_pool), 
+                      APR_INCOMPLETE );
+    ck_assert_int_eq( last, 408 );
+    ck_assert_int_eq( md_store_fs_changes(&changes, &last, g_store, 398, g_pool), 
+                      APR_SUCCESS );
+    ck_assert_int_eq( changes->nelts, 10 );
+    for (i = 0; i < changes->nelts; ++i) {
+        change = &APR_ARRAY_IDX(changes, i, md_store_fs_change_t);
+        ck_assert_int_eq( change->seq, 399 + i );
+        ck_assert_str_eq( change->name, apr_psprintf(g_pool, "md%d.test", 390 + i) );
+    }
+
+    /* a journal removed and started anew is behind what readers have seen */
+    ck_assert_int_eq( md_util_path_merge(&fpath, g_pool, g_store_dir, "md_store.journal", 
+                                         NULL), APR_SUCCESS );
+    ck_assert_int_eq( apr_file_remove(fpath, g_pool), APR_SUCCESS );
+    save_test_mds(g_store, 1, g_pool);
+    ck_assert_int_eq( md_store_fs_changes(&changes, &last, g_store, 408, g_pool), 
+                      APR_INCOMPLETE );
+    ck_assert_int_eq( last, 1 );
+}
+END_TEST
+
+START_TEST(changed_names_since)
+{
+    apr_array_header_t *names;
+    apr_int64_t last;
+
+    ck_assert_int_eq( md_store_changed_names(&names, &last, g_store, MD_SG_DOMAINS, 0, g_pool), 
+                      APR_ENOTIMPL );
+    ck_assert_ptr_null( names );
+    ck_assert_int_eq( md_store_fs_journal_set(g_store, 1, 0), APR_SUCCESS );
+
+    /* names changed more than once are listed once, in the order of their first change */
+    save_test_mds(g_store, 3, g_pool);
+    save_test_mds(g_store, 2, g_pool);
+    ck_assert_int_eq( md_store_changed_names(&names, &last, g_store, MD_SG_DOMAINS, 0, g_pool), 
+                      APR_SUCCESS );
+    ck_assert_int_eq( last, 5 );
+    ck_assert_int_eq( names->nelts, 3 );
+    ck_assert_str_eq( APR_ARRAY_IDX(names, 0, const char *), "md0.test" );
+    ck_assert_str_eq( APR_ARRAY_IDX(names, 1, const char *), "md1.test" );
+    ck_assert_str_eq( APR_ARRAY_IDX(names, 2, const char *), "md2.test" );
+
+    /* a move is journaled for both groups, changes in other groups are not listed */
+    ck_assert_int_eq( md_store_move(g_store, g_pool, MD_SG_DOMAINS, MD_SG_STAGING, 
+                                    "md2.test", 0), APR_SUCCESS );
+    ck_assert_int_eq( md_store_changed_names(&names, &last, g_store, MD_SG_STAGING, 5, g_pool), 
+                      APR_SUCCESS );
+    ck_assert_int_eq( names->nelts, 1 );
+    ck_assert_str_eq( APR_ARRAY_IDX(names, 0, const char *), "md2.test" );
+    ck_assert_int_eq( md_store_changed_names(&names, &last, g_store, MD_SG_ACCOUNTS, 5, g_pool), 
+                      APR_SUCCESS );
+    ck_assert_int_eq( names->nelts, 0 );
+
+    /* asking from the end only gives the current position */
+    ck_assert_int_eq( md_store_changed_names(&names, &last, g_store, MD_SG_DOMAINS, 
+                                             APR_INT64_MAX, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( names->nelts, 0 );
+    ck_assert_int_eq( last, 7 );
+}
+END_TEST
+
+static apr_time_t bench_load_certs(apr_pool_t *p)
+{
+    apr_array_header_t *chain;
+    apr_time_t start;
+    md_cert_t *cert;
+    const char *name;
+    int i;
+    
+    start = apr_time_now();
+    for (i = 0; i < BENCH_CHAIN_COUNT; ++i) {
+        name = apr_psprintf(p, "md%d.test", i);
+        ck_assert_int_eq( md_cert_load(g_store, MD_SG_DOMAINS, name, &cert, p), APR_SUCCESS );
+        ck_assert_int_eq( md_chain_load(g_store, MD_SG_DOMAINS, name, &chain, p), APR_SUCCESS );
+    }
+    return apr_time_now() - start;
+}
+
+START_TEST(bench_chain_load_pem_der)
+{
+    apr_pool_t *p;
+    apr_time_t t_pem, t_der;
+    md_cert_t *cert;
+    md_pkey_t *pkey;
+    const char *name;
+    int i;
+
+    /* saving writes the DER files, loading only uses them while the cache is on */
+    ck_assert_int_eq( md_store_fs_der_cache_set(g_store, 1), APR_SUCCESS );
+    ck_assert_int_eq( md_pkey_gen_rsa(&pkey, g_pool, 2048), APR_SUCCESS );
+    ck_assert_int_eq( apr_pool_create(&p, g_pool), APR_SUCCESS );
+    for (i = 0; i < BENCH_CHAIN_COUNT; ++i) {
+        name = apr_psprintf(p, "md%d.test", i);
+        cert = make_test_cert(pkey, name, p);
+        ck_assert_int_eq( md_cert_save(g_store, p, MD_SG_DOMAINS, name, cert, 1), APR_SUCCESS );
+        ck_assert_int_eq( md_chain_save(g_store, p, MD_SG_DOMAINS, name, g_chain, 1),
+                          APR_SUCCESS );
+        apr_pool_clear(p);
+    }
+
+    ck_assert_int_eq( md_store_fs_der_cache_set(g_store, 0), APR_SUCCESS );
+    t_pem = bench_load_certs(p);
+    apr_pool_clear(p);
+
+    ck_assert_int_eq( md_store_fs_der_cache_set(g_store, 1), APR_SUCCESS );
+    t_der = bench_load_certs(p);
+    apr_pool_destroy(p);
+
+    fprintf(stderr, "# loading cert and chain of %d mds: PEM %" APR_TIME_T_FMT "ms, "
+            "DER cache %" APR_TIME_T_FMT "ms\n", BENCH_CHAIN_COUNT, 
+            apr_time_as_msec(t_pem), apr_time_as_msec(t_der));
+}
+END_TEST
+
+START_TEST(bench_iter_walk_at)
+{
+    static const char *walk_names[] = { "full paths", "openat" };
+    const char *dir, *fpath;
+    apr_pool_t *p;
+    apr_time_t start, t_walk, t_load;
+    int i, walk, count;
+
+    ck_assert_int_eq( apr_pool_create(&p, g_pool), APR_SUCCESS );
+    for (i = 0; i < BENCH_ITER_COUNT; ++i) {
+        ck_assert_int_eq( md_util_path_merge(&dir, p, g_store_dir, "domains", 
+                                             apr_psprintf(p, "md%d.test", i), NULL), 
+                          APR_SUCCESS );
+        ck_assert_int_eq( apr_dir_make_recursive(dir, MD_FPROT_D_UONLY, p), APR_SUCCESS );
+        ck_assert_int_eq( md_util_path_merge(&fpath, p, dir, MD_FN_MD, NULL), APR_SUCCESS );
+        ck_assert_int_eq( md_text_fcreatex(fpath, MD_FPROT_F_UONLY, p, "{}"), APR_SUCCESS );
+        apr_pool_clear(p);
+    }
+
+    for (walk = 0; walk <= 1; ++walk) {
+        md_util_walk_at_set(walk);
+
+        /* the walk alone, nothing matches */
+        count = 0;
+        start = apr_time_now();
+        ck_assert_int_eq( md_store_iter(count_insp, &count, g_store, p, MD_SG_DOMAINS, "*",
+                                        "none.json", MD_SV_TEXT), APR_SUCCESS );
+        t_walk = apr_time_now() - start;
+        ck_assert_int_eq( count, 0 );
+        apr_pool_clear(p);
+
+        count = 0;
+        start = apr_time_now();
+        ck_assert_int_eq( md_store_iter(count_insp, &count, g_store, p, MD_SG_DOMAINS, "*",
+                                        MD_FN_MD, MD_SV_TEXT), APR_SUCCESS );
+        t_load = apr_time_now() - start;
+        ck_assert_int_eq( count, BENCH_ITER_COUNT );
+        apr_pool_clear(p);
+
+        fprintf(stderr, "# md_store_iter over %d mds, %-10s: walk %" APR_TIME_T_FMT 
+                "us, load %" APR_TIME_T_FMT "us\n", BENCH_ITER_COUNT, walk_names[walk], 
+                t_walk, t_load);
+    }
+    md_util_walk_at_set(1);
+    apr_pool_destroy(p);
+}
+END_TEST
+
+START_TEST(md_iter_parallel_delivers)
+{
+    apr_array_header_t *names;
+    md_seen_ctx ctx;
+    int i;
+
+    save_test_mds(g_store, PAR_MD_COUNT, g_pool);
+    ck_assert_int_eq( md_store_names(&names, g_store, g_pool, MD_SG_DOMAINS, "*", MD_FN_MD),
+                      APR_SUCCESS );
+    ck_assert_int_eq( names->nelts, PAR_MD_COUNT );
+
+    ctx.names = apr_array_make(g_pool, PAR_MD_COUNT, sizeof(const char *));
+    ctx.stop_after = -1;
+    ck_assert_int_eq( md_store_md_iter_parallel(md_seen, &ctx, g_store, g_pool, 
+                                                MD_SG_DOMAINS, "*", 4, 1), APR_SUCCESS );
+    ck_assert_int_eq( ctx.names->nelts, PAR_MD_COUNT );
+    for (i = 0; i < names->nelts; ++i) {
+        ck_assert_str_eq( APR_ARRAY_IDX(ctx.names, i, const char *), 
+                          APR_ARRAY_IDX(names, i, const char *) );
+    }
+
+    ctx.names = apr_array_make(g_pool, PAR_MD_COUNT, sizeof(const char *));
+    ck_assert_int_eq( md_store_md_iter_parallel(md_seen, &ctx, g_store, g_pool, 
+                                                MD_SG_DOMAINS, "*", 4, 0), APR_SUCCESS );
+    ck_assert_int_eq( ctx.names->nelts, PAR_MD_COUNT );
+
+    /* an inspector saying stop is not called again */
+    ctx.names = apr_array_make(g_pool, PAR_MD_COUNT, sizeof(const char *));
+    ctx.stop_after = 10;
+    ck_assert_int_eq( md_store_md_iter_parallel(md_seen, &ctx, g_store, g_pool, 
+                                                MD_SG_DOMAINS, "*", 4, 0), APR_SUCCESS );
+    ck_assert_int_eq( ctx.names->nelts, 10 );
+
+    /* nothing matching */
+    ctx.names = apr_array_make(g_pool, PAR_MD_COUNT, sizeof(const char *));
+    ck_assert_int_eq( md_store_md_iter_parallel(md_seen, &ctx, g_store, g_pool, 
+                                                MD_SG_DOMAINS, "none.*", 4, 1), APR_SUCCESS );
+    ck_assert_int_eq( ctx.names->nelts, 0 );
+}
+END_TEST
+
+START_TEST(bench_md_iter_threads)
+{
+    static const int nthreads[] = { 1, 2, 4, 8, 16 };
+    md_seen_ctx ctx;
+    apr_pool_t *p;
+    apr_time_t start, elapsed;
+    int i, ordered;
+
+    save_test_mds(g_store, BENCH_MD_COUNT, g_pool);
+    ck_assert_int_eq( apr_pool_create(&p, g_pool), APR_SUCCESS );
+    ctx.stop_after = -1;
+    for (ordered = 0; ordered <= 1; ++ordered) {
+        for (i = 0; i < (int)(sizeof(nthreads)/sizeof(nthreads[0])); ++i) {
+            ctx.names = apr_array_make(p, BENCH_MD_COUNT, sizeof(const char *));
+            start = apr_time_now();
+            ck_assert_int_eq( md_store_md_iter_parallel(md_seen, &ctx, g_store, p, 
+                                                        MD_SG_DOMAINS, "*", nthreads[i], 
+                                                        ordered), APR_SUCCESS );
+            elapsed = apr_time_now() - start;
+            ck_assert_int_eq( ctx.names->nelts, BENCH_MD_COUNT );
+            apr_pool_clear(p);
+            fprintf(stderr, "# md_store_md_iter over %d mds, %2d threads, %-9s: %" 
+                    APR_TIME_T_FMT "us\n", BENCH_MD_COUNT, nthreads[i], 
+                    ordered? "ordered" : "unordered", elapsed);
+        }
+    }
+    apr_pool_destroy(p);
+}
+END_TEST
+
+START_TEST(bench_save_durability)
+{
+    static const char *mode_names[] = { "none", "batched", "strict" };
+    apr_array_header_t *domains;
+    apr_pool_t *p;
+    apr_time_t start, elapsed;
+    md_t *md;
+    int i, mode;
+
+    for (mode = MD_S_FS_SYNC_NONE; mode <= MD_S_FS_SYNC_STRICT; ++mode) {
+        ck_assert_int_eq( md_store_fs_durability_set(g_store, mode, apr_time_from_sec(60)),
+                          APR_SUCCESS );
+        start = apr_time_now();
+        for (i = 0; i < BENCH_SAVE_COUNT; ++i) {
+            ck_assert_int_eq( apr_pool_create(&p, g_pool), APR_SUCCESS );
+            domains = apr_array_make(p, 1, sizeof(const char *));
+            APR_ARRAY_PUSH(domains, const char *) = apr_psprintf(p, "%s%d.test",
+                                                                 mode_names[mode], i);
+            ck_assert_ptr_eq( md_create(&md, p, domains), NULL );
+            ck_assert_int_eq( md_save(g_store, p, MD_SG_DOMAINS, md, 1), APR_SUCCESS );
+            apr_pool_destroy(p);
+        }
+        ck_assert_int_eq( md_store_sync(g_store, g_pool), APR_SUCCESS );
+        elapsed = apr_time_now() - start;
+        fprintf(stderr, "# md_save of %d mds, durability %-7s: %" APR_TIME_T_FMT "us\n",
+                BENCH_SAVE_COUNT, mode_names[mode], elapsed);
+
+        ck_assert_int_eq( md_load(g_store, MD_SG_DOMAINS,
+                                  apr_psprintf(g_pool, "%s%d.test", mode_names[mode], 0),
+                                  &md, g_pool), APR_SUCCESS );
+    }
+}
+END_TEST
+
+TCase *md_store_fs_test_case(void)
+{
+    TCase *testcase = tcase_create("md_store_fs");
+
+    tcase_add_checked_fixture(testcase, md_store_fs_setup, md_store_fs_teardown);
+    tcase_set_timeout(testcase, 60);
+
+    tcase_add_test(testcase, der_cache_shares_chain_certs);
+    tcase_add_test(testcase, der_cache_follows_pem_changes);
+    tcase_add_test(testcase, der_cache_checks_blobs);
+    tcase_add_test(testcase, der_cache_collects_blobs);
+    tcase_add_test(testcase, chains_share_interned_certs);
+    tcase_add_test(testcase, chain_files_are_shared);
+    tcase_add_test(testcase, archive_retention_compact_restore);
+    tcase_add_test(testcase, archive_index_rebuilt);
+    tcase_add_test(testcase, txn_replaces_all_aspects);
+    tcase_add_test(testcase, txn_recovers_interrupted_commit);
+    tcase_add_test(testcase, init_removes_stale_tmp);
+    tcase_add_test(testcase, lock_shared_exclusive);
+    tcase_add_test(testcase, lease_held_across_processes);
+    tcase_add_test(testcase, lease_expires_and_fences);
+    tcase_add_test(testcase, lease_granted_once);
+    tcase_add_test(testcase, watch_reports_changed_mds);
+    tcase_add_test(testcase, journal_lists_changes_since);
+    tcase_add_test(testcase, changed_names_since);
+    tcase_add_test(testcase, md_iter_parallel_delivers);
+    
+    if (MD_UNIT_BENCH_ENABLED()) {
+        tcase_set_timeout(testcase, 600);
+        tcase_add_test(testcase, bench_save_durability);
+        tcase_add_test(testcase, bench_iter_walk_at);
+        tcase_add_test(testcase, bench_md_iter_threads);
+        tcase_add_test(testcase, bench_chain_load_pem_der);
+    }
+
+    return testcase;
+}
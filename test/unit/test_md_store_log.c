@@ -0,0 +1,429 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <apr_file_info.h>
+#include <apr_file_io.h>
+#include <apr_strings.h>
+
+#include "test_common.h"
+#include "md.h"
+#include "md_crypt.h"
+#include "md_json.h"
+#include "md_store.h"
+#include "md_store_log.h"
+#include "md_util.h"
+
+/* number of times a value is replaced before compacting */
+#define COMPACT_SAVES       200
+
+/*
+ * Helpers
+ */
+
+static md_json_t *make_json(const char *value, apr_pool_t *p)
+{
+    md_json_t *json = md_json_create(p);
+
+    ck_assert_int_eq( md_json_sets(value, json, "value", NULL), APR_SUCCESS );
+    return json;
+}
+
+static const char *load_value(md_store_t *store, md_store_group_t group, const char *name,
+                              apr_pool_t *p)
+{
+    md_json_t *json;
+
+    if (md_store_load_json(store, group, name, MD_FN_MD, &json, p) != APR_SUCCESS) {
+        return NULL;
+    }
+    return md_json_gets(json, "value", NULL);
+}
+
+static void assert_same_cert(md_cert_t *c1, md_cert_t *c2, apr_pool_t *p)
+{
+    const char *d1, *d2;
+    apr_size_t l1, l2;
+
+    ck_assert_int_eq( md_cert_to_der(&d1, &l1, c1, p), APR_SUCCESS );
+    ck_assert_int_eq( md_cert_to_der(&d2, &l2, c2, p), APR_SUCCESS );
+    ck_assert_int_eq( l1, l2 );
+    ck_assert_mem_eq( d1, d2, l1 );
+}
+
+static int count_insp(void *baton, const char *name, const char *aspect,
+                      md_store_vtype_t vtype, void *value, apr_pool_t *ptemp)
+{
+    int *pcount = baton;
+
+    ++(*pcount);
+    return 1;
+}
+
+/*
+ * Test Fixture -- runs once per test
+ */
+
+static apr_pool_t *g_pool;
+static const char *g_store_dir;
+static const char *g_log_path;
+static md_store_t *g_store;
+static md_pkey_t *g_pkey;
+static apr_array_header_t *g_chain;
+
+static void md_store_log_setup(void)
+{
+    const char *tmpdir;
+    md_cert_t *cert;
+
+    if (apr_pool_create(&g_pool, NULL) != APR_SUCCESS) {
+        exit(1);
+    }
+    if (apr_temp_dir_get(&tmpdir, g_pool) != APR_SUCCESS
+        || md_util_path_merge(&g_store_dir, g_pool, tmpdir,
+                              apr_psprintf(g_pool, "md-unit-%d", (int)getpid()),
+                              NULL) != APR_SUCCESS
+        || md_util_path_merge(&g_log_path, g_pool, g_store_dir, "md_store.log",
+                              NULL) != APR_SUCCESS
+        || md_store_log_init(&g_store, g_pool, g_store_dir) != APR_SUCCESS
+        || md_pkey_gen_rsa(&g_pkey, g_pool, 2048) != APR_SUCCESS) {
+        exit(1);
+    }
+
+    g_chain = apr_array_make(g_pool, 2, sizeof(md_cert_t *));
+    if (md_cert_self_sign(&cert, "intermediate.test", "intermediate.test", g_pkey,
+                          apr_time_from_sec(90 * MD_SECS_PER_DAY), g_pool) != APR_SUCCESS) {
+        exit(1);
+    }
+    APR_ARRAY_PUSH(g_chain, md_cert_t *) = cert;
+    if (md_cert_self_sign(&cert, "root.test", "root.test", g_pkey,
+                          apr_time_from_sec(90 * MD_SECS_PER_DAY), g_pool) != APR_SUCCESS) {
+        exit(1);
+    }
+    APR_ARRAY_PUSH(g_chain, md_cert_t *) = cert;
+}
+
+static void md_store_log_teardown(void)
+{
+    md_store_destroy(g_store);
+    md_util_rm_recursive(g_store_dir, g_pool, 5);
+    apr_pool_destroy(g_pool);
+}
+
+static int log_contains(const char *needle, apr_pool_t *p)
+{
+    apr_file_t *f;
+    apr_finfo_t info;
+    apr_size_t len, nlen = strlen(needle), i;
+    char *data;
+
+    ck_assert_int_eq( apr_file_open(&f, g_log_path, APR_FOPEN_READ|APR_FOPEN_BINARY, 
+                                    APR_OS_DEFAULT, p), APR_SUCCESS );
+    ck_assert_int_eq( apr_file_info_get(&info, APR_FINFO_SIZE, f), APR_SUCCESS );
+    len = (apr_size_t)info.size;
+    data = apr_palloc(p, len + 1);
+    ck_assert_int_eq( apr_file_read_full(f, data, len, &len), APR_SUCCESS );
+    apr_file_close(f);
+    for (i = 0; i + nlen <= len; ++i) {
+        if (!memcmp(data + i, needle, nlen)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Tests
+ */
+
+START_TEST(log_values_roundtrip)
+{
+    md_store_t *store;
+    apr_array_header_t *chain;
+    md_cert_t *cert;
+    md_pkey_t *pkey;
+    const char *text;
+    int i;
+
+    ck_assert_int_eq( md_store_save_json(g_store, g_pool, MD_SG_DOMAINS, "a.test", MD_FN_MD,
+                                         make_json("one", g_pool), 1), APR_SUCCESS );
+    ck_assert_int_eq( md_store_save_json(g_store, g_pool, MD_SG_DOMAINS, "a.test", MD_FN_MD,
+                                         make_json("two", g_pool), 1), APR_EEXIST );
+    ck_assert_int_eq( md_store_save(g_store, g_pool, MD_SG_DOMAINS, "a.test", "note.txt",
+                                    MD_SV_TEXT, "some text", 0), APR_SUCCESS );
+    ck_assert_int_eq( md_pkey_save(g_store, g_pool, MD_SG_DOMAINS, "a.test", g_pkey, 1),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_cert_save(g_store, g_pool, MD_SG_DOMAINS, "a.test",
+                                   APR_ARRAY_IDX(g_chain, 0, md_cert_t *), 1), APR_SUCCESS );
+    ck_assert_int_eq( md_chain_save(g_store, g_pool, MD_SG_DOMAINS, "a.test", g_chain, 1),
+                      APR_SUCCESS );
+
+    /* a second store on the same log replays what the first one wrote */
+    ck_assert_int_eq( md_store_log_init(&store, g_pool, g_store_dir), APR_SUCCESS );
+    ck_assert_str_eq( load_value(store, MD_SG_DOMAINS, "a.test", g_pool), "one" );
+    ck_assert_int_eq( md_store_load(store, MD_SG_DOMAINS, "a.test", "note.txt", MD_SV_TEXT,
+                                    (void**)&text, g_pool), APR_SUCCESS );
+    ck_assert_str_eq( text, "some text" );
+    ck_assert_int_eq( md_pkey_load(store, MD_SG_DOMAINS, "a.test", &pkey, g_pool),
+                      APR_SUCCESS );
+    ck_assert_str_eq( md_pkey_get_rsa_n64(pkey, g_pool), md_pkey_get_rsa_n64(g_pkey, g_pool) );
+    ck_assert_int_eq( md_cert_load(store, MD_SG_DOMAINS, "a.test", &cert, g_pool),
+                      APR_SUCCESS );
+    assert_same_cert(cert, APR_ARRAY_IDX(g_chain, 0, md_cert_t *), g_pool);
+    ck_assert_int_eq( md_chain_load(store, MD_SG_DOMAINS, "a.test", &chain, g_pool),
+                      APR_SUCCESS );
+    ck_assert_int_eq( chain->nelts, 2 );
+    for (i = 0; i < chain->nelts; ++i) {
+        assert_same_cert(APR_ARRAY_IDX(chain, i, md_cert_t *),
+                         APR_ARRAY_IDX(g_chain, i, md_cert_t *), g_pool);
+    }
+
+    /* and sees changes made afterwards */
+    ck_assert_int_eq( md_store_save_json(g_store, g_pool, MD_SG_DOMAINS, "a.test", MD_FN_MD,
+                                         make_json("two", g_pool), 0), APR_SUCCESS );
+    ck_assert_str_eq( load_value(store, MD_SG_DOMAINS, "a.test", g_pool), "two" );
+    ck_assert_int_eq( md_store_load(store, MD_SG_DOMAINS, "a.test", MD_FN_CERT, MD_SV_PKEY,
+                                    (void**)&pkey, g_pool), APR_EINVAL );
+    md_store_destroy(store);
+}
+END_TEST
+
+START_TEST(log_remove_purge_move)
+{
+    md_store_log_stats_t stats;
+    int count;
+
+    ck_assert_int_eq( md_store_remove(g_store, MD_SG_DOMAINS, "a.test", MD_FN_MD, g_pool, 0),
+                      APR_ENOENT );
+    ck_assert_int_eq( md_store_remove(g_store, MD_SG_DOMAINS, "a.test", MD_FN_MD, g_pool, 1),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_store_move(g_store, g_pool, MD_SG_STAGING, MD_SG_DOMAINS,
+                                    "a.test", 1), APR_ENOENT );
+
+    ck_assert_int_eq( md_store_save_json(g_store, g_pool, MD_SG_DOMAINS, "a.test", MD_FN_MD,
+                                         make_json("old", g_pool), 0), APR_SUCCESS );
+    ck_assert_int_eq( md_store_save_json(g_store, g_pool, MD_SG_STAGING, "a.test", MD_FN_MD,
+                                         make_json("new", g_pool), 0), APR_SUCCESS );
+    ck_assert_int_eq( md_chain_save(g_store, g_pool, MD_SG_STAGING, "a.test", g_chain, 0),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_store_move(g_store, g_pool, MD_SG_STAGING, MD_SG_DOMAINS,
+                                    "a.test", 1), APR_SUCCESS );
+
+    ck_assert_str_eq( load_value(g_store, MD_SG_DOMAINS, "a.test", g_pool), "new" );
+    ck_assert_str_eq( load_value(g_store, MD_SG_ARCHIVE, "a.test.1", g_pool), "old" );
+    ck_assert_ptr_eq( load_value(g_store, MD_SG_STAGING, "a.test", g_pool), NULL );
+
+    count = 0;
+    ck_assert_int_eq( md_store_iter(count_insp, &count, g_store, g_pool, MD_SG_DOMAINS,
+                                    "*", "chain.*", MD_SV_CHAIN), APR_SUCCESS );
+    ck_assert_int_eq( count, 1 );
+    count = 0;
+    ck_assert_int_eq( md_store_iter(count_insp, &count, g_store, g_pool, MD_SG_ARCHIVE,
+                                    "a.*", MD_FN_MD, MD_SV_JSON), APR_SUCCESS );
+    ck_assert_int_eq( count, 1 );
+    count = 0;
+    ck_assert_int_eq( md_store_iter(count_insp, &count, g_store, g_pool, MD_SG_DOMAINS,
+                                    "b.*", MD_FN_MD, MD_SV_JSON), APR_SUCCESS );
+    ck_assert_int_eq( count, 0 );
+
+    ck_assert_int_eq( md_store_remove(g_store, MD_SG_DOMAINS, "a.test", MD_FN_CHAIN,
+                                      g_pool, 0), APR_SUCCESS );
+    ck_assert_int_eq( md_store_purge(g_store, g_pool, MD_SG_DOMAINS, "a.test"), APR_SUCCESS );
+    ck_assert_int_eq( md_store_purge(g_store, g_pool, MD_SG_DOMAINS, "a.test"), APR_SUCCESS );
+    ck_assert_ptr_eq( load_value(g_store, MD_SG_DOMAINS, "a.test", g_pool), NULL );
+
+    md_store_log_stats_get(&stats, g_store);
+    ck_assert_int_eq( stats.names, 1 );
+    ck_assert_int_eq( stats.values, 1 );
+}
+END_TEST
+
+START_TEST(log_ignores_torn_tail)
+{
+    md_store_t *store;
+    apr_file_t *f;
+    apr_size_t len;
+    char junk[40];
+
+    ck_assert_int_eq( md_store_save_json(g_store, g_pool, MD_SG_DOMAINS, "a.test", MD_FN_MD,
+                                         make_json("one", g_pool), 0), APR_SUCCESS );
+
+    /* what a crash in the middle of appending leaves behind */
+    memset(junk, 0x5a, sizeof(junk));
+    ck_assert_int_eq( apr_file_open(&f, g_log_path, APR_FOPEN_WRITE|APR_FOPEN_APPEND,
+                                    APR_OS_DEFAULT, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( apr_file_write_full(f, junk, sizeof(junk), &len), APR_SUCCESS );
+    apr_file_close(f);
+
+    ck_assert_int_eq( md_store_log_init(&store, g_pool, g_store_dir), APR_SUCCESS );
+    ck_assert_str_eq( load_value(store, MD_SG_DOMAINS, "a.test", g_pool), "one" );
+
+    /* the next writer cuts it off, or readers would stop at the junk */
+    ck_assert_int_eq( md_store_save_json(store, g_pool, MD_SG_DOMAINS, "b.test", MD_FN_MD,
+                                         make_json("two", g_pool), 0), APR_SUCCESS );
+    ck_assert_str_eq( load_value(g_store, MD_SG_DOMAINS, "b.test", g_pool), "two" );
+    ck_assert_str_eq( load_value(g_store, MD_SG_DOMAINS, "a.test", g_pool), "one" );
+    md_store_destroy(store);
+}
+END_TEST
+
+START_TEST(log_refuses_damaged_middle)
+{
+    md_store_t *store;
+    apr_file_t *f;
+    apr_finfo_t before, after;
+    apr_off_t off;
+    apr_size_t len;
+    char c;
+
+    ck_assert_int_eq( md_store_save_json(g_store, g_pool, MD_SG_DOMAINS, "a.test", MD_FN_MD,
+                                         make_json("one", g_pool), 0), APR_SUCCESS );
+    ck_assert_int_eq( md_store_save_json(g_store, g_pool, MD_SG_DOMAINS, "b.test", MD_FN_MD,
+                                         make_json("two", g_pool), 0), APR_SUCCESS );
+
+    /* damage the first record, the op after the magic and crc */
+    ck_assert_int_eq( apr_file_open(&f, g_log_path, APR_FOPEN_READ|APR_FOPEN_WRITE
+                                    |APR_FOPEN_BINARY, APR_OS_DEFAULT, g_pool), APR_SUCCESS );
+    off = 8 + 4;
+    ck_assert_int_eq( apr_file_seek(f, APR_SET, &off), APR_SUCCESS );
+    c = (char)0xff;
+    ck_assert_int_eq( apr_file_write_full(f, &c, 1, &len), APR_SUCCESS );
+    apr_file_close(f);
+    ck_assert_int_eq( apr_stat(&before, g_log_path, APR_FINFO_SIZE, g_pool), APR_SUCCESS );
+
+    /* that is no torn change: nothing is cut off, the log is not used */
+    ck_assert_int_eq( md_store_log_init(&store, g_pool, g_store_dir), APR_EINVAL );
+    ck_assert_int_eq( apr_stat(&after, g_log_path, APR_FINFO_SIZE, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( after.size, before.size );
+}
+END_TEST
+
+START_TEST(log_encrypts_pkeys)
+{
+    md_pkey_t *pkey;
+    const char *fpath;
+
+    ck_assert_int_eq( md_pkey_save(g_store, g_pool, MD_SG_STAGING, "a.test", g_pkey, 0),
+                      APR_SUCCESS );
+    ck_assert( log_contains("ENCRYPTED", g_pool) );
+    ck_assert_int_eq( md_pkey_load(g_store, MD_SG_STAGING, "a.test", &pkey, g_pool),
+                      APR_SUCCESS );
+    ck_assert_str_eq( md_pkey_get_rsa_n64(pkey, g_pool), md_pkey_get_rsa_n64(g_pkey, g_pool) );
+
+    /* handed out encrypted, unless the server needs to load it */
+    ck_assert_int_eq( md_store_get_fname(&fpath, g_store, MD_SG_STAGING, "a.test",
+                                         MD_FN_PKEY, g_pool), APR_SUCCESS );
+    ck_assert_int_ne( md_pkey_fload(&pkey, g_pool, NULL, 0, fpath), APR_SUCCESS );
+}
+END_TEST
+
+START_TEST(log_compacts)
+{
+    md_store_t *store;
+    md_store_log_stats_t before, after;
+    apr_pool_t *p;
+    int i;
+
+    ck_assert_int_eq( md_store_log_init(&store, g_pool, g_store_dir), APR_SUCCESS );
+    md_store_log_compact_set(g_store, 100, 0);
+    for (i = 0; i < COMPACT_SAVES; ++i) {
+        ck_assert_int_eq( apr_pool_create(&p, g_pool), APR_SUCCESS );
+        ck_assert_int_eq( md_store_save_json(g_store, p, MD_SG_DOMAINS, "a.test", MD_FN_MD,
+                                             make_json(apr_psprintf(p, "v%d", i), p), 0),
+                          APR_SUCCESS );
+        apr_pool_destroy(p);
+    }
+    ck_assert_int_eq( md_pkey_save(g_store, g_pool, MD_SG_DOMAINS, "a.test", g_pkey, 0),
+                      APR_SUCCESS );
+    ck_assert_str_eq( load_value(store, MD_SG_DOMAINS, "a.test", g_pool),
+                      apr_psprintf(g_pool, "v%d", COMPACT_SAVES - 1) );
+
+    md_store_log_stats_get(&before, g_store);
+    ck_assert_int_eq( md_store_log_compact(g_store, g_pool), APR_SUCCESS );
+    md_store_log_stats_get(&after, g_store);
+    ck_assert_int_lt( after.size, before.size );
+    ck_assert_int_eq( after.live, before.live );
+    ck_assert_int_eq( after.values, 2 );
+
+    /* the other store switches to the new log */
+    ck_assert_int_eq( md_store_save_json(g_store, g_pool, MD_SG_DOMAINS, "a.test", MD_FN_MD,
+                                         make_json("last", g_pool), 0), APR_SUCCESS );
+    ck_assert_str_eq( load_value(store, MD_SG_DOMAINS, "a.test", g_pool), "last" );
+
+    /* automatic compaction, once most of the log is garbage */
+    md_store_log_compact_set(g_store, 50, 0);
+    for (i = 0; i < 4; ++i) {
+        ck_assert_int_eq( md_store_save_json(g_store, g_pool, MD_SG_DOMAINS, "a.test",
+                                             MD_FN_MD, make_json("again", g_pool), 0),
+                          APR_SUCCESS );
+    }
+    md_store_log_stats_get(&after, g_store);
+    ck_assert_int_le( (after.size - after.live) * 100, after.size * 50 );
+    ck_assert_str_eq( load_value(store, MD_SG_DOMAINS, "a.test", g_pool), "again" );
+    md_store_destroy(store);
+}
+END_TEST
+
+START_TEST(log_get_fname_materializes)
+{
+    md_pkey_t *pkey;
+    apr_array_header_t *chain;
+    const char *fpath, *dir;
+
+    ck_assert_int_eq( md_pkey_save(g_store, g_pool, MD_SG_DOMAINS, "a.test", g_pkey, 0),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_chain_save(g_store, g_pool, MD_SG_DOMAINS, "a.test", g_chain, 0),
+                      APR_SUCCESS );
+
+    ck_assert_int_eq( md_store_get_fname(&fpath, g_store, MD_SG_DOMAINS, "a.test",
+                                         MD_FN_PKEY, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( md_pkey_fload(&pkey, g_pool, NULL, 0, fpath), APR_SUCCESS );
+    ck_assert_str_eq( md_pkey_get_rsa_n64(pkey, g_pool), md_pkey_get_rsa_n64(g_pkey, g_pool) );
+
+    ck_assert_int_eq( md_store_get_fname(&dir, g_store, MD_SG_DOMAINS, "a.test",
+                                         NULL, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( md_util_path_merge(&fpath, g_pool, dir, MD_FN_CHAIN, NULL), APR_SUCCESS );
+    ck_assert_int_eq( md_chain_fload(&chain, g_pool, fpath), APR_SUCCESS );
+    ck_assert_int_eq( chain->nelts, 2 );
+
+    /* files of removed values do not linger */
+    ck_assert_int_eq( md_store_remove(g_store, MD_SG_DOMAINS, "a.test", MD_FN_PKEY,
+                                      g_pool, 0), APR_SUCCESS );
+    ck_assert_int_eq( md_store_get_fname(&fpath, g_store, MD_SG_DOMAINS, "a.test",
+                                         MD_FN_PKEY, g_pool), APR_SUCCESS );
+    ck_assert_int_ne( md_util_is_file(fpath, g_pool), APR_SUCCESS );
+}
+END_TEST
+
+TCase *md_store_log_test_case(void)
+{
+    TCase *testcase = tcase_create("md_store_log");
+
+    tcase_add_checked_fixture(testcase, md_store_log_setup, md_store_log_teardown);
+    tcase_set_timeout(testcase, 60);
+
+    tcase_add_test(testcase, log_values_roundtrip);
+    tcase_add_test(testcase, log_remove_purge_move);
+    tcase_add_test(testcase, log_ignores_torn_tail);
+    tcase_add_test(testcase, log_refuses_damaged_middle);
+    tcase_add_test(testcase, log_encrypts_pkeys);
+    tcase_add_test(testcase, log_compacts);
+    tcase_add_test(testcase, log_get_fname_materializes);
+
+    return testcase;
+}
@@ -0,0 +1,271 @@
+/*
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <apr_file_info.h>
+#include <apr_strings.h>
+#include <apr_time.h>
+
+#include "test_common.h"
+#include "md.h"
+#include "md_json.h"
+#include "md_store.h"
+#include "md_store_fs.h"
+#include "md_store_mem.h"
+#include "md_util.h"
+
+/* number of managed domains in the stores for the iteration benchmark */
+#define BENCH_MD_COUNT      250
+
+/*
+ * Helpers
+ */
+
+static md_t *test_md(apr_pool_t *p, const char *name)
+{
+    apr_array_header_t *domains;
+    md_t *md;
+
+    domains = apr_array_make(p, 2, sizeof(const char *));
+    APR_ARRAY_PUSH(domains, const char *) = name;
+    APR_ARRAY_PUSH(domains, const char *) = apr_pstrcat(p, "www.", name, NULL);
+    ck_assert_ptr_eq(md_create(&md, p, domains), NULL);
+    md->ca_url = "https://acme.example.org/directory";
+    md->ca_proto = "ACME";
+    return md;
+}
+
+static int count_md(void *baton, md_store_t *store, md_t *md, apr_pool_t *ptemp)
+{
+    int *pcount = baton;
+
+    ++(*pcount);
+    return 1;
+}
+
+static apr_interval_time_t bench_iter(md_store_t *store, apr_pool_t *pool)
+{
+    apr_pool_t *p;
+    apr_time_t start;
+    int i, count = 0;
+
+    for (i = 0; i < BENCH_MD_COUNT; ++i) {
+        ck_assert_int_eq( apr_pool_create(&p, pool), APR_SUCCESS );
+        ck_assert_int_eq( md_save(store, p, MD_SG_DOMAINS,
+                                  test_md(p, apr_psprintf(p, "bench%d.test", i)), 1),
+                          APR_SUCCESS );
+        apr_pool_destroy(p);
+    }
+    ck_assert_int_eq( apr_pool_create(&p, pool), APR_SUCCESS );
+    start = apr_time_now();
+    ck_assert_int_eq( md_store_md_iter(count_md, &count, store, p, MD_SG_DOMAINS, "*"),
+                      APR_SUCCESS );
+    apr_pool_destroy(p);
+    ck_assert_int_eq( count, BENCH_MD_COUNT );
+    return apr_time_now() - start;
+}
+
+/*
+ * Test Fixture -- runs once per test
+ */
+
+static apr_pool_t *g_pool;
+static md_store_t *g_store;
+
+static void md_store_mem_setup(void)
+{
+    if (apr_pool_create(&g_pool, NULL) != APR_SUCCESS
+        || md_store_mem_init(&g_store, g_pool) != APR_SUCCESS) {
+        exit(1);
+    }
+}
+
+static void md_store_mem_teardown(void)
+{
+    apr_pool_destroy(g_pool);
+}
+
+/*
+ * Tests
+ */
+
+START_TEST(mem_values_are_copies)
+{
+    md_json_t *json, *loaded;
+    const char *text;
+    md_t *md;
+
+    json = md_json_create(g_pool);
+    ck_assert_int_eq( md_json_sets("one", json, "value", NULL), APR_SUCCESS );
+    ck_assert_int_eq( md_store_save_json(g_store, g_pool, MD_SG_DOMAINS, "a.test", "v.json",
+                                         json, 1), APR_SUCCESS );
+    ck_assert_int_eq( md_store_save_json(g_store, g_pool, MD_SG_DOMAINS, "a.test", "v.json",
+                                         json, 1), APR_EEXIST );
+
+    /* changing what was saved or loaded leaves the store alone */
+    ck_assert_int_eq( md_json_sets("two", json, "value", NULL), APR_SUCCESS );
+    ck_assert_int_eq( md_store_load_json(g_store, MD_SG_DOMAINS, "a.test", "v.json",
+                                         &loaded, g_pool), APR_SUCCESS );
+    ck_assert_str_eq( md_json_gets(loaded, "value", NULL), "one" );
+    ck_assert_int_eq( md_json_sets("three", loaded, "value", NULL), APR_SUCCESS );
+    ck_assert_int_eq( md_store_load_json(g_store, MD_SG_DOMAINS, "a.test", "v.json",
+                                         &loaded, g_pool), APR_SUCCESS );
+    ck_assert_str_eq( md_json_gets(loaded, "value", NULL), "one" );
+
+    /* JSON reads as text, as it does from a file */
+    ck_assert_int_eq( md_store_load(g_store, MD_SG_DOMAINS, "a.test", "v.json", MD_SV_TEXT,
+                                    (void**)&text, g_pool), APR_SUCCESS );
+    ck_assert_ptr_nonnull( strstr(text, "\"one\"") );
+
+    ck_assert_int_eq( md_save(g_store, g_pool, MD_SG_DOMAINS, test_md(g_pool, "a.test"), 0),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_load(g_store, MD_SG_DOMAINS, "a.test", &md, g_pool), APR_SUCCESS );
+    ck_assert_str_eq( md->name, "a.test" );
+
+    ck_assert_int_eq( md_store_remove(g_store, MD_SG_DOMAINS, "a.test", "v.json", g_pool, 0),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_store_remove(g_store, MD_SG_DOMAINS, "a.test", "v.json", g_pool, 0),
+                      APR_ENOENT );
+    ck_assert_int_eq( md_store_purge(g_store, g_pool, MD_SG_DOMAINS, "a.test"), APR_SUCCESS );
+    ck_assert_int_eq( md_load(g_store, MD_SG_DOMAINS, "a.test", &md, g_pool), APR_ENOENT );
+}
+END_TEST
+
+START_TEST(mem_move_archives)
+{
+    md_store_txn_t *txn;
+    md_t *md;
+    int count;
+
+    ck_assert_int_eq( md_store_move(g_store, g_pool, MD_SG_STAGING, MD_SG_DOMAINS,
+                                    "a.test", 1), APR_ENOENT );
+    ck_assert_int_eq( md_save(g_store, g_pool, MD_SG_DOMAINS, test_md(g_pool, "a.test"), 0),
+                      APR_SUCCESS );
+
+    for (count = 1; count <= 2; ++count) {
+        md = test_md(g_pool, "a.test");
+        md->ca_url = apr_psprintf(g_pool, "https://ca%d.example.org/", count);
+        ck_assert_int_eq( md_store_txn_begin(&txn, g_store, g_pool, MD_SG_STAGING, "a.test"),
+                          APR_SUCCESS );
+        ck_assert_int_eq( md_store_txn_put_md(txn, md), APR_SUCCESS );
+        ck_assert_int_eq( md_store_txn_commit(txn), APR_SUCCESS );
+        ck_assert_int_eq( md_store_move(g_store, g_pool, MD_SG_STAGING, MD_SG_DOMAINS,
+                                        "a.test", 1), APR_SUCCESS );
+    }
+
+    ck_assert_int_eq( md_load(g_store, MD_SG_DOMAINS, "a.test", &md, g_pool), APR_SUCCESS );
+    ck_assert_str_eq( md->ca_url, "https://ca2.example.org/" );
+    ck_assert_int_eq( md_load(g_store, MD_SG_STAGING, "a.test", &md, g_pool), APR_ENOENT );
+    ck_assert_int_eq( md_load(g_store, MD_SG_ARCHIVE, "a.test.1", &md, g_pool), APR_SUCCESS );
+    ck_assert_str_eq( md->ca_url, "https://acme.example.org/directory" );
+    ck_assert_int_eq( md_load(g_store, MD_SG_ARCHIVE, "a.test.2", &md, g_pool), APR_SUCCESS );
+    ck_assert_str_eq( md->ca_url, "https://ca1.example.org/" );
+
+    count = 0;
+    ck_assert_int_eq( md_store_md_iter(count_md, &count, g_store, g_pool, MD_SG_ARCHIVE,
+                                       "a.test.*"), APR_SUCCESS );
+    ck_assert_int_eq( count, 2 );
+}
+END_TEST
+
+START_TEST(mem_generic_txn_applies_on_commit)
+{
+    md_store_txn_t *txn;
+    const char *text;
+    md_t *md;
+
+    /* run the generic transaction the store falls back to without own support */
+    g_store->txn_begin = NULL;
+    ck_assert_int_eq( md_save(g_store, g_pool, MD_SG_DOMAINS, test_md(g_pool, "a.test"), 0),
+                      APR_SUCCESS );
+
+    md = test_md(g_pool, "a.test");
+    md->ca_url = "https://ca1.example.org/";
+    ck_assert_int_eq( md_store_txn_begin(&txn, g_store, g_pool, MD_SG_DOMAINS, "a.test"),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_store_txn_put_md(txn, md), APR_SUCCESS );
+    ck_assert_int_eq( md_load(g_store, MD_SG_DOMAINS, "a.test", &md, g_pool), APR_SUCCESS );
+    ck_assert_str_eq( md->ca_url, "https://acme.example.org/directory" );
+    md_store_txn_abort(txn);
+    ck_assert_int_eq( md_load(g_store, MD_SG_DOMAINS, "a.test", &md, g_pool), APR_SUCCESS );
+    ck_assert_str_eq( md->ca_url, "https://acme.example.org/directory" );
+
+    ck_assert_int_eq( md_store_txn_begin(&txn, g_store, g_pool, MD_SG_DOMAINS, "a.test"),
+                      APR_SUCCESS );
+    ck_assert_int_eq( md_store_save(g_store, g_pool, MD_SG_DOMAINS, "a.test", "v.json",
+                                    MD_SV_TEXT, (void*)"old", 0), APR_SUCCESS );
+    md = test_md(g_pool, "a.test");
+    md->ca_url = "https://ca2.example.org/";
+    ck_assert_int_eq( md_store_txn_put_md(txn, md), APR_SUCCESS );
+    ck_assert_int_eq( md_store_txn_commit(txn), APR_SUCCESS );
+    ck_assert_int_eq( md_load(g_store, MD_SG_DOMAINS, "a.test", &md, g_pool), APR_SUCCESS );
+    ck_assert_str_eq( md->ca_url, "https://ca2.example.org/" );
+    ck_assert_int_eq( md_store_load(g_store, MD_SG_DOMAINS, "a.test", "v.json", MD_SV_TEXT,
+                                    (void**)&text, g_pool), APR_ENOENT );
+}
+END_TEST
+
+START_TEST(mem_latency)
+{
+    apr_time_t start;
+    md_t *md;
+
+    md_store_mem_latency_set(g_store, apr_time_from_msec(20));
+    start = apr_time_now();
+    ck_assert_int_eq( md_load(g_store, MD_SG_DOMAINS, "a.test", &md, g_pool), APR_ENOENT );
+    ck_assert_int_ge( apr_time_now() - start, apr_time_from_msec(20) );
+}
+END_TEST
+
+START_TEST(bench_md_iter_fs_mem)
+{
+    md_store_t *store;
+    const char *tmpdir, *dir;
+    apr_interval_time_t t_fs, t_mem;
+
+    ck_assert_int_eq( apr_temp_dir_get(&tmpdir, g_pool), APR_SUCCESS );
+    ck_assert_int_eq( md_util_path_merge(&dir, g_pool, tmpdir,
+                                         apr_psprintf(g_pool, "md-unit-%d", (int)getpid()),
+                                         NULL), APR_SUCCESS );
+    ck_assert_int_eq( md_store_fs_init(&store, g_pool, dir), APR_SUCCESS );
+    t_fs = bench_iter(store, g_pool);
+    md_util_rm_recursive(dir, g_pool, 5);
+    t_mem = bench_iter(g_store, g_pool);
+
+    fprintf(stderr, "# md_store_md_iter over %d mds: fs  %" APR_TIME_T_FMT "us\n",
+            BENCH_MD_COUNT, t_fs);
+    fprintf(stderr, "# md_store_md_iter over %d mds: mem %" APR_TIME_T_FMT "us\n",
+            BENCH_MD_COUNT, t_mem);
+}
+END_TEST
+
+TCase *md_store_mem_test_case(void)
+{
+    TCase *testcase = tcase_create("md_store_mem");
+
+    tcase_add_checked_fixture(testcase, md_store_mem_setup, md_store_mem_teardown);
+    tcase_set_timeout(testcase, 60);
+
+    tcase_add_test(testcase, mem_values_are_copies);
+    tcase_add_test(testcase, mem_move_archives);
+    tcase_add_test(testcase, mem_generic_txn_applies_on_commit);
+    tcase_add_test(testcase, mem_latency);
+    tcase_add_test(testcase, bench_md_iter_fs_mem);
+
+    return testcase;
+}
@@ -13,6 +13,13 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <apr_file_info.h>
+#include <apr_file_io.h>
+#include <apr_strings.h>
+#include <apr_tables.h>
 
 #include "test_common.h"
 #include "md_util.h"
@@ -21,6 +28,52 @@
  * Helpers
  */
 
+static apr_status_t collect_cb(void *baton, apr_pool_t *p, apr_pool_t *ptemp, 
+                               const char *dir, const char *name, apr_filetype_e ftype)
+{
+    apr_array_header_t *seen = baton;
+    const char *path;
+
+    ck_assert_int_eq( md_util_path_merge(&path, ptemp, dir, name, NULL), APR_SUCCESS );
+    APR_ARRAY_PUSH(seen, const char *) = apr_psprintf(seen->pool, "%s:%d", path, ftype);
+    return APR_SUCCESS;
+}
+
+static int cmp_str(const void *a, const void *b)
+{
+    return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+static const char *seen_str(apr_array_header_t *seen)
+{
+    qsort(seen->elts, (size_t)seen->nelts, sizeof(const char *), cmp_str);
+    return apr_array_pstrcat(seen->pool, seen, ' ');
+}
+
+static const char *make_tree(apr_pool_t *p)
+{
+    const char *tmpdir, *base, *path;
+    int i, j;
+
+    ck_assert_int_eq( apr_temp_dir_get(&tmpdir, p), APR_SUCCESS );
+    ck_assert_int_eq( md_util_path_merge(&base, p, tmpdir,
+                                         apr_psprintf(p, "md-unit-%d", (int)getpid()), NULL),
+                      APR_SUCCESS );
+    for (i = 0; i < 3; ++i) {
+        for (j = 0; j < 3; ++j) {
+            ck_assert_int_eq( md_util_path_merge(&path, p, base, "domains", 
+                                                 apr_psprintf(p, "d%d.test", i), NULL),
+                              APR_SUCCESS );
+            ck_assert_int_eq( apr_dir_make_recursive(path, APR_OS_DEFAULT, p), APR_SUCCESS );
+            ck_assert_int_eq( md_util_path_merge(&path, p, path, 
+                                                 apr_psprintf(p, "f%d.json", j), NULL),
+                              APR_SUCCESS );
+            ck_assert_int_eq( md_text_fcreatex(path, APR_OS_DEFAULT, p, "{}"), APR_SUCCESS );
+        }
+    }
+    return base;
+}
+
 /*
  * Test Fixture -- runs once per test
  */
@@ -97,6 +150,52 @@ START_TEST(base64_md_util_largetrip)
 }
 END_TEST
 
+START_TEST(files_do_walkers_agree)
+{
+    apr_array_header_t *seen_at, *seen_apr;
+    const char *base, *path;
+
+    base = make_tree(g_pool);
+    ck_assert_int_eq( md_util_path_merge(&path, g_pool, base, "domains", "d1.test", 
+                                         "link.json", NULL), APR_SUCCESS );
+    ck_assert_int_eq( symlink("f0.json", path), 0 );
+
+    seen_at = apr_array_make(g_pool, 10, sizeof(const char *));
+    md_util_walk_at_set(1);
+    ck_assert_int_eq( md_util_files_do(collect_cb, seen_at, g_pool, base, "domains", 
+                                       "d[12].test", "*.json", NULL), APR_SUCCESS );
+    seen_apr = apr_array_make(g_pool, 10, sizeof(const char *));
+    md_util_walk_at_set(0);
+    ck_assert_int_eq( md_util_files_do(collect_cb, seen_apr, g_pool, base, "domains", 
+                                       "d[12].test", "*.json", NULL), APR_SUCCESS );
+    md_util_walk_at_set(1);
+
+    ck_assert_int_eq( seen_at->nelts, 7 );
+    ck_assert_str_eq( seen_str(seen_at), seen_str(seen_apr) );
+    ck_assert_int_eq( md_util_files_do(collect_cb, seen_at, g_pool, base, "missing", 
+                                       "*", NULL), APR_ENOENT );
+    md_util_rm_recursive(base, g_pool, 5);
+}
+END_TEST
+
+START_TEST(tree_do_stats_links_themselves)
+{
+    apr_array_header_t *seen;
+    const char *base, *path;
+
+    base = make_tree(g_pool);
+    ck_assert_int_eq( md_util_path_merge(&path, g_pool, base, "link.json", NULL), 
+                      APR_SUCCESS );
+    ck_assert_int_eq( symlink("domains/d0.test/f0.json", path), 0 );
+
+    /* a link to a file is no directory, even though the walk started at one */
+    seen = apr_array_make(g_pool, 10, sizeof(const char *));
+    ck_assert_int_eq( md_util_tree_do(collect_cb, seen, g_pool, base, 1), APR_SUCCESS );
+    ck_assert_int_eq( seen->nelts, 1 + 3 + 9 + 1 );
+    md_util_rm_recursive(base, g_pool, 5);
+}
+END_TEST
+
 TCase *md_util_test_case(void)
 {
     TCase *testcase = tcase_create("md_util");
@@ -105,6 +204,8 @@ TCase *md_util_test_case(void)
 
     tcase_add_test(testcase, base64_md_util_roundtrip);
     tcase_add_test(testcase, base64_md_util_largetrip);
+    tcase_add_test(testcase, files_do_walkers_agree);
+    tcase_add_test(testcase, tree_do_stats_links_themselves);
 
     return testcase;
 }